@@ -0,0 +1,176 @@
+//**********************************************************************
+// CAceSet
+// =======
+// Class to collect the ACEs in an ACL by user
+//**********************************************************************
+
+#ifndef STRICT
+#define STRICT
+#endif
+
+#include <windows.h>
+#include <stdlib.h>
+#include "CAceSet.h"
+
+
+//**********************************************************************
+// CAceSet
+// =======
+//**********************************************************************
+
+CAceSet::CAceSet()
+{
+  m_Ace = NULL;
+  m_NumAces = m_MaxAces = 0;
+
+  m_Block = NULL;
+}
+
+
+CAceSet::~CAceSet()
+{ ACESETBLOCK* next;
+
+  Reset();
+
+  for ( ; m_Block; m_Block = next)
+  { next = m_Block->Next;
+    free(m_Block);
+  }
+
+  if (m_Ace)
+    free(m_Ace);
+}
+
+
+//**********************************************************************
+// CAceSet::Reset
+// ==============
+// Empty the set ready for the next object
+//**********************************************************************
+
+void CAceSet::Reset(void)
+{ ACESETBLOCK *block, *next;
+
+  m_NumAces = 0;
+
+  if (!m_Block)
+    return;
+
+// The most recent block is at the head of the list and the first one
+// allocated is at the end, so keep the last block
+
+  for (block = m_Block; block->Next; block = next)
+  { next = block->Next;
+    free(block);
+  }
+
+  m_Block = block;
+  m_Block->Used = 0;
+}
+
+
+//**********************************************************************
+// CAceSet::Find
+// =============
+// Find the entry for a user and ACE type. Returns NULL if there isn't
+// one.
+//**********************************************************************
+
+RHSACE* CAceSet::Find(const WCHAR* Username, DWORD Type)
+{ int i;
+
+  for (i = 0; i < m_NumAces; i++)
+    if (m_Ace[i].Type == Type && lstrcmp(m_Ace[i].Username, Username) == 0)
+      return(m_Ace + i);
+
+  return(NULL);
+}
+
+
+//**********************************************************************
+// CAceSet::Add
+// ============
+// Add an entry for a user and ACE type with no access. Returns NULL if
+// there isn't enough memory.
+//**********************************************************************
+
+RHSACE* CAceSet::Add(const WCHAR* Domain, const WCHAR* Username, DWORD Type, DWORD Flags)
+{ RHSACE* ace;
+
+  if (m_NumAces >= m_MaxAces)
+  { ace = (RHSACE*) realloc(m_Ace, (m_MaxAces + 32)*sizeof(RHSACE));
+    if (!ace)
+      return(NULL);
+
+    m_Ace = ace;
+    m_MaxAces += 32;
+  }
+
+  ace = m_Ace + m_NumAces;
+
+  ace->Domain = CopyString(Domain);
+  ace->Username = CopyString(Username);
+  if (!ace->Domain || !ace->Username)
+    return(NULL);
+
+  ace->Mask = 0;
+  ace->Type = Type;
+  ace->Flags = Flags;
+
+  m_NumAces++;
+
+  return(ace);
+}
+
+
+//**********************************************************************
+// CAceSet::Alloc
+// ==============
+// Allocate memory from the arena
+//**********************************************************************
+
+void* CAceSet::Alloc(size_t Size)
+{ size_t blocksize;
+  ACESETBLOCK* block;
+
+// Keep the allocations aligned
+
+  Size = (Size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+  if (!m_Block || m_Block->Used + Size > m_Block->Size)
+  { blocksize = Size > ACESET_BLOCKSIZE ? Size : ACESET_BLOCKSIZE;
+
+    block = (ACESETBLOCK*) malloc(sizeof(ACESETBLOCK) + blocksize);
+    if (!block)
+      return(NULL);
+
+    block->Next = m_Block;
+    block->Size = blocksize;
+    block->Used = 0;
+    m_Block = block;
+  }
+
+  block = m_Block;
+  block->Used += Size;
+
+  return((BYTE*) (block + 1) + block->Used - Size);
+}
+
+
+//**********************************************************************
+// CAceSet::CopyString
+// ===================
+//**********************************************************************
+
+const WCHAR* CAceSet::CopyString(const WCHAR* s)
+{ int len;
+  WCHAR* copy;
+
+  len = lstrlen(s);
+
+  copy = (WCHAR*) Alloc((len + 1)*sizeof(WCHAR));
+  if (copy)
+    memcpy(copy, s, (len + 1)*sizeof(WCHAR));
+
+  return(copy);
+}
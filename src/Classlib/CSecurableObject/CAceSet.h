@@ -0,0 +1,84 @@
+//**********************************************************************
+// CAceSet
+// =======
+// Class to collect the ACEs in an ACL by user
+//**********************************************************************
+
+#ifndef _INC_CACESET
+#define _INC_CACESET
+
+
+//**********************************************************************
+// RHSACE
+// ------
+// The combined access for one user and ACE type
+//**********************************************************************
+
+#define RHSACE_NCINHERIT      0x01 // Child objects that are not containers inherit permissions
+#define RHSACE_INHERIT_PASS   0x02 // Child objects inherit and pass on permissions
+#define RHSACE_INHERIT_NOPASS 0x04 // Child objects inherit but do not pass on permissions
+#define RHSACE_NOINHERIT_PASS 0x08 // Object is not affected by but passes on permissions
+#define RHSACE_INHERITED      0x10 // Permissions have been inherited
+
+typedef struct
+{ const WCHAR* Domain;   // This identifies the user
+  const WCHAR* Username;
+
+  DWORD Mask,  // access mask
+        Type,  // 0 = access allowed, 1 = access denied
+        Flags;
+
+} RHSACE;
+
+
+//**********************************************************************
+// CAceSet
+// -------
+// There is no limit on the number of ACEs. The names are allocated
+// from an arena that Reset empties in one go, and the ACE array is kept
+// between objects, so once a set has been used for a few objects it
+// rarely needs to allocate memory. Use one set per thread.
+//**********************************************************************
+
+#define ACESET_BLOCKSIZE 0x1000
+
+typedef struct _ACESETBLOCK
+{ struct _ACESETBLOCK* Next;
+  size_t Size;
+  size_t Used;
+
+} ACESETBLOCK;
+
+class CAceSet
+{
+  public:
+    CAceSet();
+    ~CAceSet();
+
+    void Reset(void);
+
+    RHSACE* Find(const WCHAR* Username, DWORD Type);
+    RHSACE* Add(const WCHAR* Domain, const WCHAR* Username, DWORD Type, DWORD Flags);
+
+    inline int NumAces(void) { return(m_NumAces); }
+    inline RHSACE* Ace(int i) { return(m_Ace + i); }
+
+  private:
+    void* Alloc(size_t Size);
+    const WCHAR* CopyString(const WCHAR* s);
+
+  private:
+    RHSACE* m_Ace;
+    int m_NumAces, m_MaxAces;
+
+// The first block is kept by Reset and the rest freed
+
+    ACESETBLOCK* m_Block;
+};
+
+
+//**********************************************************************
+// End of CAceSet
+//**********************************************************************
+
+#endif // _INC_CACESET
@@ -122,6 +122,14 @@ BOOL CRegSecObject::GetObjectSecurity(void)
     return(FALSE);
   }
 
+// If we've been asked to skip SDs that are purely inherited check the
+// ACEs before going to the trouble of building the SD
+
+  if (SkipInheritedSD(pSD))
+  { LocalFree(pSD);
+    return TRUE;
+  }
+
 // Build a security descriptor with the ACLs we've just retrieved
 
   if (!BuildSD(pSD))
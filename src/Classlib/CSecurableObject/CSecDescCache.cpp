@@ -0,0 +1,207 @@
+//**********************************************************************
+// CSecDescCache
+// =============
+// Cache of security descriptors and the text they were formatted to
+//**********************************************************************
+
+#ifndef STRICT
+#define STRICT
+#endif
+
+#include <windows.h>
+#include <stdlib.h>
+#include "CSecDescCache.h"
+
+
+//**********************************************************************
+// CSecDescCache
+// =============
+//**********************************************************************
+
+CSecDescCache::CSecDescCache()
+{ int i;
+
+  for (i = 0; i < SECDESC_BUCKETS; i++)
+    m_Bucket[i] = NULL;
+  m_NumEntries = 0;
+
+  m_Group = NULL;
+  m_NumGroups = m_MaxGroups = 0;
+
+  InitializeSRWLock(&m_Lock);
+}
+
+
+CSecDescCache::~CSecDescCache()
+{ int i, j;
+  SECDESCENTRY *entry, *next;
+
+  for (i = 0; i < SECDESC_BUCKETS; i++)
+  { for (entry = m_Bucket[i]; entry; entry = next)
+    { next = entry->Next;
+
+      for (j = 0; j < entry->NumObjects; j++)
+        free(entry->Objects[j]);
+      if (entry->Objects)
+        free(entry->Objects);
+
+      free(entry->Text);
+      free(entry);
+    }
+  }
+
+  if (m_Group)
+    free(m_Group);
+}
+
+
+//**********************************************************************
+// CSecDescCache::Find
+// ===================
+// Find an SD. Returns NULL if it hasn't been seen before.
+//**********************************************************************
+
+SECDESCENTRY* CSecDescCache::Find(const BYTE* SD, DWORD Length, UINT Hash)
+{ SECDESCENTRY* entry;
+
+  if (!SD)
+    return(NULL);
+
+  AcquireSRWLockShared(&m_Lock);
+  entry = Lookup(SD, Length, Hash);
+  ReleaseSRWLockShared(&m_Lock);
+
+  return(entry);
+}
+
+
+//**********************************************************************
+// CSecDescCache::Add
+// ==================
+// Add an SD and its formatted text. If another thread has added the
+// same SD in the meantime its entry is returned instead. Returns NULL
+// if there isn't enough memory.
+//**********************************************************************
+
+SECDESCENTRY* CSecDescCache::Add(const BYTE* SD, DWORD Length, UINT Hash, const WCHAR* Text)
+{ SECDESCENTRY *entry, *existing;
+
+  if (!SD)
+    return(NULL);
+
+  entry = (SECDESCENTRY*) malloc(sizeof(SECDESCENTRY) + Length);
+  if (!entry)
+    return(NULL);
+
+  entry->Text = _wcsdup(Text);
+  if (!entry->Text)
+  { free(entry);
+    return(NULL);
+  }
+
+  entry->Hash = Hash;
+  entry->Length = Length;
+  entry->Objects = NULL;
+  entry->NumObjects = entry->MaxObjects = 0;
+  memcpy(entry->SD, SD, Length);
+
+  AcquireSRWLockExclusive(&m_Lock);
+
+  existing = Lookup(SD, Length, Hash);
+  if (!existing)
+  { entry->Next = m_Bucket[Hash % SECDESC_BUCKETS];
+    m_Bucket[Hash % SECDESC_BUCKETS] = entry;
+    m_NumEntries++;
+  }
+
+  ReleaseSRWLockExclusive(&m_Lock);
+
+  if (existing)
+  { free(entry->Text);
+    free(entry);
+    return(existing);
+  }
+
+  return(entry);
+}
+
+
+//**********************************************************************
+// CSecDescCache::AddObject
+// ========================
+// Add an object to the list of objects with this SD
+//**********************************************************************
+
+BOOL CSecDescCache::AddObject(SECDESCENTRY* Entry, const WCHAR* Name)
+{ BOOL ok;
+  WCHAR* name;
+  WCHAR** objects;
+  SECDESCENTRY** group;
+
+  name = _wcsdup(Name);
+  if (!name)
+    return(FALSE);
+
+  ok = TRUE;
+
+  AcquireSRWLockExclusive(&m_Lock);
+
+// Make room for the object first, so if that fails the SD isn't left
+// in the list of groups with no objects
+
+  if (Entry->NumObjects >= Entry->MaxObjects)
+  { objects = (WCHAR**) realloc(Entry->Objects, (Entry->MaxObjects + 64)*sizeof(WCHAR*));
+    if (objects)
+    { Entry->Objects = objects;
+      Entry->MaxObjects += 64;
+    }
+    else
+    { ok = FALSE;
+    }
+  }
+
+// If this is the first object for the SD add it to the list of groups
+
+  if (ok && Entry->NumObjects == 0)
+  { if (m_NumGroups >= m_MaxGroups)
+    { group = (SECDESCENTRY**) realloc(m_Group, (m_MaxGroups + 64)*sizeof(SECDESCENTRY*));
+      if (group)
+      { m_Group = group;
+        m_MaxGroups += 64;
+      }
+      else
+      { ok = FALSE;
+      }
+    }
+
+    if (ok)
+      m_Group[m_NumGroups++] = Entry;
+  }
+
+  if (ok)
+    Entry->Objects[Entry->NumObjects++] = name;
+
+  ReleaseSRWLockExclusive(&m_Lock);
+
+  if (!ok)
+    free(name);
+
+  return(ok);
+}
+
+
+//**********************************************************************
+// CSecDescCache::Lookup
+// =====================
+// Must be called with the lock held
+//**********************************************************************
+
+SECDESCENTRY* CSecDescCache::Lookup(const BYTE* SD, DWORD Length, UINT Hash)
+{ SECDESCENTRY* entry;
+
+  for (entry = m_Bucket[Hash % SECDESC_BUCKETS]; entry; entry = entry->Next)
+    if (entry->Hash == Hash && entry->Length == Length && memcmp(entry->SD, SD, Length) == 0)
+      return(entry);
+
+  return(NULL);
+}
@@ -0,0 +1,82 @@
+//**********************************************************************
+// CSecDescCache
+// =============
+// Cache of security descriptors and the text they were formatted to
+//**********************************************************************
+
+#ifndef _INC_CSECDESCCACHE
+#define _INC_CSECDESCCACHE
+
+
+//**********************************************************************
+// SECDESCENTRY
+// ------------
+// One distinct self relative SD. Text is the formatted ACL, which is an
+// empty string if there is nothing to show. Objects is the list of
+// objects with this SD, used when grouping the objects by their ACL.
+//**********************************************************************
+
+typedef struct _SECDESCENTRY
+{ struct _SECDESCENTRY* Next;
+  UINT Hash;
+  DWORD Length;
+
+  WCHAR* Text;
+
+  WCHAR** Objects;
+  int NumObjects, MaxObjects;
+
+  BYTE SD[1];
+
+} SECDESCENTRY;
+
+
+//**********************************************************************
+// CSecDescCache
+// -------------
+// Most objects in a tree share one of a few SDs, so the ACL only needs
+// to be decoded and formatted the first time each SD is seen. The SDs
+// are compared byte for byte, using the hash from
+// CSecureableObject::GetRawSD to find them. The cache can be shared by
+// several threads.
+//**********************************************************************
+
+#define SECDESC_BUCKETS 1024
+
+class CSecDescCache
+{
+  public:
+    CSecDescCache();
+    ~CSecDescCache();
+
+    SECDESCENTRY* Find(const BYTE* SD, DWORD Length, UINT Hash);
+    SECDESCENTRY* Add(const BYTE* SD, DWORD Length, UINT Hash, const WCHAR* Text);
+
+    BOOL AddObject(SECDESCENTRY* Entry, const WCHAR* Name);
+
+    inline int NumEntries(void) { return(m_NumEntries); }
+    inline int NumGroups(void) { return(m_NumGroups); }
+    inline SECDESCENTRY* Group(int i) { return(m_Group[i]); }
+
+  private:
+    SECDESCENTRY* Lookup(const BYTE* SD, DWORD Length, UINT Hash);
+
+  private:
+    SECDESCENTRY* m_Bucket[SECDESC_BUCKETS];
+    int m_NumEntries;
+
+// The entries that have objects, in the order their first object was
+// added
+
+    SECDESCENTRY** m_Group;
+    int m_NumGroups, m_MaxGroups;
+
+    SRWLOCK m_Lock;
+};
+
+
+//**********************************************************************
+// End of CSecDescCache
+//**********************************************************************
+
+#endif // _INC_CSECDESCCACHE
@@ -15,6 +15,35 @@
 #include "CSecurableObject.h"
 
 
+//**********************************************************************
+// SID cache
+// ---------
+// Looking up a SID can mean a round trip to a domain controller, and a
+// directory tree has the same few SIDs in thousands of ACLs, so names
+// are cached for the life of the process. The cache is shared by all
+// threads. Lookups that fail are cached too, as unknown SIDs are often
+// the slowest to look up.
+//**********************************************************************
+
+#define SIDCACHE_BUCKETS 256
+#define SIDCACHE_NAMELEN 63
+
+typedef struct _SIDCACHEENTRY
+{ struct _SIDCACHEENTRY* Next;
+  BOOL Found;
+  WCHAR Domain[SIDCACHE_NAMELEN+1];
+  WCHAR Account[SIDCACHE_NAMELEN+1];
+  BYTE Sid[1];
+
+} SIDCACHEENTRY;
+
+static SIDCACHEENTRY* SidCache[SIDCACHE_BUCKETS];
+static SRWLOCK SidCacheLock = SRWLOCK_INIT;
+
+static SIDCACHEENTRY* FindCachedSID(BYTE* pcSid, DWORD dwLength, UINT uHash);
+static UINT HashBytes(const BYTE* pData, DWORD dwLength);
+
+
 //**********************************************************************
 // CSecureableObject
 // =================
@@ -38,6 +67,11 @@ CSecureableObject::CSecureableObject(BOOL bProtected)
   m_pSACL = NULL;
   m_pOwner = NULL;
   m_pPrimaryGroup = NULL;
+  m_pRawSD = NULL;
+  m_dwRawSDLength = 0;
+  m_uRawSDHash = 0;
+  m_bSkipInherited = FALSE;
+  m_bSkipped = FALSE;
 
 // Allocate and initialise the security descriptor
 
@@ -942,17 +976,108 @@ BOOL CSecureableObject::GetSIDFromName(const WCHAR* pDomainName, const WCHAR* pA
 
 BOOL CSecureableObject::GetNameFromSID(WCHAR* pDomainName, WCHAR* pAccountName, BYTE* pcSid)
 {
-  DWORD len_name, len_domain;
+  DWORD len_name, len_domain, len_sid;
+  UINT hash;
+  BOOL found;
   SID_NAME_USE sidname;
+  SIDCACHEENTRY *entry, *existing;
 
   lstrcpy(pDomainName, L"Unknown");
   lstrcpy(pAccountName, L"Unknown");
 
-  len_name = len_domain = 63;
-  if (!LookupAccountSid(NULL, pcSid, pAccountName, &len_name, pDomainName, &len_domain, &sidname))
+  if (!IsValidSid(pcSid))
     return FALSE;
 
-  return TRUE;
+  len_sid = GetLengthSid(pcSid);
+  hash = HashBytes(pcSid, len_sid);
+
+// Look in the cache first
+
+  AcquireSRWLockShared(&SidCacheLock);
+
+  entry = FindCachedSID(pcSid, len_sid, hash);
+  if (entry)
+  { lstrcpy(pDomainName, entry->Domain);
+    lstrcpy(pAccountName, entry->Account);
+  }
+
+  ReleaseSRWLockShared(&SidCacheLock);
+
+  if (entry)
+    return entry->Found;
+
+// Not cached so look it up. The lock isn't held during the lookup so
+// other threads aren't held up, which means two threads may look up the
+// same SID but only the first one is added.
+
+  len_name = len_domain = SIDCACHE_NAMELEN;
+  found = LookupAccountSid(NULL, pcSid, pAccountName, &len_name, pDomainName, &len_domain, &sidname);
+
+  if (!found)
+  { lstrcpy(pDomainName, L"Unknown");
+    lstrcpy(pAccountName, L"Unknown");
+  }
+
+  entry = (SIDCACHEENTRY*) malloc(sizeof(SIDCACHEENTRY) + len_sid);
+  if (!entry)
+    return found;
+
+  entry->Found = found;
+  lstrcpy(entry->Domain, pDomainName);
+  lstrcpy(entry->Account, pAccountName);
+  CopySid(len_sid, entry->Sid, pcSid);
+
+  AcquireSRWLockExclusive(&SidCacheLock);
+
+  existing = FindCachedSID(pcSid, len_sid, hash);
+  if (!existing)
+  { entry->Next = SidCache[hash % SIDCACHE_BUCKETS];
+    SidCache[hash % SIDCACHE_BUCKETS] = entry;
+  }
+
+  ReleaseSRWLockExclusive(&SidCacheLock);
+
+  if (existing)
+    free(entry);
+
+  return found;
+}
+
+
+//**********************************************************************
+// FindCachedSID
+// -------------
+// Must be called with the cache lock held
+//**********************************************************************
+
+static SIDCACHEENTRY* FindCachedSID(BYTE* pcSid, DWORD dwLength, UINT uHash)
+{ SIDCACHEENTRY* entry;
+
+  for (entry = SidCache[uHash % SIDCACHE_BUCKETS]; entry; entry = entry->Next)
+    if (GetLengthSid(entry->Sid) == dwLength && memcmp(entry->Sid, pcSid, dwLength) == 0)
+      return entry;
+
+  return NULL;
+}
+
+
+//**********************************************************************
+// HashBytes
+// ---------
+// FNV-1a hash used for SIDs and security descriptors
+//**********************************************************************
+
+static UINT HashBytes(const BYTE* pData, DWORD dwLength)
+{ UINT hash;
+  DWORD i;
+
+  hash = 2166136261u;
+  for (i = 0; i < dwLength; i++)
+  { hash ^= pData[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
 }
 
 
@@ -1017,7 +1142,11 @@ BOOL CSecureableObject::BuildSD(PSECURITY_DESCRIPTOR pSelfRelativeReturnSD)
      if (!MakeAbsoluteSD(pSelfRelativeReturnSD, m_pSD, &iSDSize, m_pDACL, &iDACLSize, m_pSACL, &iSACLSize, m_pOwner, &iOwnerSize, m_pPrimaryGroup, &iGroupSize))
        goto ErrorExit;
 
-// It worked, we have a new SD which we keep for later modification
+// It worked, we have a new SD which we keep for later modification.
+// Keep a copy of the SD as it was read too.
+
+     if (!SaveRawSD(pSelfRelativeReturnSD))
+       goto ErrorExit;
 
      return TRUE;
    }
@@ -1037,6 +1166,111 @@ BOOL CSecureableObject::BuildSD(PSECURITY_DESCRIPTOR pSelfRelativeReturnSD)
 }
 
 
+//**********************************************************************
+// CSecureableObject::SkipInheritedSD
+// ==================================
+// Called by GetObjectSecurity in the subclasses with the SD that was
+// just read. If we've been asked to skip inherited SDs, and the DACL
+// contains nothing but inherited ACEs, this frees our SD and returns
+// TRUE so the SD isn't built. Only the ACE headers are read, so this is
+// much cheaper than building the SD and walking the ACEs.
+//**********************************************************************
+
+BOOL CSecureableObject::SkipInheritedSD(PSECURITY_DESCRIPTOR pSelfRelativeSD)
+{ DWORD revision, i;
+  SECURITY_DESCRIPTOR_CONTROL control;
+  PACL pAcl = NULL;
+  ACE_HEADER* pAce;
+  BOOL bHasDacl, bHasDefaulted;
+
+  m_bSkipped = FALSE;
+
+  if (!m_bSkipInherited)
+    return FALSE;
+
+// A protected DACL doesn't inherit anything, so its ACEs are all
+// explicit
+
+  if (!GetSecurityDescriptorControl(pSelfRelativeSD, &control, &revision))
+    return FALSE;
+
+  if (!GetSecurityDescriptorDacl(pSelfRelativeSD, &bHasDacl, &pAcl, &bHasDefaulted))
+    return FALSE;
+
+  if (bHasDacl && pAcl && (control & SE_DACL_PROTECTED) && pAcl->AceCount > 0)
+    return FALSE;
+
+// Otherwise look for an ACE that isn't inherited. If there is no DACL
+// there are no ACEs to show either.
+
+  if (bHasDacl && pAcl)
+  { for (i = 0; i < pAcl->AceCount; i++)
+    { if (!GetAce(pAcl, i, (void**) &pAce))
+        return FALSE;
+
+      if (!(pAce->AceFlags & INHERITED_ACE))
+        return FALSE;
+    }
+  }
+
+// There's nothing but inherited ACEs
+
+  FreeDataStructures();
+  m_bSkipped = TRUE;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CSecureableObject::SaveRawSD
+// ============================
+// Keep a copy of the self relative SD that was read from the object and
+// hash it, so identical SDs can be recognised without decoding them.
+//**********************************************************************
+
+BOOL CSecureableObject::SaveRawSD(PSECURITY_DESCRIPTOR pSelfRelativeSD)
+{ DWORD len;
+
+  if (m_pRawSD)
+    free(m_pRawSD);
+
+  m_pRawSD = NULL;
+  m_dwRawSDLength = 0;
+  m_uRawSDHash = 0;
+
+  len = GetSecurityDescriptorLength(pSelfRelativeSD);
+
+  m_pRawSD = (BYTE*) malloc(len);
+  if (!m_pRawSD)
+  { SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+
+  memcpy(m_pRawSD, pSelfRelativeSD, len);
+  m_dwRawSDLength = len;
+  m_uRawSDHash = HashBytes(m_pRawSD, len);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CSecureableObject::GetRawSD
+// ===========================
+// Return the SD as it was read by GetObjectSecurity, or NULL if it
+// hasn't been read
+//**********************************************************************
+
+const BYTE* CSecureableObject::GetRawSD(DWORD* pdwLength, UINT* puHash)
+{
+  *pdwLength = m_dwRawSDLength;
+  *puHash = m_uRawSDHash;
+
+  return m_pRawSD;
+}
+
+
 //**********************************************************************
 // CSecureableObject::FreeDataStructures
 // =====================================
@@ -1045,6 +1279,8 @@ BOOL CSecureableObject::BuildSD(PSECURITY_DESCRIPTOR pSelfRelativeReturnSD)
 
 void CSecureableObject::FreeDataStructures(void)
 {
+  if (m_pRawSD)
+    free(m_pRawSD);
   if (m_pSD)
     free (m_pSD);
   if (m_pDACL)
@@ -1073,6 +1309,9 @@ void CSecureableObject::ZeroOut(void)
   m_pSACL = NULL;
   m_pOwner = NULL;
   m_pPrimaryGroup = NULL;
+  m_pRawSD = NULL;
+  m_dwRawSDLength = 0;
+  m_uRawSDHash = 0;
 }
 
 
@@ -58,6 +58,11 @@ class CSecureableObject
     BOOL GetRightsFromACE(WCHAR* pAccountName, WCHAR* pDomainName, DWORD* dwAccessMask, DWORD* dwType, DWORD* dwFlags, DWORD dwIndex);
     BOOL GetAllRightsFor(DWORD* Mask, DWORD dwIndex);
 
+    const BYTE* GetRawSD(DWORD* pdwLength, UINT* puHash);
+
+    inline void SetSkipInherited(BOOL bSkip) { m_bSkipInherited = bSkip; }
+    inline BOOL WasSkipped(void) { return(m_bSkipped); }
+
     const WCHAR* GetLastErrorMessage(void);
 
 // Public data
@@ -69,6 +74,7 @@ class CSecureableObject
 
   protected:
     BOOL BuildSD(PSECURITY_DESCRIPTOR pSelfRelativeReturnSD);
+    BOOL SkipInheritedSD(PSECURITY_DESCRIPTOR pSelfRelativeSD);
 
     void FreeDataStructures(void);
     void ZeroOut(void);
@@ -85,9 +91,22 @@ class CSecureableObject
     PSID m_pOwner;
     PSID m_pPrimaryGroup;
 
+// The self relative SD as it was read, and its hash
+
+    BYTE* m_pRawSD;
+    DWORD m_dwRawSDLength;
+    UINT m_uRawSDHash;
+
+// If m_bSkipInherited is set GetObjectSecurity doesn't build the SD when
+// the DACL has no ACEs except inherited ones, and sets m_bSkipped
+
+    BOOL m_bSkipInherited;
+    BOOL m_bSkipped;
+
 // Private methods
 
   private:
+    BOOL SaveRawSD(PSECURITY_DESCRIPTOR pSelfRelativeSD);
     BOOL GetSIDFromName(const WCHAR* pDomainName, const WCHAR* pAccountName, BYTE **pcSid, WCHAR **pcDomainName);
     BOOL GetNameFromSID(WCHAR* pDomainName, WCHAR* pAccountName, BYTE *pcSid);
 
@@ -0,0 +1,232 @@
+//**********************************************************************
+// CRhsPatchFile
+// =============
+// Class to write binary patch files
+//
+// A patch lists the byte ranges that differ between two versions of a
+// file. Writing those ranges over the old version produces the new
+// version.
+//**********************************************************************
+
+#ifndef STRICT
+#define STRICT
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include "CRhsPatchFile.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+#define LEN_PATCHBUF 0x10000
+
+
+//**********************************************************************
+// CRhsPatchFile
+// -------------
+//**********************************************************************
+
+CRhsPatchFile::CRhsPatchFile()
+{
+  m_File = INVALID_HANDLE_VALUE;
+  m_FileName = NULL;
+  m_Buf = NULL;
+  m_BufUsed = 0;
+  m_NumRanges = m_NumBytes = 0;
+  lstrcpy(m_LastError, L"");
+}
+
+CRhsPatchFile::~CRhsPatchFile()
+{
+  Close();
+}
+
+
+//**********************************************************************
+// Create
+// ------
+// Create a new patch file and write the header
+//**********************************************************************
+
+BOOL CRhsPatchFile::Create(const WCHAR* PatchFile, UINT64 OldSize, UINT64 NewSize, DWORD BlockSize)
+{ RHSPATCHHEADER header;
+
+  Close();
+
+// Allocate the write buffer and save the file name for error messages
+
+  m_Buf = (BYTE*) malloc(LEN_PATCHBUF);
+  m_FileName = (WCHAR*) malloc((lstrlen(PatchFile) + 1)*sizeof(WCHAR));
+
+  if (!m_Buf || !m_FileName)
+  { lstrcpy(m_LastError, L"Out of memory creating patch file");
+    return FALSE;
+  }
+
+  lstrcpy(m_FileName, PatchFile);
+
+// Create the file
+
+  m_File = CreateFile(PatchFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+  if (m_File == INVALID_HANDLE_VALUE)
+  { SetLastError(L"Cannot create patch file", PatchFile);
+    return FALSE;
+  }
+
+// Write the header
+
+  ZeroMemory(&header, sizeof(header));
+  CopyMemory(header.Magic, RHSPATCH_MAGIC, sizeof(header.Magic));
+  header.Version = RHSPATCH_VERSION;
+  header.BlockSize = BlockSize;
+  header.OldSize = OldSize;
+  header.NewSize = NewSize;
+
+  return Write(&header, sizeof(header));
+}
+
+
+//**********************************************************************
+// AddRange
+// --------
+// Add a range of data to the patch
+//**********************************************************************
+
+BOOL CRhsPatchFile::AddRange(UINT64 Offset, const void* Data, DWORD Length)
+{ RHSPATCHRANGE range;
+
+  if (m_File == INVALID_HANDLE_VALUE)
+  { lstrcpy(m_LastError, L"The patch file has not been created");
+    return FALSE;
+  }
+
+  if (Length == 0)
+    return TRUE;
+
+  range.Offset = Offset;
+  range.Length = Length;
+
+  if (!Write(&range, sizeof(range)))
+    return FALSE;
+
+  if (!Write(Data, Length))
+    return FALSE;
+
+  m_NumRanges++;
+  m_NumBytes += Length;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Close
+// -----
+// Write the end marker and close the file. Calling Close when the file
+// is already closed does nothing.
+//**********************************************************************
+
+BOOL CRhsPatchFile::Close(void)
+{ BOOL retcode;
+  RHSPATCHRANGE range;
+
+  retcode = TRUE;
+
+  if (m_File != INVALID_HANDLE_VALUE)
+  { range.Offset = RHSPATCH_END;
+    range.Length = 0;
+
+    if (!Write(&range, sizeof(range)) || !Flush())
+      retcode = FALSE;
+
+    CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+  }
+
+  if (m_Buf)
+    free(m_Buf);
+  m_Buf = NULL;
+  m_BufUsed = 0;
+
+  if (m_FileName)
+    free(m_FileName);
+  m_FileName = NULL;
+
+  return retcode;
+}
+
+
+//**********************************************************************
+// Write
+// -----
+// Buffered write to the patch file
+//**********************************************************************
+
+BOOL CRhsPatchFile::Write(const void* Data, DWORD Length)
+{ DWORD len;
+  const BYTE* p = (const BYTE*) Data;
+
+  while (Length > 0)
+  { if (m_BufUsed == LEN_PATCHBUF)
+      if (!Flush())
+        return FALSE;
+
+    len = LEN_PATCHBUF - m_BufUsed;
+    if (len > Length)
+      len = Length;
+
+    CopyMemory(m_Buf + m_BufUsed, p, len);
+    m_BufUsed += len;
+    p += len;
+    Length -= len;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Flush
+// -----
+//**********************************************************************
+
+BOOL CRhsPatchFile::Flush(void)
+{ DWORD numwritten;
+
+  if (m_BufUsed == 0)
+    return TRUE;
+
+  if (!WriteFile(m_File, m_Buf, m_BufUsed, &numwritten, NULL) || numwritten != m_BufUsed)
+  { SetLastError(L"Error writing patch file", m_FileName);
+    return FALSE;
+  }
+
+  m_BufUsed = 0;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// SetLastError
+// ------------
+//**********************************************************************
+
+void CRhsPatchFile::SetLastError(const WCHAR* Error, const WCHAR* FileName)
+{ int i;
+
+  swprintf(m_LastError, 511, L"%s \"%s\": ", Error, FileName);
+  i = lstrlen(m_LastError);
+  FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, 0, GetLastError(), 0, m_LastError + i, 511 - i, NULL);
+
+  for (i = lstrlen(m_LastError); i > 0; i--)
+  { if (m_LastError[i-1] != '\r' && m_LastError[i-1] != '\n')
+      break;
+    m_LastError[i-1] = '\0';
+  }
+}
+
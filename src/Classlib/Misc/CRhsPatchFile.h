@@ -0,0 +1,89 @@
+//**********************************************************************
+// CRhsPatchFile
+// =============
+// Class to write binary patch files
+//**********************************************************************
+
+#ifndef _INC_CRHSPATCHFILE
+#define _INC_CRHSPATCHFILE
+
+
+//**********************************************************************
+// Patch file format
+// -----------------
+// The file starts with a header giving the size of the file the patch
+// applies to and the size of the file after patching. This is followed
+// by any number of ranges, each a RHSPATCHRANGE followed by Length
+// bytes of data to write at Offset. The last range has an offset of
+// RHSPATCH_END and no data.
+//**********************************************************************
+
+#define RHSPATCH_MAGIC   "RHSPATCH"
+#define RHSPATCH_VERSION 1
+#define RHSPATCH_END     ((UINT64) -1)
+
+#pragma pack(push, 4)
+
+typedef struct
+{
+  char   Magic[8];
+  DWORD  Version;
+  DWORD  BlockSize;
+  UINT64 OldSize,
+         NewSize;
+
+} RHSPATCHHEADER;
+
+typedef struct
+{
+  UINT64 Offset;
+  DWORD  Length;
+
+} RHSPATCHRANGE;
+
+#pragma pack(pop)
+
+
+//**********************************************************************
+// CRhsPatchFile
+// -------------
+//**********************************************************************
+
+class CRhsPatchFile
+{
+  public:
+    CRhsPatchFile();
+    ~CRhsPatchFile();
+
+    BOOL Create(const WCHAR* PatchFile, UINT64 OldSize, UINT64 NewSize, DWORD BlockSize);
+    BOOL AddRange(UINT64 Offset, const void* Data, DWORD Length);
+    BOOL Close(void);
+
+    inline UINT64 NumRanges(void) { return m_NumRanges; }
+    inline UINT64 NumBytes(void) { return m_NumBytes; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL Write(const void* Data, DWORD Length);
+    BOOL Flush(void);
+    void SetLastError(const WCHAR* Error, const WCHAR* FileName);
+
+  private:
+    HANDLE m_File;
+    WCHAR* m_FileName;
+
+    BYTE* m_Buf;
+    DWORD m_BufUsed;
+
+    UINT64 m_NumRanges, m_NumBytes;
+
+    WCHAR m_LastError[512];
+};
+
+
+//**********************************************************************
+// End of CRhsPatchFile
+//**********************************************************************
+
+#endif // _INC_CRHSPATCHFILE
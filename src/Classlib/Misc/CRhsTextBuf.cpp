@@ -0,0 +1,133 @@
+//**********************************************************************
+// CRhsTextBuf
+// ===========
+// Class to build up a string by appending to it
+//**********************************************************************
+
+#ifndef STRICT
+#define STRICT
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "CRhsTextBuf.h"
+
+
+//**********************************************************************
+// CRhsTextBuf
+// -----------
+//**********************************************************************
+
+CRhsTextBuf::CRhsTextBuf()
+{
+  m_Buf = NULL;
+  m_Len = m_Size = 0;
+}
+
+
+CRhsTextBuf::~CRhsTextBuf()
+{
+  if (m_Buf)
+    free(m_Buf);
+}
+
+
+//**********************************************************************
+// CRhsTextBuf::Reset
+// ------------------
+//**********************************************************************
+
+void CRhsTextBuf::Reset(void)
+{
+  m_Len = 0;
+  if (m_Buf)
+    m_Buf[0] = '\0';
+}
+
+
+//**********************************************************************
+// CRhsTextBuf::Append
+// -------------------
+//**********************************************************************
+
+BOOL CRhsTextBuf::Append(const WCHAR* Text)
+{ int len;
+
+  len = lstrlen(Text);
+  if (!Grow(len))
+    return(FALSE);
+
+  memcpy(m_Buf + m_Len, Text, (len + 1)*sizeof(WCHAR));
+  m_Len += len;
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// CRhsTextBuf::Printf
+// -------------------
+// Append formatted text
+//**********************************************************************
+
+BOOL CRhsTextBuf::Printf(const WCHAR* Format, ...)
+{ int len;
+  va_list ap;
+
+// Find how much space we need
+
+  va_start(ap, Format);
+  len = _vscwprintf(Format, ap);
+  va_end(ap);
+
+  if (len < 0 || !Grow(len))
+    return(FALSE);
+
+// Then append the text
+
+  va_start(ap, Format);
+  len = vswprintf(m_Buf + m_Len, m_Size - m_Len, Format, ap);
+  va_end(ap);
+
+  if (len < 0)
+  { m_Buf[m_Len] = '\0';
+    return(FALSE);
+  }
+
+  m_Len += len;
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// CRhsTextBuf::Grow
+// -----------------
+// Make sure there is room for another Needed characters and the null
+//**********************************************************************
+
+BOOL CRhsTextBuf::Grow(int Needed)
+{ int size;
+  WCHAR* buf;
+
+  if (m_Len + Needed + 1 <= m_Size)
+    return(TRUE);
+
+  size = m_Size > 0 ? m_Size : 256;
+  while (size < m_Len + Needed + 1)
+    size *= 2;
+
+  buf = (WCHAR*) realloc(m_Buf, size*sizeof(WCHAR));
+  if (!buf)
+    return(FALSE);
+
+  if (!m_Buf)
+    buf[0] = '\0';
+
+  m_Buf = buf;
+  m_Size = size;
+
+  return(TRUE);
+}
@@ -0,0 +1,46 @@
+//**********************************************************************
+// CRhsTextBuf
+// ===========
+// Class to build up a string by appending to it
+//**********************************************************************
+
+#ifndef _INC_CRhsTextBuf
+#define _INC_CRhsTextBuf
+
+
+//**********************************************************************
+// CRhsTextBuf
+// -----------
+// The length is tracked so appending doesn't have to find the end of
+// the string, and the buffer grows as needed. Reset empties the string
+// but keeps the buffer, so a buffer reused for many strings soon stops
+// allocating memory.
+//**********************************************************************
+
+class CRhsTextBuf
+{
+  public:
+    CRhsTextBuf();
+    ~CRhsTextBuf();
+
+    void Reset(void);
+    BOOL Append(const WCHAR* Text);
+    BOOL Printf(const WCHAR* Format, ...);
+
+    inline const WCHAR* Text(void) { return(m_Buf ? m_Buf : L""); }
+    inline int Length(void) { return(m_Len); }
+
+  private:
+    BOOL Grow(int Needed);
+
+  private:
+    WCHAR* m_Buf;
+    int m_Len, m_Size;
+};
+
+
+//**********************************************************************
+// End of CRhsTextBuf
+//**********************************************************************
+
+#endif // _INC_CRhsTextBuf
@@ -10,6 +10,7 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "CRhsWildCard.h"
 
 
@@ -21,11 +22,51 @@
 CRhsWildCard::CRhsWildCard()
 {
   m_CaseSensitive = FALSE;
+
+  m_SrcPat = m_Lower = m_Upper = NULL;
+  m_Wild = NULL;
+  m_PatLen = m_NumWild = 0;
+
+  m_SpanStart = m_SpanLen = NULL;
+
+  m_DstPat = NULL;
+  m_DstWild = NULL;
+  m_DstLen = 0;
+
   lstrcpy(m_LastError, L"");
 }
 
 CRhsWildCard::~CRhsWildCard()
 {
+  FreePatterns();
+}
+
+
+//**********************************************************************
+// Compile
+// -------
+// Compile the source pattern and, if DstPat isn't NULL, the destination
+// pattern. Patterns that haven't changed since the last call aren't
+// compiled again.
+//**********************************************************************
+
+BOOL CRhsWildCard::Compile(const WCHAR* SrcPat, const WCHAR* DstPat)
+{
+
+// If the source pattern changes the destination has to be checked
+// against it again
+
+  if (!m_SrcPat || lstrcmp(m_SrcPat, SrcPat) != 0)
+  { if (!CompileSource(SrcPat))
+      return FALSE;
+  }
+
+  if (DstPat && (!m_DstPat || lstrcmp(m_DstPat, DstPat) != 0))
+  { if (!CompileDest(DstPat))
+      return FALSE;
+  }
+
+  return TRUE;
 }
 
 
@@ -37,6 +78,23 @@ CRhsWildCard::~CRhsWildCard()
 
 BOOL CRhsWildCard::Match(const WCHAR* SrcPat, const WCHAR* Source)
 {
+  if (!Compile(SrcPat, NULL))
+    return FALSE;
+
+  return Match(Source);
+}
+
+BOOL CRhsWildCard::Match(const WCHAR* Source)
+{
+  if (!m_SrcPat)
+  { lstrcpy(m_LastError, L"No source pattern has been compiled");
+    return FALSE;
+  }
+
+  if (!MatchSpans(Source))
+  { lstrcpy(m_LastError, L"Source pattern and source string do not match");
+    return FALSE;
+  }
 
 // Return indicating that the string matches the pattern
 
@@ -52,140 +110,301 @@ BOOL CRhsWildCard::Match(const WCHAR* SrcPat, const WCHAR* Source)
 //**********************************************************************
 
 BOOL CRhsWildCard::Complete(const WCHAR* SrcPat, const WCHAR* Source, const WCHAR* DstPat, WCHAR* Destination, int BufLen)
-{ int bufend, srcpat, source, dstpat, dest, i, j;
-  const WCHAR* p;
-  WCHAR s[256];
+{
+  if (!Compile(SrcPat, DstPat))
+    return FALSE;
 
-// bufend is the offset of the last charactert in the buffer
+  return Complete(Source, Destination, BufLen);
+}
 
-  bufend = BufLen - 1;
+BOOL CRhsWildCard::Complete(const WCHAR* Source, WCHAR* Destination, int BufLen)
+{ int dest, i, j;
 
-// Loop over all characters in DstPat
+  if (!m_SrcPat || !m_DstPat)
+  { lstrcpy(m_LastError, L"No source and destination patterns have been compiled");
+    return FALSE;
+  }
 
-  srcpat = source = dstpat = dest = 0;
+  if (BufLen < 1)
+  { lstrcpy(m_LastError, L"Destination buffer is not long enough");
+    return FALSE;
+  }
 
-  while (SrcPat[srcpat] != '\0')
-  {
+// Find the text each wildcard matches
 
-// Step through SrcPat and Source until we hit a * or ? (or \0)
-// - if SrcPat and Source don't match flag an error
+  if (!MatchSpans(Source))
+  { lstrcpy(m_LastError, L"Source pattern and source string do not match");
+    return FALSE;
+  }
 
-    while (SrcPat[srcpat] != '*' && SrcPat[srcpat] != '?' && SrcPat[srcpat] != '\0')
-    { if (!CompareChar(SrcPat[srcpat], Source[source]))
-      { lstrcpy(m_LastError, L"Source pattern and source string do not match");
-        return FALSE;
-      }
+// Copy DstPat to Destination, replacing the wildcards with the text they
+// matched
 
-      srcpat++;
-      source++;
+  dest = 0;
+
+  for (i = 0; i < m_DstLen; i++)
+  { if (m_DstWild[i] < 0)
+    { if (dest >= BufLen - 1)
+        break;
+      Destination[dest++] = m_DstPat[i];
+    }
+    else
+    { for (j = 0; j < m_SpanLen[m_DstWild[i]] && dest < BufLen - 1; j++)
+        Destination[dest++] = Source[m_SpanStart[m_DstWild[i]] + j];
+      if (j < m_SpanLen[m_DstWild[i]])
+        break;
     }
+  }
 
-// Copy from DstPat to Destination until we hit a * or ? (or \0)
-// - if SrcPat and DstPat don't match flag an error
+  Destination[dest] = '\0';
 
-    while (DstPat[dstpat] != '*' && DstPat[dstpat] != '?' && DstPat[dstpat] != '\0')
-    { if (dest >= bufend)
-      { Destination[bufend] = '\0';
-        lstrcpy(m_LastError, L"Destination buffer is not long enough");
-        return FALSE;
-      }
-      Destination[dest++] = DstPat[dstpat++];
-    }
+  if (i < m_DstLen)
+  { lstrcpy(m_LastError, L"Destination buffer is not long enough");
+    return FALSE;
+  }
 
-    if (!CompareChar(SrcPat[srcpat], DstPat[dstpat]))
-    { lstrcpy(m_LastError, L"Source and destination patterns do not match");
-      return FALSE;
-    }
+// Return indicating success
 
-// If we hit a ? we just need to copy one character from Source to
-// Destination
+  return TRUE;
+}
 
-    if (SrcPat[srcpat] == '?')
-    { if (Source[source] == '\0')
-      { lstrcpy(m_LastError, L"End of source string when matching ? in source pattern");
-        return FALSE;
-      }
 
-      if (dest >= bufend)
-      { Destination[bufend] = '\0';
-        lstrcpy(m_LastError, L"Destination buffer is not long enough");
-        return FALSE;
-      }
+//**********************************************************************
+// SetCaseSensitive
+// ----------------
+//**********************************************************************
 
-      Destination[dest++] = Source[source++];
-      srcpat++;
-      dstpat++;
-    }
+void CRhsWildCard::SetCaseSensitive(BOOL CaseSensitive)
+{
+  if (CaseSensitive == m_CaseSensitive)
+    return;
 
-// Processing * is more complicated.
+  m_CaseSensitive = CaseSensitive;
 
-    if (SrcPat[srcpat] == '*')
-    {
+// The case is built into the compiled pattern
 
-// Multiple * get treated as one; jump past repeated *
+  FreePatterns();
+}
 
-      for (i = srcpat; SrcPat[i] == '*'; i++);
 
-// Get the part of SrcPat following the wildcard
+//**********************************************************************
+// CompileSource
+// -------------
+// Multiple * get treated as one. Each position in the pattern is stored
+// in lower and upper case so comparing a character doesn't need it to
+// be lowercased.
+//**********************************************************************
 
-      for (j = 0; SrcPat[i] != '*' && SrcPat[i] != '?' && SrcPat[i] != '\0'; i++, j++)
-        s[j] = SrcPat[i];
-      s[j] = '\0';
+BOOL CRhsWildCard::CompileSource(const WCHAR* SrcPat)
+{ int len, i, j;
 
-// Now find this part of SrcPat in Source. If s = "" the * matches the
-// remaining part of Source.
+  FreePatterns();
 
-      if (s[0] == '\0')
-      { i = lstrlen(Source);
-      }
-      else
-      { p = FindString(Source+source, s);
-        if (!p)
-        { lstrcpy(m_LastError, L"End of source string when matching * in source pattern");
-          return FALSE;
-        }
+  len = lstrlen(SrcPat);
 
-        i = p - Source;
-      }
+  m_SrcPat = (WCHAR*) malloc((len + 1)*sizeof(WCHAR));
+  m_Lower = (WCHAR*) malloc((len + 1)*sizeof(WCHAR));
+  m_Upper = (WCHAR*) malloc((len + 1)*sizeof(WCHAR));
+  m_Wild = (int*) malloc((len + 1)*sizeof(int));
+  m_SpanStart = (int*) malloc((len + 1)*sizeof(int));
+  m_SpanLen = (int*) malloc((len + 1)*sizeof(int));
 
-// At this point Source[i] is the character after the end of the part of
-// Source that matches the * in SrcPat. Copy this part to Destination.
+  if (!m_SrcPat || !m_Lower || !m_Upper || !m_Wild || !m_SpanStart || !m_SpanLen)
+  { FreePatterns();
+    lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
 
-      while (source < i)
-      { if (dest >= bufend)
-        { Destination[bufend] = '\0';
-          lstrcpy(m_LastError, L"Destination buffer is not long enough");
-          return FALSE;
-        }
-        Destination[dest++] = Source[source++];
-      }
+  lstrcpy(m_SrcPat, SrcPat);
 
-// And advance past the * in SrcPat and DstPat
+  m_NumWild = 0;
 
-      while (SrcPat[srcpat] == '*')
-        srcpat++;
-      dstpat++;
+  for (i = j = 0; SrcPat[i] != '\0'; i++)
+  { if (SrcPat[i] == '*' && j > 0 && m_Lower[j-1] == '*')
+      continue;
+
+    if (m_CaseSensitive || SrcPat[i] == '*' || SrcPat[i] == '?')
+    { m_Lower[j] = m_Upper[j] = SrcPat[i];
+    }
+    else
+    { m_Lower[j] = (WCHAR) (UINT_PTR) CharLower((LPTSTR) SrcPat[i]);
+      m_Upper[j] = (WCHAR) (UINT_PTR) CharUpper((LPTSTR) SrcPat[i]);
     }
+
+    m_Wild[j] = SrcPat[i] == '*' || SrcPat[i] == '?' ? m_NumWild++ : -1;
+    j++;
   }
 
-// Finally tack on any remaining bits of DstPat
+  m_Lower[j] = m_Upper[j] = '\0';
+  m_PatLen = j;
 
-  while (DstPat[dstpat] != '\0')
-  { if (dest >= bufend)
-    { Destination[bufend] = '\0';
-      lstrcpy(m_LastError, L"Destination buffer is not long enough");
-      return FALSE;
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CompileDest
+// -----------
+// The wildcards in DstPat must be the same as those in SrcPat, in the
+// same order. Any wildcards left over in DstPat are copied as they are.
+//**********************************************************************
+
+BOOL CRhsWildCard::CompileDest(const WCHAR* DstPat)
+{ int len, wild, i, j;
+
+  if (m_DstPat)
+    free(m_DstPat);
+  if (m_DstWild)
+    free(m_DstWild);
+
+  m_DstPat = NULL;
+  m_DstWild = NULL;
+  m_DstLen = 0;
+
+  len = lstrlen(DstPat);
+
+  m_DstPat = (WCHAR*) malloc((len + 1)*sizeof(WCHAR));
+  m_DstWild = (int*) malloc((len + 1)*sizeof(int));
+
+  if (!m_DstPat || !m_DstWild)
+  { if (m_DstPat)
+      free(m_DstPat);
+    if (m_DstWild)
+      free(m_DstWild);
+    m_DstPat = NULL;
+    m_DstWild = NULL;
+    lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  lstrcpy(m_DstPat, DstPat);
+  m_DstLen = len;
+
+  wild = 0;
+  j = 0;
+
+  for (i = 0; i < len; i++)
+  { m_DstWild[i] = -1;
+
+    if ((DstPat[i] == '*' || DstPat[i] == '?') && wild < m_NumWild)
+    {
+
+// Find the source wildcard this one replaces
+
+      while (m_Wild[j] != wild)
+        j++;
+
+      if (m_Lower[j] != DstPat[i])
+        break;
+
+      m_DstWild[i] = wild++;
     }
-    Destination[dest++] = DstPat[dstpat++];
   }
-  Destination[dest] = '\0';
 
-// Return indicating success
+  if (wild < m_NumWild)
+  { free(m_DstPat);
+    free(m_DstWild);
+    m_DstPat = NULL;
+    m_DstWild = NULL;
+    m_DstLen = 0;
+    lstrcpy(m_LastError, L"Source and destination patterns do not match");
+    return FALSE;
+  }
 
   return TRUE;
 }
 
 
+//**********************************************************************
+// MatchSpans
+// ----------
+// Match Source against the compiled pattern and record the text each
+// wildcard matched. When a character doesn't match, the last * is
+// extended by one and the pattern after it is tried again from there.
+// Earlier *s are never revisited, so each * matches as little as it
+// can. See CRhsWildCard.h for the cost of this.
+//**********************************************************************
+
+BOOL CRhsWildCard::MatchSpans(const WCHAR* Source)
+{ int pat, src, star, starsrc;
+
+  pat = src = 0;
+  star = -1;
+  starsrc = 0;
+
+  while (Source[src] != '\0')
+  { if (pat < m_PatLen && m_Lower[pat] == '?' && m_Wild[pat] >= 0)
+    { m_SpanStart[m_Wild[pat]] = src;
+      m_SpanLen[m_Wild[pat]] = 1;
+      pat++;
+      src++;
+    }
+    else if (pat < m_PatLen && m_Lower[pat] == '*' && m_Wild[pat] >= 0)
+    { star = pat;
+      starsrc = src;
+      m_SpanStart[m_Wild[pat]] = src;
+      m_SpanLen[m_Wild[pat]] = 0;
+      pat++;
+    }
+    else if (pat < m_PatLen && (Source[src] == m_Lower[pat] || Source[src] == m_Upper[pat]))
+    { pat++;
+      src++;
+    }
+    else if (star >= 0)
+    { pat = star + 1;
+      src = ++starsrc;
+      m_SpanLen[m_Wild[star]] = src - m_SpanStart[m_Wild[star]];
+    }
+    else
+    { return FALSE;
+    }
+  }
+
+// Any *s left at the end of the pattern match nothing
+
+  while (pat < m_PatLen && m_Lower[pat] == '*' && m_Wild[pat] >= 0)
+  { m_SpanStart[m_Wild[pat]] = src;
+    m_SpanLen[m_Wild[pat]] = 0;
+    pat++;
+  }
+
+  return pat == m_PatLen;
+}
+
+
+//**********************************************************************
+// FreePatterns
+// ------------
+//**********************************************************************
+
+void CRhsWildCard::FreePatterns(void)
+{
+  if (m_SrcPat)
+    free(m_SrcPat);
+  if (m_Lower)
+    free(m_Lower);
+  if (m_Upper)
+    free(m_Upper);
+  if (m_Wild)
+    free(m_Wild);
+  if (m_SpanStart)
+    free(m_SpanStart);
+  if (m_SpanLen)
+    free(m_SpanLen);
+  if (m_DstPat)
+    free(m_DstPat);
+  if (m_DstWild)
+    free(m_DstWild);
+
+  m_SrcPat = m_Lower = m_Upper = NULL;
+  m_Wild = NULL;
+  m_SpanStart = m_SpanLen = NULL;
+  m_DstPat = NULL;
+  m_DstWild = NULL;
+  m_PatLen = m_NumWild = m_DstLen = 0;
+}
+
+
 //**********************************************************************
 // CompareChar
 // -----------
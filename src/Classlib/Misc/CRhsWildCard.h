@@ -13,22 +13,70 @@
 // ------------
 //**********************************************************************
 
+// The source pattern is compiled once and kept, so calling Match or
+// Complete with the same patterns for many names doesn't parse the
+// patterns again. Compile can be called first, or the patterns can be
+// passed to Match and Complete each time and they are only compiled
+// when they change.
+//
+// Matching is not a single linear pass over the name. When a character
+// fails to match, the last * is extended by one character and the rest
+// of the pattern is tried again, so the worst case is O(n*m) for a name
+// of length n and a pattern of length m. A linear automaton would avoid
+// that, but it couldn't record what each wildcard matched, which
+// Complete needs. Ordinary file names and patterns only backtrack a few
+// characters.
+
 class CRhsWildCard
 {
   public:
     CRhsWildCard();
     ~CRhsWildCard();
 
+    BOOL Compile(const WCHAR* SrcPat, const WCHAR* DstPat);
+
+    BOOL Match(const WCHAR* Source);
     BOOL Match(const WCHAR* SrcPat, const WCHAR* Source);
+    BOOL Complete(const WCHAR* Source, WCHAR* Destination, int BufLen);
     BOOL Complete(const WCHAR* SrcPat, const WCHAR* Source, const WCHAR* DstPat, WCHAR* Destination, int BufLen);
 
+    void SetCaseSensitive(BOOL CaseSensitive);
+
     BOOL CompareChar(WCHAR a, WCHAR b);
     const WCHAR* FindString(const WCHAR* searchin, const WCHAR* searchexpr);
 
     inline const WCHAR* LastError(void) { return m_LastError; }
 
+  private:
+    BOOL CompileSource(const WCHAR* SrcPat);
+    BOOL CompileDest(const WCHAR* DstPat);
+    BOOL MatchSpans(const WCHAR* Source);
+    void FreePatterns(void);
+
   private:
     BOOL m_CaseSensitive;
+
+// The source pattern with repeated *s removed, in lower and upper case.
+// m_Wild is the number of the wildcard at each position or -1.
+
+    WCHAR* m_SrcPat;
+    WCHAR* m_Lower;
+    WCHAR* m_Upper;
+    int* m_Wild;
+    int m_PatLen, m_NumWild;
+
+// The text each wildcard matched in the last call to MatchSpans
+
+    int* m_SpanStart;
+    int* m_SpanLen;
+
+// The destination pattern, and the source wildcard to copy at each
+// position or -1 to copy the character
+
+    WCHAR* m_DstPat;
+    int* m_DstWild;
+    int m_DstLen;
+
     WCHAR m_LastError[256];
 };
 
@@ -0,0 +1,441 @@
+//**********************************************************************
+// CRhsWildCardSet
+// ===============
+// Class to match a name against a set of wildcards in one pass
+//**********************************************************************
+
+#ifndef STRICT
+#define STRICT
+#endif
+
+#include <windows.h>
+#include <stdlib.h>
+#include "CRhsWildCardSet.h"
+
+
+//**********************************************************************
+// Local functions
+//**********************************************************************
+
+#define LOWERCHAR(c) ((WCHAR) (UINT_PTR) CharLower((LPWSTR) (UINT_PTR) (c)))
+#define UPPERCHAR(c) ((WCHAR) (UINT_PTR) CharUpper((LPWSTR) (UINT_PTR) (c)))
+
+#define SETBIT(m, b) ((m)[(b) >> 6] |= (UINT64) 1 << ((b) & 63))
+
+
+//**********************************************************************
+// CRhsWildCardSet
+// ---------------
+//**********************************************************************
+
+CRhsWildCardSet::CRhsWildCardSet()
+{
+  m_Literal = NULL;
+  m_Row = NULL;
+  m_WideChar = NULL;
+  m_WideClass = NULL;
+
+  Clear();
+}
+
+CRhsWildCardSet::~CRhsWildCardSet()
+{
+  Clear();
+}
+
+
+//**********************************************************************
+// Clear
+// -----
+// Remove all the wildcards
+//**********************************************************************
+
+void CRhsWildCardSet::Clear(void)
+{ int i;
+
+  for (i = 0; i < m_NumLiterals && m_Literal; i++)
+  { free(m_Literal[i].Lower);
+    free(m_Literal[i].Upper);
+  }
+
+  if (m_Literal)
+    free(m_Literal);
+  if (m_Row)
+    free(m_Row);
+  if (m_WideChar)
+    free(m_WideChar);
+  if (m_WideClass)
+    free(m_WideClass);
+
+  m_Literal = NULL;
+  m_Row = NULL;
+  m_WideChar = NULL;
+  m_WideClass = NULL;
+
+  m_NumPatterns = 0;
+  m_MatchAll = FALSE;
+  m_NumLiterals = 0;
+  m_NumBits = 0;
+  m_NumClasses = 0;
+  m_NumWide = 0;
+
+  ZeroMemory(m_Start, sizeof(m_Start));
+  ZeroMemory(m_Star, sizeof(m_Star));
+  ZeroMemory(m_Final, sizeof(m_Final));
+  ZeroMemory(m_Class, sizeof(m_Class));
+
+  lstrcpy(m_LastError, L"");
+}
+
+
+//**********************************************************************
+// Add
+// ---
+// Add a wildcard to the set. Repeated *s are treated as one.
+//**********************************************************************
+
+BOOL CRhsWildCardSet::Add(const WCHAR* Pattern)
+{ int len, stars, queries, bits, bit, cls, i, j;
+  WCHAR* pat;
+
+  len = lstrlen(Pattern);
+  if (len == 0)
+  { lstrcpy(m_LastError, L"The wildcard is empty");
+    return(FALSE);
+  }
+
+// Copy the pattern without repeated *s and count the *s and ?s
+
+  pat = (WCHAR*) malloc((len + 1)*sizeof(WCHAR));
+  if (!pat)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return(FALSE);
+  }
+
+  stars = queries = 0;
+
+  for (i = j = 0; Pattern[i] != '\0'; i++)
+  { if (Pattern[i] == '*')
+    { if (j > 0 && pat[j-1] == '*')
+        continue;
+      stars++;
+    }
+    else if (Pattern[i] == '?')
+    { queries++;
+    }
+
+    pat[j++] = Pattern[i];
+  }
+
+  pat[j] = '\0';
+  len = j;
+
+// * matches everything, and so does *.* as it does for FindFirstFile
+
+  if ((len == 1 && stars == 1) || lstrcmp(pat, L"*.*") == 0)
+  { free(pat);
+    m_MatchAll = TRUE;
+    m_NumPatterns++;
+    return(TRUE);
+  }
+
+// Literals with at most one * at one end are compared directly
+
+  if (queries == 0 && stars <= 1)
+  { if (stars == 0 || pat[0] == '*' || pat[len-1] == '*')
+    { if (stars == 0)
+        i = AddLiteral(WILDLIT_EXACT, pat, len);
+      else if (pat[0] == '*')
+        i = AddLiteral(WILDLIT_SUFFIX, pat + 1, len - 1);
+      else
+        i = AddLiteral(WILDLIT_PREFIX, pat, len - 1);
+
+      free(pat);
+
+      if (!i)
+        return(FALSE);
+
+      m_NumPatterns++;
+      return(TRUE);
+    }
+  }
+
+// Otherwise add it to the NFA: a start bit then a bit for each character
+
+  bits = len + 1;
+  if (m_NumBits + bits > WILDSET_MAXBITS)
+  { free(pat);
+    lstrcpy(m_LastError, L"The wildcards are too long");
+    return(FALSE);
+  }
+
+// Class 0 is needed even if all the characters are ?s
+
+  if (m_NumClasses == 0 && AddClass(0) < 0)
+  { free(pat);
+    return(FALSE);
+  }
+
+  SETBIT(m_Start, m_NumBits);
+
+  for (i = 0; i < len; i++)
+  { bit = m_NumBits + 1 + i;
+
+    if (pat[i] == '*')
+    { SETBIT(m_Star, bit);
+    }
+
+// A ? matches every class
+
+    else if (pat[i] == '?')
+    { for (cls = 0; cls < m_NumClasses; cls++)
+        SETBIT(m_Row + cls*WILDSET_MAXWORDS, bit);
+    }
+
+    else
+    { cls = AddClass(pat[i]);
+      if (cls < 0)
+      { free(pat);
+        return(FALSE);
+      }
+      SETBIT(m_Row + cls*WILDSET_MAXWORDS, bit);
+    }
+  }
+
+  SETBIT(m_Final, m_NumBits + len);
+
+  m_NumBits += bits;
+  m_NumPatterns++;
+
+  free(pat);
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// Match
+// -----
+// Test if Name matches any of the wildcards
+//**********************************************************************
+
+BOOL CRhsWildCardSet::Match(const WCHAR* Name) const
+{ int len, words, cls, w, i;
+  UINT64 d, carry, any;
+  const UINT64* row;
+  UINT64 state[WILDSET_MAXWORDS];
+
+  if (m_MatchAll)
+    return(TRUE);
+
+  len = lstrlen(Name);
+
+  for (i = 0; i < m_NumLiterals; i++)
+    if (MatchLiteral(m_Literal + i, Name, len))
+      return(TRUE);
+
+  if (m_NumBits == 0)
+    return(FALSE);
+
+// Start with the start bits, and any * straight after them
+
+  words = (m_NumBits + 63)/64;
+
+  for (w = 0, carry = 0; w < words; w++)
+  { state[w] = m_Start[w] | (((m_Start[w] << 1) | carry) & m_Star[w]);
+    carry = m_Start[w] >> 63;
+  }
+
+// Move the bits on for each character of the name, then let a set bit
+// skip over a following * because a * can match nothing
+
+  for (i = 0; i < len; i++)
+  { cls = FindClass(Name[i]);
+    row = m_Row + cls*WILDSET_MAXWORDS;
+
+    any = 0;
+
+    for (w = 0, carry = 0; w < words; w++)
+    { d = state[w];
+      state[w] = (((d << 1) | carry) & row[w]) | (d & m_Star[w]);
+      carry = d >> 63;
+    }
+
+    for (w = 0, carry = 0; w < words; w++)
+    { d = state[w];
+      state[w] |= ((d << 1) | carry) & m_Star[w];
+      carry = d >> 63;
+      any |= state[w];
+    }
+
+// If no wildcard can match any more give up
+
+    if (!any)
+      return(FALSE);
+  }
+
+  for (w = 0; w < words; w++)
+    if (state[w] & m_Final[w])
+      return(TRUE);
+
+  return(FALSE);
+}
+
+
+//**********************************************************************
+// AddLiteral
+// ----------
+//**********************************************************************
+
+BOOL CRhsWildCardSet::AddLiteral(int Type, const WCHAR* Literal, int Len)
+{ int i;
+  WILDLITERAL* lit;
+
+  lit = (WILDLITERAL*) realloc(m_Literal, (m_NumLiterals + 1)*sizeof(WILDLITERAL));
+  if (!lit)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return(FALSE);
+  }
+  m_Literal = lit;
+
+  lit = m_Literal + m_NumLiterals;
+  lit->Type = Type;
+  lit->Len = Len;
+  lit->Lower = (WCHAR*) malloc((Len + 1)*sizeof(WCHAR));
+  lit->Upper = (WCHAR*) malloc((Len + 1)*sizeof(WCHAR));
+
+  if (!lit->Lower || !lit->Upper)
+  { if (lit->Lower)
+      free(lit->Lower);
+    if (lit->Upper)
+      free(lit->Upper);
+    lstrcpy(m_LastError, L"Out of memory");
+    return(FALSE);
+  }
+
+  for (i = 0; i < Len; i++)
+  { lit->Lower[i] = LOWERCHAR(Literal[i]);
+    lit->Upper[i] = UPPERCHAR(Literal[i]);
+  }
+  lit->Lower[Len] = lit->Upper[Len] = '\0';
+
+  m_NumLiterals++;
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// MatchLiteral
+// ------------
+//**********************************************************************
+
+BOOL CRhsWildCardSet::MatchLiteral(const WILDLITERAL* Lit, const WCHAR* Name, int Len) const
+{ int i;
+
+  if (Len < Lit->Len || (Lit->Type == WILDLIT_EXACT && Len != Lit->Len))
+    return(FALSE);
+
+  if (Lit->Type == WILDLIT_SUFFIX)
+    Name += Len - Lit->Len;
+
+  for (i = 0; i < Lit->Len; i++)
+    if (Name[i] != Lit->Lower[i] && Name[i] != Lit->Upper[i])
+      return(FALSE);
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// AddClass
+// --------
+// Return the class for a character, adding it if it's new. Upper and
+// lower case share a class. The new row starts with the ?s in it.
+// Returns -1 if memory runs out.
+//**********************************************************************
+
+int CRhsWildCardSet::AddClass(WCHAR c)
+{ int cls, i;
+  WCHAR lower, upper;
+  UINT64* row;
+  WCHAR* widechar;
+  WORD* wideclass;
+
+  if (c != 0)
+  { cls = FindClass(c);
+    if (cls > 0)
+      return(cls);
+  }
+
+  row = (UINT64*) realloc(m_Row, (m_NumClasses + 1)*WILDSET_MAXWORDS*sizeof(UINT64));
+  if (!row)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return(-1);
+  }
+  m_Row = row;
+
+  cls = m_NumClasses;
+
+  if (cls == 0)
+    ZeroMemory(m_Row, WILDSET_MAXWORDS*sizeof(UINT64));
+  else
+    CopyMemory(m_Row + cls*WILDSET_MAXWORDS, m_Row, WILDSET_MAXWORDS*sizeof(UINT64));
+
+  m_NumClasses++;
+
+  if (c == 0)
+    return(cls);
+
+// Map both cases to the class
+
+  lower = LOWERCHAR(c);
+  upper = UPPERCHAR(c);
+
+  for (i = 0; i < 2; i++)
+  { c = i == 0 ? lower : upper;
+
+    if (c < 256)
+    { m_Class[c] = (WORD) cls;
+    }
+    else if (FindClass(c) == 0)
+    { widechar = (WCHAR*) realloc(m_WideChar, (m_NumWide + 1)*sizeof(WCHAR));
+      if (widechar)
+        m_WideChar = widechar;
+      wideclass = (WORD*) realloc(m_WideClass, (m_NumWide + 1)*sizeof(WORD));
+      if (wideclass)
+        m_WideClass = wideclass;
+
+      if (!widechar || !wideclass)
+      { lstrcpy(m_LastError, L"Out of memory");
+        return(-1);
+      }
+
+      m_WideChar[m_NumWide] = c;
+      m_WideClass[m_NumWide] = (WORD) cls;
+      m_NumWide++;
+    }
+  }
+
+  return(cls);
+}
+
+
+//**********************************************************************
+// FindClass
+// ---------
+// Return the class for a character, or 0 if it isn't in any wildcard
+//**********************************************************************
+
+int CRhsWildCardSet::FindClass(WCHAR c) const
+{ int i;
+
+  if (c < 256)
+    return(m_Class[c]);
+
+  for (i = 0; i < m_NumWide; i++)
+    if (m_WideChar[i] == c)
+      return(m_WideClass[i]);
+
+  return(0);
+}
@@ -0,0 +1,102 @@
+//**********************************************************************
+// CRhsWildCardSet
+// ===============
+// Class to match a name against a set of wildcards in one pass
+//**********************************************************************
+
+#ifndef _INC_CRhsWildCardSet
+#define _INC_CRhsWildCardSet
+
+
+//**********************************************************************
+// WILDLITERAL
+// -----------
+// A wildcard that is just a literal with a * at one end or none, e.g.
+// *.pst, is matched by comparing the ends of the name. Lower and Upper
+// are the literal in lower and upper case.
+//**********************************************************************
+
+#define WILDLIT_EXACT  0
+#define WILDLIT_PREFIX 1  // abc*
+#define WILDLIT_SUFFIX 2  // *.pst
+
+typedef struct
+{ int Type;
+  int Len;
+  WCHAR* Lower;
+  WCHAR* Upper;
+
+} WILDLITERAL;
+
+
+//**********************************************************************
+// CRhsWildCardSet
+// ---------------
+// The other wildcards are merged into one NFA that is run bit-parallel
+// (shift-and) over the name. Each wildcard gets a start bit followed by
+// a bit for each character, ? or *. A set bit means the wildcard can
+// match the name up to that character. Each character of the name
+// moves the bits on by one where the character matches, and the * bits
+// stay set whatever the character is.
+//
+// The matching is case insensitive. Match doesn't change the object so
+// it can be called from several threads at once.
+//**********************************************************************
+
+#define WILDSET_MAXWORDS 16
+#define WILDSET_MAXBITS  (WILDSET_MAXWORDS*64)
+
+class CRhsWildCardSet
+{
+  public:
+    CRhsWildCardSet();
+    ~CRhsWildCardSet();
+
+    BOOL Add(const WCHAR* Pattern);
+    BOOL Match(const WCHAR* Name) const;
+    void Clear(void);
+
+    inline int NumPatterns(void) { return(m_NumPatterns); }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL AddLiteral(int Type, const WCHAR* Literal, int Len);
+    int AddClass(WCHAR c);
+    int FindClass(WCHAR c) const;
+    BOOL MatchLiteral(const WILDLITERAL* Lit, const WCHAR* Name, int Len) const;
+
+  private:
+    int m_NumPatterns;
+    BOOL m_MatchAll;
+
+    WILDLITERAL* m_Literal;
+    int m_NumLiterals;
+
+// The NFA
+
+    int m_NumBits;
+    UINT64 m_Start[WILDSET_MAXWORDS], m_Star[WILDSET_MAXWORDS], m_Final[WILDSET_MAXWORDS];
+
+// Each character in the wildcards has a class, and m_Row holds a row of
+// WILDSET_MAXWORDS words for each class with the bits the character can
+// match. Class 0 is any other character, so its row has just the ?s.
+
+    UINT64* m_Row;
+    int m_NumClasses;
+
+    WORD m_Class[256];
+
+    WCHAR* m_WideChar;
+    WORD* m_WideClass;
+    int m_NumWide;
+
+    WCHAR m_LastError[256];
+};
+
+
+//**********************************************************************
+// End of CRhsWildCardSet
+//**********************************************************************
+
+#endif // _INC_CRhsWildCardSet
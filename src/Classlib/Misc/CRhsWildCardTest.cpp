@@ -6,16 +6,31 @@
 #include <stdio.h>
 #include "CRhsWildCard.h"
 
+// CRhsWildCardTest <source pattern> <source>
+// CRhsWildCardTest <source pattern> <source> <destination pattern>
+
 int wmain(int argc, WCHAR* argv[])
 { BOOL b;
   CRhsWildCard wc;
   WCHAR s[256];
 
+  if (argc == 3)
+  { b = wc.Match(argv[1], argv[2]);
+    wprintf(L"%s\n", b ? L"Match" : wc.LastError());
+    return 0;
+  }
+
+  if (argc != 4)
+  { wprintf(L"Syntax: <source pattern> <source> [<destination pattern>]\n");
+    return 2;
+  }
+
   b = wc.Complete(argv[1], argv[2], argv[3], s, 256);
 
   if (!b)
   { wprintf(L"Error: %s\n", wc.LastError());
   }
+  else
   { wprintf(L"%s\n", s);
   }
 
@@ -0,0 +1,213 @@
+//**********************************************************************
+// CRhsWorkQueue
+// =============
+// Class to share work out between a pool of threads
+//**********************************************************************
+
+#ifndef STRICT
+#define STRICT
+#endif
+
+#include <windows.h>
+#include <stdlib.h>
+#include "CRhsWorkQueue.h"
+
+
+//**********************************************************************
+// CRhsWorkQueue
+// -------------
+//**********************************************************************
+
+CRhsWorkQueue::CRhsWorkQueue()
+{
+  m_NumThreads = 0;
+  m_NextThread = 0;
+
+  m_Proc = NULL;
+  m_Context = NULL;
+
+  InitializeCriticalSection(&m_Lock);
+  InitializeConditionVariable(&m_WorkReady);
+  InitializeConditionVariable(&m_AllDone);
+
+  m_Head = m_Free = NULL;
+  m_NumBusy = 0;
+  m_Shutdown = FALSE;
+}
+
+CRhsWorkQueue::~CRhsWorkQueue()
+{ RHSWORKITEM* next;
+
+  Wait();
+
+// Wait leaves nothing in the queue, so only the free list is left
+
+  for (; m_Free; m_Free = next)
+  { next = m_Free->Next;
+    free(m_Free);
+  }
+
+  DeleteCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// Start
+// -----
+// Start the worker threads. Items can be added before or after the
+// threads are started.
+//**********************************************************************
+
+BOOL CRhsWorkQueue::Start(int Threads, RHSWORKPROC Proc, void* Context)
+{ int i;
+  DWORD d;
+
+  if (m_NumThreads > 0 || !Proc)
+    return(FALSE);
+
+  if (Threads < 1)
+    Threads = 1;
+  if (Threads > RHSWORK_MAXTHREADS)
+    Threads = RHSWORK_MAXTHREADS;
+
+  m_Proc = Proc;
+  m_Context = Context;
+  m_NextThread = 0;
+  m_Shutdown = FALSE;
+
+// If only some of the threads can be started carry on with those
+
+  for (i = 0; i < Threads; i++)
+  { m_Thread[i] = CreateThread(NULL, 0, WorkerThread, this, 0, &d);
+    if (!m_Thread[i])
+      break;
+    m_NumThreads++;
+  }
+
+  return(m_NumThreads > 0);
+}
+
+
+//**********************************************************************
+// Add
+// ---
+// Add an item to the queue. This can be called from the callback.
+//**********************************************************************
+
+BOOL CRhsWorkQueue::Add(void* Item)
+{ RHSWORKITEM* w;
+
+  EnterCriticalSection(&m_Lock);
+
+  if (m_Free)
+  { w = m_Free;
+    m_Free = w->Next;
+  }
+  else
+  { w = (RHSWORKITEM*) malloc(sizeof(RHSWORKITEM));
+    if (!w)
+    { LeaveCriticalSection(&m_Lock);
+      return(FALSE);
+    }
+  }
+
+  w->Item = Item;
+  w->Next = m_Head;
+  m_Head = w;
+
+  WakeConditionVariable(&m_WorkReady);
+
+  LeaveCriticalSection(&m_Lock);
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// Wait
+// ----
+// Wait until every item, including any added by the callbacks, has been
+// done and then stop the threads
+//**********************************************************************
+
+void CRhsWorkQueue::Wait(void)
+{ int i;
+
+  if (m_NumThreads == 0)
+    return;
+
+  EnterCriticalSection(&m_Lock);
+
+  while (m_Head || m_NumBusy > 0)
+    SleepConditionVariableCS(&m_AllDone, &m_Lock, INFINITE);
+
+  m_Shutdown = TRUE;
+  WakeAllConditionVariable(&m_WorkReady);
+
+  LeaveCriticalSection(&m_Lock);
+
+  WaitForMultipleObjects(m_NumThreads, m_Thread, TRUE, INFINITE);
+
+  for (i = 0; i < m_NumThreads; i++)
+    CloseHandle(m_Thread[i]);
+
+  m_NumThreads = 0;
+}
+
+
+//**********************************************************************
+// WorkerThread
+// ------------
+//**********************************************************************
+
+DWORD WINAPI CRhsWorkQueue::WorkerThread(LPVOID Param)
+{ CRhsWorkQueue* q;
+
+  q = (CRhsWorkQueue*) Param;
+  q->Worker(InterlockedIncrement(&q->m_NextThread) - 1);
+
+  return(0);
+}
+
+
+//**********************************************************************
+// Worker
+// ------
+// The work is finished when the queue is empty and no thread is busy,
+// because only a busy thread can add more.
+//**********************************************************************
+
+void CRhsWorkQueue::Worker(int Thread)
+{ void* item;
+  RHSWORKITEM* w;
+
+  EnterCriticalSection(&m_Lock);
+
+  for (;;)
+  { while (!m_Head && !m_Shutdown)
+      SleepConditionVariableCS(&m_WorkReady, &m_Lock, INFINITE);
+
+    if (!m_Head)
+      break;
+
+    w = m_Head;
+    m_Head = w->Next;
+    item = w->Item;
+
+    w->Next = m_Free;
+    m_Free = w;
+
+    m_NumBusy++;
+
+    LeaveCriticalSection(&m_Lock);
+    m_Proc(m_Context, item, Thread);
+    EnterCriticalSection(&m_Lock);
+
+    m_NumBusy--;
+
+    if (m_NumBusy == 0 && !m_Head)
+      WakeAllConditionVariable(&m_AllDone);
+  }
+
+  LeaveCriticalSection(&m_Lock);
+}
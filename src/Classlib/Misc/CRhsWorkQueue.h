@@ -0,0 +1,84 @@
+//**********************************************************************
+// CRhsWorkQueue
+// =============
+// Class to share work out between a pool of threads
+//**********************************************************************
+
+#ifndef _INC_CRHSWORKQUEUE
+#define _INC_CRHSWORKQUEUE
+
+
+//**********************************************************************
+// RHSWORKPROC
+// -----------
+// Called on a worker thread for each item. Thread is the index of the
+// worker, from 0 to the number of threads - 1, so the callback can keep
+// its results per thread without locking. The callback can add more
+// items to the queue.
+//**********************************************************************
+
+typedef void (*RHSWORKPROC)(void* Context, void* Item, int Thread);
+
+
+//**********************************************************************
+// RHSWORKITEM
+// -----------
+//**********************************************************************
+
+typedef struct _RHSWORKITEM
+{ struct _RHSWORKITEM* Next;
+  void* Item;
+
+} RHSWORKITEM;
+
+
+//**********************************************************************
+// CRhsWorkQueue
+// -------------
+// The items are taken last in first out. When the items are
+// directories and each one adds its subdirectories, this means the
+// threads work down the tree rather than across it, and the queue only
+// holds the directories next to the ones being worked on.
+//**********************************************************************
+
+#define RHSWORK_MAXTHREADS 64
+
+class CRhsWorkQueue
+{
+  public:
+    CRhsWorkQueue();
+    ~CRhsWorkQueue();
+
+    BOOL Start(int Threads, RHSWORKPROC Proc, void* Context);
+    BOOL Add(void* Item);
+    void Wait(void);
+
+    inline int NumThreads(void) { return(m_NumThreads); }
+
+  private:
+    static DWORD WINAPI WorkerThread(LPVOID Param);
+    void Worker(int Thread);
+
+  private:
+    HANDLE m_Thread[RHSWORK_MAXTHREADS];
+    int m_NumThreads;
+    volatile LONG m_NextThread;
+
+    RHSWORKPROC m_Proc;
+    void* m_Context;
+
+    CRITICAL_SECTION m_Lock;
+    CONDITION_VARIABLE m_WorkReady, m_AllDone;
+
+    RHSWORKITEM* m_Head;
+    RHSWORKITEM* m_Free;
+    int m_NumBusy;
+    BOOL m_Shutdown;
+};
+
+
+//**********************************************************************
+// End of CRhsWorkQueue
+//**********************************************************************
+
+#endif // _INC_CRHSWORKQUEUE
@@ -0,0 +1,55 @@
+//**********************************************************************
+// NameList.cpp
+// ============
+// A list of strings stored one after another, each with its null
+//**********************************************************************
+
+#include <windows.h>
+#include <stdlib.h>
+#include "NameList.h"
+
+
+//**********************************************************************
+// NameListAdd
+// -----------
+//**********************************************************************
+
+BOOL NameListAdd(NAMELIST* List, const WCHAR* Name)
+{ int len, size;
+  WCHAR* buf;
+
+  len = lstrlen(Name) + 1;
+
+  if (List->Len + len > List->Size)
+  { size = List->Size > 0 ? List->Size*2 : 1024;
+    while (size < List->Len + len)
+      size *= 2;
+
+    buf = (WCHAR*) realloc(List->Buf, size*sizeof(WCHAR));
+    if (!buf)
+      return(FALSE);
+
+    List->Buf = buf;
+    List->Size = size;
+  }
+
+  lstrcpy(List->Buf + List->Len, Name);
+  List->Len += len;
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// NameListFree
+// ------------
+//**********************************************************************
+
+void NameListFree(NAMELIST* List)
+{
+  if (List->Buf)
+    free(List->Buf);
+
+  List->Buf = NULL;
+  List->Len = List->Size = 0;
+}
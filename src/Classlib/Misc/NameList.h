@@ -0,0 +1,40 @@
+//**********************************************************************
+// NameList.h
+// ==========
+// A list of strings stored one after another, each with its null. Used
+// to collect the names found by CRhsFindFile so the search handle can
+// be closed before the names are processed.
+//**********************************************************************
+
+#ifndef _INC_NAMELIST
+#define _INC_NAMELIST
+
+
+//**********************************************************************
+// NAMELIST
+// --------
+// Initialise Buf to NULL and Len and Size to 0 before the first add.
+//**********************************************************************
+
+typedef struct
+{ WCHAR* Buf;
+  int Len, Size;
+
+} NAMELIST;
+
+
+// *********************************************************************
+// Prototypes
+// ----------
+// *********************************************************************
+
+BOOL NameListAdd(NAMELIST* List, const WCHAR* Name);
+void NameListFree(NAMELIST* List);
+
+
+//**********************************************************************
+// End of NameList.h
+// -----------------
+//**********************************************************************
+
+#endif // _INC_NAMELIST
@@ -15,7 +15,11 @@
 #include <stdio.h>
 #include <CRhsIO/CRhsIO.h>
 #include <CSecurableObject/CFileSecObject.h>
+#include <CSecurableObject/CSecDescCache.h>
+#include <CSecurableObject/CAceSet.h>
+#include <Misc/CRhsTextBuf.h>
 #include <Misc/CRhsFindFile.h>
+#include <Misc/CRhsWorkQueue.h>
 
 
 //**********************************************************************
@@ -23,32 +27,41 @@
 //**********************************************************************
 
 DWORD WINAPI rhsmain(LPVOID unused);
-BOOL dirshowacl(const WCHAR* Directory);
+SECDESCENTRY* dirshowacl(const WCHAR* Directory, int Thread);
+BOOL FormatACL(CFileSecObject& Sec, CAceSet& Aces, CRhsTextBuf& Text);
+void PrintText(const WCHAR* Text);
+void PrintGroups(void);
+
+void ScanDirectory(void* Context, void* Item, int Thread);
+void PrintTree(struct _ACLNODE* Node);
 
 
 //**********************************************************************
-// Structure to help with handling ACEs
-// ------------------------------------
+// The longest username that can be excluded
 //**********************************************************************
 
 #define MAX_USERNAME 32
 
-#define RHSACE_NCINHERIT      0x01 // Child objects that are not containers inherit permissions
-#define RHSACE_INHERIT_PASS   0x02 // Child objects inherit and pass on permissions
-#define RHSACE_INHERIT_NOPASS 0x04 // Child objects inherit but do not pass on permissions
-#define RHSACE_NOINHERIT_PASS 0x08 // Object is not affected by but passes on permissions
-#define RHSACE_INHERITED      0x10 // Permissions have been inherited
 
-typedef struct _RhsACE
-{
-  WCHAR domain[MAX_USERNAME+1],   // This identifies the user
-        username[MAX_USERNAME+1];
+//**********************************************************************
+// ACLNODE
+// -------
+// A directory in the tree. The threads scan the directories in any
+// order, so the tree is kept to print the results in the same order as
+// a single threaded scan would. Done is set once ACL and the list of
+// children have been filled in.
+//**********************************************************************
 
-  DWORD mask, // access mask
-        type, // 0 = access allowed, 1 = access denied
-        flags;
+typedef struct _ACLNODE
+{ struct _ACLNODE* FirstChild;
+  struct _ACLNODE* NextSibling;
+  volatile BOOL Done;
+  SECDESCENTRY* ACL;
+  WCHAR Path[1];
 
-} RhsACE;
+} ACLNODE;
+
+ACLNODE* NewNode(const WCHAR* Path);
 
 
 //**********************************************************************
@@ -58,13 +71,33 @@ typedef struct _RhsACE
 
 CRhsIO RhsIO;
 
-BOOL IncludeInherited;
+BOOL IncludeInherited, GroupByACL;
 
 #define MAX_EXCLUDE 16
 WCHAR Exclude[MAX_EXCLUDE][MAX_USERNAME+1];
 int  NumExclude;
 
-#define SYNTAX L"dirshowacl [-i -x<username>] <directoryname>\r\n"
+// Reading the ACLs is mostly waiting for the disk, the server or the
+// domain controller, so by default use more threads than processors
+
+#define MAX_DEFTHREADS 16
+
+CRhsWorkQueue Queue;
+CRITICAL_SECTION DoneLock;
+CONDITION_VARIABLE DoneReady;
+volatile LONG Skipped = 0;
+
+// Each distinct security descriptor is only formatted once
+
+CSecDescCache SDCache;
+
+// Each thread has its own set for collecting the ACEs and buffer for
+// formatting them
+
+CAceSet AceSet[RHSWORK_MAXTHREADS];
+CRhsTextBuf ACLText[RHSWORK_MAXTHREADS];
+
+#define SYNTAX L"dirshowacl [-g -i -t<threads> -x<username>] <directoryname>\r\n"
 
 
 //**********************************************************************
@@ -91,16 +124,23 @@ int wmain(int argc, WCHAR* argv[])
 //**********************************************************************
 
 DWORD WINAPI rhsmain(LPVOID unused)
-{ int argnum, i;
+{ int argnum, numthreads, i;
   DWORD attr;
+  SYSTEM_INFO si;
   CRhsFindFile ff;
+  ACLNODE* root;
 
 // Process command line flags
 
-  IncludeInherited = FALSE;
+  IncludeInherited = GroupByACL = FALSE;
   NumExclude = 0;
   argnum = 1;
 
+  GetSystemInfo(&si);
+  numthreads = (int) si.dwNumberOfProcessors*2;
+  if (numthreads > MAX_DEFTHREADS)
+    numthreads = MAX_DEFTHREADS;
+
   while (argnum < RhsIO.m_argc)
   { if (RhsIO.m_argv[argnum][0] != '-')
       break;
@@ -112,13 +152,25 @@ DWORD WINAPI rhsmain(LPVOID unused)
         RhsIO.printf(SYNTAX);
         return 0;
 
+      case 'g': // Group the directories by their ACL
+        GroupByACL = TRUE;
+        break;
+
       case 'i': // Include inherited permissions
         IncludeInherited = TRUE;
         break;
 
+      case 't': // Number of threads
+        numthreads = _wtoi(RhsIO.m_argv[argnum]+2);
+        if (numthreads < 1 || numthreads > RHSWORK_MAXTHREADS)
+        { RhsIO.printf(L"The number of threads must be from 1 to %i\r\n", RHSWORK_MAXTHREADS);
+          return(1);
+        }
+        break;
+
       case 'x': // Exclude a username
-        if (NumExclude <= MAX_EXCLUDE)
-        { lstrcpy(Exclude[NumExclude], RhsIO.m_argv[argnum]+2);
+        if (NumExclude < MAX_EXCLUDE)
+        { lstrcpyn(Exclude[NumExclude], RhsIO.m_argv[argnum]+2, MAX_USERNAME+1);
           NumExclude++;
         }
         break;
@@ -167,7 +219,33 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
   RhsIO.printf(L"");
 
-  dirshowacl(RhsIO.m_argv[argnum]);
+// Start the threads scanning the tree and print the results as they
+// come in
+
+  InitializeCriticalSection(&DoneLock);
+  InitializeConditionVariable(&DoneReady);
+
+  root = NewNode(RhsIO.m_argv[argnum]);
+  if (!root || !Queue.Add(root))
+  { RhsIO.printf(L"Out of memory\r\n");
+    return 2;
+  }
+
+  if (!Queue.Start(numthreads, ScanDirectory, NULL))
+  { RhsIO.printf(L"Cannot start the scanning threads\r\n");
+    return 2;
+  }
+
+  PrintTree(root);
+  Queue.Wait();
+
+  DeleteCriticalSection(&DoneLock);
+
+  if (GroupByACL)
+    PrintGroups();
+
+  if (Skipped > 0)
+    RhsIO.printf(L"%i directories were skipped because there was not enough memory\r\n", Skipped);
 
 // All done
 
@@ -176,76 +254,235 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
 
 //**********************************************************************
-// dirshowacl
-// ----------
+// ScanDirectory
+// -------------
+// Called on a worker thread to get the ACL for a directory and queue
+// its subdirectories
 //**********************************************************************
 
-BOOL dirshowacl(const WCHAR* Directory)
-{ int num_entries, num_aces, i, j;
-  BOOL found_ace;
-  DWORD mask, type, flags;
+void ScanDirectory(void* Context, void* Item, int Thread)
+{ ACLNODE *node, *child, *last;
   CRhsFindFile ff;
-  CFileSecObject sec;
-  RhsACE ace[32];
-  WCHAR username[256], domain[256], rights[16];
   WCHAR found[MAX_PATH+1], s[MAX_PATH+1];
-  WCHAR outstr[0x1000];
 
-  swprintf(outstr, 0x1000, L"%s\r\n", Directory);
-  found_ace = FALSE;
+  node = (ACLNODE*) Item;
+
+  node->ACL = dirshowacl(node->Path, Thread);
+
+// Now work through subdirectories
+
+  last = NULL;
+
+  lstrcpy(s, node->Path);
+  lstrcat(s, L"\\*");
+
+  if (ff.First(s, found, MAX_PATH))
+  { do
+    {
+
+// Ignore ordinary files
+
+      if (!(ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY))
+        continue;
+
+// Ignore . and ..
+
+      ff.Filename(s, MAX_PATH);
+
+      if (lstrcmp(s, L".") == 0 || lstrcmp(s, L"..") == 0)
+        continue;
+
+// Add the subdirectory to the tree and queue it. If it can't be queued
+// it's marked as done so the printing doesn't wait for it.
+
+      child = NewNode(found);
+      if (!child)
+      { InterlockedIncrement(&Skipped);
+        continue;
+      }
+
+      if (last)
+        last->NextSibling = child;
+      else
+        node->FirstChild = child;
+      last = child;
+
+      if (!Queue.Add(child))
+      { InterlockedIncrement(&Skipped);
+        child->Done = TRUE;
+      }
+
+    } while (ff.Next(found, MAX_PATH));
+  }
+
+  ff.Close();
+
+// Tell the main thread this directory is done
+
+  EnterCriticalSection(&DoneLock);
+  node->Done = TRUE;
+  LeaveCriticalSection(&DoneLock);
+
+  WakeAllConditionVariable(&DoneReady);
+}
+
+
+//**********************************************************************
+// PrintTree
+// ---------
+// Print the results for a directory then its subdirectories, waiting
+// for each one to be scanned. The nodes are freed once printed.
+//**********************************************************************
+
+void PrintTree(ACLNODE* Node)
+{ ACLNODE *child, *next;
+
+  EnterCriticalSection(&DoneLock);
+  while (!Node->Done)
+    SleepConditionVariableCS(&DoneReady, &DoneLock, INFINITE);
+  LeaveCriticalSection(&DoneLock);
+
+  if (Node->ACL && Node->ACL->Text[0] != '\0')
+  { if (GroupByACL)
+    { if (!SDCache.AddObject(Node->ACL, Node->Path))
+        InterlockedIncrement(&Skipped);
+    }
+    else
+    { RhsIO.printf(L"%s\r\n", Node->Path);
+      PrintText(Node->ACL->Text);
+    }
+  }
+
+  for (child = Node->FirstChild; child; child = next)
+  { next = child->NextSibling;
+    PrintTree(child);
+  }
+
+  free(Node);
+}
+
+
+//**********************************************************************
+// NewNode
+// -------
+//**********************************************************************
+
+ACLNODE* NewNode(const WCHAR* Path)
+{ ACLNODE* node;
+
+  node = (ACLNODE*) malloc(sizeof(ACLNODE) + lstrlen(Path)*sizeof(WCHAR));
+  if (!node)
+    return NULL;
+
+  node->FirstChild = node->NextSibling = NULL;
+  node->Done = FALSE;
+  node->ACL = NULL;
+  lstrcpy(node->Path, Path);
+
+  return node;
+}
+
+
+//**********************************************************************
+// dirshowacl
+// ----------
+// Get the ACL for a directory. The ACL is only formatted if no other
+// directory has had the same security descriptor. This returns NULL if
+// the ACL can't be read or there is nothing to show.
+//**********************************************************************
+
+SECDESCENTRY* dirshowacl(const WCHAR* Directory, int Thread)
+{ DWORD len;
+  UINT hash;
+  const BYTE* sd;
+  SECDESCENTRY* entry;
+  CFileSecObject sec;
 
 // Attach the CSecurableObject to this directory
 
   sec.SetFileName((WCHAR*) Directory);
-  sec.GetObjectSecurity();
 
-// Loop over all ACEs in the list
+// Unless we want the inherited permissions most directories have
+// nothing to show, so don't decode their ACL at all
 
-  num_entries = sec.GetNumEntries();
-  num_aces = 0;
+  sec.SetSkipInherited(!IncludeInherited);
 
-  for (i = 0; i < num_entries; i++)
-  { sec.GetRightsFromACE(username, domain, &mask, &type, &flags, i);
+  if (!sec.GetObjectSecurity())
+    return NULL;
 
-// Look to see if this is a new user
+  if (sec.WasSkipped())
+    return NULL;
 
-    for (j = 0; j < num_aces; j++)
-      if (lstrcmp(username, ace[j].username) == 0 && type == ace[j].type)
-        break;
+// Check if we've already seen this security descriptor
+
+  sd = sec.GetRawSD(&len, &hash);
+
+  entry = SDCache.Find(sd, len, hash);
+  if (entry)
+    return entry;
+
+// If not format the ACL and add it
+
+  if (!FormatACL(sec, AceSet[Thread], ACLText[Thread]))
+    return NULL;
+
+  return SDCache.Add(sd, len, hash, ACLText[Thread].Text());
+}
+
+
+//**********************************************************************
+// FormatACL
+// ---------
+// Format the ACEs to show. OutStr is set to an empty string if there
+// are none.
+//**********************************************************************
+
+BOOL FormatACL(CFileSecObject& Sec, CAceSet& Aces, CRhsTextBuf& Text)
+{ int num_entries, i, j;
+  DWORD mask, type, flags;
+  RHSACE* ace;
+  WCHAR username[256], domain[256], rights[16];
+
+  Aces.Reset();
+  Text.Reset();
+
+// Loop over all ACEs in the list
+
+  num_entries = Sec.GetNumEntries();
+
+  for (i = 0; i < num_entries; i++)
+  { Sec.GetRightsFromACE(username, domain, &mask, &type, &flags, i);
 
 // If this is a new user get all their entries
 
-    if (j >= num_aces)
-    { lstrcpy(ace[num_aces].domain, domain);
-      lstrcpy(ace[num_aces].username, username);
-      ace[num_aces].type = type;
-      ace[num_aces].flags = flags;
+    if (!Aces.Find(username, type))
+    { ace = Aces.Add(domain, username, type, flags);
+      if (!ace)
+        return FALSE;
 
 // This gets all entries in the ACL matchine the current SID and type
-      sec.GetAllRightsFor(&(ace[num_aces].mask), i);
-
-      num_aces++;
+      Sec.GetAllRightsFor(&(ace->Mask), i);
     }
   }
 
 // Got all the entries so print them
 
-  for (i = 0; i < num_aces; i++)
-  {
+  for (i = 0; i < Aces.NumAces(); i++)
+  { ace = Aces.Ace(i);
 
 // We only want non-inherited permissions unless we've specifically
 // asked for them.
 
-    if (ace[i].flags & RHSACE_INHERITED)
+    if (ace->Flags & RHSACE_INHERITED)
       if (!IncludeInherited)
         continue;
 
 // For tidiness omit the standard "domains" BUILTIN and NT AUTHORITY
 
-    if (lstrlen(ace[i].domain) == 0 || lstrcmp(ace[i].domain, L"BUILTIN") == 0 || lstrcmp(ace[i].domain, L"NT AUTHORITY") == 0)
-      lstrcpy(username, ace[i].username);
+    if (lstrlen(ace->Domain) == 0 || lstrcmp(ace->Domain, L"BUILTIN") == 0 || lstrcmp(ace->Domain, L"NT AUTHORITY") == 0)
+      lstrcpyn(username, ace->Username, 256);
     else
-      swprintf(username, 0x1000, L"%s\\%s", ace[i].domain, ace[i].username);
+      swprintf(username, 256, L"%s\\%s", ace->Domain, ace->Username);
     CharLower(username);
 
 // Check if we're excluding this username
@@ -258,58 +495,56 @@ BOOL dirshowacl(const WCHAR* Directory)
     if (j < NumExclude)
       continue;
 
-// Print the access including whether it's an allowed or denied ACE
+// Add the access including whether it's an allowed or denied ACE
 
-    found_ace = TRUE;
-
-    sec.RightsToText(ace[i].mask, rights);
-    if (ace[i].flags & RHSACE_INHERITED)
+    Sec.RightsToText(ace->Mask, rights);
+    if (ace->Flags & RHSACE_INHERITED)
       lstrcat(rights, L"(I)");
 
-    if (ace[i].type == 0)
-      swprintf(outstr + lstrlen(outstr), 0x1000, L"\t%s\t%s\r\n", username, rights);
-    else
-      swprintf(outstr + lstrlen(outstr), 0x1000, L"\t%s\tDenied: %s\r\n", username, rights);
+    if (!Text.Printf(ace->Type == 0 ? L"\t%s\t%s\r\n" : L"\t%s\tDenied: %s\r\n", username, rights))
+      return FALSE;
   }
 
-// Only print the output if we found a non-inherited ACL
-
-  if (found_ace)
-    RhsIO.printf(outstr);
-
-// Now work through subdirectories
-
-  lstrcpy(s, Directory);
-  lstrcat(s, L"\\*");
+  return TRUE;
+}
 
-  if (ff.First(s, found, MAX_PATH))
-  { do
-    {
 
-// Ignore ordinary files
+//**********************************************************************
+// PrintText
+// ---------
+// RhsIO.printf has a limit on the length of its output, and the ACL for
+// an object with lots of users can be longer, so print it in pieces
+//**********************************************************************
 
-      if (!(ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY))
-        continue;
+void PrintText(const WCHAR* Text)
+{ int len;
 
-// Ignore . and ..
+  for (len = lstrlen(Text); len > 0; len -= 0x1000, Text += 0x1000)
+    RhsIO.printf(L"%.*s", len < 0x1000 ? len : 0x1000, Text);
+}
 
-      ff.Filename(s, MAX_PATH);
 
-      if (lstrcmp(s, L".") == 0 || lstrcmp(s, L"..") == 0)
-        continue;
+//**********************************************************************
+// PrintGroups
+// -----------
+// Print each distinct ACL once followed by the directories that have it
+//**********************************************************************
 
-// Print the ACL for this directory and subdirectories
+void PrintGroups(void)
+{ int i, j;
+  SECDESCENTRY* entry;
 
-      dirshowacl(found);
+  for (i = 0; i < SDCache.NumGroups(); i++)
+  { entry = SDCache.Group(i);
 
-    } while (ff.Next(found, MAX_PATH));
+    RhsIO.printf(L"ACL %i: %i directories\r\n", i + 1, entry->NumObjects);
+    PrintText(entry->Text);
+    for (j = 0; j < entry->NumObjects; j++)
+      RhsIO.printf(L"  %s\r\n", entry->Objects[j]);
+    RhsIO.printf(L"\r\n");
   }
 
-  ff.Close();
-
-// All done
-
-  return TRUE;
+  RhsIO.printf(L"%i distinct ACLs decoded\r\n", SDCache.NumEntries());
 }
 
 
@@ -3,15 +3,126 @@
 // ========
 // Listing of subdirectories including the total disk space they use.
 //
+// The subdirectories are scanned by a pool of threads. Each directory
+// being scanned has a DIRNODE, and when a directory and everything
+// below it has been scanned its totals are added to its parent and the
+// node is freed, so the memory used depends on how deep and how wide
+// the part of the tree being scanned is, not on the size of the tree.
+//
+// Each thread keeps its own largest directories and files, and its own
+// file size histogram, and these are merged when the scan has finished.
+//
 // John Rennie
 // 03/05/04
 // *********************************************************************
 
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <CRhsIO/CRhsIO.h>
 #include <Misc/CRhsFindFile.h>
 #include <Misc/CRhsDate.h>
+#include <Misc/CRhsWorkQueue.h>
+#include <Misc/CRhsWildCardSet.h>
+
+
+//**********************************************************************
+// DIRNODE
+// -------
+// A directory being scanned. Pending is one for the directory itself
+// plus one for each subdirectory that hasn't finished yet. Top is the
+// index in g_Top of the subdirectory of the root this is in.
+//**********************************************************************
+
+typedef struct _DIRNODE
+{ struct _DIRNODE* Parent;
+  int Top;
+
+  volatile LONG Pending;
+  volatile LONGLONG Bytes, Files;
+
+  WCHAR Path[1];
+
+} DIRNODE;
+
+
+//**********************************************************************
+// TOPDIR
+// ------
+// The subdirectories of the root directory, in the order they were
+// found
+//**********************************************************************
+
+typedef struct
+{ WCHAR* Name;
+  UINT64 Bytes, Files;
+
+} TOPDIR;
+
+
+//**********************************************************************
+// SIZEHEAP
+// --------
+// A min-heap holding the largest Max sizes offered to it
+//**********************************************************************
+
+typedef struct
+{ UINT64 Size;
+  WCHAR* Path;
+
+} SIZEENTRY;
+
+typedef struct
+{ SIZEENTRY* Entry;
+  int Num, Max;
+
+} SIZEHEAP;
+
+
+//**********************************************************************
+// Histogram buckets
+// -----------------
+// A file goes in the first bucket its size is less than
+//**********************************************************************
+
+typedef struct
+{ UINT64 Limit;
+  const WCHAR* Name;
+
+} SIZEBUCKET;
+
+static const SIZEBUCKET BUCKET[] =
+{ { 1,                     L"0" },
+  { 0x400,                 L"< 1K" },
+  { 0x1000,                L"< 4K" },
+  { 0x4000,                L"< 16K" },
+  { 0x10000,               L"< 64K" },
+  { 0x40000,               L"< 256K" },
+  { 0x100000,              L"< 1M" },
+  { 0x400000,              L"< 4M" },
+  { 0x1000000,             L"< 16M" },
+  { 0x4000000,             L"< 64M" },
+  { 0x10000000,            L"< 256M" },
+  { 0x40000000,            L"< 1G" },
+  { 0x100000000,           L"< 4G" },
+  { 0x400000000,           L"< 16G" },
+  { 0xFFFFFFFFFFFFFFFF,    L">= 16G" }
+};
+
+#define NUM_BUCKETS ((int) (sizeof(BUCKET)/sizeof(SIZEBUCKET)))
+
+
+//**********************************************************************
+// THREADSTATE
+// -----------
+// The results kept by each scanning thread
+//**********************************************************************
+
+typedef struct
+{ SIZEHEAP Dirs, Files;
+  UINT64 HistFiles[NUM_BUCKETS], HistBytes[NUM_BUCKETS];
+
+} THREADSTATE;
 
 
 //**********************************************************************
@@ -20,11 +131,21 @@
 
 DWORD WINAPI rhsmain(LPVOID unused);
 
-double GetDirDiskSpace(const WCHAR* DirName, FILETIME* CutOff, BOOL Modified, DWORD* NumFiles);
+void ScanDirectory(void* Context, void* Item, int Thread);
+DIRNODE* NewNode(const WCHAR* Path, DIRNODE* Parent, int Top);
+void ReleaseNode(DIRNODE* Node, THREADSTATE* State);
+
+BOOL HeapInit(SIZEHEAP* Heap, int Max);
+BOOL HeapWants(SIZEHEAP* Heap, UINT64 Size);
+void HeapOffer(SIZEHEAP* Heap, UINT64 Size, const WCHAR* Path);
+void HeapFree(SIZEHEAP* Heap);
+void PrintLargest(const WCHAR* Title, BOOL Files, int NumThreads, int TopN);
+int CompareSizes(const void* One, const void* Two);
+
+void PrintHistogram(int NumThreads);
 
 BOOL SetBackupPrivilege(BOOL NotifyErrors);
 BOOL UnsetBackupPrivilege(BOOL NotifyErrors);
-int strcmpw(const WCHAR* Pattern, const WCHAR* Source);
 
 
 //**********************************************************************
@@ -39,13 +160,17 @@ CRhsIO RhsIO;
 //**********************************************************************
 
 #define SYNTAX \
-L"dirspace v2.0.1\r\n" \
-L"Syntax: [-i<wildcards> -m<Cutoff date>/-c<Cutoff date>] [<source dir>] \r\n" \
+L"dirspace v2.1.1\r\n" \
+L"Syntax: [-i<wildcards> -m<Cutoff date>/-c<Cutoff date> -n<count> -h -t<threads>] [<source dir>] \r\n" \
 L"Flags:\r\n" \
 L"  -i<wildcards>   include only files matching the wildcards. Separate\r\n" \
 L"                  multiple wildcards with , or ;\r\n" \
 L"  -m<cutoff date> include only files modified after this date\r\n" \
-L"  -c<cutoff date> include only files created after this date\r\n"
+L"  -c<cutoff date> include only files created after this date\r\n" \
+L"  -n<count>       list the largest <count> directories and files\r\n" \
+L"                  at any depth\r\n" \
+L"  -h              list the number of files in each range of sizes\r\n" \
+L"  -t<threads>     the number of threads to scan with\r\n"
 
 #define MAX_FILELEN 4096
 
@@ -54,6 +179,26 @@ int   g_NumWildcards = 0;
 WCHAR* g_Wildcards[32];
 WCHAR  g_WildcardBuf[256];
 
+// The wildcards compiled so each file name is only scanned once
+
+CRhsWildCardSet g_WildCardSet;
+
+// Listing a directory spends most of its time waiting for the disk or
+// the server, so by default use more threads than there are processors
+
+#define MAX_DEFTHREADS 16
+
+FILETIME g_CutOff;
+BOOL g_Modified = TRUE;
+int g_TopN = 0;
+
+TOPDIR* g_Top = NULL;
+int g_NumTop = 0;
+
+CRhsWorkQueue g_Queue;
+THREADSTATE g_State[RHSWORK_MAXTHREADS];
+volatile LONG g_Skipped = 0;
+
 
 //**********************************************************************
 // WinMain
@@ -79,18 +224,26 @@ int wmain(int argc, WCHAR* argv[])
 //**********************************************************************
 
 DWORD WINAPI rhsmain(LPVOID unused)
-{ int numarg, i, j;
-  double subdir_space, total_space;
-  DWORD num_files, num_sub_files;
-  BOOL modify_date;
+{ int numarg, numthreads, i, j;
+  UINT64 total_bytes, total_files;
+  BOOL histogram;
   SYSTEMTIME st;
-  FILETIME ft;
+  SYSTEM_INFO si;
   CRhsDate dt;
   CRhsFindFile ff;
+  TOPDIR* top;
+  DIRNODE* node;
   WCHAR rootdir[MAX_FILELEN+1], subdir[MAX_FILELEN+1], s[MAX_FILELEN+1];
 
-  ft.dwLowDateTime = 0;
-  ft.dwHighDateTime = 0;
+  g_CutOff.dwLowDateTime = 0;
+  g_CutOff.dwHighDateTime = 0;
+
+  histogram = FALSE;
+
+  GetSystemInfo(&si);
+  numthreads = (int) si.dwNumberOfProcessors*2;
+  if (numthreads > MAX_DEFTHREADS)
+    numthreads = MAX_DEFTHREADS;
 
 // Check the arguments
 
@@ -150,7 +303,7 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
       case 'm':
       case 'M':
-        modify_date = TRUE;
+        g_Modified = TRUE;
 
         if (!dt.SetDate(RhsIO.m_argv[numarg]+2))
         { RhsIO.errprintf(L"The date supplied, \"%s\", is not valid.\r\n", RhsIO.m_argv[numarg]+2);
@@ -158,14 +311,14 @@ DWORD WINAPI rhsmain(LPVOID unused)
         }
 
         dt.GetDate(&st);
-        SystemTimeToFileTime(&st, &ft);
+        SystemTimeToFileTime(&st, &g_CutOff);
         break;
 
 // -c specifies a created date. Count only files created on ar after this date.
 
       case 'c':
       case 'C':
-        modify_date = FALSE;
+        g_Modified = FALSE;
 
         if (!dt.SetDate(RhsIO.m_argv[numarg]+2))
         { RhsIO.errprintf(L"The date supplied, \"%s\", is not valid.\r\n", RhsIO.m_argv[numarg]+2);
@@ -173,7 +326,36 @@ DWORD WINAPI rhsmain(LPVOID unused)
         }
 
         dt.GetDate(&st);
-        SystemTimeToFileTime(&st, &ft);
+        SystemTimeToFileTime(&st, &g_CutOff);
+        break;
+
+// -n lists the largest directories and files
+
+      case 'n':
+      case 'N':
+        g_TopN = _wtoi(RhsIO.m_argv[numarg]+2);
+        if (g_TopN <= 0)
+        { RhsIO.errprintf(L"The number of directories and files to list, \"%s\", is not valid.\r\n", RhsIO.m_argv[numarg]+2);
+          return 2;
+        }
+        break;
+
+// -h lists the file size histogram
+
+      case 'h':
+      case 'H':
+        histogram = TRUE;
+        break;
+
+// -t sets the number of threads
+
+      case 't':
+      case 'T':
+        numthreads = _wtoi(RhsIO.m_argv[numarg]+2);
+        if (numthreads < 1 || numthreads > RHSWORK_MAXTHREADS)
+        { RhsIO.errprintf(L"The number of threads must be from 1 to %i.\r\n", RHSWORK_MAXTHREADS);
+          return 2;
+        }
         break;
 
 // Unknown flag
@@ -203,6 +385,24 @@ DWORD WINAPI rhsmain(LPVOID unused)
   { lstrcpyn(rootdir, RhsIO.m_argv[numarg], MAX_FILELEN);
   }
 
+// Compile the wildcards
+
+  for (i = 0; i < g_NumWildcards; i++)
+  { if (!g_WildCardSet.Add(g_Wildcards[i]))
+    { RhsIO.errprintf(L"Invalid wildcard \"%s\": %s\r\n", g_Wildcards[i], g_WildCardSet.LastError());
+      return 2;
+    }
+  }
+
+// Set up the per thread results
+
+  for (i = 0; i < numthreads; i++)
+  { if (!HeapInit(&g_State[i].Dirs, g_TopN) || !HeapInit(&g_State[i].Files, g_TopN))
+    { RhsIO.errprintf(L"Out of memory\r\n");
+      return 2;
+    }
+  }
+
 // Set the backup privilege so we can count files we can't open
 
   SetBackupPrivilege(true);
@@ -218,15 +418,18 @@ DWORD WINAPI rhsmain(LPVOID unused)
     RhsIO.printf(L"\r\n");
   }
 
-  if (ft.dwLowDateTime != 0)
+  if (g_CutOff.dwLowDateTime != 0)
   { RhsIO.printf(L"Cutoff date is %s\r\n", dt.FormatDate(s, 255, 4));
 
-    if (modify_date)
+    if (g_Modified)
       RhsIO.printf(L"Files modified on or after %s\r\n", dt.FormatDate(s, 255, 4));
     else
       RhsIO.printf(L"Files created on or after %s\r\n", dt.FormatDate(s, 255, 4));
   }
 
+// List the subdirectories of the root directory. The list has to be
+// complete before the scan starts because the threads write into it.
+
   lstrcpy(s, rootdir);
   lstrcat(s, L"\\*");
 
@@ -234,31 +437,86 @@ DWORD WINAPI rhsmain(LPVOID unused)
   { RhsIO.errprintf(L"Cannot find the directory \"%s\"\r\n", rootdir);
     return 2;
   }
-  else
-  { total_space = 0;
-    num_files = 0;
 
-    do
-    { if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
-      { if (ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT)
-        { // Ignore junction points
-        }
-        else
-        { subdir_space = GetDirDiskSpace(ff.FullFilename(s, MAX_FILELEN), &ft, modify_date, &num_sub_files);
-          RhsIO.printf(L"%s\t%.0f\t%i\r\n", ff.Filename(subdir, MAX_FILELEN), subdir_space, num_sub_files);
+  do
+  { if (!(ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY))
+      continue;
 
-          total_space += subdir_space;
-          num_files += num_sub_files;
-        }
-      }
+// Ignore junction points, and . and .. because they aren't subdirectories
 
-    } while (ff.Next(subdir, MAX_FILELEN));
+    if (ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT)
+      continue;
 
-    RhsIO.printf(L"Total\t%.0f\tMb\r\n", total_space);
-  }
+    if (lstrcmp(subdir, L".") == 0 || lstrcmp(subdir, L"..") == 0)
+      continue;
+
+    top = (TOPDIR*) realloc(g_Top, (g_NumTop + 1)*sizeof(TOPDIR));
+    if (!top)
+    { RhsIO.errprintf(L"Out of memory\r\n");
+      return 2;
+    }
+    g_Top = top;
+
+    top = g_Top + g_NumTop;
+    top->Name = _wcsdup(subdir);
+    top->Bytes = top->Files = 0;
+    if (!top->Name)
+    { RhsIO.errprintf(L"Out of memory\r\n");
+      return 2;
+    }
+
+    g_NumTop++;
+
+  } while (ff.Next(subdir, MAX_FILELEN));
 
   ff.Close();
 
+// Queue the subdirectories and scan them
+
+  for (i = 0; i < g_NumTop; i++)
+  { lstrcpy(s, rootdir);
+    lstrcat(s, L"\\");
+    lstrcat(s, g_Top[i].Name);
+
+    node = NewNode(s, NULL, i);
+    if (!node || !g_Queue.Add(node))
+    { RhsIO.errprintf(L"Out of memory\r\n");
+      return 2;
+    }
+  }
+
+  if (!g_Queue.Start(numthreads, ScanDirectory, NULL))
+  { RhsIO.errprintf(L"Cannot start the scanning threads\r\n");
+    return 2;
+  }
+
+  numthreads = g_Queue.NumThreads();
+  g_Queue.Wait();
+
+// Print the results in the order the directories were listed
+
+  total_bytes = total_files = 0;
+
+  for (i = 0; i < g_NumTop; i++)
+  { RhsIO.printf(L"%s\t%.0f\t%.0f\r\n", g_Top[i].Name, (double) g_Top[i].Bytes/1048576.0, (double) g_Top[i].Files);
+
+    total_bytes += g_Top[i].Bytes;
+    total_files += g_Top[i].Files;
+  }
+
+  RhsIO.printf(L"Total\t%.0f\tMb\r\n", (double) total_bytes/1048576.0);
+
+  if (g_Skipped > 0)
+    RhsIO.errprintf(L"%i directories could not be scanned because memory ran out\r\n", g_Skipped);
+
+  if (g_TopN > 0)
+  { PrintLargest(L"Largest directories", FALSE, numthreads, g_TopN);
+    PrintLargest(L"Largest files", TRUE, numthreads, g_TopN);
+  }
+
+  if (histogram)
+    PrintHistogram(numthreads);
+
 // Turn the backup privilege off again
 
   UnsetBackupPrivilege(true);
@@ -270,32 +528,38 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
 
 //**********************************************************************
-// GetDirDiskSpace
-// ---------------
+// ScanDirectory
+// -------------
+// Called on a worker thread to scan one directory. The subdirectories
+// are added to the queue rather than recursed into, and the directory
+// is released when its files have been added up.
 //**********************************************************************
 
-double GetDirDiskSpace(const WCHAR* DirName, FILETIME* CutOff, BOOL Modified, DWORD* NumFiles)
+void ScanDirectory(void* Context, void* Item, int Thread)
 { int i;
-  double disk_space, file_size;
-  DWORD num_files, num_sub_files;
+  UINT64 size, bytes, files;
   DWORD low, high;
   FILETIME ft;
   CRhsFindFile ff;
+  DIRNODE *node, *child;
+  THREADSTATE* state;
   WCHAR filename[MAX_FILELEN+1], s[MAX_FILELEN+1];
 
-  disk_space = 0;
-  num_files = 0;
+  node = (DIRNODE*) Item;
+  state = g_State + Thread;
+
+  bytes = files = 0;
 
 // Find all files in the specified directory
 
-  lstrcpy(s, DirName);
+  lstrcpy(s, node->Path);
   lstrcat(s, L"\\*");
 
   if (ff.First(s, filename, MAX_FILELEN))
   { do
     {
 
-// If we've found a directory recurse into it
+// If we've found a directory queue it
 
       if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
       {
@@ -310,10 +574,21 @@ double GetDirDiskSpace(const WCHAR* DirName, FILETIME* CutOff, BOOL Modified, DW
         if (lstrcmp(filename, L".") == 0 || lstrcmp(filename, L"..") == 0)
           continue;
 
-// Recurse into the directory/juntion point
+// The child holds a reference on this directory until it's finished
+
+        child = NewNode(ff.FullFilename(s, MAX_FILELEN), node, node->Top);
+        if (!child)
+        { InterlockedIncrement(&g_Skipped);
+          continue;
+        }
+
+        InterlockedIncrement(&node->Pending);
 
-        disk_space += GetDirDiskSpace(ff.FullFilename(filename, MAX_FILELEN), CutOff, Modified, &num_sub_files);
-        num_files += num_sub_files;
+        if (!g_Queue.Add(child))
+        { InterlockedDecrement(&node->Pending);
+          InterlockedIncrement(&g_Skipped);
+          free(child);
+        }
       }
 
 // Otherwise we've found a file
@@ -325,43 +600,36 @@ double GetDirDiskSpace(const WCHAR* DirName, FILETIME* CutOff, BOOL Modified, DW
 // of the wildcards. If it doesn't skip past this file.
 
         if (g_NumWildcards > 0)
-        { for (i = 0; i < g_NumWildcards; i++)
-          { ff.Filename(filename, MAX_FILELEN);
-            CharLower(filename);
-            if (strcmpw(g_Wildcards[i], filename) == 0)
-              break;
-          }
-          if (i == g_NumWildcards)
+          if (!g_WildCardSet.Match(filename))
             continue;
-        }
-
-// Get the file size
-
-        ff.FileSize(&low, &high);
-        file_size = ((double) high)*4294967296.0 + (double) low;
-        file_size /= 1048576.0;
-
-// If we are not using a date cutoff add the file size immediately
-
-        if (CutOff->dwLowDateTime == 0)
-        { disk_space += file_size;
-          num_files++;
-        }
 
 // If we are using a date cutoff compare the file timestamp with the
 // date cutoff.
 
-        else
-        { if (Modified)
+        if (g_CutOff.dwLowDateTime != 0)
+        { if (g_Modified)
             ft = ff.LastWriteTime();
           else
             ft = ff.CreationTime();
 
-          if (CompareFileTime(CutOff, &ft) == -1)
-          { disk_space += file_size;
-            num_files++;
-          }
+          if (CompareFileTime(&g_CutOff, &ft) != -1)
+            continue;
         }
+
+// Add the file size
+
+        ff.FileSize(&low, &high);
+        size = ((UINT64) high << 32) | low;
+
+        bytes += size;
+        files++;
+
+        for (i = 0; i < NUM_BUCKETS - 1 && size >= BUCKET[i].Limit; i++);
+        state->HistFiles[i]++;
+        state->HistBytes[i] += size;
+
+        if (HeapWants(&state->Files, size))
+          HeapOffer(&state->Files, size, ff.FullFilename(s, MAX_FILELEN));
       }
 
 // Next file
@@ -373,13 +641,257 @@ double GetDirDiskSpace(const WCHAR* DirName, FILETIME* CutOff, BOOL Modified, DW
 
   ff.Close();
 
-// The number of files found (including recursed directories) is
-// written into the NumFiles argument and the files size is returned
-// as the return value of the function.
+// Add the files to this directory and release it
 
-  *NumFiles = num_files;
+  InterlockedExchangeAdd64(&node->Bytes, (LONGLONG) bytes);
+  InterlockedExchangeAdd64(&node->Files, (LONGLONG) files);
 
-  return disk_space;
+  ReleaseNode(node, state);
+}
+
+
+//**********************************************************************
+// NewNode
+// -------
+//**********************************************************************
+
+DIRNODE* NewNode(const WCHAR* Path, DIRNODE* Parent, int Top)
+{ DIRNODE* node;
+
+  node = (DIRNODE*) malloc(sizeof(DIRNODE) + lstrlen(Path)*sizeof(WCHAR));
+  if (!node)
+    return(NULL);
+
+  node->Parent = Parent;
+  node->Top = Top;
+  node->Pending = 1;
+  node->Bytes = node->Files = 0;
+  lstrcpy(node->Path, Path);
+
+  return(node);
+}
+
+
+//**********************************************************************
+// ReleaseNode
+// -----------
+// Release a reference on a directory. When the last reference goes the
+// directory and everything below it has been counted, so its totals are
+// added to its parent and the parent is released in turn.
+//**********************************************************************
+
+void ReleaseNode(DIRNODE* Node, THREADSTATE* State)
+{ DIRNODE* parent;
+
+  while (Node && InterlockedDecrement(&Node->Pending) == 0)
+  { if (HeapWants(&State->Dirs, (UINT64) Node->Bytes))
+      HeapOffer(&State->Dirs, (UINT64) Node->Bytes, Node->Path);
+
+    parent = Node->Parent;
+
+    if (parent)
+    { InterlockedExchangeAdd64(&parent->Bytes, Node->Bytes);
+      InterlockedExchangeAdd64(&parent->Files, Node->Files);
+    }
+    else
+    { g_Top[Node->Top].Bytes = (UINT64) Node->Bytes;
+      g_Top[Node->Top].Files = (UINT64) Node->Files;
+    }
+
+    free(Node);
+    Node = parent;
+  }
+}
+
+
+//**********************************************************************
+// HeapInit
+// --------
+//**********************************************************************
+
+BOOL HeapInit(SIZEHEAP* Heap, int Max)
+{
+  Heap->Num = 0;
+  Heap->Max = Max;
+  Heap->Entry = NULL;
+
+  if (Max > 0)
+  { Heap->Entry = (SIZEENTRY*) malloc(Max*sizeof(SIZEENTRY));
+    if (!Heap->Entry)
+      return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+
+//**********************************************************************
+// HeapWants
+// ---------
+// Check if a size would go in the heap, so the caller needn't build the
+// path if it won't
+//**********************************************************************
+
+BOOL HeapWants(SIZEHEAP* Heap, UINT64 Size)
+{
+  if (Heap->Max == 0)
+    return(FALSE);
+
+  return(Heap->Num < Heap->Max || Size > Heap->Entry[0].Size);
+}
+
+
+//**********************************************************************
+// HeapOffer
+// ---------
+// Add a size to the heap, pushing out the smallest if the heap is full.
+// The smallest size is always at the top of the heap.
+//**********************************************************************
+
+void HeapOffer(SIZEHEAP* Heap, UINT64 Size, const WCHAR* Path)
+{ int i, child;
+  WCHAR* path;
+  SIZEENTRY e;
+
+  if (!HeapWants(Heap, Size))
+    return;
+
+  path = _wcsdup(Path);
+  if (!path)
+    return;
+
+  e.Size = Size;
+  e.Path = path;
+
+// If there is room add it at the bottom and move it up
+
+  if (Heap->Num < Heap->Max)
+  { for (i = Heap->Num++; i > 0 && Heap->Entry[(i-1)/2].Size > Size; i = (i-1)/2)
+      Heap->Entry[i] = Heap->Entry[(i-1)/2];
+
+    Heap->Entry[i] = e;
+    return;
+  }
+
+// Otherwise replace the top and move it down
+
+  free(Heap->Entry[0].Path);
+
+  for (i = 0; (child = 2*i + 1) < Heap->Num; i = child)
+  { if (child + 1 < Heap->Num && Heap->Entry[child+1].Size < Heap->Entry[child].Size)
+      child++;
+    if (Heap->Entry[child].Size >= Size)
+      break;
+    Heap->Entry[i] = Heap->Entry[child];
+  }
+
+  Heap->Entry[i] = e;
+}
+
+
+//**********************************************************************
+// HeapFree
+// --------
+//**********************************************************************
+
+void HeapFree(SIZEHEAP* Heap)
+{ int i;
+
+  for (i = 0; i < Heap->Num; i++)
+    free(Heap->Entry[i].Path);
+
+  if (Heap->Entry)
+    free(Heap->Entry);
+
+  Heap->Entry = NULL;
+  Heap->Num = 0;
+}
+
+
+//**********************************************************************
+// PrintLargest
+// ------------
+// Merge the directory or file heaps from all the threads and print the
+// largest TopN
+//**********************************************************************
+
+void PrintLargest(const WCHAR* Title, BOOL Files, int NumThreads, int TopN)
+{ int num, i, j;
+  SIZEHEAP* heap;
+  SIZEENTRY* all;
+
+  RhsIO.printf(L"\r\n%s\r\n", Title);
+
+  num = 0;
+  for (i = 0; i < NumThreads; i++)
+    num += Files ? g_State[i].Files.Num : g_State[i].Dirs.Num;
+
+  all = NULL;
+  if (num > 0)
+  { all = (SIZEENTRY*) malloc(num*sizeof(SIZEENTRY));
+    if (!all)
+      RhsIO.errprintf(L"Out of memory\r\n");
+  }
+
+  if (all)
+  { num = 0;
+    for (i = 0; i < NumThreads; i++)
+    { heap = Files ? &g_State[i].Files : &g_State[i].Dirs;
+      for (j = 0; j < heap->Num; j++)
+        all[num++] = heap->Entry[j];
+    }
+
+    qsort(all, num, sizeof(SIZEENTRY), CompareSizes);
+
+    for (i = 0; i < num && i < TopN; i++)
+      RhsIO.printf(L"%.0f\t%s\r\n", (double) all[i].Size, all[i].Path);
+
+    free(all);
+  }
+
+  for (i = 0; i < NumThreads; i++)
+    HeapFree(Files ? &g_State[i].Files : &g_State[i].Dirs);
+}
+
+
+//**********************************************************************
+// CompareSizes
+// ------------
+// qsort callback to sort SIZEENTRYs largest first
+//**********************************************************************
+
+int CompareSizes(const void* One, const void* Two)
+{ UINT64 one, two;
+
+  one = ((const SIZEENTRY*) One)->Size;
+  two = ((const SIZEENTRY*) Two)->Size;
+
+  return(one < two ? 1 : (one > two ? -1 : 0));
+}
+
+
+//**********************************************************************
+// PrintHistogram
+// --------------
+// Add up the histograms from all the threads and print them
+//**********************************************************************
+
+void PrintHistogram(int NumThreads)
+{ int i, t;
+  UINT64 files, bytes;
+
+  RhsIO.printf(L"\r\nSize\tFiles\tMb\r\n");
+
+  for (i = 0; i < NUM_BUCKETS; i++)
+  { files = bytes = 0;
+
+    for (t = 0; t < NumThreads; t++)
+    { files += g_State[t].HistFiles[i];
+      bytes += g_State[t].HistBytes[i];
+    }
+
+    RhsIO.printf(L"%s\t%.0f\t%.0f\r\n", BUCKET[i].Name, (double) files, (double) bytes/1048576.0);
+  }
 }
 
 
@@ -433,50 +945,3 @@ BOOL UnsetBackupPrivilege(BOOL NotifyErrors)
 
   return(TRUE);
 }
-
-
-//**********************************************************************
-// strcmpw
-// =======
-// Just like strcmp except it handles wildcards * and ?
-//**********************************************************************
-
-int strcmpw(const WCHAR* Pattern, const WCHAR* Source)
-{ int i;
-  const WCHAR *patptr, *strptr;
-
-  patptr = Pattern;
-  strptr = Source;
-
-  while (*patptr != '\0' || *strptr != '\0')
-  {
-    if (*patptr == '*')
-    { while (*patptr == '*')
-        patptr++;
-
-      if (*patptr == '\0')
-        return(0);
-
-      while ((i = strcmpw(patptr, strptr)) != 0)
-        if (*strptr++ == '\0')
-          return(i);
-    }
-
-    else if (*patptr == '?')
-    {
-    }
-
-    else
-    { if (*patptr > *strptr)
-        return(1);
-
-      if (*patptr < *strptr)
-        return(-1);
-    }
-
-    ++patptr;
-    ++strptr;
-  }
-
-  return(0);
-}
@@ -0,0 +1,771 @@
+// *********************************************************************
+// CLineDiff
+// =========
+// Compare two text files line by line and find the blocks of lines that
+// differ. This uses the Myers O(ND) algorithm in its linear space form,
+// i.e. finding the middle snake and recursing on the two halves.
+//
+// The files are streamed rather than loaded. Each line is reduced to a
+// 64 bit hash, and each distinct hash is given an integer ID, so the
+// comparison works on arrays of integers. Only the file offset of each
+// line is kept so the text can be read back when the differences are
+// printed. Two lines are taken as equal if their hashes are equal. The
+// chance of two different lines having the same 64 bit hash is small
+// enough to ignore.
+//
+// John Rennie
+// 19/10/26
+// *********************************************************************
+
+#include <windows.h>
+#include <limits.h>
+#include <stdio.h>
+#include <Misc/Utils.h>
+#include "CLineDiff.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+#define LEN_READBUF 0x10000
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x00000100000001b3ULL
+
+#define LINEDIFF_MINLINES 0x400
+#define LINEDIFF_MINHASH  0x1000
+
+
+//**********************************************************************
+// CLineDiff
+// ---------
+//**********************************************************************
+
+CLineDiff::CLineDiff()
+{
+  ZeroMemory(m_File, sizeof(m_File));
+  m_File[0].h = m_File[1].h = INVALID_HANDLE_VALUE;
+
+  m_HashTable = NULL;
+  m_HashIds = NULL;
+  m_HashSize = m_NumIds = m_MaxIds = 0;
+  m_IdCount[0] = m_IdCount[1] = NULL;
+
+  m_FwdDiag = m_BackDiag = NULL;
+
+  m_Changes = NULL;
+  m_NumChanges = 0;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CLineDiff::~CLineDiff()
+{
+  Close();
+}
+
+
+//**********************************************************************
+// CLineDiff::Compare
+// ------------------
+// Find the differences between the two files. If this succeeds use
+// NumChanges and Change to retrieve the changed blocks and GetLine to
+// get the text of the lines.
+//**********************************************************************
+
+BOOL CLineDiff::Compare(const WCHAR* SrcFile, const WCHAR* DestFile)
+{ int f, n, m, pre, suf, i, diags;
+  DWORD* ids;
+
+// Start from a clean state
+
+  Close();
+
+// Read the two files and convert the lines to IDs
+
+  if (!ReadLines(LINEDIFF_SRC, SrcFile))
+    return FALSE;
+
+  if (!ReadLines(LINEDIFF_DEST, DestFile))
+    return FALSE;
+
+  n = (int) m_File[0].numlines;
+  m = (int) m_File[1].numlines;
+
+  for (f = 0; f < 2; f++)
+  { m_File[f].changed = (char*) calloc(m_File[f].numlines + 1, 1);
+    m_File[f].cmpids  = (DWORD*) malloc((m_File[f].numlines + 1)*sizeof(DWORD));
+    m_File[f].cmpidx  = (DWORD*) malloc((m_File[f].numlines + 1)*sizeof(DWORD));
+
+    if (!m_File[f].changed || !m_File[f].cmpids || !m_File[f].cmpidx)
+    { lstrcpy(m_LastError, L"Out of memory comparing files");
+      return FALSE;
+    }
+  }
+
+// Lines common to the start and end of both files cannot be part of a
+// difference so strip them off before doing any real work.
+
+  for (pre = 0; pre < n && pre < m; pre++)
+    if (m_File[0].ids[pre] != m_File[1].ids[pre])
+      break;
+
+  for (suf = 0; n - suf > pre && m - suf > pre; suf++)
+    if (m_File[0].ids[n - 1 - suf] != m_File[1].ids[m - 1 - suf])
+      break;
+
+// A line that doesn't appear anywhere in the other file must have
+// changed, so mark it now and leave it out of the comparison. In the
+// typical case this removes most of the changed lines and makes the
+// Myers search much cheaper.
+
+  for (f = 0; f < 2; f++)
+  { ids = m_File[f].ids;
+    m_File[f].numcmp = 0;
+
+    for (i = pre; i < (int) m_File[f].numlines - suf; i++)
+    { if (m_IdCount[1 - f][ids[i]] == 0)
+      { m_File[f].changed[i] = 1;
+      }
+      else
+      { m_File[f].cmpids[m_File[f].numcmp] = ids[i];
+        m_File[f].cmpidx[m_File[f].numcmp] = (DWORD) i;
+        m_File[f].numcmp++;
+      }
+    }
+  }
+
+// Allocate the diagonal vectors and run the comparison
+
+  diags = m_File[0].numcmp + m_File[1].numcmp + 3;
+
+  m_FwdDiag  = (int*) malloc(diags*sizeof(int));
+  m_BackDiag = (int*) malloc(diags*sizeof(int));
+
+  if (!m_FwdDiag || !m_BackDiag)
+  { lstrcpy(m_LastError, L"Out of memory comparing files");
+    return FALSE;
+  }
+
+// If the edit distance gets beyond this we stop looking for the
+// optimal split. The result is still a valid diff, just not the
+// smallest possible one.
+
+  m_TooExpensive = 1;
+  for (i = diags; i != 0; i >>= 2)
+    m_TooExpensive <<= 1;
+  if (m_TooExpensive < 4096)
+    m_TooExpensive = 4096;
+
+  CompareSeq(0, m_File[0].numcmp, 0, m_File[1].numcmp);
+
+  free(m_FwdDiag);
+  free(m_BackDiag);
+  m_FwdDiag = m_BackDiag = NULL;
+
+// Convert the changed flags to a list of changed blocks
+
+  return BuildChanges();
+}
+
+
+//**********************************************************************
+// CLineDiff::Close
+// ----------------
+// Close the files and free all memory
+//**********************************************************************
+
+void CLineDiff::Close(void)
+{ int f;
+
+  for (f = 0; f < 2; f++)
+  { if (m_File[f].h != INVALID_HANDLE_VALUE)
+      CloseHandle(m_File[f].h);
+
+    if (m_File[f].ids)     free(m_File[f].ids);
+    if (m_File[f].offsets) free(m_File[f].offsets);
+    if (m_File[f].changed) free(m_File[f].changed);
+    if (m_File[f].cmpids)  free(m_File[f].cmpids);
+    if (m_File[f].cmpidx)  free(m_File[f].cmpidx);
+
+    if (m_IdCount[f])
+      free(m_IdCount[f]);
+    m_IdCount[f] = NULL;
+  }
+
+  ZeroMemory(m_File, sizeof(m_File));
+  m_File[0].h = m_File[1].h = INVALID_HANDLE_VALUE;
+
+  if (m_HashTable) free(m_HashTable);
+  if (m_HashIds)   free(m_HashIds);
+  m_HashTable = NULL;
+  m_HashIds = NULL;
+  m_HashSize = m_NumIds = m_MaxIds = 0;
+
+  if (m_FwdDiag)  free(m_FwdDiag);
+  if (m_BackDiag) free(m_BackDiag);
+  m_FwdDiag = m_BackDiag = NULL;
+
+  if (m_Changes)
+    free(m_Changes);
+  m_Changes = NULL;
+  m_NumChanges = 0;
+}
+
+
+//**********************************************************************
+// CLineDiff::GetLine
+// ------------------
+// Read the text of a line back from the file. The line terminator is
+// removed and long lines are truncated to fit the buffer.
+//**********************************************************************
+
+BOOL CLineDiff::GetLine(int File, DWORD Line, char* Buf, int BufLen)
+{ DWORD len, numread;
+  LARGE_INTEGER li;
+
+  lstrcpyA(Buf, "");
+
+  if (File < 0 || File > 1 || Line >= m_File[File].numlines || BufLen < 1)
+    return FALSE;
+
+// The line runs from its offset to the start of the next line
+
+  li.QuadPart = (LONGLONG) m_File[File].offsets[Line];
+  len = (DWORD) (m_File[File].offsets[Line + 1] - m_File[File].offsets[Line]);
+  if (len > (DWORD) BufLen - 1)
+    len = (DWORD) BufLen - 1;
+
+  if (!SetFilePointerEx(m_File[File].h, li, NULL, FILE_BEGIN))
+    return FALSE;
+
+  if (!ReadFile(m_File[File].h, Buf, len, &numread, NULL))
+    return FALSE;
+
+  Buf[numread] = '\0';
+  UtilsStripTrailingCRLF(Buf);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CLineDiff::ReadLines
+// --------------------
+// Stream through the file and record the ID and offset of every line.
+// A CR before the LF is ignored so DOS and Unix files compare equal, as
+// they did when the files were read in text mode.
+//**********************************************************************
+
+BOOL CLineDiff::ReadLines(int File, const WCHAR* FileName)
+{ DWORD numread, i;
+  UINT64 hash, offset, linestart;
+  BOOL pending_cr, in_line;
+  BYTE c;
+  BYTE* buf;
+
+// Open the file. The handle stays open so GetLine can read it.
+
+  m_File[File].h = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+  if (m_File[File].h == INVALID_HANDLE_VALUE)
+  { SetLastError(File == LINEDIFF_SRC ? L"Cannot open source" : L"Cannot open destination", FileName);
+    return FALSE;
+  }
+
+  buf = (BYTE*) malloc(LEN_READBUF);
+  if (!buf)
+  { lstrcpy(m_LastError, L"Out of memory comparing files");
+    return FALSE;
+  }
+
+// Read the file and hash each line
+
+  hash = FNV_OFFSET;
+  offset = linestart = 0;
+  pending_cr = in_line = FALSE;
+
+  for (;;)
+  { if (!ReadFile(m_File[File].h, buf, LEN_READBUF, &numread, NULL))
+    { SetLastError(File == LINEDIFF_SRC ? L"Error reading source" : L"Error reading destination", FileName);
+      free(buf);
+      return FALSE;
+    }
+
+    if (numread == 0)
+      break;
+
+    for (i = 0; i < numread; i++, offset++)
+    { c = buf[i];
+
+      if (c == '\n')
+      { if (!AddLine(File, hash, linestart))
+        { free(buf);
+          return FALSE;
+        }
+
+        hash = FNV_OFFSET;
+        linestart = offset + 1;
+        pending_cr = in_line = FALSE;
+        continue;
+      }
+
+// A CR only counts if it isn't followed by a LF
+
+      if (pending_cr)
+      { hash = (hash ^ '\r')*FNV_PRIME;
+        pending_cr = FALSE;
+      }
+
+      in_line = TRUE;
+
+      if (c == '\r')
+        pending_cr = TRUE;
+      else
+        hash = (hash ^ c)*FNV_PRIME;
+    }
+  }
+
+  free(buf);
+
+// The last line may not have a terminator
+
+  if (in_line)
+  { if (pending_cr)
+      hash = (hash ^ '\r')*FNV_PRIME;
+
+    if (!AddLine(File, hash, linestart))
+      return FALSE;
+  }
+
+// Record the end of the last line. AddLine always leaves room for this.
+
+  if (!m_File[File].offsets)
+  { m_File[File].offsets = (UINT64*) malloc(sizeof(UINT64));
+    if (!m_File[File].offsets)
+    { lstrcpy(m_LastError, L"Out of memory comparing files");
+      return FALSE;
+    }
+  }
+
+  m_File[File].offsets[m_File[File].numlines] = offset;
+
+// Return indicating success
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CLineDiff::AddLine
+// ------------------
+// Add a line to the file's list of line IDs
+//**********************************************************************
+
+BOOL CLineDiff::AddLine(int File, UINT64 Hash, UINT64 Offset)
+{ DWORD id, newmax;
+  DWORD* newids;
+  UINT64* newoffsets;
+
+// Grow the arrays if necessary. Leave one spare offset for the end of
+// the last line.
+
+  if (m_File[File].numlines + 1 >= m_File[File].maxlines)
+  { newmax = m_File[File].maxlines ? m_File[File].maxlines*2 : LINEDIFF_MINLINES;
+
+    newids = (DWORD*) realloc(m_File[File].ids, newmax*sizeof(DWORD));
+    if (!newids)
+    { lstrcpy(m_LastError, L"Out of memory comparing files");
+      return FALSE;
+    }
+    m_File[File].ids = newids;
+
+    newoffsets = (UINT64*) realloc(m_File[File].offsets, newmax*sizeof(UINT64));
+    if (!newoffsets)
+    { lstrcpy(m_LastError, L"Out of memory comparing files");
+      return FALSE;
+    }
+    m_File[File].offsets = newoffsets;
+
+    m_File[File].maxlines = newmax;
+  }
+
+// Get the ID for this line
+
+  id = LineId(Hash);
+  if (id == (DWORD) -1)
+  { lstrcpy(m_LastError, L"Out of memory comparing files");
+    return FALSE;
+  }
+
+  m_File[File].ids[m_File[File].numlines] = id;
+  m_File[File].offsets[m_File[File].numlines] = Offset;
+  m_File[File].numlines++;
+
+  m_IdCount[File][id]++;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CLineDiff::LineId
+// -----------------
+// Look up the line hash in the hash table and return its ID. If it's a
+// new hash allocate a new ID. Returns -1 if we run out of memory.
+//**********************************************************************
+
+DWORD CLineDiff::LineId(UINT64 Hash)
+{ DWORD slot, newsize, i, f, newmax;
+  UINT64* newtable;
+  DWORD* newids;
+  DWORD* newcount;
+
+// Grow the hash table when it gets half full
+
+  if ((m_NumIds + 1)*2 > m_HashSize)
+  { newsize = m_HashSize ? m_HashSize*2 : LINEDIFF_MINHASH;
+
+    newtable = (UINT64*) malloc(newsize*sizeof(UINT64));
+    newids = (DWORD*) calloc(newsize, sizeof(DWORD));
+
+    if (!newtable || !newids)
+    { if (newtable) free(newtable);
+      if (newids) free(newids);
+      return (DWORD) -1;
+    }
+
+    for (i = 0; i < m_HashSize; i++)
+    { if (m_HashIds[i] == 0)
+        continue;
+
+      slot = (DWORD) (m_HashTable[i] ^ (m_HashTable[i] >> 32)) & (newsize - 1);
+      while (newids[slot] != 0)
+        slot = (slot + 1) & (newsize - 1);
+
+      newtable[slot] = m_HashTable[i];
+      newids[slot] = m_HashIds[i];
+    }
+
+    if (m_HashTable) free(m_HashTable);
+    if (m_HashIds)   free(m_HashIds);
+
+    m_HashTable = newtable;
+    m_HashIds = newids;
+    m_HashSize = newsize;
+  }
+
+// Find the hash. The table holds ID + 1 so that zero means empty.
+
+  slot = (DWORD) (Hash ^ (Hash >> 32)) & (m_HashSize - 1);
+
+  while (m_HashIds[slot] != 0)
+  { if (m_HashTable[slot] == Hash)
+      return m_HashIds[slot] - 1;
+
+    slot = (slot + 1) & (m_HashSize - 1);
+  }
+
+// It's a new line so give it the next ID
+
+  if (m_NumIds >= m_MaxIds)
+  { newmax = m_MaxIds ? m_MaxIds*2 : LINEDIFF_MINLINES;
+
+    for (f = 0; f < 2; f++)
+    { newcount = (DWORD*) realloc(m_IdCount[f], newmax*sizeof(DWORD));
+      if (!newcount)
+        return (DWORD) -1;
+
+      ZeroMemory(newcount + m_MaxIds, (newmax - m_MaxIds)*sizeof(DWORD));
+      m_IdCount[f] = newcount;
+    }
+
+    m_MaxIds = newmax;
+  }
+
+  m_HashTable[slot] = Hash;
+  m_HashIds[slot] = ++m_NumIds;
+
+  return m_NumIds - 1;
+}
+
+
+//**********************************************************************
+// CLineDiff::CompareSeq
+// ---------------------
+// Compare the section of the source lines [Off1, Lim1) with the section
+// of the destination lines [Off2, Lim2) and mark the lines that are not
+// part of the longest common subsequence as changed.
+//**********************************************************************
+
+void CLineDiff::CompareSeq(int Off1, int Lim1, int Off2, int Lim2)
+{ int xmid, ymid;
+  const DWORD* a = m_File[0].cmpids;
+  const DWORD* b = m_File[1].cmpids;
+
+// Skip past matching lines at the start and end of the section
+
+  while (Off1 < Lim1 && Off2 < Lim2 && a[Off1] == b[Off2])
+  { Off1++;
+    Off2++;
+  }
+
+  while (Off1 < Lim1 && Off2 < Lim2 && a[Lim1 - 1] == b[Lim2 - 1])
+  { Lim1--;
+    Lim2--;
+  }
+
+// If one section is empty all the lines in the other have changed
+
+  if (Off1 == Lim1)
+  { for (; Off2 < Lim2; Off2++)
+      m_File[1].changed[m_File[1].cmpidx[Off2]] = 1;
+  }
+  else if (Off2 == Lim2)
+  { for (; Off1 < Lim1; Off1++)
+      m_File[0].changed[m_File[0].cmpidx[Off1]] = 1;
+  }
+
+// Otherwise split at the middle snake and do the halves separately
+
+  else
+  { Split(Off1, Lim1, Off2, Lim2, &xmid, &ymid);
+    CompareSeq(Off1, xmid, Off2, ymid);
+    CompareSeq(xmid, Lim1, ymid, Lim2);
+  }
+}
+
+
+//**********************************************************************
+// CLineDiff::Split
+// ----------------
+// Find the midpoint of the shortest edit script for the two sections by
+// running the forward and backward searches until they overlap.
+//**********************************************************************
+
+void CLineDiff::Split(int Off1, int Lim1, int Off2, int Lim2, int* XMid, int* YMid)
+{ int dmin, dmax, fmid, bmid, fmin, fmax, bmin, bmax;
+  int c, d, x, y, tlo, thi;
+  int fxybest, fxbest, bxybest, bxbest;
+  BOOL odd;
+  const DWORD* a = m_File[0].cmpids;
+  const DWORD* b = m_File[1].cmpids;
+
+// The diagonal vectors are indexed by x - y, which can go as low as
+// -(number of destination lines) - 1.
+
+  int* fd = m_FwdDiag + m_File[1].numcmp + 1;
+  int* bd = m_BackDiag + m_File[1].numcmp + 1;
+
+  dmin = Off1 - Lim2;
+  dmax = Lim1 - Off2;
+  fmid = Off1 - Off2;
+  bmid = Lim1 - Lim2;
+  fmin = fmax = fmid;
+  bmin = bmax = bmid;
+  odd = (fmid - bmid) & 1;
+
+  fd[fmid] = Off1;
+  bd[bmid] = Lim1;
+
+  for (c = 1; ; c++)
+  {
+
+// Extend the forward search by one edit on every diagonal
+
+    if (fmin > dmin)
+      fd[--fmin - 1] = -1;
+    else
+      ++fmin;
+
+    if (fmax < dmax)
+      fd[++fmax + 1] = -1;
+    else
+      --fmax;
+
+    for (d = fmax; d >= fmin; d -= 2)
+    { tlo = fd[d - 1];
+      thi = fd[d + 1];
+      x = tlo >= thi ? tlo + 1 : thi;
+      y = x - d;
+
+      while (x < Lim1 && y < Lim2 && a[x] == b[y])
+      { x++;
+        y++;
+      }
+
+      fd[d] = x;
+
+      if (odd && bmin <= d && d <= bmax && bd[d] <= x)
+      { *XMid = x;
+        *YMid = y;
+        return;
+      }
+    }
+
+// Now extend the backward search
+
+    if (bmin > dmin)
+      bd[--bmin - 1] = INT_MAX;
+    else
+      ++bmin;
+
+    if (bmax < dmax)
+      bd[++bmax + 1] = INT_MAX;
+    else
+      --bmax;
+
+    for (d = bmax; d >= bmin; d -= 2)
+    { tlo = bd[d - 1];
+      thi = bd[d + 1];
+      x = tlo < thi ? tlo : thi - 1;
+      y = x - d;
+
+      while (x > Off1 && y > Off2 && a[x - 1] == b[y - 1])
+      { x--;
+        y--;
+      }
+
+      bd[d] = x;
+
+      if (!odd && fmin <= d && d <= fmax && x <= fd[d])
+      { *XMid = x;
+        *YMid = y;
+        return;
+      }
+    }
+
+// If the files are very different finding the optimal split could take
+// a long time. Past the cost limit give up and split at whichever of
+// the forward and backward searches has got furthest.
+
+    if (c >= m_TooExpensive)
+    { fxybest = -1;
+      fxbest = Off1;
+
+      for (d = fmax; d >= fmin; d -= 2)
+      { x = fd[d] < Lim1 ? fd[d] : Lim1;
+        y = x - d;
+        if (y > Lim2)
+        { x = Lim2 + d;
+          y = Lim2;
+        }
+        if (fxybest < x + y)
+        { fxybest = x + y;
+          fxbest = x;
+        }
+      }
+
+      bxybest = INT_MAX;
+      bxbest = Lim1;
+
+      for (d = bmax; d >= bmin; d -= 2)
+      { x = bd[d] > Off1 ? bd[d] : Off1;
+        y = x - d;
+        if (y < Off2)
+        { x = Off2 + d;
+          y = Off2;
+        }
+        if (x + y < bxybest)
+        { bxybest = x + y;
+          bxbest = x;
+        }
+      }
+
+      if ((Lim1 + Lim2) - bxybest < fxybest - (Off1 + Off2))
+      { *XMid = fxbest;
+        *YMid = fxybest - fxbest;
+      }
+      else
+      { *XMid = bxbest;
+        *YMid = bxybest - bxbest;
+      }
+
+      return;
+    }
+  }
+}
+
+
+//**********************************************************************
+// CLineDiff::BuildChanges
+// -----------------------
+// Walk the changed flags for both files and build the list of changed
+// blocks. Unchanged lines pair up one to one between the files.
+//**********************************************************************
+
+BOOL CLineDiff::BuildChanges(void)
+{ DWORD i, j, i0, j0, n, m, maxchanges;
+  LINEDIFFCHANGE* newchanges;
+
+  n = m_File[0].numlines;
+  m = m_File[1].numlines;
+
+  maxchanges = 0;
+  i = j = 0;
+
+  while (i < n || j < m)
+  {
+
+// Step over matching lines
+
+    if (i < n && j < m && !m_File[0].changed[i] && !m_File[1].changed[j])
+    { i++;
+      j++;
+      continue;
+    }
+
+// Find the extent of this block of changes
+
+    i0 = i;
+    j0 = j;
+
+    while (i < n && m_File[0].changed[i])
+      i++;
+
+    while (j < m && m_File[1].changed[j])
+      j++;
+
+// This shouldn't happen, but if the unchanged lines don't pair up treat
+// the rest of both files as changed rather than loop forever.
+
+    if (i == i0 && j == j0)
+    { i = n;
+      j = m;
+    }
+
+// Add the block to the list
+
+    if (m_NumChanges >= maxchanges)
+    { maxchanges = maxchanges ? maxchanges*2 : 64;
+      newchanges = (LINEDIFFCHANGE*) realloc(m_Changes, maxchanges*sizeof(LINEDIFFCHANGE));
+      if (!newchanges)
+      { lstrcpy(m_LastError, L"Out of memory comparing files");
+        return FALSE;
+      }
+      m_Changes = newchanges;
+    }
+
+    m_Changes[m_NumChanges].Src = i0;
+    m_Changes[m_NumChanges].SrcLen = i - i0;
+    m_Changes[m_NumChanges].Dest = j0;
+    m_Changes[m_NumChanges].DestLen = j - j0;
+    m_NumChanges++;
+  }
+
+// Return indicating success
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CLineDiff::SetLastError
+// -----------------------
+//**********************************************************************
+
+void CLineDiff::SetLastError(const WCHAR* Error, const WCHAR* FileName)
+{
+  swprintf(m_LastError, 511, L"%s \"%s\": \"%s\"", Error, FileName, GetLastErrorMessage());
+}
@@ -0,0 +1,108 @@
+// *********************************************************************
+// CLineDiff.h
+// ===========
+//
+// John Rennie
+// 19/10/26
+// *********************************************************************
+
+#ifndef _INC_CLINEDIFF
+#define _INC_CLINEDIFF
+
+
+//**********************************************************************
+// LINEDIFFCHANGE
+// --------------
+// One block of changed lines. Src/Dest are zero based line numbers and
+// either of the lengths may be zero for a pure insert or delete.
+//**********************************************************************
+
+typedef struct
+{
+  DWORD Src, SrcLen,
+        Dest, DestLen;
+
+} LINEDIFFCHANGE;
+
+
+//**********************************************************************
+// CLineDiff
+// ---------
+// Class to compare two text files line by line
+//**********************************************************************
+
+#define LINEDIFF_SRC  0
+#define LINEDIFF_DEST 1
+
+class CLineDiff
+{
+  public:
+    CLineDiff();
+    ~CLineDiff();
+
+    BOOL Compare(const WCHAR* SrcFile, const WCHAR* DestFile);
+    void Close(void);
+
+    BOOL GetLine(int File, DWORD Line, char* Buf, int BufLen);
+
+    inline DWORD NumLines(int File) { return m_File[File].numlines; }
+    inline DWORD NumChanges(void) { return m_NumChanges; }
+    inline const LINEDIFFCHANGE* Change(DWORD i) { return m_Changes + i; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL ReadLines(int File, const WCHAR* FileName);
+    DWORD LineId(UINT64 Hash);
+    BOOL AddLine(int File, UINT64 Hash, UINT64 Offset);
+
+    void CompareSeq(int Off1, int Lim1, int Off2, int Lim2);
+    void Split(int Off1, int Lim1, int Off2, int Lim2, int* XMid, int* YMid);
+
+    BOOL BuildChanges(void);
+    void SetLastError(const WCHAR* Error, const WCHAR* FileName);
+
+  private:
+
+// Per file data. Lines are identified by an integer ID so the text of
+// the lines is never held in memory. The offsets are kept so the text
+// can be read back from the file when printing the differences.
+
+    struct
+    { HANDLE h;
+      DWORD  numlines, maxlines;
+      DWORD* ids;
+      UINT64* offsets;
+      char*  changed;
+
+      int    numcmp;  // Lines passed to the Myers comparison
+      DWORD* cmpids;
+      DWORD* cmpidx;
+    } m_File[2];
+
+// Hash table mapping line hashes to line IDs
+
+    UINT64* m_HashTable;
+    DWORD*  m_HashIds;
+    DWORD   m_HashSize, m_NumIds, m_MaxIds;
+    DWORD*  m_IdCount[2];
+
+// Work arrays for the Myers algorithm
+
+    int* m_FwdDiag;
+    int* m_BackDiag;
+    int  m_TooExpensive;
+
+    LINEDIFFCHANGE* m_Changes;
+    DWORD m_NumChanges;
+
+    WCHAR m_LastError[512];
+};
+
+
+//**********************************************************************
+// End of CLineDiff
+// ----------------
+//**********************************************************************
+
+#endif // _INC_CLINEDIFF
@@ -10,10 +10,13 @@
 #include <windows.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <CRhsIO/CRhsIO.h>
 #include <Misc/CRhsFindFile.h>
 #include <Misc/CRhsWildCard.h>
+#include <Misc/CRhsPatchFile.h>
 #include <Misc/Utils.h>
+#include "CLineDiff.h"
 
 
 //**********************************************************************
@@ -23,7 +26,10 @@
 DWORD WINAPI rhsmain(LPVOID unused);
 BOOL FileCompSub(WCHAR* Source, WCHAR* Dest);
 BOOL CompareFileBinary(const WCHAR* SrcFile, const WCHAR* DestFile);
+BOOL CompareFileBlocks(const WCHAR* SrcFile, const WCHAR* DestFile);
 BOOL CompareFileASCII(const WCHAR* SrcFile, const WCHAR* DestFile);
+void PrintDiffHunk(CLineDiff* Diff, DWORD First, DWORD Last);
+void PrintDiffLine(CLineDiff* Diff, int File, DWORD Line, WCHAR Prefix);
 
 
 //**********************************************************************
@@ -34,17 +40,26 @@ CRhsIO RhsIO;
 
 int g_NumCompared, g_NumDiffs;
 
-BOOL g_ASCII, g_Recurse, g_Hidden, g_Quiet, g_System;
+BOOL g_ASCII, g_Blocks, g_Recurse, g_Hidden, g_Quiet, g_System;
+
+DWORD g_BlockSize;
+WCHAR g_PatchFile[LEN_FILENAME+1];
 
 CRhsWildCard g_WildCard;
 
+#define DEF_BLOCKSIZE 0x100000
+#define MIN_BLOCKSIZE 0x1000
+#define MAX_BLOCKSIZE 0x4000000
+
 #define SYNTAX \
-L"FileComp v1.0\r\n" \
-L"Syntax: [-a -d -h -q -s] <source file name> <dest file name>\r\n" \
+L"FileComp v1.2\r\n" \
+L"Syntax: [-a -b[<size>] -d -h -p<patch file> -q -s] <source file name> <dest file name>\r\n" \
 L"Flags:\r\n" \
-L"  -a assume the files are text (ASCII) files not binary\r\n" \
+L"  -a assume the files are text (ASCII) files and list the differences\r\n" \
+L"  -b compare in blocks of <size> bytes (default 1M) and list the differing blocks\r\n" \
 L"  -d recurse into subdirectories\r\n" \
 L"  -h include hidden files\r\n" \
+L"  -p with -b write a patch to turn the destination into the source\r\n" \
 L"  -q don't list files compared, just differences\r\n" \
 L"  -s include system files\r\n"
 
@@ -81,6 +96,7 @@ int wmain(int argc, WCHAR* argv[])
 
 DWORD WINAPI rhsmain(LPVOID unused)
 { int numarg;
+  WCHAR* p;
   WCHAR source[LEN_FILENAME+1], dest[LEN_FILENAME+1];
 
 // Check the arguments
@@ -94,7 +110,9 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
 // Process flags
 
-  g_ASCII = g_Recurse = g_Hidden = g_Quiet = g_System = FALSE;
+  g_ASCII = g_Blocks = g_Recurse = g_Hidden = g_Quiet = g_System = FALSE;
+  g_BlockSize = DEF_BLOCKSIZE;
+  lstrcpy(g_PatchFile, L"");
 
   for (numarg = 1; numarg < RhsIO.m_argc; numarg++)
   { if (RhsIO.m_argv[numarg][0] != '-')
@@ -106,6 +124,28 @@ DWORD WINAPI rhsmain(LPVOID unused)
         g_ASCII = TRUE;
         break;
 
+// The block size can have a K or M suffix
+
+      case 'b':
+      case 'B':
+        g_Blocks = TRUE;
+        if (RhsIO.m_argv[numarg][2] != '\0')
+        { g_BlockSize = wcstoul(RhsIO.m_argv[numarg] + 2, &p, 10);
+
+// Check the size before applying the suffix so it can't overflow
+
+          if (*p == 'k' || *p == 'K')
+            g_BlockSize = g_BlockSize > MAX_BLOCKSIZE/0x400 ? MAX_BLOCKSIZE + 1 : g_BlockSize*0x400;
+          else if (*p == 'm' || *p == 'M')
+            g_BlockSize = g_BlockSize > MAX_BLOCKSIZE/0x100000 ? MAX_BLOCKSIZE + 1 : g_BlockSize*0x100000;
+
+          if (g_BlockSize < MIN_BLOCKSIZE || g_BlockSize > MAX_BLOCKSIZE)
+          { RhsIO.errprintf(L"The block size must be between 4K and 64M\r\n");
+            return 2;
+          }
+        }
+        break;
+
       case 'd':
       case 'D':
         g_Recurse = TRUE;
@@ -116,6 +156,15 @@ DWORD WINAPI rhsmain(LPVOID unused)
         g_Hidden = TRUE;
         break;
 
+      case 'p':
+      case 'P':
+        lstrcpyn(g_PatchFile, RhsIO.m_argv[numarg] + 2, LEN_FILENAME);
+        if (lstrlen(g_PatchFile) == 0)
+        { RhsIO.errprintf(L"The -p flag must be followed by a file name e.g. -pchanges.pat\r\n");
+          return 2;
+        }
+        break;
+
       case 'q':
       case 'Q':
         g_Quiet = TRUE;
@@ -146,6 +195,26 @@ DWORD WINAPI rhsmain(LPVOID unused)
   lstrcpy(source, RhsIO.m_argv[numarg]);
   lstrcpy(dest, RhsIO.m_argv[numarg+1]);
 
+// Check the flags make sense together. A patch is for a single file so
+// it can't be used with wildcards or -d.
+
+  if (g_ASCII && g_Blocks)
+  { RhsIO.errprintf(L"The -a and -b flags cannot be used together\r\n");
+    return 2;
+  }
+
+  if (lstrlen(g_PatchFile) > 0)
+  { if (!g_Blocks)
+    { RhsIO.errprintf(L"The -p flag can only be used with -b\r\n");
+      return 2;
+    }
+
+    if (g_Recurse || wcspbrk(source, L"*?"))
+    { RhsIO.errprintf(L"The -p flag can only be used when comparing a single file\r\n");
+      return 2;
+    }
+  }
+
 // Start searching
 
   g_NumCompared = g_NumDiffs = 0;
@@ -294,6 +363,8 @@ BOOL FileCompSub(WCHAR* Source, WCHAR* Dest)
 
       if (g_ASCII)
         CompareFileASCII(srcfile, destfile);
+      else if (g_Blocks)
+        CompareFileBlocks(srcfile, destfile);
       else
         CompareFileBinary(srcfile, destfile);
 
@@ -429,15 +500,41 @@ BOOL CompareFileBinary(const WCHAR* SrcFile, const WCHAR* DestFile)
 
 
 // *********************************************************************
-// CompareFileASCII
-// ----------------
+// CompareFileBlocks
+// -----------------
+// Compare the files in blocks of g_BlockSize and report the ranges of
+// blocks that differ and the number of bytes changed. Both files are
+// read with overlapped I/O into a pair of buffers each, so the next
+// block of both files is being read while the current one is compared.
+// If g_PatchFile is set write a patch that converts the destination
+// file into the source file.
 // *********************************************************************
 
-BOOL CompareFileASCII(const WCHAR* SrcFile, const WCHAR* DestFile)
-{ int lines_read, err;
-  FILE* srcfile;
-  FILE* destfile;
-  char srcbuf[LEN_COMPBUF], destbuf[LEN_COMPBUF];
+#define PATCH_MERGEGAP 32
+
+typedef struct
+{ HANDLE h;
+  UINT64 size;
+  BYTE* buf[2];
+  DWORD len[2];
+  BOOL pending[2];
+  OVERLAPPED ov[2];
+} BLOCKSTREAM;
+
+BOOL OpenBlockStream(BLOCKSTREAM* Stream, const WCHAR* FileName);
+void CloseBlockStream(BLOCKSTREAM* Stream);
+BOOL StartBlockRead(BLOCKSTREAM* Stream, UINT64 Block, int Slot);
+BOOL FinishBlockRead(BLOCKSTREAM* Stream, int Slot);
+BOOL CompareBlock(const BYTE* Src, DWORD SrcLen, const BYTE* Dest, DWORD DestLen, UINT64 Offset, CRhsPatchFile* Patch, DWORD* Changed);
+void PrintBlockRange(const WCHAR* SrcFile, const WCHAR* DestFile, UINT64 First, UINT64 Last, BOOL* Header);
+
+BOOL CompareFileBlocks(const WCHAR* SrcFile, const WCHAR* DestFile)
+{ int slot;
+  BOOL header, error;
+  UINT64 block, numblocks, runstart, changedblocks, changedbytes;
+  DWORD changed;
+  BLOCKSTREAM src, dest;
+  CRhsPatchFile patch;
 
 // If required print the operation details
 
@@ -446,87 +543,432 @@ BOOL CompareFileASCII(const WCHAR* SrcFile, const WCHAR* DestFile)
 
 // Open the source file
 
-  if ((err = _wfopen_s(&srcfile, SrcFile, L"r")) != 0)
-  { RhsIO.errprintf(L"Cannot open source \"%s\": \"%i\"\r\n\r\n", SrcFile, err);
+  if (!OpenBlockStream(&src, SrcFile))
+  { RhsIO.errprintf(L"Cannot open source \"%s\": \"%s\"\r\n\r\n", SrcFile, GetLastErrorMessage());
+    CloseBlockStream(&src);
     return TRUE;
   }
 
 // Check that the destination file exists
 
   if (GetFileAttributes(DestFile) == (DWORD) -1)
-  { RhsIO.printf(L"Destination file \"%s\" does not exist\r\n\r\n", SrcFile);
-    CloseHandle(srcfile);
+  { RhsIO.printf(L"Destination file \"%s\" does not exist\r\n\r\n", DestFile);
+    CloseBlockStream(&src);
     g_NumDiffs++;
     return TRUE;
   }
 
 // Open the destination file
 
-  if (_wfopen_s(&destfile, DestFile, L"r") != 0)
+  if (!OpenBlockStream(&dest, DestFile))
   { RhsIO.errprintf(L"Cannot open destination \"%s\": \"%s\"\r\n\r\n", DestFile, GetLastErrorMessage());
-    fclose(srcfile);
+    CloseBlockStream(&src);
+    CloseBlockStream(&dest);
     g_NumDiffs++;
     return TRUE;
   }
 
-// Do the comparison
+// If required create the patch file
 
-  lines_read = 0;
+  if (lstrlen(g_PatchFile) > 0)
+  { if (!patch.Create(g_PatchFile, dest.size, src.size, g_BlockSize))
+    { RhsIO.errprintf(L"%s\r\n\r\n", patch.LastError());
+      CloseBlockStream(&src);
+      CloseBlockStream(&dest);
+      return TRUE;
+    }
+  }
 
-  for (;;)
-  {
+// Start reading the first block of both files
 
-// Check if we've reached the end of either file
+  numblocks = src.size > dest.size ? src.size : dest.size;
+  numblocks = (numblocks + g_BlockSize - 1)/g_BlockSize;
 
-    if (feof(srcfile) && feof(destfile))
-    { if (!g_Quiet)
-        RhsIO.printf(L"Files are identical\r\n\r\n");
-      break;
+  header = error = FALSE;
+  changedblocks = changedbytes = 0;
+  runstart = (UINT64) -1;
+
+  if (numblocks > 0)
+  { if (!StartBlockRead(&src, 0, 0) || !StartBlockRead(&dest, 0, 0))
+    { RhsIO.errprintf(L"Error reading files \"%s\" and \"%s\": \"%s\"\r\n", SrcFile, DestFile, GetLastErrorMessage());
+      numblocks = 0;
+      error = TRUE;
     }
+  }
 
-    if (feof(srcfile) && !feof(destfile))
-    { RhsIO.printf(L"Destination file \"%s\" is longer\r\n\r\n", DestFile);
-      g_NumDiffs++;
+// Do the comparison
+
+  for (block = 0; block < numblocks; block++)
+  { slot = (int) (block & 1);
+
+    if (!FinishBlockRead(&src, slot))
+    { RhsIO.errprintf(L"Error reading source \"%s\": \"%s\"\r\n", SrcFile, GetLastErrorMessage());
+      error = TRUE;
       break;
     }
 
-    if (!feof(srcfile) && feof(destfile))
-    { RhsIO.printf(L"Source file \"%s\" is longer\r\n\r\n", SrcFile);
-      g_NumDiffs++;
+    if (!FinishBlockRead(&dest, slot))
+    { RhsIO.errprintf(L"Error reading destination \"%s\": \"%s\"\r\n", DestFile, GetLastErrorMessage());
+      error = TRUE;
       break;
     }
 
-// Read the next lines from the files
+// Get the next blocks on their way while we compare these ones
 
-    if (!fgets(srcbuf, LEN_COMPBUF, srcfile) && !feof(srcfile))
-    { RhsIO.errprintf(L"Error reading source \"%s\": \"%s\"\r\n\r\n", SrcFile, GetLastErrorMessage());
+    if (block + 1 < numblocks)
+    { if (!StartBlockRead(&src, block + 1, 1 - slot) || !StartBlockRead(&dest, block + 1, 1 - slot))
+      { RhsIO.errprintf(L"Error reading files \"%s\" and \"%s\": \"%s\"\r\n", SrcFile, DestFile, GetLastErrorMessage());
+        error = TRUE;
+        break;
+      }
+    }
+
+// Compare the blocks and keep track of runs of changed blocks
+
+    if (!CompareBlock(src.buf[slot], src.len[slot], dest.buf[slot], dest.len[slot], block*g_BlockSize, lstrlen(g_PatchFile) > 0 ? &patch : NULL, &changed))
+    { RhsIO.errprintf(L"%s\r\n", patch.LastError());
+      error = TRUE;
       break;
     }
 
-    if (!fgets(destbuf, LEN_COMPBUF, destfile) && !feof(destfile))
-    { RhsIO.errprintf(L"Error reading destination \"%s\": \"%s\"\r\n\r\n", DestFile, GetLastErrorMessage());
+    if (changed > 0)
+    { changedblocks++;
+      changedbytes += changed;
+      if (runstart == (UINT64) -1)
+        runstart = block;
+    }
+    else if (runstart != (UINT64) -1)
+    { PrintBlockRange(SrcFile, DestFile, runstart, block - 1, &header);
+      runstart = (UINT64) -1;
+    }
+
+    if (RhsIO.GetAbort())
+    { error = TRUE;
       break;
     }
+  }
 
-    lines_read = lines_read + 1;
+  if (runstart != (UINT64) -1)
+    PrintBlockRange(SrcFile, DestFile, runstart, block - 1, &header);
 
-// Compare the data read
+// Print the summary
 
-    if (lstrcmpA(srcbuf, destbuf) != 0)
-    { if (g_Quiet)
-        RhsIO.printf(L"Files \"%s\" and \"%s\" are different at line %d\r\n\r\n", SrcFile, DestFile, lines_read);
-      else
-        RhsIO.printf(L"Files are different at line %d\r\n\r\n", lines_read);
+  if (changedblocks == 0)
+  { if (!g_Quiet && !error)
+      RhsIO.printf(L"Files are identical\r\n");
+  }
+  else
+  { RhsIO.printf(L"%.0f of %.0f blocks differ, %.0f bytes changed\r\n", (double) changedblocks, (double) numblocks, (double) changedbytes);
+    g_NumDiffs++;
+  }
 
-      g_NumDiffs++;
-      break;
+  if (lstrlen(g_PatchFile) > 0 && !error)
+  { if (patch.Close())
+      RhsIO.printf(L"Patch written to \"%s\": %.0f ranges, %.0f bytes\r\n", g_PatchFile, (double) patch.NumRanges(), (double) patch.NumBytes());
+    else
+      RhsIO.errprintf(L"%s\r\n", patch.LastError());
+  }
+
+  RhsIO.printf(L"\r\n");
+
+// Close the files. This waits for any reads still in progress.
+
+  CloseBlockStream(&src);
+  CloseBlockStream(&dest);
+
+// If something went wrong the patch is incomplete so get rid of it
+
+  if (lstrlen(g_PatchFile) > 0 && error)
+  { patch.Close();
+    DeleteFile(g_PatchFile);
+  }
+
+// Return indicating success
+
+  return TRUE;
+}
+
+
+// *********************************************************************
+// OpenBlockStream
+// ---------------
+// *********************************************************************
+
+BOOL OpenBlockStream(BLOCKSTREAM* Stream, const WCHAR* FileName)
+{ int i;
+  LARGE_INTEGER li;
+
+  ZeroMemory(Stream, sizeof(BLOCKSTREAM));
+
+  Stream->h = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (Stream->h == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  if (!GetFileSizeEx(Stream->h, &li))
+    return FALSE;
+  Stream->size = (UINT64) li.QuadPart;
+
+  for (i = 0; i < 2; i++)
+  { Stream->buf[i] = (BYTE*) malloc(g_BlockSize);
+    Stream->ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (!Stream->buf[i] || !Stream->ov[i].hEvent)
+    { SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+      return FALSE;
     }
   }
 
-// Close the files
+  return TRUE;
+}
+
+
+// *********************************************************************
+// CloseBlockStream
+// ----------------
+// *********************************************************************
+
+void CloseBlockStream(BLOCKSTREAM* Stream)
+{ int i;
+
+  for (i = 0; i < 2; i++)
+  { if (Stream->pending[i])
+    { CancelIo(Stream->h);
+      FinishBlockRead(Stream, i);
+    }
+
+    if (Stream->ov[i].hEvent)
+      CloseHandle(Stream->ov[i].hEvent);
+
+    if (Stream->buf[i])
+      free(Stream->buf[i]);
+  }
+
+  if (Stream->h != INVALID_HANDLE_VALUE && Stream->h != NULL)
+    CloseHandle(Stream->h);
+
+  ZeroMemory(Stream, sizeof(BLOCKSTREAM));
+}
+
+
+// *********************************************************************
+// StartBlockRead
+// --------------
+// Start an overlapped read of the block into the buffer for Slot. If
+// the block is past the end of the file there is nothing to read and
+// the buffer length is set to zero.
+// *********************************************************************
+
+BOOL StartBlockRead(BLOCKSTREAM* Stream, UINT64 Block, int Slot)
+{ UINT64 offset;
+  HANDLE event;
+
+  Stream->len[Slot] = 0;
+  Stream->pending[Slot] = FALSE;
+
+  offset = Block*g_BlockSize;
+  if (offset >= Stream->size)
+    return TRUE;
+
+  Stream->len[Slot] = Stream->size - offset < g_BlockSize ? (DWORD) (Stream->size - offset) : g_BlockSize;
+
+  event = Stream->ov[Slot].hEvent;
+  ZeroMemory(&Stream->ov[Slot], sizeof(OVERLAPPED));
+  Stream->ov[Slot].hEvent = event;
+  Stream->ov[Slot].Offset = (DWORD) offset;
+  Stream->ov[Slot].OffsetHigh = (DWORD) (offset >> 32);
+  ResetEvent(event);
+
+  if (!ReadFile(Stream->h, Stream->buf[Slot], Stream->len[Slot], NULL, &Stream->ov[Slot]))
+    if (GetLastError() != ERROR_IO_PENDING)
+      return FALSE;
+
+  Stream->pending[Slot] = TRUE;
+
+  return TRUE;
+}
 
-  fclose(srcfile);
-  fclose(destfile);
+
+// *********************************************************************
+// FinishBlockRead
+// ---------------
+// Wait for the read into Slot to complete
+// *********************************************************************
+
+BOOL FinishBlockRead(BLOCKSTREAM* Stream, int Slot)
+{ DWORD numread;
+
+  if (!Stream->pending[Slot])
+    return TRUE;
+
+  Stream->pending[Slot] = FALSE;
+
+  if (!GetOverlappedResult(Stream->h, &Stream->ov[Slot], &numread, TRUE))
+    return FALSE;
+
+// The file shouldn't change size while we're reading it, but if it does
+// just compare what we got.
+
+  Stream->len[Slot] = numread;
+
+  return TRUE;
+}
+
+
+// *********************************************************************
+// CompareBlock
+// ------------
+// Compare one block and set Changed to the number of bytes that differ.
+// If the files are different lengths the bytes past the end of the
+// shorter file count as changed. If Patch is not NULL add the changed
+// ranges to it. Differences separated by only a few bytes are merged
+// into one range as that makes the patch smaller. Returns FALSE if the
+// patch can't be written.
+// *********************************************************************
+
+BOOL CompareBlock(const BYTE* Src, DWORD SrcLen, const BYTE* Dest, DWORD DestLen, UINT64 Offset, CRhsPatchFile* Patch, DWORD* Changed)
+{ DWORD common, changed, i, start, end;
+
+  common = SrcLen < DestLen ? SrcLen : DestLen;
+  *Changed = 0;
+
+// Usually the blocks are the same so check that first
+
+  if (SrcLen == DestLen && memcmp(Src, Dest, common) == 0)
+    return TRUE;
+
+// Find the runs of differing bytes
+
+  changed = 0;
+  i = 0;
+
+  while (i < common)
+  { if (Src[i] == Dest[i])
+    { i++;
+      continue;
+    }
+
+    start = i;
+    end = i + 1;
+    changed++;
+
+    for (i = end; i < common && i - end < PATCH_MERGEGAP; i++)
+    { if (Src[i] != Dest[i])
+      { end = i + 1;
+        changed++;
+      }
+    }
+
+    if (Patch)
+      if (!Patch->AddRange(Offset + start, Src + start, end - start))
+        return FALSE;
+
+    i = end;
+  }
+
+// If the source is longer the rest of it is new data. If the
+// destination is longer the patch truncates it.
+
+  if (SrcLen > common)
+  { changed += SrcLen - common;
+    if (Patch)
+      if (!Patch->AddRange(Offset + common, Src + common, SrcLen - common))
+        return FALSE;
+  }
+
+  if (DestLen > common)
+    changed += DestLen - common;
+
+  *Changed = changed;
+  return TRUE;
+}
+
+
+// *********************************************************************
+// PrintBlockRange
+// ---------------
+// *********************************************************************
+
+void PrintBlockRange(const WCHAR* SrcFile, const WCHAR* DestFile, UINT64 First, UINT64 Last, BOOL* Header)
+{
+
+// In quiet mode the file names haven't been printed yet
+
+  if (g_Quiet && !*Header)
+    RhsIO.printf(L"Files \"%s\" and \"%s\" are different\r\n", SrcFile, DestFile);
+  *Header = TRUE;
+
+  if (First == Last)
+    RhsIO.printf(L"  Block %.0f differs: offset %.0f\r\n", (double) First, (double) (First*g_BlockSize));
+  else
+    RhsIO.printf(L"  Blocks %.0f to %.0f differ: offset %.0f, length %.0f\r\n", (double) First, (double) Last, (double) (First*g_BlockSize), (double) ((Last - First + 1)*g_BlockSize));
+}
+
+
+// *********************************************************************
+// CompareFileASCII
+// ----------------
+// Compare the files line by line and list the differences in unified
+// diff format, i.e. blocks of changed lines with a few lines of context
+// round them.
+// *********************************************************************
+
+#define DIFF_CONTEXT 3
+#define LEN_DIFFLINE 0x1000
+
+BOOL CompareFileASCII(const WCHAR* SrcFile, const WCHAR* DestFile)
+{ DWORD first, last, srcend;
+  const LINEDIFFCHANGE* change;
+  CLineDiff diff;
+
+// If required print the operation details
+
+  if (!g_Quiet)
+    RhsIO.printf(L"Comparing files \"%s\" and \"%s\"\r\n", SrcFile, DestFile);
+
+// Check that the destination file exists
+
+  if (GetFileAttributes(DestFile) == (DWORD) -1)
+  { RhsIO.printf(L"Destination file \"%s\" does not exist\r\n\r\n", DestFile);
+    g_NumDiffs++;
+    return TRUE;
+  }
+
+// Do the comparison
+
+  if (!diff.Compare(SrcFile, DestFile))
+  { RhsIO.errprintf(L"%s\r\n\r\n", diff.LastError());
+    return TRUE;
+  }
+
+  if (diff.NumChanges() == 0)
+  { if (!g_Quiet)
+      RhsIO.printf(L"Files are identical\r\n\r\n");
+    return TRUE;
+  }
+
+  g_NumDiffs++;
+
+// Print the differences
+
+  RhsIO.printf(L"--- %s\r\n+++ %s\r\n", SrcFile, DestFile);
+
+  for (first = 0; first < diff.NumChanges(); first = last + 1)
+  { if (RhsIO.GetAbort())
+      break;
+
+// Changes close enough for their context to overlap go in the same hunk
+
+    for (last = first; last + 1 < diff.NumChanges(); last++)
+    { change = diff.Change(last);
+      srcend = change->Src + change->SrcLen;
+      if (diff.Change(last + 1)->Src - srcend > 2*DIFF_CONTEXT)
+        break;
+    }
+
+    PrintDiffHunk(&diff, first, last);
+  }
+
+  RhsIO.printf(L"\r\n");
 
 // Return indicating success
 
@@ -534,3 +976,76 @@ BOOL CompareFileASCII(const WCHAR* SrcFile, const WCHAR* DestFile)
 }
 
 
+// *********************************************************************
+// PrintDiffHunk
+// -------------
+// Print the changes from First to Last inclusive as a single hunk
+// *********************************************************************
+
+void PrintDiffHunk(CLineDiff* Diff, DWORD First, DWORD Last)
+{ DWORD c, s, d, srcstart, srcend, deststart, destend;
+  const LINEDIFFCHANGE* first;
+  const LINEDIFFCHANGE* last;
+  const LINEDIFFCHANGE* change;
+
+  first = Diff->Change(First);
+  last = Diff->Change(Last);
+
+// Work out the range of lines including the context. The lines outside
+// the changes are the same in both files so the context is the same
+// length on both sides.
+
+  srcstart = first->Src > DIFF_CONTEXT ? first->Src - DIFF_CONTEXT : 0;
+  deststart = first->Dest - (first->Src - srcstart);
+
+  srcend = last->Src + last->SrcLen + DIFF_CONTEXT;
+  if (srcend > Diff->NumLines(LINEDIFF_SRC))
+    srcend = Diff->NumLines(LINEDIFF_SRC);
+  destend = last->Dest + last->DestLen + (srcend - (last->Src + last->SrcLen));
+
+// The hunk header uses one based line numbers, except that an empty
+// range gives the line before it.
+
+  RhsIO.printf(L"@@ -%u,%u +%u,%u @@\r\n",
+               srcend > srcstart ? srcstart + 1 : srcstart, srcend - srcstart,
+               destend > deststart ? deststart + 1 : deststart, destend - deststart);
+
+// Print the lines
+
+  s = srcstart;
+  d = deststart;
+
+  for (c = First; c <= Last; c++)
+  { change = Diff->Change(c);
+
+    for (; s < change->Src; s++, d++)
+      PrintDiffLine(Diff, LINEDIFF_SRC, s, ' ');
+
+    for (; s < change->Src + change->SrcLen; s++)
+      PrintDiffLine(Diff, LINEDIFF_SRC, s, '-');
+
+    for (; d < change->Dest + change->DestLen; d++)
+      PrintDiffLine(Diff, LINEDIFF_DEST, d, '+');
+  }
+
+  for (; s < srcend; s++)
+    PrintDiffLine(Diff, LINEDIFF_SRC, s, ' ');
+}
+
+
+// *********************************************************************
+// PrintDiffLine
+// -------------
+// *********************************************************************
+
+void PrintDiffLine(CLineDiff* Diff, int File, DWORD Line, WCHAR Prefix)
+{ char line[LEN_DIFFLINE];
+  WCHAR wline[LEN_DIFFLINE];
+
+  Diff->GetLine(File, Line, line, LEN_DIFFLINE);
+  MultiByteToWideChar(CP_ACP, 0, line, -1, wline, LEN_DIFFLINE);
+
+  RhsIO.printf(L"%c%s\r\n", Prefix, wline);
+}
+
+
@@ -0,0 +1,180 @@
+// *********************************************************************
+// CFindOutput.cpp
+// ===============
+// *********************************************************************
+
+#include <windows.h>
+#include <stdlib.h>
+#include <Misc/CRhsFindFile.h>
+#include <Misc/Utils.h>
+#include "CFindOutput.h"
+
+
+//**********************************************************************
+// CFindOutput
+// -----------
+//**********************************************************************
+
+CFindOutput::CFindOutput()
+{
+  m_File = INVALID_HANDLE_VALUE;
+  m_Format = 0;
+
+  m_Buf = NULL;
+  m_Len = 0;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CFindOutput::~CFindOutput()
+{
+  if (m_Buf)
+    free(m_Buf);
+}
+
+
+//**********************************************************************
+// CFindOutput::Open
+// -----------------
+//**********************************************************************
+
+BOOL CFindOutput::Open(HANDLE File, int Format)
+{
+  if (File == NULL || File == INVALID_HANDLE_VALUE)
+  { lstrcpy(m_LastError, L"There is no output to write to");
+    return FALSE;
+  }
+
+  m_Buf = (BYTE*) malloc(FINDOUT_BUFSIZE);
+  if (!m_Buf)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  m_File = File;
+  m_Format = Format;
+  m_Len = 0;
+
+  if (m_Format == FINDOUT_BINARY)
+  { CopyMemory(m_Buf, FINDRECORD_MAGIC, 4);
+    m_Len = 4;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindOutput::Write
+// ------------------
+// Write the file FF has found. Path is the directory and Name the file
+// name.
+//**********************************************************************
+
+BOOL CFindOutput::Write(const WCHAR* Path, const WCHAR* Name, CRhsFindFile* FF)
+{ int pathlen, namelen;
+  DWORD low, high;
+  FILETIME ft;
+  FINDRECORD r;
+
+  pathlen = lstrlen(Path);
+  namelen = lstrlen(Name);
+
+// A path followed by a null. A UTF-16 character is at most 3 bytes in
+// UTF-8.
+
+  if (m_Format == FINDOUT_NUL)
+  { if (!Reserve((pathlen + namelen + 1)*3 + 1))
+      return FALSE;
+
+    WriteUTF8(Path, pathlen);
+    m_Buf[m_Len++] = '\\';
+    WriteUTF8(Name, namelen);
+    m_Buf[m_Len++] = '\0';
+
+    return TRUE;
+  }
+
+// A FINDRECORD followed by the path
+
+  if (pathlen + namelen + 1 > 0xFFFF)
+    return TRUE;
+
+  if (!Reserve(sizeof(FINDRECORD) + (pathlen + namelen + 1)*sizeof(WCHAR)))
+    return FALSE;
+
+  FF->FileSize(&low, &high);
+  r.Size = ((UINT64) high << 32) | low;
+
+  ft = FF->CreationTime();
+  r.CreationTime = ((UINT64) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  ft = FF->LastAccessTime();
+  r.LastAccessTime = ((UINT64) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  ft = FF->LastWriteTime();
+  r.LastWriteTime = ((UINT64) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+  r.Attributes = FF->Attributes();
+  r.PathLen = (WORD) (pathlen + namelen + 1);
+
+  CopyMemory(m_Buf + m_Len, &r, sizeof(FINDRECORD));
+  m_Len += sizeof(FINDRECORD);
+
+  CopyMemory(m_Buf + m_Len, Path, pathlen*sizeof(WCHAR));
+  m_Len += pathlen*sizeof(WCHAR);
+  CopyMemory(m_Buf + m_Len, L"\\", sizeof(WCHAR));
+  m_Len += sizeof(WCHAR);
+  CopyMemory(m_Buf + m_Len, Name, namelen*sizeof(WCHAR));
+  m_Len += namelen*sizeof(WCHAR);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindOutput::Flush
+// ------------------
+//**********************************************************************
+
+BOOL CFindOutput::Flush(void)
+{ DWORD written;
+
+  if (m_Len == 0)
+    return TRUE;
+
+  if (!WriteFile(m_File, m_Buf, m_Len, &written, NULL) || written != (DWORD) m_Len)
+  { lstrcpyn(m_LastError, GetLastErrorMessage(), 256);
+    m_Len = 0;
+    return FALSE;
+  }
+
+  m_Len = 0;
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindOutput::Reserve
+// --------------------
+// Make sure there is room for Bytes more in the buffer
+//**********************************************************************
+
+BOOL CFindOutput::Reserve(int Bytes)
+{
+  if (m_Len + Bytes <= FINDOUT_BUFSIZE)
+    return TRUE;
+
+  return Flush();
+}
+
+
+//**********************************************************************
+// CFindOutput::WriteUTF8
+// ----------------------
+// The caller has reserved the space
+//**********************************************************************
+
+void CFindOutput::WriteUTF8(const WCHAR* s, int Len)
+{
+  if (Len > 0)
+    m_Len += WideCharToMultiByte(CP_UTF8, 0, s, Len, (char*) m_Buf + m_Len, FINDOUT_BUFSIZE - m_Len, NULL, NULL);
+}
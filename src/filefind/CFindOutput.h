@@ -0,0 +1,79 @@
+// *********************************************************************
+// CFindOutput.h
+// =============
+// *********************************************************************
+
+#ifndef _INC_CFINDOUTPUT
+#define _INC_CFINDOUTPUT
+
+
+//**********************************************************************
+// FINDRECORD
+// ----------
+// The record written for each file by -b. The times are FILETIMEs and
+// the record is followed by PathLen UTF-16 characters with no null.
+// The stream starts with the four bytes FINDRECORD_MAGIC.
+//**********************************************************************
+
+#define FINDRECORD_MAGIC "FFB1"
+
+#pragma pack(push, 1)
+
+typedef struct
+{ UINT64 Size;
+  UINT64 CreationTime, LastAccessTime, LastWriteTime;
+  DWORD Attributes;
+  WORD PathLen;
+
+} FINDRECORD;
+
+#pragma pack(pop)
+
+
+//**********************************************************************
+// CFindOutput
+// -----------
+// Class to write the files found straight to a file or pipe for
+// another program to read, either as UTF-8 paths each followed by a
+// null, or as FINDRECORDs. The output is collected in a large buffer
+// so there is one WriteFile per megabyte and no formatting.
+//**********************************************************************
+
+#define FINDOUT_NUL    1
+#define FINDOUT_BINARY 2
+
+#define FINDOUT_BUFSIZE 0x100000
+
+class CFindOutput
+{
+  public:
+    CFindOutput();
+    ~CFindOutput();
+
+    BOOL Open(HANDLE File, int Format);
+    BOOL Write(const WCHAR* Path, const WCHAR* Name, CRhsFindFile* FF);
+    BOOL Flush(void);
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL Reserve(int Bytes);
+    void WriteUTF8(const WCHAR* s, int Len);
+
+  private:
+    HANDLE m_File;
+    int m_Format;
+
+    BYTE* m_Buf;
+    int m_Len;
+
+    WCHAR m_LastError[256];
+};
+
+
+//**********************************************************************
+// End of CFindOutput
+// ------------------
+//**********************************************************************
+
+#endif // _INC_CFINDOUTPUT
@@ -0,0 +1,472 @@
+// *********************************************************************
+// CFindPredicate.cpp
+// ==================
+// *********************************************************************
+
+#include <windows.h>
+#include <Misc/CRhsFindFile.h>
+#include <Misc/CRhsDate.h>
+#include <Misc/CRhsWildCardSet.h>
+#include "CFindPredicate.h"
+
+
+//**********************************************************************
+// Local definitions
+// -----------------
+//**********************************************************************
+
+// Times are FILETIMEs, i.e. in units of 100ns
+
+#define TICKS_HOUR ((UINT64) 36000000000)
+#define TICKS_DAY  (TICKS_HOUR*24)
+
+#define FIND_NODEPTH 0x7FFFFFFF
+
+#define LEN_FINDTERM 256
+
+// The attribute letters used by attr=
+
+typedef struct
+{ WCHAR Letter;
+  DWORD Attribute;
+
+} FINDATTRIB;
+
+static const FINDATTRIB FINDATTRIBS[] =
+{ { 'a', FILE_ATTRIBUTE_ARCHIVE },
+  { 'c', FILE_ATTRIBUTE_COMPRESSED },
+  { 'd', FILE_ATTRIBUTE_DIRECTORY },
+  { 'e', FILE_ATTRIBUTE_ENCRYPTED },
+  { 'h', FILE_ATTRIBUTE_HIDDEN },
+  { 'l', FILE_ATTRIBUTE_REPARSE_POINT },
+  { 'o', FILE_ATTRIBUTE_OFFLINE },
+  { 'p', FILE_ATTRIBUTE_SPARSE_FILE },
+  { 'r', FILE_ATTRIBUTE_READONLY },
+  { 's', FILE_ATTRIBUTE_SYSTEM },
+  { 't', FILE_ATTRIBUTE_TEMPORARY },
+  { 0, 0 }
+};
+
+
+//**********************************************************************
+// CFindPredicate
+// --------------
+//**********************************************************************
+
+CFindPredicate::CFindPredicate()
+{ FILETIME ft;
+
+  m_NumTerms = 0;
+  m_NumNames = 0;
+  m_MaxDepth = FIND_NODEPTH;
+
+  GetSystemTimeAsFileTime(&ft);
+  m_Now = ((UINT64) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CFindPredicate::~CFindPredicate()
+{
+}
+
+
+//**********************************************************************
+// CFindPredicate::Parse
+// ---------------------
+// Add the tests in Expr, which are separated by commas. A file has to
+// pass all the tests, including those from earlier calls.
+//**********************************************************************
+
+BOOL CFindPredicate::Parse(const WCHAR* Expr)
+{ int i, j;
+  WCHAR term[LEN_FINDTERM];
+
+  for (i = 0; Expr[i] != '\0'; )
+  { for (j = 0; Expr[i] != ',' && Expr[i] != '\0'; i++)
+      if (j < LEN_FINDTERM - 1)
+        term[j++] = Expr[i];
+    term[j] = '\0';
+
+    if (Expr[i] == ',')
+      i++;
+
+    if (j > 0)
+      if (!ParseTerm(term))
+        return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindPredicate::Match
+// ---------------------
+// Test the file FF has just found. Name is its name and Depth is the
+// number of directories below the starting directory it is.
+//**********************************************************************
+
+BOOL CFindPredicate::Match(CRhsFindFile* FF, const WCHAR* Name, int Depth)
+{ int i;
+  BOOL pass;
+  UINT64 value;
+  DWORD low, high;
+  FILETIME ft;
+  FINDTERM* t;
+
+  for (i = 0; i < m_NumTerms; i++)
+  { t = m_Term + i;
+
+    switch (t->Field)
+    { case FIND_DEPTH:
+        pass = Compare((UINT64) Depth, t->Op, t->Value);
+        break;
+
+// attr= needs all the attributes and attr!= needs none of them
+
+      case FIND_ATTRIB:
+        value = FF->Attributes() & t->Value;
+        pass = t->Op == FIND_EQ ? value == t->Value : value == 0;
+        break;
+
+      case FIND_SIZE:
+        FF->FileSize(&low, &high);
+        pass = Compare(((UINT64) high << 32) | low, t->Op, t->Value);
+        break;
+
+      case FIND_MTIME:
+      case FIND_CTIME:
+      case FIND_ATIME:
+        if (t->Field == FIND_MTIME)
+          ft = FF->LastWriteTime();
+        else if (t->Field == FIND_CTIME)
+          ft = FF->CreationTime();
+        else
+          ft = FF->LastAccessTime();
+
+        pass = Compare(((UINT64) ft.dwHighDateTime << 32) | ft.dwLowDateTime, t->Op, t->Value);
+        break;
+
+      case FIND_NAME:
+        pass = m_Name[t->Value].Match(Name);
+        if (t->Op == FIND_NE)
+          pass = !pass;
+        break;
+
+      default:
+        pass = FALSE;
+        break;
+    }
+
+    if (!pass)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindPredicate::ParseTerm
+// -------------------------
+// A test is <field><op><value> where op is one of < <= = != >= >
+//**********************************************************************
+
+BOOL CFindPredicate::ParseTerm(const WCHAR* Term)
+{ int i, oplen;
+  FINDTERM t;
+  const WCHAR* value;
+  WCHAR field[LEN_FINDTERM];
+
+  if (m_NumTerms >= MAX_FINDTERMS)
+  { wsprintf(m_LastError, L"There are more than %i tests", MAX_FINDTERMS);
+    return FALSE;
+  }
+
+// Split the test into the field, the operator and the value
+
+  for (i = 0; Term[i] != '\0' && Term[i] != '<' && Term[i] != '>' && Term[i] != '=' && Term[i] != '!'; i++)
+    field[i] = Term[i];
+  field[i] = '\0';
+
+  oplen = 1;
+
+  if (Term[i] == '<' && Term[i+1] == '=')
+  { t.Op = FIND_LE;
+    oplen = 2;
+  }
+  else if (Term[i] == '>' && Term[i+1] == '=')
+  { t.Op = FIND_GE;
+    oplen = 2;
+  }
+  else if (Term[i] == '!' && Term[i+1] == '=')
+  { t.Op = FIND_NE;
+    oplen = 2;
+  }
+  else if (Term[i] == '<')
+  { t.Op = FIND_LT;
+  }
+  else if (Term[i] == '>')
+  { t.Op = FIND_GT;
+  }
+  else if (Term[i] == '=')
+  { t.Op = FIND_EQ;
+  }
+  else
+  { wsprintf(m_LastError, L"The test \"%.200s\" has no comparison", Term);
+    return FALSE;
+  }
+
+  value = Term + i + oplen;
+
+  if (i == 0 || *value == '\0')
+  { wsprintf(m_LastError, L"The test \"%.200s\" is not valid", Term);
+    return FALSE;
+  }
+
+// Depth is free to test, and limits how far down the search goes
+
+  if (lstrcmpi(field, L"depth") == 0)
+  { for (i = 0; value[i] >= '0' && value[i] <= '9'; i++);
+    if (value[i] != '\0')
+    { wsprintf(m_LastError, L"The depth \"%.200s\" is not valid", value);
+      return FALSE;
+    }
+
+    t.Field = FIND_DEPTH;
+    t.Value = (UINT64) _wtoi(value);
+    t.Cost = 0;
+
+    i = (int) t.Value;
+    if (t.Op == FIND_LT)
+      i--;
+    if ((t.Op == FIND_LT || t.Op == FIND_LE || t.Op == FIND_EQ) && i < m_MaxDepth)
+      m_MaxDepth = i < 0 ? 0 : i;
+  }
+
+// Attributes are a mask test so are just as cheap
+
+  else if (lstrcmpi(field, L"attr") == 0 || lstrcmpi(field, L"attrib") == 0)
+  { if (t.Op != FIND_EQ && t.Op != FIND_NE)
+    { wsprintf(m_LastError, L"Attributes can only be tested with = or !=");
+      return FALSE;
+    }
+
+    t.Field = FIND_ATTRIB;
+    t.Cost = 0;
+    if (!ParseAttributes(value, &t.Value))
+      return FALSE;
+  }
+
+  else if (lstrcmpi(field, L"size") == 0)
+  { t.Field = FIND_SIZE;
+    t.Cost = 1;
+    if (!ParseSize(value, &t.Value))
+      return FALSE;
+  }
+
+  else if (lstrcmpi(field, L"mtime") == 0 || lstrcmpi(field, L"ctime") == 0 || lstrcmpi(field, L"atime") == 0)
+  { if (lstrcmpi(field, L"mtime") == 0)
+      t.Field = FIND_MTIME;
+    else if (lstrcmpi(field, L"ctime") == 0)
+      t.Field = FIND_CTIME;
+    else
+      t.Field = FIND_ATIME;
+
+    t.Cost = 1;
+    if (!ParseTime(value, &t.Value))
+      return FALSE;
+  }
+
+// Names are the most expensive because the whole name has to be read.
+// The value can be several wildcards separated by ;
+
+  else if (lstrcmpi(field, L"name") == 0)
+  { if (t.Op != FIND_EQ && t.Op != FIND_NE)
+    { wsprintf(m_LastError, L"Names can only be tested with = or !=");
+      return FALSE;
+    }
+
+    if (m_NumNames >= MAX_FINDNAMES)
+    { wsprintf(m_LastError, L"There are more than %i name tests", MAX_FINDNAMES);
+      return FALSE;
+    }
+
+    while (*value != '\0')
+    { for (i = 0; value[i] != ';' && value[i] != '\0'; i++)
+        field[i] = value[i];
+      field[i] = '\0';
+
+      if (i > 0)
+      { if (!m_Name[m_NumNames].Add(field))
+        { wsprintf(m_LastError, L"The wildcard \"%.200s\" is not valid: %s", field, m_Name[m_NumNames].LastError());
+          return FALSE;
+        }
+      }
+
+      value += value[i] == ';' ? i + 1 : i;
+    }
+
+    if (m_Name[m_NumNames].NumPatterns() == 0)
+    { wsprintf(m_LastError, L"The test \"%.200s\" has no wildcards", Term);
+      return FALSE;
+    }
+
+    t.Field = FIND_NAME;
+    t.Value = (UINT64) m_NumNames++;
+    t.Cost = 2;
+  }
+
+  else
+  { wsprintf(m_LastError, L"Unknown test \"%.200s\"", field);
+    return FALSE;
+  }
+
+// Keep the tests sorted cheapest first, and in the order they were
+// given when they cost the same
+
+  for (i = m_NumTerms; i > 0 && m_Term[i-1].Cost > t.Cost; i--)
+    m_Term[i] = m_Term[i-1];
+
+  m_Term[i] = t;
+  m_NumTerms++;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindPredicate::ParseSize
+// -------------------------
+// A size in bytes, optionally followed by K, M, G or T
+//**********************************************************************
+
+BOOL CFindPredicate::ParseSize(const WCHAR* Value, UINT64* Size)
+{ int i;
+  UINT64 size;
+
+  size = 0;
+  for (i = 0; Value[i] >= '0' && Value[i] <= '9'; i++)
+    size = size*10 + (Value[i] - '0');
+
+  if (i > 0)
+  { switch (Value[i])
+    { case 'k': case 'K': size <<= 10; i++; break;
+      case 'm': case 'M': size <<= 20; i++; break;
+      case 'g': case 'G': size <<= 30; i++; break;
+      case 't': case 'T': size <<= 40; i++; break;
+    }
+
+    if (Value[i] == 'b' || Value[i] == 'B')
+      i++;
+  }
+
+  if (i == 0 || Value[i] != '\0')
+  { wsprintf(m_LastError, L"The size \"%.200s\" is not valid", Value);
+    return FALSE;
+  }
+
+  *Size = size;
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindPredicate::ParseTime
+// -------------------------
+// Either a date, or an age followed by h, d, w, m or y for hours, days,
+// weeks, months or years. An age is converted to the time that long
+// ago, so mtime<2y means last modified more than two years ago.
+//**********************************************************************
+
+BOOL CFindPredicate::ParseTime(const WCHAR* Value, UINT64* Time)
+{ int i;
+  UINT64 n, unit;
+  SYSTEMTIME st;
+  FILETIME ft;
+  CRhsDate dt;
+  WCHAR s[LEN_FINDTERM];
+
+  n = 0;
+  for (i = 0; Value[i] >= '0' && Value[i] <= '9'; i++)
+    n = n*10 + (Value[i] - '0');
+
+  if (i > 0 && Value[i] != '\0' && Value[i+1] == '\0')
+  { switch (Value[i])
+    { case 'h': case 'H': unit = TICKS_HOUR;    break;
+      case 'd': case 'D': unit = TICKS_DAY;     break;
+      case 'w': case 'W': unit = TICKS_DAY*7;   break;
+      case 'm': case 'M': unit = TICKS_DAY*30;  break;
+      case 'y': case 'Y': unit = TICKS_DAY*365; break;
+      default:            unit = 0;             break;
+    }
+
+    if (unit > 0)
+    { *Time = n*unit < m_Now ? m_Now - n*unit : 0;
+      return TRUE;
+    }
+  }
+
+// Otherwise it must be a date
+
+  lstrcpyn(s, Value, LEN_FINDTERM);
+
+  if (!dt.SetDate(s))
+  { wsprintf(m_LastError, L"The date or age \"%.200s\" is not valid", Value);
+    return FALSE;
+  }
+
+  dt.GetDate(&st);
+  SystemTimeToFileTime(&st, &ft);
+
+  *Time = ((UINT64) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindPredicate::ParseAttributes
+// -------------------------------
+//**********************************************************************
+
+BOOL CFindPredicate::ParseAttributes(const WCHAR* Value, UINT64* Mask)
+{ int i, j;
+
+  *Mask = 0;
+
+  for (i = 0; Value[i] != '\0'; i++)
+  { for (j = 0; FINDATTRIBS[j].Letter != 0; j++)
+      if (FINDATTRIBS[j].Letter == Value[i] || FINDATTRIBS[j].Letter == Value[i] + ('a' - 'A'))
+        break;
+
+    if (FINDATTRIBS[j].Letter == 0)
+    { wsprintf(m_LastError, L"Unknown attribute \"%c\"", Value[i]);
+      return FALSE;
+    }
+
+    *Mask |= FINDATTRIBS[j].Attribute;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CFindPredicate::Compare
+// -----------------------
+//**********************************************************************
+
+BOOL CFindPredicate::Compare(UINT64 One, int Op, UINT64 Two)
+{
+  switch (Op)
+  { case FIND_LT: return One < Two;
+    case FIND_LE: return One <= Two;
+    case FIND_EQ: return One == Two;
+    case FIND_NE: return One != Two;
+    case FIND_GE: return One >= Two;
+    case FIND_GT: return One > Two;
+  }
+
+  return FALSE;
+}
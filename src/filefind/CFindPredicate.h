@@ -0,0 +1,97 @@
+// *********************************************************************
+// CFindPredicate.h
+// ================
+// *********************************************************************
+
+#ifndef _INC_CFINDPREDICATE
+#define _INC_CFINDPREDICATE
+
+
+//**********************************************************************
+// FINDTERM
+// --------
+// One test in a predicate. Value is the size in bytes, the time as a
+// FILETIME, the depth, the attribute mask or the index of the name
+// wildcards, depending on Field.
+//**********************************************************************
+
+#define FIND_DEPTH  0
+#define FIND_ATTRIB 1
+#define FIND_SIZE   2
+#define FIND_MTIME  3
+#define FIND_CTIME  4
+#define FIND_ATIME  5
+#define FIND_NAME   6
+
+#define FIND_LT 0
+#define FIND_LE 1
+#define FIND_EQ 2
+#define FIND_NE 3
+#define FIND_GE 4
+#define FIND_GT 5
+
+typedef struct
+{ int Field;
+  int Op;
+  UINT64 Value;
+  int Cost;
+
+} FINDTERM;
+
+
+//**********************************************************************
+// CFindPredicate
+// --------------
+// Class to hold a list of tests that a file must pass, e.g.
+//   size>1G,mtime<2y
+// The tests only use the data FindFirstFile returns, so testing a file
+// needs no more calls to the file system. The tests are sorted so the
+// cheapest are done first.
+//**********************************************************************
+
+#define MAX_FINDTERMS 32
+#define MAX_FINDNAMES 8
+
+class CFindPredicate
+{
+  public:
+    CFindPredicate();
+    ~CFindPredicate();
+
+    BOOL Parse(const WCHAR* Expr);
+
+    BOOL Match(CRhsFindFile* FF, const WCHAR* Name, int Depth);
+
+    inline int NumTerms(void) { return m_NumTerms; }
+    inline int MaxDepth(void) { return m_MaxDepth; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL ParseTerm(const WCHAR* Term);
+    BOOL ParseSize(const WCHAR* Value, UINT64* Size);
+    BOOL ParseTime(const WCHAR* Value, UINT64* Time);
+    BOOL ParseAttributes(const WCHAR* Value, UINT64* Mask);
+
+    BOOL Compare(UINT64 One, int Op, UINT64 Two);
+
+  private:
+    FINDTERM m_Term[MAX_FINDTERMS];
+    int m_NumTerms;
+
+    CRhsWildCardSet m_Name[MAX_FINDNAMES];
+    int m_NumNames;
+
+    int m_MaxDepth;
+    UINT64 m_Now;
+
+    WCHAR m_LastError[256];
+};
+
+
+//**********************************************************************
+// End of CFindPredicate
+// ---------------------
+//**********************************************************************
+
+#endif // _INC_CFINDPREDICATE
@@ -10,10 +10,15 @@
 #include <windows.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <CRhsIO/CRhsIO.h>
 #include <Misc/CRhsFindFile.h>
 #include <Misc/CRhsDate.h>
+#include <Misc/CRhsWildCardSet.h>
+#include <Misc/NameList.h>
 #include <Misc/Utils.h>
+#include "CFindPredicate.h"
+#include "CFindOutput.h"
 
 
 //**********************************************************************
@@ -21,7 +26,7 @@
 //**********************************************************************
 
 DWORD WINAPI rhsmain(LPVOID unused);
-BOOL FindFileSub(WCHAR* Filename);
+BOOL FindFileSub(const WCHAR* Path, int Depth);
 
 BOOL SetBackupPrivilege(BOOL NotifyErrors);
 BOOL UnsetBackupPrivilege(BOOL NotifyErrors);
@@ -36,12 +41,25 @@ CRhsIO RhsIO;
 FILETIME g_SearchDate;
 BOOL     g_UseSearchDate;
 
+CRhsWildCardSet g_WildCards;
+CFindPredicate g_Predicate;
+
+// -0 and -b write the files found to the output with no formatting
+
+int g_RawFormat;
+CFindOutput g_Output;
+
 int g_NumFiles;
 
 #define SYNTAX \
-L"filefind v1.0\r\n" \
-L"Syntax: [-m<cutoff date>] <file name>\r\n" \
-L"  -m<cutoff date> include only files modified after this date\r\n"
+L"filefind v1.3\r\n" \
+L"Syntax: [-m<cutoff date> -p<tests> -0 -b] <file name>\r\n" \
+L"  -m<cutoff date> include only files modified after this date\r\n" \
+L"  -p<tests>       include only files passing all the tests, e.g.\r\n" \
+L"                  -psize>1G,mtime<2y. See filefind.txt for the tests\r\n" \
+L"  -0              write the full paths as UTF-8 each followed by a null\r\n" \
+L"  -b              write binary records with the size, times and\r\n" \
+L"                  attributes. See filefind.txt for the format\r\n"
 
 
 //**********************************************************************
@@ -76,10 +94,11 @@ int wmain(int argc, WCHAR* argv[])
 
 DWORD WINAPI rhsmain(LPVOID unused)
 { int numarg;
+  BOOL ok;
   CRhsDate dt;
   SYSTEMTIME st;
 
-  WCHAR target[LEN_FILENAME];
+  WCHAR target[LEN_FILENAME], path[LEN_FILENAME], name[LEN_FILENAME];
 
 // Check the arguments
 
@@ -93,6 +112,7 @@ DWORD WINAPI rhsmain(LPVOID unused)
 // Process flags
 
   g_UseSearchDate = FALSE;
+  g_RawFormat = 0;
 
   for (numarg = 1; numarg < RhsIO.m_argc; numarg++)
   { if (RhsIO.m_argv[numarg][0] != '-')
@@ -112,6 +132,23 @@ DWORD WINAPI rhsmain(LPVOID unused)
         SystemTimeToFileTime(&st, &g_SearchDate);
         break;
 
+      case 'p':
+      case 'P':
+        if (!g_Predicate.Parse(RhsIO.m_argv[numarg]+2))
+        { RhsIO.SetLastError(L"%s\r\n", g_Predicate.LastError());
+          return 2;
+        }
+        break;
+
+      case '0':
+        g_RawFormat = FINDOUT_NUL;
+        break;
+
+      case 'b':
+      case 'B':
+        g_RawFormat = FINDOUT_BINARY;
+        break;
+
       case '?':
         RhsIO.printf(SYNTAX);
         return 0;
@@ -140,17 +177,55 @@ DWORD WINAPI rhsmain(LPVOID unused)
     return 2;
   }
 
+// Each directory is listed once and the names are matched against the
+// wildcard here
+
+  UtilsGetPathFromFilename(target, path, LEN_FILENAME);
+  UtilsGetNameFromFilename(target, name, LEN_FILENAME);
+
+  if (!g_WildCards.Add(name))
+  { RhsIO.SetLastError(L"Invalid file name %s: %s\r\n", name, g_WildCards.LastError());
+    return 2;
+  }
+
+// The raw formats write straight to the standard output so they can't
+// be used in the GUI window
+
+  if (g_RawFormat)
+  { if (!RhsIO.IsConsole())
+    { RhsIO.SetLastError(L"-0 and -b can only be used from the command prompt\r\n");
+      return 2;
+    }
+
+    if (!g_Output.Open(RhsIO.m_stdout, g_RawFormat))
+    { RhsIO.SetLastError(L"%s\r\n", g_Output.LastError());
+      return 2;
+    }
+  }
+
 // Start searching
 
   g_NumFiles = 0;
 
-  RhsIO.printf(L"Searching for: %s\r\n", target);
+  if (!g_RawFormat)
+    RhsIO.printf(L"Searching for: %s\r\n", target);
 
   SetBackupPrivilege(FALSE);
-  FindFileSub(target);
+  ok = FindFileSub(path, 0);
   UnsetBackupPrivilege(FALSE);
 
-  RhsIO.printf(L"%i files found\r\n", g_NumFiles);
+  if (g_RawFormat)
+  { if (ok && !g_Output.Flush())
+    { RhsIO.SetLastError(L"Cannot write the output: %s\r\n", g_Output.LastError());
+      ok = FALSE;
+    }
+  }
+  else
+  { RhsIO.printf(L"%i files found\r\n", g_NumFiles);
+  }
+
+  if (!ok)
+    return 2;
 
 /// All done so return indicating success
 
@@ -161,61 +236,55 @@ DWORD WINAPI rhsmain(LPVOID unused)
 //**********************************************************************
 // FindFileSub
 // -----------
+// Search the directory Path and its subdirectories. The directory is
+// listed once: the subdirectories are kept to recurse into, and the
+// files matching the wildcard are formatted and kept to print after
+// the subdirectories have been searched. Depth is the number of
+// directories Path is below the starting directory.
 //**********************************************************************
 
-BOOL FindFileSub(WCHAR* Filename)
-{ BOOL heading = FALSE;
+BOOL FindFileSub(const WCHAR* Path, int Depth)
+{ BOOL ok;
   CRhsFindFile ff;
   FILETIME ft;
+  NAMELIST subdirs, found;
+  const WCHAR* p;
   WCHAR filename[LEN_FILENAME+1], s[LEN_FILENAME];
 
-// First find all subdirectories and recurse into them
+  subdirs.Buf = found.Buf = NULL;
+  subdirs.Len = subdirs.Size = found.Len = found.Size = 0;
 
-  UtilsGetPathFromFilename(Filename, s, LEN_FILENAME);
+  ok = TRUE;
+
+  lstrcpyn(s, Path, LEN_FILENAME - 2);
   lstrcat(s, L"\\*");
 
   if (ff.First(s, filename, LEN_FILENAME))
   { do
     {
 
-// If we've found a directory recurse into it
-
-      if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
-      {
-
-// If this "directory" is a junction point ignore it
-
-        if (ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT)
-          continue;
-
 // Ignore . and ..
 
-        if (lstrcmp(filename, L".") == 0 || lstrcmp(filename, L"..") == 0)
-          continue;
+      if (lstrcmp(filename, L".") == 0 || lstrcmp(filename, L"..") == 0)
+        continue;
 
-// Append the target file name to the directory we've found and recurse
-// into it.
+// If we've found a directory keep it to recurse into, unless this
+// "directory" is a junction point or the tests don't go that deep
 
-        ff.FullFilename(filename, LEN_FILENAME);
-        lstrcat(filename, L"\\");
-        UtilsGetNameFromFilename(Filename, filename + lstrlen(filename), LEN_FILENAME - lstrlen(filename));
-
-        if (!FindFileSub(filename))
-          return FALSE;
+      if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
+      { if (!(ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT) && Depth < g_Predicate.MaxDepth())
+        { if (!NameListAdd(&subdirs, filename))
+          { RhsIO.SetLastError(L"Out of memory listing %s\r\n", Path);
+            ok = FALSE;
+            break;
+          }
+        }
       }
 
-// Find next file
-
-    } while (ff.Next(filename, LEN_FILENAME));
-  }
-
-  ff.Close();
+// Check if the name matches the wildcard
 
-// Now we've searched all subdirectories, so search this directory
-
-  if (ff.First(Filename, s, LEN_FILENAME))
-  { do
-    {
+      if (!g_WildCards.Match(filename))
+        continue;
 
 // If we are using a search date check the file timestamp
 
@@ -226,38 +295,74 @@ BOOL FindFileSub(WCHAR* Filename)
           continue;
       }
 
-// If we haven't printed the heading yet do it now
+// Apply the tests to the data we already have for the file
+
+      if (g_Predicate.NumTerms() > 0)
+        if (!g_Predicate.Match(&ff, filename, Depth))
+          continue;
+
+// The raw formats write the file straight away
+
+      if (g_RawFormat)
+      { if (!g_Output.Write(Path, filename, &ff))
+        { RhsIO.SetLastError(L"Cannot write the output: %s\r\n", g_Output.LastError());
+          ok = FALSE;
+          break;
+        }
 
-      if (!heading)
-      { UtilsGetPathFromFilename(Filename, s, LEN_FILENAME);
-        RhsIO.printf(L"Directory: %s\r\n", s);
-        heading = TRUE;
+        g_NumFiles++;
+        continue;
       }
 
-/// Print the file details
+// Keep the file details
 
       UtilsFileInfoFormat(&ff, FALSE, s, LEN_FILENAME);
-      RhsIO.printf(L"%s\r\n", s);
-
-      g_NumFiles++;
+      if (!NameListAdd(&found, s))
+      { RhsIO.SetLastError(L"Out of memory listing %s\r\n", Path);
+        ok = FALSE;
+        break;
+      }
 
 // Find next file
 
-    } while (ff.Next(s, LEN_FILENAME));
+    } while (ff.Next(filename, LEN_FILENAME));
   }
 
   ff.Close();
 
-// If we've printed anything append a blank line
+// Recurse into the subdirectories
+
+  for (p = subdirs.Buf; ok && p && p < subdirs.Buf + subdirs.Len; p += lstrlen(p) + 1)
+  { if (lstrlen(Path) + lstrlen(p) + 1 >= LEN_FILENAME)
+      continue;
+
+    lstrcpy(s, Path);
+    lstrcat(s, L"\\");
+    lstrcat(s, p);
+
+    ok = FindFileSub(s, Depth + 1);
+  }
+
+// Now we've searched all subdirectories, so print the files found in
+// this directory
+
+  if (ok && found.Len > 0)
+  { RhsIO.printf(L"Directory: %s\r\n", Path);
+
+    for (p = found.Buf; p < found.Buf + found.Len; p += lstrlen(p) + 1)
+    { RhsIO.printf(L"%s\r\n", p);
+      g_NumFiles++;
+    }
 
-  if (heading)
-  { UtilsGetPathFromFilename(Filename, s, LEN_FILENAME);
     RhsIO.printf(L"\r\n");
   }
 
-// All done so return indicating success
+  NameListFree(&subdirs);
+  NameListFree(&found);
+
+// All done
 
-  return TRUE;
+  return ok;
 }
 
 
@@ -311,5 +416,3 @@ BOOL UnsetBackupPrivilege(BOOL NotifyErrors)
 
   return(TRUE);
 }
-
-
@@ -13,9 +13,12 @@
 #include <tchar.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <CRhsIO/CRhsIO.h>
 #include <Misc/CRhsFindFile.h>
 #include <Misc/CRhsDate.h>
+#include <Misc/CRhsWildCardSet.h>
+#include <Misc/NameList.h>
 #include <Misc/Utils.h>
 #include "CSearchExpr.h"
 #include "CTextBuffer.h"
@@ -41,6 +44,8 @@ typedef struct
   FILETIME searchdate;
   BOOL     usesearchdate;
 
+  CRhsWildCardSet wildcard;
+
   int numfiles;
 
   int num_searchexpr;
@@ -74,7 +79,7 @@ BOOL FindTextSub(WCHAR* FileName, FTINFO* FTInfo);
 CRhsIO RhsIO;
 
 #define SYNTAX \
-L"findtext v1.2.2\r\n" \
+L"findtext v1.2.3\r\n" \
 L"Syntax: [-d -h -i -m<cutoff date> -n<num hits> -s] <search string> <file name(s)>\r\n" \
 L"Flags:\r\n" \
 L"  -d recurse into subdirectories\r\n" \
@@ -118,7 +123,7 @@ int wmain(int argc, WCHAR* argv[])
 
 DWORD WINAPI rhsmain(LPVOID unused)
 { int numarg, i, j;
-  WCHAR target[LEN_FILENAME];
+  WCHAR target[LEN_FILENAME], name[LEN_FILENAME];
   DWORD attrib;
   FTINFO ftinfo;
   CRhsDate dt;
@@ -265,6 +270,18 @@ DWORD WINAPI rhsmain(LPVOID unused)
     return 2;
   }
 
+// When searching subdirectories each directory is listed once and the
+// names are matched against the wildcard here
+
+  if (ftinfo.subdir)
+  { UtilsGetNameFromFilename(target, name, LEN_FILENAME);
+
+    if (!ftinfo.wildcard.Add(name))
+    { RhsIO.errprintf(L"Invalid file name %s: %s\r\n", name, ftinfo.wildcard.LastError());
+      return 2;
+    }
+  }
+
 // Print the search expressions
 
   RhsIO.printf(L"Searching file(s) %s for:\r\n", target);
@@ -299,72 +316,74 @@ DWORD WINAPI rhsmain(LPVOID unused)
 //**********************************************************************
 // FindText
 // --------
+// The directory is listed once. The subdirectories are kept to recurse
+// into and the files to search are kept to search after the
+// subdirectories, so the order is the same as listing the directory
+// twice. Without -d the wildcard is left to FindFirstFile.
 //**********************************************************************
 
 BOOL FindText(WCHAR* Filename, FTINFO* FTInfo)
-{ CRhsFindFile ff;
+{ BOOL ok;
+  CRhsFindFile ff;
   FILETIME ft;
-  WCHAR s[LEN_FILENAME];
+  NAMELIST subdirs, files;
+  const WCHAR* p;
+  WCHAR path[LEN_FILENAME], name[LEN_FILENAME], s[LEN_FILENAME];
+
+  subdirs.Buf = files.Buf = NULL;
+  subdirs.Len = subdirs.Size = files.Len = files.Size = 0;
 
-// First find all subdirectories and recurse into them
+  ok = TRUE;
+
+  UtilsGetPathFromFilename(Filename, path, LEN_FILENAME);
+  UtilsGetNameFromFilename(Filename, name, LEN_FILENAME);
 
   if (FTInfo->subdir)
-  { UtilsGetPathFromFilename(Filename, s, LEN_FILENAME);
+  { lstrcpyn(s, path, LEN_FILENAME - 2);
     lstrcat(s, L"\\*");
+  }
+  else
+  { lstrcpy(s, Filename);
+  }
 
-    if (ff.First(s, s, LEN_FILENAME))
-    { do
-      {
+  if (ff.First(s, s, LEN_FILENAME))
+  { do
+    {
 
-// If we've found a directory recurse into it
+// Check for an abort signal
 
-        if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
-        {
+      if (RhsIO.GetAbort())
+        break;
 
-// If this "directory" is a junction point ignore it
+// If we've found a directory keep it to recurse into
 
-          if (ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT)
-            continue;
+      if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
+      { if (!FTInfo->subdir)
+          continue;
 
-// Ignore . and ..
+// If this "directory" is a junction point ignore it
 
-          if (lstrcmp(s, L".") == 0 || lstrcmp(s, L"..") == 0)
-            continue;
+        if (ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT)
+          continue;
 
-// Append the target file name to the directory we've found and recurse
-// into it.
+// Ignore . and ..
 
-          ff.FullFilename(s, LEN_FILENAME);
-          lstrcat(s, L"\\");
-          UtilsGetNameFromFilename(Filename, s + lstrlen(s), LEN_FILENAME - lstrlen(s));
+        if (lstrcmp(s, L".") == 0 || lstrcmp(s, L"..") == 0)
+          continue;
 
-          if (!FindText(s, FTInfo))
-            return FALSE;
+        if (!NameListAdd(&subdirs, s))
+        { ok = FALSE;
+          break;
         }
 
-// Find next file
-
-      } while (ff.Next(s, LEN_FILENAME));
-    }
-
-    ff.Close();
-  }
-
-// Now we've searched all subdirectories, so search this directory
-
-  if (ff.First(Filename, Filename, LEN_FILENAME))
-  { do
-    {
-
-// Check for an abort signal
-
-      if (RhsIO.GetAbort())
-        break;
+        continue;
+      }
 
-// Ignore all directories
+// Check the name matches the wildcard
 
-      if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
-        continue;
+      if (FTInfo->subdir)
+        if (!FTInfo->wildcard.Match(s))
+          continue;
 
 // Search hidden and/or system files only if -h and/or -s were specified
 
@@ -385,13 +404,12 @@ BOOL FindText(WCHAR* Filename, FTINFO* FTInfo)
           continue;
       }
 
-/// Search this file
-
-      ff.FullFilename(s, LEN_FILENAME);
+// Keep the file to search
 
-      FindTextSub(s, FTInfo);
-
-      FTInfo->numfiles++;
+      if (!NameListAdd(&files, s))
+      { ok = FALSE;
+        break;
+      }
 
 // Find next file
 
@@ -400,9 +418,50 @@ BOOL FindText(WCHAR* Filename, FTINFO* FTInfo)
 
   ff.Close();
 
-// All done so return indicating success
+  if (!ok)
+    RhsIO.errprintf(L"Out of memory listing %s\r\n", path);
 
-  return TRUE;
+// Append the target file name to the directories we've found and
+// recurse into them
+
+  for (p = subdirs.Buf; ok && p && p < subdirs.Buf + subdirs.Len; p += lstrlen(p) + 1)
+  { if (lstrlen(path) + lstrlen(p) + lstrlen(name) + 2 >= LEN_FILENAME)
+      continue;
+
+    lstrcpy(s, path);
+    lstrcat(s, L"\\");
+    lstrcat(s, p);
+    lstrcat(s, L"\\");
+    lstrcat(s, name);
+
+    if (!FindText(s, FTInfo))
+      ok = FALSE;
+  }
+
+// Now we've searched all subdirectories, so search this directory
+
+  for (p = files.Buf; ok && p && p < files.Buf + files.Len; p += lstrlen(p) + 1)
+  { if (RhsIO.GetAbort())
+      break;
+
+    if (lstrlen(path) + lstrlen(p) + 1 >= LEN_FILENAME)
+      continue;
+
+    lstrcpy(s, path);
+    lstrcat(s, L"\\");
+    lstrcat(s, p);
+
+    FindTextSub(s, FTInfo);
+
+    FTInfo->numfiles++;
+  }
+
+  NameListFree(&subdirs);
+  NameListFree(&files);
+
+// All done
+
+  return ok;
 }
 
 
@@ -511,5 +570,3 @@ BOOL FindTextSub(WCHAR* FileName, FTINFO* FTInfo)
 
   return TRUE;
 }
-
-
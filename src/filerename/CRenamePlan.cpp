@@ -0,0 +1,560 @@
+// *********************************************************************
+// CRenamePlan.cpp
+// ===============
+// *********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <Misc/Utils.h>
+#include "CRenamePlan.h"
+
+
+//**********************************************************************
+// Local definitions
+// -----------------
+//**********************************************************************
+
+#define RENAME_FIRSTSLOTS 64
+
+// The longest a name in a directory can be
+
+#define RENAME_MAXNAME 255
+
+// States for ordering the renames
+
+#define STATE_TODO  0
+#define STATE_DOING 1
+#define STATE_DONE  2
+
+static UINT HashName(const WCHAR* Key);
+
+
+//**********************************************************************
+// CRenamePlan
+// -----------
+//**********************************************************************
+
+CRenamePlan::CRenamePlan(const WCHAR* Dir)
+{
+  m_Dir = _wcsdup(Dir);
+
+  m_Entry = NULL;
+  m_NumEntries = m_MaxEntries = 0;
+
+  m_Slot = NULL;
+  m_NumSlots = m_UsedSlots = 0;
+
+  m_Step = NULL;
+  m_NumSteps = m_MaxSteps = 0;
+
+  m_Temp = NULL;
+  m_NumTemps = 0;
+
+  m_HasDirs = FALSE;
+  m_NumRenamed = 0;
+  m_Failed = FALSE;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CRenamePlan::~CRenamePlan()
+{
+  Free();
+
+  if (m_Dir)
+    free(m_Dir);
+}
+
+
+//**********************************************************************
+// CRenamePlan::Free
+// -----------------
+// Free the plan once it has been done, keeping the directory and the
+// result
+//**********************************************************************
+
+void CRenamePlan::Free(void)
+{ int i;
+
+  for (i = 0; i < m_NumEntries; i++)
+  { free(m_Entry[i].Name);
+    if (m_Entry[i].NewName)
+      free(m_Entry[i].NewName);
+  }
+
+  for (i = 0; i < m_NumSlots; i++)
+    if (m_Slot[i].Key)
+      free(m_Slot[i].Key);
+
+  for (i = 0; i < m_NumTemps; i++)
+    free(m_Temp[i]);
+
+  if (m_Entry)
+    free(m_Entry);
+  if (m_Slot)
+    free(m_Slot);
+  if (m_Step)
+    free(m_Step);
+  if (m_Temp)
+    free(m_Temp);
+
+  m_Entry = NULL;
+  m_NumEntries = m_MaxEntries = 0;
+  m_Slot = NULL;
+  m_NumSlots = m_UsedSlots = 0;
+  m_Step = NULL;
+  m_NumSteps = m_MaxSteps = 0;
+  m_Temp = NULL;
+  m_NumTemps = 0;
+}
+
+
+//**********************************************************************
+// CRenamePlan::AddName
+// --------------------
+// Add a name in the directory. NewName is the name to rename it to, or
+// NULL if it stays as it is.
+//**********************************************************************
+
+BOOL CRenamePlan::AddName(const WCHAR* Name, const WCHAR* NewName, BOOL IsDir)
+{ RENAMEENTRY* e;
+  RENAMESLOT* slot;
+
+  if (!m_Dir)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+// Renaming a file to exactly the same name does nothing
+
+  if (NewName && lstrcmp(Name, NewName) == 0)
+    NewName = NULL;
+
+  slot = FindSlot(Name, TRUE);
+  if (!slot)
+    return FALSE;
+
+  slot->Exists = TRUE;
+
+  if (!NewName)
+    return TRUE;
+
+  if (m_NumEntries >= m_MaxEntries)
+  { e = (RENAMEENTRY*) realloc(m_Entry, (m_MaxEntries + 256)*sizeof(RENAMEENTRY));
+    if (!e)
+    { lstrcpy(m_LastError, L"Out of memory");
+      return FALSE;
+    }
+    m_Entry = e;
+    m_MaxEntries += 256;
+  }
+
+  e = m_Entry + m_NumEntries;
+  e->Name = _wcsdup(Name);
+  e->NewName = _wcsdup(NewName);
+  e->IsDir = IsDir;
+  e->Next = -1;
+  e->State = STATE_TODO;
+
+  if (!e->Name || !e->NewName)
+  { if (e->Name)
+      free(e->Name);
+    if (e->NewName)
+      free(e->NewName);
+    lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  slot->Source = m_NumEntries++;
+
+  if (IsDir)
+    m_HasDirs = TRUE;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CRenamePlan::Build
+// ------------------
+// Check the renames and put them in order. Returns FALSE if any rename
+// would clash, in which case nothing in the directory is renamed.
+//**********************************************************************
+
+BOOL CRenamePlan::Build(void)
+{ int i, j, start, end, k;
+  int* path;
+  RENAMESLOT* slot;
+  WCHAR* temp;
+
+// Check the new names
+
+  for (i = 0; i < m_NumEntries; i++)
+  { slot = FindSlot(m_Entry[i].NewName, TRUE);
+    if (!slot)
+      return FALSE;
+
+    if (slot->Target >= 0)
+    { swprintf(m_LastError, LEN_FILENAME+256, L"%s and %s would both be renamed to %s",
+               m_Entry[slot->Target].Name, m_Entry[i].Name, m_Entry[i].NewName);
+      return FALSE;
+    }
+
+    slot->Target = i;
+
+// The new name can only exist already if that file is being renamed, or
+// this is the same file with the case changed
+
+    if (slot->Exists && slot->Source < 0)
+    { swprintf(m_LastError, LEN_FILENAME+256, L"Renaming %s to %s would overwrite an existing file",
+               m_Entry[i].Name, m_Entry[i].NewName);
+      return FALSE;
+    }
+
+    if (slot->Source != i)
+      m_Entry[i].Next = slot->Source;
+  }
+
+// Each name is the target of at most one rename, so the renames form
+// chains and cycles. Follow each chain to its end and rename from the
+// end back.
+
+  path = (int*) malloc((m_NumEntries + 1)*sizeof(int));
+  if (!path)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  for (i = 0; i < m_NumEntries; i++)
+  { if (m_Entry[i].State != STATE_TODO)
+      continue;
+
+    end = 0;
+    for (j = i; j >= 0 && m_Entry[j].State == STATE_TODO; j = m_Entry[j].Next)
+    { m_Entry[j].State = STATE_DOING;
+      path[end++] = j;
+    }
+
+// If the chain comes back on itself move the first file in the cycle
+// out of the way, do the rest of the cycle, then move it to its name
+
+    temp = NULL;
+    start = 0;
+
+    if (j >= 0 && m_Entry[j].State == STATE_DOING)
+    { for (start = 0; path[start] != j; start++);
+
+      temp = TempName(m_Entry[j].Name);
+      if (!temp || !AddStep(m_Entry[j].Name, temp, FALSE))
+      { free(path);
+        return FALSE;
+      }
+    }
+
+    for (k = end - 1; k >= 0; k--)
+    { if (k == start && temp)
+        continue;
+      if (!AddStep(m_Entry[path[k]].Name, m_Entry[path[k]].NewName, TRUE))
+      { free(path);
+        return FALSE;
+      }
+    }
+
+    if (temp)
+    { if (!AddStep(temp, m_Entry[j].NewName, TRUE))
+      { free(path);
+        return FALSE;
+      }
+    }
+
+    for (k = 0; k < end; k++)
+      m_Entry[path[k]].State = STATE_DONE;
+  }
+
+  free(path);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CRenamePlan::Execute
+// --------------------
+// Do the renames. This stops at the first one that fails, and if that
+// is part way through a cycle the renames done in the cycle are undone.
+//**********************************************************************
+
+BOOL CRenamePlan::Execute(void)
+{ int i, k, cycle;
+  WCHAR errmsg[LEN_FILENAME+256], syserr[512];
+
+// cycle is the step that moved a file to a temporary name, if we are
+// part way through a cycle
+
+  cycle = -1;
+
+  for (i = 0; i < m_NumSteps; i++)
+  { if (!m_Step[i].Final)
+      cycle = i;
+
+    if (!MoveStep(m_Step[i].From, m_Step[i].To))
+    { ErrorMessage(GetLastError(), syserr, 512);
+      swprintf(m_LastError, LEN_FILENAME+256, L"%s -> %s: %s", m_Step[i].From, m_Step[i].To, syserr);
+      m_Failed = TRUE;
+
+// If we're part way through a cycle undo the renames done in it so the
+// file isn't left with its temporary name
+
+      if (cycle >= 0)
+      { for (k = i - 1; k >= cycle; k--)
+        { if (!MoveStep(m_Step[k].To, m_Step[k].From))
+          { lstrcpy(errmsg, m_LastError);
+            swprintf(m_LastError, LEN_FILENAME+256, L"%s\r\n%s has been left as %s", errmsg, m_Step[cycle].From, m_Step[cycle].To);
+            return FALSE;
+          }
+
+          if (m_Step[k].Final)
+            m_NumRenamed--;
+        }
+      }
+
+      return FALSE;
+    }
+
+    if (m_Step[i].Final)
+      m_NumRenamed++;
+
+// The move from the temporary name ends the cycle
+
+    if (cycle >= 0 && m_Step[i].From == m_Step[cycle].To)
+      cycle = -1;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CRenamePlan::MoveStep
+// ---------------------
+// Rename a file in the directory
+//**********************************************************************
+
+BOOL CRenamePlan::MoveStep(const WCHAR* From, const WCHAR* To)
+{ WCHAR from[LEN_FILENAME+1], to[LEN_FILENAME+1];
+
+  if (lstrlen(m_Dir) + lstrlen(From) + 2 > LEN_FILENAME || lstrlen(m_Dir) + lstrlen(To) + 2 > LEN_FILENAME)
+  { SetLastError(ERROR_FILENAME_EXCED_RANGE);
+    return FALSE;
+  }
+
+  lstrcpy(from, m_Dir);
+  lstrcat(from, L"\\");
+  lstrcat(from, From);
+
+  lstrcpy(to, m_Dir);
+  lstrcat(to, L"\\");
+  lstrcat(to, To);
+
+  return MoveFile(from, to);
+}
+
+
+//**********************************************************************
+// CRenamePlan::FindSlot
+// ---------------------
+// Find the hash table slot for a name, ignoring case. If Add is TRUE
+// the name is added if it isn't there.
+//**********************************************************************
+
+RENAMESLOT* CRenamePlan::FindSlot(const WCHAR* Name, BOOL Add)
+{ int len;
+  UINT i;
+  WCHAR key[LEN_FILENAME+1];
+
+  len = lstrlen(Name);
+  if (len > LEN_FILENAME)
+    len = LEN_FILENAME;
+
+  CopyMemory(key, Name, len*sizeof(WCHAR));
+  key[len] = '\0';
+  CharLowerBuff(key, len);
+
+// Keep the table no more than half full
+
+  if (Add && (m_UsedSlots + 1)*2 > m_NumSlots)
+    if (!GrowSlots())
+      return NULL;
+
+  if (m_NumSlots == 0)
+    return NULL;
+
+  for (i = HashName(key) & (m_NumSlots - 1); m_Slot[i].Key; i = (i + 1) & (m_NumSlots - 1))
+    if (lstrcmp(m_Slot[i].Key, key) == 0)
+      return m_Slot + i;
+
+  if (!Add)
+    return NULL;
+
+  m_Slot[i].Key = _wcsdup(key);
+  if (!m_Slot[i].Key)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return NULL;
+  }
+
+  m_Slot[i].Exists = FALSE;
+  m_Slot[i].Source = m_Slot[i].Target = -1;
+  m_UsedSlots++;
+
+  return m_Slot + i;
+}
+
+
+//**********************************************************************
+// CRenamePlan::GrowSlots
+// ----------------------
+// Double the size of the hash table
+//**********************************************************************
+
+BOOL CRenamePlan::GrowSlots(void)
+{ int numslots, i;
+  UINT j;
+  RENAMESLOT* slot;
+
+  numslots = m_NumSlots > 0 ? m_NumSlots*2 : RENAME_FIRSTSLOTS;
+
+  slot = (RENAMESLOT*) calloc(numslots, sizeof(RENAMESLOT));
+  if (!slot)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  for (i = 0; i < m_NumSlots; i++)
+  { if (!m_Slot[i].Key)
+      continue;
+
+    for (j = HashName(m_Slot[i].Key) & (numslots - 1); slot[j].Key; j = (j + 1) & (numslots - 1));
+    slot[j] = m_Slot[i];
+  }
+
+  if (m_Slot)
+    free(m_Slot);
+
+  m_Slot = slot;
+  m_NumSlots = numslots;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CRenamePlan::AddStep
+// --------------------
+//**********************************************************************
+
+BOOL CRenamePlan::AddStep(const WCHAR* From, const WCHAR* To, BOOL Final)
+{ RENAMESTEP* step;
+
+  if (m_NumSteps >= m_MaxSteps)
+  { step = (RENAMESTEP*) realloc(m_Step, (m_MaxSteps + 256)*sizeof(RENAMESTEP));
+    if (!step)
+    { lstrcpy(m_LastError, L"Out of memory");
+      return FALSE;
+    }
+    m_Step = step;
+    m_MaxSteps += 256;
+  }
+
+  m_Step[m_NumSteps].From = From;
+  m_Step[m_NumSteps].To = To;
+  m_Step[m_NumSteps].Final = Final;
+  m_NumSteps++;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CRenamePlan::TempName
+// ---------------------
+// Make a name for breaking a cycle that isn't in the directory and
+// isn't the new name of any file
+//**********************************************************************
+
+WCHAR* CRenamePlan::TempName(const WCHAR* Name)
+{ int n, len;
+  WCHAR** temps;
+  WCHAR s[LEN_FILENAME+1], suffix[32];
+
+  temps = (WCHAR**) realloc(m_Temp, (m_NumTemps + 1)*sizeof(WCHAR*));
+  if (!temps)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return NULL;
+  }
+  m_Temp = temps;
+
+// Shorten the name if need be so the temporary name is no longer than a
+// file name can be
+
+  for (n = m_NumTemps; ; n++)
+  { swprintf(suffix, 32, L".~rn%i", n);
+    len = lstrlen(Name);
+    if (len > RENAME_MAXNAME - lstrlen(suffix))
+      len = RENAME_MAXNAME - lstrlen(suffix);
+
+    swprintf(s, LEN_FILENAME, L"%.*s%s", len, Name, suffix);
+    if (!FindSlot(s, FALSE))
+      break;
+  }
+
+// Add it to the table so the next temporary name is different
+
+  if (!FindSlot(s, TRUE))
+    return NULL;
+
+  m_Temp[m_NumTemps] = _wcsdup(s);
+  if (!m_Temp[m_NumTemps])
+  { lstrcpy(m_LastError, L"Out of memory");
+    return NULL;
+  }
+
+  return m_Temp[m_NumTemps++];
+}
+
+
+//**********************************************************************
+// CRenamePlan::ErrorMessage
+// -------------------------
+// Format a Windows error into Buf. Plans are executed on several
+// threads at once so this can't use the shared GetLastErrorMessage
+// buffer.
+//**********************************************************************
+
+void CRenamePlan::ErrorMessage(DWORD Error, WCHAR* Buf, int BufLen)
+{ int i;
+
+  lstrcpy(Buf, L"<unknown error>");
+  FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, 0, Error, 0, Buf, BufLen - 1, NULL);
+
+  for (i = lstrlen(Buf); i > 0 && (Buf[i-1] == '\r' || Buf[i-1] == '\n'); i--)
+    Buf[i-1] = '\0';
+}
+
+
+//**********************************************************************
+// HashName
+// --------
+// FNV-1a hash of a lowercased name
+//**********************************************************************
+
+static UINT HashName(const WCHAR* Key)
+{ UINT h;
+
+  for (h = 2166136261u; *Key != '\0'; Key++)
+  { h ^= (UINT) *Key;
+    h *= 16777619u;
+  }
+
+  return h;
+}
@@ -0,0 +1,131 @@
+// *********************************************************************
+// CRenamePlan.h
+// =============
+// *********************************************************************
+
+#ifndef _INC_CRENAMEPLAN
+#define _INC_CRENAMEPLAN
+
+
+//**********************************************************************
+// RENAMEENTRY
+// -----------
+// A name in the directory. NewName is NULL if it isn't being renamed.
+// Next is the entry whose name this one is being renamed to, which has
+// to be renamed first.
+//**********************************************************************
+
+typedef struct
+{ WCHAR* Name;
+  WCHAR* NewName;
+  BOOL IsDir;
+
+  int Next;
+  int State;
+
+} RENAMEENTRY;
+
+
+//**********************************************************************
+// RENAMESTEP
+// ----------
+// One MoveFile. Final is FALSE for a move to a temporary name.
+//**********************************************************************
+
+typedef struct
+{ const WCHAR* From;
+  const WCHAR* To;
+  BOOL Final;
+
+} RENAMESTEP;
+
+
+//**********************************************************************
+// RENAMESLOT
+// ----------
+// The hash table entry for a lowercased name. Exists is TRUE if the
+// name is in the directory, Source is the entry with this name that is
+// being renamed and Target the entry being renamed to it, or -1.
+//**********************************************************************
+
+typedef struct
+{ WCHAR* Key;
+  BOOL Exists;
+  int Source;
+  int Target;
+
+} RENAMESLOT;
+
+
+//**********************************************************************
+// CRenamePlan
+// -----------
+// Class to plan all the renames in one directory before doing any of
+// them. Every name in the directory is added, and Build checks no two
+// files are renamed to the same name and no file would be renamed over
+// a file that is staying. It then orders the renames so a file is
+// renamed out of the way before another is renamed to its name, and
+// breaks cycles like a -> b, b -> a by renaming through a temporary
+// name.
+//**********************************************************************
+
+class CRenamePlan
+{
+  public:
+    CRenamePlan(const WCHAR* Dir);
+    ~CRenamePlan();
+
+    BOOL AddName(const WCHAR* Name, const WCHAR* NewName, BOOL IsDir);
+    BOOL Build(void);
+    BOOL Execute(void);
+    void Free(void);
+
+    inline const WCHAR* Dir(void) { return m_Dir; }
+    inline int NumSteps(void) { return m_NumSteps; }
+    inline const RENAMESTEP* Step(int i) { return m_Step + i; }
+    inline BOOL HasDirs(void) { return m_HasDirs; }
+    inline int NumRenamed(void) { return m_NumRenamed; }
+    inline BOOL Failed(void) { return m_Failed; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    RENAMESLOT* FindSlot(const WCHAR* Name, BOOL Add);
+    BOOL GrowSlots(void);
+    BOOL AddStep(const WCHAR* From, const WCHAR* To, BOOL Final);
+    BOOL MoveStep(const WCHAR* From, const WCHAR* To);
+    WCHAR* TempName(const WCHAR* Name);
+
+    static void ErrorMessage(DWORD Error, WCHAR* Buf, int BufLen);
+
+  private:
+    WCHAR* m_Dir;
+
+    RENAMEENTRY* m_Entry;
+    int m_NumEntries, m_MaxEntries;
+
+    RENAMESLOT* m_Slot;
+    int m_NumSlots, m_UsedSlots;
+
+    RENAMESTEP* m_Step;
+    int m_NumSteps, m_MaxSteps;
+
+// Temporary names are kept so they can be freed
+
+    WCHAR** m_Temp;
+    int m_NumTemps;
+
+    BOOL m_HasDirs;
+    int m_NumRenamed;
+    BOOL m_Failed;
+
+    WCHAR m_LastError[LEN_FILENAME+256];
+};
+
+
+//**********************************************************************
+// End of CRenamePlan
+// ------------------
+//**********************************************************************
+
+#endif // _INC_CRENAMEPLAN
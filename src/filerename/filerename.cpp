@@ -13,7 +13,9 @@
 #include <CRhsIO/CRhsIO.h>
 #include <Misc/CRhsFindFile.h>
 #include <Misc/CRhsWildCard.h>
+#include <Misc/CRhsWorkQueue.h>
 #include <Misc/Utils.h>
+#include "CRenamePlan.h"
 
 
 //**********************************************************************
@@ -22,6 +24,8 @@
 
 DWORD WINAPI rhsmain(LPVOID unused);
 BOOL FileRenameSub(WCHAR* Filename);
+BOOL AddPlan(CRenamePlan* Plan);
+void ExecutePlan(void* Context, void* Item, int Thread);
 
 BOOL SetBackupPrivilege(BOOL NotifyErrors);
 BOOL UnsetBackupPrivilege(BOOL NotifyErrors);
@@ -40,15 +44,30 @@ BOOL g_Recurse, g_Hidden, g_Quiet, g_Report, g_System;
 
 CRhsWildCard g_WildCard;
 
+// The plans for each directory, in the order they were made, which is
+// subdirectories before their parents
+
+CRenamePlan** g_Plan = NULL;
+int g_NumPlans = 0, g_MaxPlans = 0;
+int g_NumErrors = 0, g_NumFileErrors = 0;
+
+// Plans that don't rename directories are done by the worker threads
+// while the tree is still being listed
+
+#define MAX_DEFTHREADS 16
+
+CRhsWorkQueue g_Queue;
+
 #define SYNTAX \
-L"filerename v1.0\r\n" \
-L"Syntax: [-d -h -q -r -s] <old file name> <new file name>\r\n" \
+L"filerename v1.1\r\n" \
+L"Syntax: [-d -h -q -r -s -t<threads>] <old file name> <new file name>\r\n" \
 L"Flags:\r\n" \
 L"  -d recurse into subdirectories\r\n" \
 L"  -h include hidden files\r\n" \
 L"  -q don't list files renamed\r\n" \
 L"  -r report mode\r\n" \
-L"  -s include system files\r\n"
+L"  -s include system files\r\n" \
+L"  -t<threads> number of threads to rename with\r\n"
 
 
 //**********************************************************************
@@ -82,9 +101,19 @@ int wmain(int argc, WCHAR* argv[])
 //**********************************************************************
 
 DWORD WINAPI rhsmain(LPVOID unused)
-{ int numarg;
+{ int numarg, numthreads, i;
+  CRenamePlan* plan;
+  SYSTEM_INFO si;
   WCHAR startdir[LEN_FILENAME+1], s[LEN_FILENAME+1];
 
+// Renaming is mostly waiting for the file system, so by default use
+// two threads per processor
+
+  GetSystemInfo(&si);
+  numthreads = (int) si.dwNumberOfProcessors*2;
+  if (numthreads > MAX_DEFTHREADS)
+    numthreads = MAX_DEFTHREADS;
+
 // Check the arguments
 
   if (RhsIO.m_argc == 2)
@@ -128,6 +157,15 @@ DWORD WINAPI rhsmain(LPVOID unused)
         g_System = TRUE;
         break;
 
+      case 't':
+      case 'T':
+        numthreads = _wtoi(RhsIO.m_argv[numarg]+2);
+        if (numthreads < 1 || numthreads > RHSWORK_MAXTHREADS)
+        { RhsIO.errprintf(L"The number of threads must be from 1 to %i\r\n", RHSWORK_MAXTHREADS);
+          return 2;
+        }
+        break;
+
       case '?':
         RhsIO.printf(SYNTAX);
         return 0;
@@ -165,6 +203,22 @@ DWORD WINAPI rhsmain(LPVOID unused)
     return 2;
   }
 
+// Compile the patterns once for all the files
+
+  if (!g_WildCard.Compile(g_Search, g_Replace))
+  { RhsIO.errprintf(L"%s\r\n", g_WildCard.LastError());
+    return 2;
+  }
+
+// Start the threads that do the renaming
+
+  if (!g_Report)
+  { if (!g_Queue.Start(numthreads, ExecutePlan, NULL))
+    { RhsIO.errprintf(L"Cannot start the renaming threads\r\n");
+      return 2;
+    }
+  }
+
 // Start searching
 
   g_NumFiles = 0;
@@ -177,8 +231,45 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
   FileRenameSub(startdir);
 
+// Wait for the threads to finish then rename the directories. These
+// are done in the order they were planned so the subdirectories of a
+// directory are renamed before it is.
+
+  if (!g_Report)
+  { g_Queue.Wait();
+
+    for (i = 0; i < g_NumPlans; i++)
+      if (g_Plan[i]->HasDirs())
+        ExecutePlan(NULL, g_Plan[i], 0);
+  }
+
+// Report any failures and count the files renamed
+
+  for (i = 0; i < g_NumPlans; i++)
+  { plan = g_Plan[i];
+
+    g_NumFiles += plan->NumRenamed();
+
+    if (plan->Failed())
+    { RhsIO.printf(L"Error in %s: %s\r\n", plan->Dir(), plan->LastError());
+      g_NumErrors++;
+    }
+
+    delete plan;
+  }
+
+  if (g_Plan)
+    free(g_Plan);
+
   if (!g_Quiet)
-    RhsIO.printf(L"%i files renamed\r\n", g_NumFiles);
+    RhsIO.printf(L"%i files %s\r\n", g_NumFiles, g_Report ? L"would be renamed" : L"renamed");
+
+// If anything failed return an error
+
+  if (g_NumErrors > 0 || g_NumFileErrors > 0)
+  { RhsIO.SetLastError(L"%i directories and %i files could not be renamed", g_NumErrors, g_NumFileErrors);
+    return 2;
+  }
 
 /// All done so return indicating success
 
@@ -188,130 +279,202 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
 //**********************************************************************
 // FileRenameSub
-// -----------
+// -------------
+// Plan the renames in one directory. The directory is listed once and
+// every name in it goes into the plan, so the plan can check a new name
+// won't overwrite a file that isn't being renamed.
 //**********************************************************************
 
 BOOL FileRenameSub(WCHAR* StartDir)
-{ BOOL heading;
+{ int numsubdirs, i;
+  BOOL isdir, listed;
+  WCHAR** subdir;
+  WCHAR** p;
+  CRenamePlan* plan;
+  const RENAMESTEP* step;
   CRhsFindFile ff;
-  WCHAR filename[LEN_FILENAME+1], newfilename[LEN_FILENAME+1], s[LEN_FILENAME];
+  WCHAR filename[LEN_FILENAME+1], s[LEN_FILENAME+1];
 
-// If we are recursing into subdirectories do the recursion now
+  plan = new CRenamePlan(StartDir);
+  if (!plan)
+  { RhsIO.printf(L"Out of memory\r\n");
+    return FALSE;
+  }
 
-  if (g_Recurse)
-  { lstrcpy(s, StartDir);
-    lstrcat(s, L"\\*");
+  subdir = NULL;
+  numsubdirs = 0;
+  listed = TRUE;
 
-    if (ff.First(s, filename, LEN_FILENAME))
-    { do
-      {
+  lstrcpy(s, StartDir);
+  lstrcat(s, L"\\*");
 
-  // If we've found a directory recurse into it
+  if (ff.First(s, filename, LEN_FILENAME))
+  { do
+    {
 
-        if (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY)
-        {
+// Ignore . and ..
 
-// If this "directory" is a junction point ignore it
+      if (lstrcmp(filename, L".") == 0 || lstrcmp(filename, L"..") == 0)
+        continue;
 
-          if (ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT)
-            continue;
+      isdir = (ff.Attributes() & FILE_ATTRIBUTE_DIRECTORY) != 0;
 
-// Ignore . and ..
+// If we are recursing save the subdirectories for later, but ignore
+// junction points
 
-          if (lstrcmp(filename, L".") == 0 || lstrcmp(filename, L"..") == 0)
-            continue;
+      if (g_Recurse && isdir && !(ff.Attributes() & FILE_ATTRIBUTE_REPARSE_POINT))
+      { p = (WCHAR**) realloc(subdir, (numsubdirs + 1)*sizeof(WCHAR*));
+        if (p)
+        { subdir = p;
+          ff.FullFilename(s, LEN_FILENAME);
+          subdir[numsubdirs] = _wcsdup(s);
+          if (subdir[numsubdirs])
+            numsubdirs++;
+        }
+      }
 
-// Append the target file name to the directory we've found and recurse
-// into it.
+// Work out the new name. Hidden and system files, and files that don't
+// match, stay as they are.
 
-          ff.FullFilename(filename, LEN_FILENAME);
-          if (!FileRenameSub(filename))
-            return FALSE;
+      if (((ff.Attributes() & FILE_ATTRIBUTE_HIDDEN) && !g_Hidden)
+       || ((ff.Attributes() & FILE_ATTRIBUTE_SYSTEM) && !g_System)
+       || !g_WildCard.Match(filename))
+      { if (!plan->AddName(filename, NULL, isdir))
+        { listed = FALSE;
+          break;
         }
+        continue;
+      }
+
+      if (!g_WildCard.Complete(filename, s, LEN_FILENAME))
+      { RhsIO.printf(L"%s\\%s: %s\r\n", StartDir, filename, g_WildCard.LastError());
+        g_NumFileErrors++;
+        if (!plan->AddName(filename, NULL, isdir))
+        { listed = FALSE;
+          break;
+        }
+        continue;
+      }
+
+      if (!plan->AddName(filename, s, isdir))
+      { listed = FALSE;
+        break;
+      }
 
 // Find next file
 
-      } while (ff.Next(filename, LEN_FILENAME));
-    }
+    } while (ff.Next(filename, LEN_FILENAME));
+  }
+
+  ff.Close();
 
-    ff.Close();
+// Plan the subdirectories first
+
+  for (i = 0; i < numsubdirs; i++)
+  { FileRenameSub(subdir[i]);
+    free(subdir[i]);
   }
 
-// Now we've searched all subdirectories, so search this directory
+  if (subdir)
+    free(subdir);
 
-  heading = FALSE;
+// Only add this directory's plan now, after the plans for all its
+// subdirectories, so the plans are deepest first
 
-  lstrcpy(s, StartDir);
-  lstrcat(s, L"\\");
-  lstrcat(s, g_Search);
+  if (!AddPlan(plan))
+  { delete plan;
+    RhsIO.printf(L"Out of memory\r\n");
+    return FALSE;
+  }
 
-  if (ff.First(s, filename, LEN_FILENAME))
-  { do
-    {
+// Check the renames don't clash. If they do nothing in this directory
+// is renamed. If the directory couldn't be listed completely the plan
+// can't be checked, so nothing is renamed either.
 
-// Check the file attributes
+  if (!listed || !plan->Build())
+  { RhsIO.printf(L"Directory: %s\r\n%s\r\n\r\n", StartDir, plan->LastError());
+    g_NumErrors++;
+    plan->Free();
+    return FALSE;
+  }
 
-      if (ff.Attributes() & FILE_ATTRIBUTE_HIDDEN)
-        if (!g_Hidden)
-          continue;
+  if (plan->NumSteps() == 0)
+    return TRUE;
 
-      if (ff.Attributes() & FILE_ATTRIBUTE_SYSTEM)
-        if (!g_System)
-          continue;
+// List the renames, including the moves to temporary names
 
-// Work out the new name
+  if (!g_Quiet)
+  { RhsIO.printf(L"Directory: %s\r\n", StartDir);
 
-      ff.Filename(filename, LEN_FILENAME);
-      if (!g_WildCard.Complete(g_Search, filename, g_Replace, s, LEN_FILENAME))
-      { RhsIO.printf(L"%s: %s\r\n", filename, g_WildCard.LastError());
-        ff.Close();
-        return FALSE;
-      }
+    for (i = 0; i < plan->NumSteps(); i++)
+    { step = plan->Step(i);
+      RhsIO.printf(L"%s -> %s\r\n", step->From, step->To);
+    }
 
-// If we haven't printed the heading yet do it now
+    RhsIO.printf(L"\r\n");
+  }
 
-      if (!g_Quiet)
-      { if (!heading)
-        { RhsIO.printf(L"Directory: %s\r\n", StartDir);
-          heading = TRUE;
-        }
+// In report mode just count the files that would be renamed
 
-        RhsIO.printf(L"%s -> %s\r\n", filename, s);
-      }
+  if (g_Report)
+  { for (i = 0; i < plan->NumSteps(); i++)
+      if (plan->Step(i)->Final)
+        g_NumFiles++;
 
-// Rename the file
+    plan->Free();
+    return TRUE;
+  }
 
-      if (!g_Report)
-      { lstrcpy(newfilename, StartDir);
-        lstrcat(newfilename, L"\\");
-        lstrcat(newfilename, s);
+// Plans that rename directories have to wait until everything below
+// them has been renamed
 
-        ff.FullFilename(filename, LEN_FILENAME);
+  if (!plan->HasDirs())
+  { if (!g_Queue.Add(plan))
+      ExecutePlan(NULL, plan, 0);
+  }
 
-        if (!MoveFile(filename, newfilename))
-        { RhsIO.printf(L"%s\r\n", GetLastErrorMessage());
-          ff.Close();
-          return FALSE;
-        }
-      }
+// All done so return indicating success
 
-      g_NumFiles++;
+  return TRUE;
+}
 
-// Find next file
 
-    } while (ff.Next(s, LEN_FILENAME));
+//**********************************************************************
+// AddPlan
+// -------
+//**********************************************************************
+
+BOOL AddPlan(CRenamePlan* Plan)
+{ CRenamePlan** p;
+
+  if (!Plan)
+    return FALSE;
+
+  if (g_NumPlans >= g_MaxPlans)
+  { p = (CRenamePlan**) realloc(g_Plan, (g_MaxPlans + 256)*sizeof(CRenamePlan*));
+    if (!p)
+      return FALSE;
+    g_Plan = p;
+    g_MaxPlans += 256;
   }
 
-  ff.Close();
+  g_Plan[g_NumPlans++] = Plan;
+  return TRUE;
+}
 
-// If we've printed anything append a blank line
 
-  if (heading)
-    RhsIO.printf(L"\r\n");
+//**********************************************************************
+// ExecutePlan
+// -----------
+// Called on a worker thread to do the renames in one directory. Only
+// the result is kept once the renames are done.
+//**********************************************************************
 
-// All done so return indicating success
+void ExecutePlan(void* Context, void* Item, int Thread)
+{ CRenamePlan* plan = (CRenamePlan*) Item;
 
-  return TRUE;
+  plan->Execute();
+  plan->Free();
 }
 
 
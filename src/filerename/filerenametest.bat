@@ -0,0 +1,34 @@
+@echo off
+rem *********************************************************************
+rem filerenametest
+rem ==============
+rem Check filerename -d renames nested directories that all match, so
+rem each directory has to be renamed after the ones below it.
+rem
+rem Run from the directory containing filerename.exe
+rem *********************************************************************
+
+setlocal
+
+set TESTDIR=%TEMP%\filerenametest
+if exist "%TESTDIR%" rmdir /s /q "%TESTDIR%"
+
+mkdir "%TESTDIR%\old1\old2\old3"
+mkdir "%TESTDIR%\old1\old4"
+echo test> "%TESTDIR%\old1\old2\old3\old5.txt"
+
+filerename -d -q "%TESTDIR%\old*" "new*"
+if errorlevel 1 goto failed
+
+if not exist "%TESTDIR%\new1\new2\new3\new5.txt" goto failed
+if not exist "%TESTDIR%\new1\new4" goto failed
+if exist "%TESTDIR%\old1" goto failed
+
+echo filerenametest passed
+rmdir /s /q "%TESTDIR%"
+exit /b 0
+
+:failed
+echo filerenametest failed
+dir /s /b "%TESTDIR%"
+exit /b 1
@@ -0,0 +1,597 @@
+//**********************************************************************
+// CArchiveStore
+// =============
+// Deduplicating archive for reconcile -a.
+//
+// Without it every destination file that is overwritten or deleted is
+// copied in full into the archive, so a big file that changes a little
+// every day adds a full copy to the archive every day. With a store the
+// file is split into chunks of 16K to 256K, averaging about 80K, and
+// only chunks that aren't already in the store are written. The archive
+// directory gets a manifest in place of the file, named <file>.manifest,
+// which lists the chunks needed to rebuild it.
+//
+// The chunk boundaries are found with a gear hash: a rolling hash over
+// the last 64 bytes that is updated with one shift and one add per
+// byte. A chunk ends where the top 16 bits of the hash are zero, so the
+// boundaries depend only on the nearby data and are found again in the
+// next version of the file even if bytes were inserted before them.
+//
+// The store is a directory with one subdirectory for each possible
+// first byte of the hash, and each chunk is a file named by its hash in
+// hex. Chunks are never changed once written, so several runs of
+// reconcile, with different archive directories, can share one store.
+//
+// A manifest is a text file:
+//
+// RHSARCHIVE 1
+// ATTRIBUTES <hex>
+// CREATED <hex filetime>
+// MODIFIED <hex filetime>
+// <hash> <length>
+// ...
+// SIZE <bytes>
+// END
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "CArchiveStore.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+#define ARCHIVE_SIGNATURE "RHSARCHIVE 1"
+#define ARCHIVE_END       "END"
+
+// A chunk ends where these bits of the gear hash are zero. The top bits
+// depend on the most bytes.
+
+#define ARCHIVE_CHUNKMASK 0xFFFF000000000000ULL
+
+// Bytes older than this have been shifted out of the gear hash
+
+#define ARCHIVE_WINDOW 64
+
+// Seed for the gear table. It must never change or chunks written by
+// earlier versions would no longer match.
+
+#define ARCHIVE_GEARSEED 0x52485341ULL
+
+
+//**********************************************************************
+// Prototypes
+//**********************************************************************
+
+static BOOL ParseHex(const char* Hex, BYTE* Data, int Len);
+
+
+//**********************************************************************
+// CArchiveStore
+// -------------
+//**********************************************************************
+
+CArchiveStore::CArchiveStore()
+{ int i;
+  UINT64 x, z;
+
+  lstrcpy(m_Store, L"");
+  m_Prov = 0;
+
+  m_BytesArchived = m_BytesStored = 0;
+
+// Fill the gear table with fixed pseudo-random numbers (splitmix64)
+
+  x = ARCHIVE_GEARSEED;
+
+  for (i = 0; i < 256; i++)
+  { x += 0x9E3779B97F4A7C15ULL;
+    z = x;
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    m_Gear[i] = z ^ (z >> 31);
+  }
+
+  lstrcpy(m_LastError, L"");
+}
+
+CArchiveStore::~CArchiveStore()
+{
+  if (m_Prov)
+    CryptReleaseContext(m_Prov, 0);
+}
+
+
+//**********************************************************************
+// Open
+// ----
+// Open the store, creating the directory if it doesn't exist
+//**********************************************************************
+
+BOOL CArchiveStore::Open(const WCHAR* StoreDir)
+{ DWORD attrib;
+
+  if (lstrlen(StoreDir) + 2 + ARCHIVE_HASHLEN*2 + 16 > ARCHIVE_MAXPATH)
+  { swprintf(m_LastError, ARCHIVE_MAXPATH+256, L"The archive store name %s is too long", StoreDir);
+    return FALSE;
+  }
+
+  lstrcpy(m_Store, StoreDir);
+
+  CreateDirectory(m_Store, NULL);
+
+  attrib = GetFileAttributes(m_Store);
+  if (attrib == INVALID_FILE_ATTRIBUTES || !(attrib & FILE_ATTRIBUTE_DIRECTORY))
+  { swprintf(m_LastError, ARCHIVE_MAXPATH+256, L"Cannot create the archive store %s", m_Store);
+    return FALSE;
+  }
+
+  if (!CryptAcquireContext(&m_Prov, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT))
+  { m_Prov = 0;
+    lstrcpy(m_LastError, L"Cannot start the SHA-256 hashing");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Archive
+// -------
+// Split a file into chunks, add the new ones to the store and write a
+// manifest for the file.
+//**********************************************************************
+
+BOOL CArchiveStore::Archive(const WCHAR* FileName, const WCHAR* Manifest)
+{ DWORD bytesread, err;
+  UINT64 hash, total;
+  BOOL eof;
+  BYTE* buf;
+  int start, pos, len, end;
+  FILE* f;
+  HANDLE h;
+  BY_HANDLE_FILE_INFORMATION info;
+
+  h = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  if (!GetFileInformationByHandle(h, &info))
+  { err = GetLastError();
+    CloseHandle(h);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  buf = (BYTE*) malloc(ARCHIVE_BUFSIZE);
+  if (!buf)
+  { CloseHandle(h);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+
+  f = _wfopen(Manifest, L"wb");
+  if (!f)
+  { err = GetLastError();
+    free(buf);
+    CloseHandle(h);
+    SetLastError(err ? err : ERROR_CANNOT_MAKE);
+    return FALSE;
+  }
+
+  fprintf(f, "%s\r\n", ARCHIVE_SIGNATURE);
+  fprintf(f, "ATTRIBUTES %lx\r\n", (unsigned long) info.dwFileAttributes);
+  fprintf(f, "CREATED %08lx%08lx\r\n", (unsigned long) info.ftCreationTime.dwHighDateTime, (unsigned long) info.ftCreationTime.dwLowDateTime);
+  fprintf(f, "MODIFIED %08lx%08lx\r\n", (unsigned long) info.ftLastWriteTime.dwHighDateTime, (unsigned long) info.ftLastWriteTime.dwLowDateTime);
+
+// Buffer holds len bytes. The current chunk starts at start and the
+// hash has been run up to pos. When the buffer is used up the partial
+// chunk is moved to the front and more is read after it.
+
+  err = 0;
+  total = 0;
+  hash = 0;
+  start = pos = len = 0;
+  eof = FALSE;
+
+  for (;;)
+  { if (pos == len)
+    { if (eof)
+      { if (pos > start && !StoreChunk(buf + start, pos - start, f))
+          err = GetLastError();
+        break;
+      }
+
+      memmove(buf, buf + start, len - start);
+      len -= start;
+      pos -= start;
+      start = 0;
+
+      if (!ReadFile(h, buf + len, ARCHIVE_BUFSIZE - len, &bytesread, NULL))
+      { err = GetLastError();
+        break;
+      }
+
+      eof = bytesread == 0;
+      len += (int) bytesread;
+      continue;
+    }
+
+// Bytes more than a window before the minimum chunk size can't affect
+// where the chunk ends, so skip them
+
+    if (pos - start < ARCHIVE_MINCHUNK - ARCHIVE_WINDOW)
+    { end = start + ARCHIVE_MINCHUNK - ARCHIVE_WINDOW;
+      pos = end < len ? end : len;
+      continue;
+    }
+
+    hash = (hash << 1) + m_Gear[buf[pos++]];
+
+    if ((pos - start >= ARCHIVE_MINCHUNK && (hash & ARCHIVE_CHUNKMASK) == 0) || pos - start >= ARCHIVE_MAXCHUNK)
+    { if (!StoreChunk(buf + start, pos - start, f))
+      { err = GetLastError();
+        break;
+      }
+
+      total += pos - start;
+      start = pos;
+      hash = 0;
+    }
+  }
+
+  if (err == 0)
+  { total += pos - start;
+    fprintf(f, "SIZE %.0f\r\n", (double) total);
+    fprintf(f, "%s\r\n", ARCHIVE_END);
+    if (ferror(f))
+      err = ERROR_WRITE_FAULT;
+  }
+
+  if (fclose(f) != 0 && err == 0)
+    err = ERROR_WRITE_FAULT;
+
+  free(buf);
+  CloseHandle(h);
+
+// Don't leave a manifest for a file that wasn't stored
+
+  if (err != 0)
+  { DeleteFile(Manifest);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  InterlockedExchangeAdd64(&m_BytesArchived, (LONGLONG) total);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Restore
+// -------
+// Rebuild a file from its manifest. An existing file is never
+// overwritten. Each chunk is checked against its hash as it's read.
+//**********************************************************************
+
+BOOL CArchiveStore::Restore(const WCHAR* Manifest, const WCHAR* FileName)
+{ DWORD err, written, chunklen;
+  UINT64 attributes, created, modified, size, total;
+  BOOL ended;
+  int len, linenum;
+  char line[256];
+  char* p;
+  BYTE* buf;
+  FILE* f;
+  HANDLE h;
+  FILETIME ftcreated, ftmodified;
+
+  f = _wfopen(Manifest, L"rb");
+  if (!f)
+  { err = GetLastError();
+    SetLastError(err ? err : ERROR_FILE_NOT_FOUND);
+    return FALSE;
+  }
+
+  buf = (BYTE*) malloc(ARCHIVE_MAXCHUNK);
+  if (!buf)
+  { fclose(f);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+
+  h = CreateFile(FileName, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+  { err = GetLastError();
+    free(buf);
+    fclose(f);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  err = 0;
+  ended = FALSE;
+  attributes = created = modified = size = total = 0;
+
+  for (linenum = 1; !ended && err == 0 && fgets(line, sizeof(line), f); linenum++)
+  { len = lstrlenA(line);
+    while (len > 0 && (line[len-1] == '\r' || line[len-1] == '\n'))
+      line[--len] = '\0';
+
+    if (linenum == 1)
+    { if (lstrcmpA(line, ARCHIVE_SIGNATURE) != 0)
+        err = ERROR_INVALID_DATA;
+    }
+    else if (strncmp(line, "ATTRIBUTES ", 11) == 0)
+    { attributes = _strtoui64(line + 11, NULL, 16);
+    }
+    else if (strncmp(line, "CREATED ", 8) == 0)
+    { created = _strtoui64(line + 8, NULL, 16);
+    }
+    else if (strncmp(line, "MODIFIED ", 9) == 0)
+    { modified = _strtoui64(line + 9, NULL, 16);
+    }
+    else if (strncmp(line, "SIZE ", 5) == 0)
+    { size = _strtoui64(line + 5, NULL, 10);
+    }
+    else if (lstrcmpA(line, ARCHIVE_END) == 0)
+    { ended = TRUE;
+    }
+
+// Anything else is a chunk
+
+    else
+    { if (len < ARCHIVE_HASHLEN*2 + 2 || line[ARCHIVE_HASHLEN*2] != ' ')
+      { err = ERROR_INVALID_DATA;
+        break;
+      }
+
+      line[ARCHIVE_HASHLEN*2] = '\0';
+      chunklen = (DWORD) strtoul(line + ARCHIVE_HASHLEN*2 + 1, &p, 10);
+      if (*p != '\0' || chunklen == 0 || chunklen > ARCHIVE_MAXCHUNK)
+      { err = ERROR_INVALID_DATA;
+        break;
+      }
+
+      if (!ReadChunk(line, chunklen, buf))
+      { err = GetLastError();
+        break;
+      }
+
+      if (!WriteFile(h, buf, chunklen, &written, NULL) || written != chunklen)
+      { err = GetLastError();
+        if (err == 0)
+          err = ERROR_WRITE_FAULT;
+        break;
+      }
+
+      total += chunklen;
+    }
+  }
+
+  if (err == 0 && (!ended || total != size))
+    err = ERROR_INVALID_DATA;
+
+// Put back the times and attributes
+
+  if (err == 0)
+  { ftcreated.dwHighDateTime  = (DWORD) (created >> 32);
+    ftcreated.dwLowDateTime   = (DWORD) (created & 0xFFFFFFFF);
+    ftmodified.dwHighDateTime = (DWORD) (modified >> 32);
+    ftmodified.dwLowDateTime  = (DWORD) (modified & 0xFFFFFFFF);
+
+    if (!SetFileTime(h, &ftcreated, NULL, &ftmodified))
+      err = GetLastError();
+  }
+
+  CloseHandle(h);
+  free(buf);
+  fclose(f);
+
+  if (err == 0 && attributes != 0)
+    SetFileAttributes(FileName, (DWORD) attributes);
+
+  if (err != 0)
+  { DeleteFile(FileName);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// StoreChunk
+// ----------
+// Add a chunk to the store if it isn't there already and list it in
+// the manifest. New chunks are written to a temporary file and renamed
+// so a chunk file is never seen half written. If two threads store the
+// same chunk at once the second rename fails and is ignored.
+//**********************************************************************
+
+BOOL CArchiveStore::StoreChunk(const BYTE* Data, DWORD Len, FILE* Manifest)
+{ int i;
+  DWORD err, written;
+  BYTE hash[ARCHIVE_HASHLEN];
+  char hex[ARCHIVE_HASHLEN*2+1];
+  WCHAR chunkfile[ARCHIVE_MAXPATH+1], tempfile[ARCHIVE_MAXPATH+1];
+  HANDLE h;
+
+  if (!HashChunk(Data, Len, hash))
+    return FALSE;
+
+  for (i = 0; i < ARCHIVE_HASHLEN; i++)
+    sprintf(hex + i*2, "%02x", hash[i]);
+
+  ChunkFileName(hex, chunkfile, FALSE);
+
+  if (GetFileAttributes(chunkfile) == INVALID_FILE_ATTRIBUTES)
+  { ChunkFileName(hex, tempfile, TRUE);
+    CreateDirectory(tempfile, NULL);
+
+    swprintf(tempfile, ARCHIVE_MAXPATH+1, L"%s.%lx", chunkfile, (unsigned long) GetCurrentThreadId());
+
+    h = CreateFile(tempfile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+      return FALSE;
+
+    if (!WriteFile(h, Data, Len, &written, NULL) || written != Len)
+    { err = GetLastError();
+      CloseHandle(h);
+      DeleteFile(tempfile);
+      SetLastError(err ? err : ERROR_WRITE_FAULT);
+      return FALSE;
+    }
+
+    CloseHandle(h);
+
+    if (!MoveFile(tempfile, chunkfile))
+    { err = GetLastError();
+      DeleteFile(tempfile);
+      if (GetFileAttributes(chunkfile) == INVALID_FILE_ATTRIBUTES)
+      { SetLastError(err);
+        return FALSE;
+      }
+    }
+    else
+    { InterlockedExchangeAdd64(&m_BytesStored, (LONGLONG) Len);
+    }
+  }
+
+  if (fprintf(Manifest, "%s %lu\r\n", hex, (unsigned long) Len) < 0)
+  { SetLastError(ERROR_WRITE_FAULT);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// ReadChunk
+// ---------
+// Read a chunk from the store and check it hasn't been corrupted
+//**********************************************************************
+
+BOOL CArchiveStore::ReadChunk(const char* HexHash, DWORD Len, BYTE* Data)
+{ DWORD bytesread, err;
+  BYTE expected[ARCHIVE_HASHLEN], hash[ARCHIVE_HASHLEN];
+  WCHAR chunkfile[ARCHIVE_MAXPATH+1];
+  HANDLE h;
+
+  if (!ParseHex(HexHash, expected, ARCHIVE_HASHLEN))
+  { SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+
+  ChunkFileName(HexHash, chunkfile, FALSE);
+
+  h = CreateFile(chunkfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  if (!ReadFile(h, Data, Len, &bytesread, NULL))
+  { err = GetLastError();
+    CloseHandle(h);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  CloseHandle(h);
+
+  if (bytesread != Len || !HashChunk(Data, Len, hash) || memcmp(hash, expected, ARCHIVE_HASHLEN) != 0)
+  { SetLastError(ERROR_CRC);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// HashChunk
+// ---------
+// Get the SHA-256 hash of a chunk
+//**********************************************************************
+
+BOOL CArchiveStore::HashChunk(const BYTE* Data, DWORD Len, BYTE* Hash)
+{ BOOL success;
+  DWORD hashlen;
+  HCRYPTHASH hash;
+
+  if (!CryptCreateHash(m_Prov, CALG_SHA_256, 0, 0, &hash))
+    return FALSE;
+
+  hashlen = ARCHIVE_HASHLEN;
+  success = CryptHashData(hash, Data, Len, 0) && CryptGetHashParam(hash, HP_HASHVAL, Hash, &hashlen, 0);
+
+  CryptDestroyHash(hash);
+
+  return success;
+}
+
+
+//**********************************************************************
+// ChunkFileName
+// -------------
+// The chunk's file name, or with Dir the name of the directory it's in
+//**********************************************************************
+
+void CArchiveStore::ChunkFileName(const char* HexHash, WCHAR* FileName, BOOL Dir)
+{ int i, len;
+
+  lstrcpy(FileName, m_Store);
+  len = lstrlen(FileName);
+
+  FileName[len++] = '\\';
+  FileName[len++] = HexHash[0];
+  FileName[len++] = HexHash[1];
+
+  if (!Dir)
+  { FileName[len++] = '\\';
+    for (i = 0; i < ARCHIVE_HASHLEN*2; i++)
+      FileName[len++] = HexHash[i];
+  }
+
+  FileName[len] = '\0';
+}
+
+
+//**********************************************************************
+// ParseHex
+// --------
+//**********************************************************************
+
+static BOOL ParseHex(const char* Hex, BYTE* Data, int Len)
+{ int i, j, digit;
+
+  for (i = 0; i < Len; i++)
+  { Data[i] = 0;
+
+    for (j = 0; j < 2; j++)
+    { digit = Hex[i*2 + j];
+
+      if (digit >= '0' && digit <= '9')
+        digit -= '0';
+      else if (digit >= 'a' && digit <= 'f')
+        digit -= 'a' - 10;
+      else if (digit >= 'A' && digit <= 'F')
+        digit -= 'A' - 10;
+      else
+        return FALSE;
+
+      Data[i] = (BYTE) (Data[i]*16 + digit);
+    }
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,74 @@
+//**********************************************************************
+// CArchiveStore.h
+// ===============
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CARCHIVESTORE
+#define _INC_CARCHIVESTORE
+
+
+//**********************************************************************
+// CArchiveStore
+// -------------
+// A deduplicating store for archived files. Files are split into chunks
+// at points chosen by their contents, so an insert or delete only
+// changes the chunks around it, and each chunk is stored once under its
+// SHA-256 hash. An archived file is replaced by a small manifest that
+// lists its chunks.
+//
+// Archive and Restore can be called from the copy threads. They return
+// FALSE with the Windows error set, like CopyFile.
+//**********************************************************************
+
+#define ARCHIVE_HASHLEN  32
+#define ARCHIVE_MINCHUNK 0x4000
+#define ARCHIVE_MAXCHUNK 0x40000
+#define ARCHIVE_BUFSIZE  0x100000
+#define ARCHIVE_MAXPATH  2048
+
+#define ARCHIVE_MANIFEXT L".manifest"
+
+class CArchiveStore
+{
+  public:
+    CArchiveStore();
+    ~CArchiveStore();
+
+    BOOL Open(const WCHAR* StoreDir);
+    inline BOOL Enabled(void) { return m_Prov != 0; }
+
+    BOOL Archive(const WCHAR* FileName, const WCHAR* Manifest);
+    BOOL Restore(const WCHAR* Manifest, const WCHAR* FileName);
+
+    inline UINT64 BytesArchived(void) { return (UINT64) m_BytesArchived; }
+    inline UINT64 BytesStored(void) { return (UINT64) m_BytesStored; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL StoreChunk(const BYTE* Data, DWORD Len, FILE* Manifest);
+    BOOL ReadChunk(const char* HexHash, DWORD Len, BYTE* Data);
+    BOOL HashChunk(const BYTE* Data, DWORD Len, BYTE* Hash);
+    void ChunkFileName(const char* HexHash, WCHAR* FileName, BOOL Dir);
+
+  private:
+    WCHAR m_Store[ARCHIVE_MAXPATH+1];
+    HCRYPTPROV m_Prov;
+
+    UINT64 m_Gear[256];
+
+    volatile LONGLONG m_BytesArchived, m_BytesStored;
+
+    WCHAR m_LastError[ARCHIVE_MAXPATH+256];
+};
+
+
+//**********************************************************************
+// End of CArchiveStore
+// --------------------
+//**********************************************************************
+
+#endif // _INC_CARCHIVESTORE
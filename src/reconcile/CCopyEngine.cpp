@@ -0,0 +1,1682 @@
+//**********************************************************************
+// CCopyEngine
+// ===========
+// Copy files using a pool of worker threads.
+//
+// The reconcile plan executor submits a job for every file that needs
+// copying, moving, deleting or timestamping and carries straight on.
+// Worker threads pick up the jobs, subject to a limit on the number of
+// jobs in progress on each volume, and the jobs' log lines are printed
+// in submission order once all the jobs ahead of them have finished.
+// The executor's own messages go through the same list so they stay in
+// order too.
+//
+// Small files are copied with CopyFile. Large files are copied in
+// chunks with several reads and writes in flight at once, bypassing the
+// file cache, and only the allocated parts of sparse files are read. If
+// delta mode is set, updates to large files only copy the parts that
+// changed.
+//
+// If there is a throttle each job waits for it before starting, and
+// large files wait for it before each chunk is read.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <CRhsIO/CRhsIO.h>
+#include "CDeltaCopy.h"
+#include "CReconcilePlan.h"
+#include "CReconcileJournal.h"
+#include "CThrottle.h"
+#include "CReconcileStats.h"
+#include "CCopyEngine.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+// Limit on jobs submitted but not yet printed. When it's reached
+// Submit waits, so the walker can't get too far ahead of the copies.
+
+#define MAX_QUEUEDJOBS 0x1000
+
+// Files this size or bigger are copied in chunks
+
+#define LARGEFILE_SIZE  0x1000000
+#define LARGEFILE_CHUNK 0x100000
+#define LARGEFILE_SLOTS 4
+
+// Unbuffered reads and writes must be whole sectors. This is big enough
+// for any sector size in use.
+
+#define LARGEFILE_ALIGN 0x1000
+
+// How often in milliseconds large copies report their progress
+
+#define LARGEFILE_PROGRESS 1000
+
+// Buffer for copying alternate data streams
+
+#define STREAM_BUFSIZE 0x10000
+
+// When journalling, large copies record their progress this often
+
+#define LARGEFILE_CHECKPOINT 0x4000000
+
+// Below this size a delta copy isn't worth the trouble
+
+#define DELTA_MINSIZE 0x100000
+
+#define LEN_LOGLINE 0x2000
+
+
+//**********************************************************************
+// External functions from reconcile.cpp
+//**********************************************************************
+
+extern CRhsIO RhsIO;
+
+BOOL ReconcileArchiveFile(WCHAR*, WCHAR*);
+
+
+//**********************************************************************
+// CCopyEngine
+// -----------
+//**********************************************************************
+
+CCopyEngine::CCopyEngine()
+{
+  m_NumThreads = 0;
+  m_VolumeDepth = 0;
+  m_Quiet = FALSE;
+  m_FailOnError = TRUE;
+  m_DeltaMode = DELTA_NONE;
+  m_Journal = NULL;
+  m_Throttle = NULL;
+  m_Stats = NULL;
+  m_CopyOptions = COPYOPT_UNBUFFERED;
+  m_ChunkSize = LARGEFILE_CHUNK;
+  m_Progress = NULL;
+  m_ProgressContext = NULL;
+
+  InitializeCriticalSection(&m_Lock);
+  InitializeConditionVariable(&m_WorkReady);
+  InitializeConditionVariable(&m_JobDone);
+
+  m_Head = m_Tail = NULL;
+  m_NumQueued = 0;
+  m_Shutdown = FALSE;
+
+  m_NumVolumes = 0;
+
+  m_Failed = FALSE;
+  m_NumCreated = m_NumUpdated = m_NumDeleted = m_NumTimeStamped = m_NumMoved = 0;
+  m_DeltaLiteral = m_DeltaMatched = 0;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CCopyEngine::~CCopyEngine()
+{
+  Stop();
+  DeleteCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// Start
+// -----
+// Start the worker threads. VolumeDepth is the maximum number of jobs
+// that can be in progress on any one volume.
+//**********************************************************************
+
+BOOL CCopyEngine::Start(int Threads, int VolumeDepth, BOOL Quiet, BOOL FailOnError)
+{ int i;
+  DWORD d;
+
+  if (Threads < 1)
+    Threads = 1;
+  if (Threads > MAX_COPYTHREADS)
+    Threads = MAX_COPYTHREADS;
+
+  m_VolumeDepth = VolumeDepth < 1 ? 1 : VolumeDepth;
+  m_Quiet = Quiet;
+  m_FailOnError = FailOnError;
+  m_Shutdown = FALSE;
+  m_Failed = FALSE;
+
+  for (i = 0; i < Threads; i++)
+  { m_Thread[i] = CreateThread(NULL, 0, WorkerThread, this, 0, &d);
+
+    if (!m_Thread[i])
+    { ErrorMessage(GetLastError(), m_LastError, 256);
+      Stop();
+      return FALSE;
+    }
+
+    m_NumThreads++;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Wait
+// ----
+// Wait for all submitted jobs to finish and be printed. Returns FALSE
+// if a job failed and we are not continuing after errors.
+//**********************************************************************
+
+BOOL CCopyEngine::Wait(void)
+{
+  EnterCriticalSection(&m_Lock);
+
+  while (m_Head)
+    SleepConditionVariableCS(&m_JobDone, &m_Lock, INFINITE);
+
+  LeaveCriticalSection(&m_Lock);
+
+  return !m_Failed;
+}
+
+
+//**********************************************************************
+// Stop
+// ----
+// Stop the worker threads. Any jobs not yet started are thrown away.
+//**********************************************************************
+
+void CCopyEngine::Stop(void)
+{ int i;
+  COPYJOB* job;
+
+  EnterCriticalSection(&m_Lock);
+  m_Shutdown = TRUE;
+  WakeAllConditionVariable(&m_WorkReady);
+  WakeAllConditionVariable(&m_JobDone);
+  LeaveCriticalSection(&m_Lock);
+
+  if (m_NumThreads > 0)
+  { WaitForMultipleObjects(m_NumThreads, m_Thread, TRUE, INFINITE);
+
+    for (i = 0; i < m_NumThreads; i++)
+      CloseHandle(m_Thread[i]);
+  }
+  m_NumThreads = 0;
+
+  while (m_Head)
+  { job = m_Head;
+    m_Head = job->Next;
+    FreeJob(job);
+  }
+  m_Tail = NULL;
+  m_NumQueued = 0;
+
+  for (i = 0; i < m_NumVolumes; i++)
+    free(m_Volume[i]);
+  m_NumVolumes = 0;
+}
+
+
+//**********************************************************************
+// SetCopyOptions
+// --------------
+// Set the COPYOPT flags and the size of the chunks large files are
+// copied in. The chunk size is rounded down to a whole number of
+// sectors.
+//**********************************************************************
+
+void CCopyEngine::SetCopyOptions(DWORD Options, DWORD ChunkSize)
+{
+  m_CopyOptions = Options;
+  m_ChunkSize = ChunkSize & ~(LARGEFILE_ALIGN - 1);
+
+  if (m_ChunkSize < LARGEFILE_ALIGN)
+    m_ChunkSize = LARGEFILE_CHUNK;
+}
+
+
+//**********************************************************************
+// Submit
+// ------
+// Add a job to the end of the list. Archive may be NULL. Size is the
+// size of the source file from the directory listing, which saves
+// asking for it again. Id is the action's index in the journal, or -1.
+//**********************************************************************
+
+BOOL CCopyEngine::Submit(int Type, const WCHAR* Source, const WCHAR* Dest, const WCHAR* Archive, UINT64 Size, int Id)
+{ COPYJOB* job;
+
+  job = NewJob(Type, Source, Dest, Archive);
+  if (!job)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  job->Size = Size;
+  job->Id = Id;
+
+  return QueueJob(job);
+}
+
+
+//**********************************************************************
+// SubmitTimeStamp
+// ---------------
+// Add a job to set the times of Dest. Created may be NULL to set just
+// the modified time.
+//**********************************************************************
+
+BOOL CCopyEngine::SubmitTimeStamp(const WCHAR* Source, const WCHAR* Dest, const FILETIME* Created, const FILETIME* Modified, int Id)
+{ COPYJOB* job;
+
+  job = NewJob(COPYJOB_TIMESTAMP, Source, Dest, NULL);
+  if (!job)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  if (Created)
+  { job->SetCreated = TRUE;
+    job->Created = *Created;
+  }
+  job->Modified = *Modified;
+  job->Id = Id;
+
+  return QueueJob(job);
+}
+
+
+//**********************************************************************
+// QueueJob
+// --------
+//**********************************************************************
+
+BOOL CCopyEngine::QueueJob(COPYJOB* Job)
+{
+  EnterCriticalSection(&m_Lock);
+
+// Wait for room in the list
+
+  while (m_NumQueued >= MAX_QUEUEDJOBS && !m_Shutdown)
+    SleepConditionVariableCS(&m_JobDone, &m_Lock, INFINITE);
+
+// Work out which volumes the job uses
+
+  Job->Volume[0] = Job->Type == COPYJOB_TIMESTAMP ? -1 : VolumeIndex(Job->Source);
+  Job->Volume[1] = VolumeIndex(Job->Dest);
+  Job->Volume[2] = Job->Archive ? VolumeIndex(Job->Archive) : -1;
+
+  if (Job->Volume[1] == Job->Volume[0])
+    Job->Volume[1] = -1;
+  if (Job->Volume[2] == Job->Volume[0] || Job->Volume[2] == Job->Volume[1])
+    Job->Volume[2] = -1;
+
+// Add the job to the list and wake a worker
+
+  AddJob(Job);
+  WakeConditionVariable(&m_WorkReady);
+
+  LeaveCriticalSection(&m_Lock);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// printf
+// ------
+// Print a message in order with the job output
+//**********************************************************************
+
+void CCopyEngine::printf(const WCHAR* Format, ...)
+{ va_list ap;
+
+  va_start(ap, Format);
+  Message(FALSE, Format, ap);
+  va_end(ap);
+}
+
+
+//**********************************************************************
+// errprintf
+// ---------
+//**********************************************************************
+
+void CCopyEngine::errprintf(const WCHAR* Format, ...)
+{ va_list ap;
+
+  va_start(ap, Format);
+  Message(TRUE, Format, ap);
+  va_end(ap);
+}
+
+
+//**********************************************************************
+// Message
+// -------
+// A message is a job that's already finished
+//**********************************************************************
+
+void CCopyEngine::Message(BOOL Error, const WCHAR* Format, va_list ap)
+{ COPYJOB* job;
+
+  job = NewJob(COPYJOB_MESSAGE, L"", L"", NULL);
+  if (!job)
+    return;
+
+  JobLog(job, Error, Format, ap);
+  job->State = COPYSTATE_DONE;
+  job->Volume[0] = job->Volume[1] = job->Volume[2] = -1;
+
+  EnterCriticalSection(&m_Lock);
+  AddJob(job);
+  FlushLog();
+  LeaveCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// WorkerThread
+// ------------
+//**********************************************************************
+
+DWORD WINAPI CCopyEngine::WorkerThread(LPVOID Param)
+{
+  ((CCopyEngine*) Param)->Worker();
+  return 0;
+}
+
+
+//**********************************************************************
+// Worker
+// ------
+// Take jobs off the list and run them until told to stop
+//**********************************************************************
+
+void CCopyEngine::Worker(void)
+{ int i;
+  COPYJOB* job;
+
+  EnterCriticalSection(&m_Lock);
+
+  while (!m_Shutdown)
+  {
+
+// Find a job we are allowed to run
+
+    job = NextJob();
+    if (!job)
+    { SleepConditionVariableCS(&m_WorkReady, &m_Lock, INFINITE);
+      continue;
+    }
+
+    job->State = COPYSTATE_RUNNING;
+    for (i = 0; i < COPYJOB_VOLUMES; i++)
+      if (job->Volume[i] >= 0)
+        m_InFlight[job->Volume[i]]++;
+
+// Run the job without holding the lock. Once an error has stopped the
+// run, or the user has aborted, the remaining jobs are just skipped.
+// Only jobs that succeed go in the journal.
+
+    LeaveCriticalSection(&m_Lock);
+
+    if (!m_Failed && !RhsIO.GetAbort())
+    { if (!RunJob(job))
+      { job->Failed = TRUE;
+        if (m_FailOnError)
+          m_Failed = TRUE;
+      }
+      else if (m_Journal && job->Id >= 0)
+      { m_Journal->Done(job->Id);
+      }
+    }
+
+    EnterCriticalSection(&m_Lock);
+
+// Release the volumes and print whatever is now at the head of the list
+
+    for (i = 0; i < COPYJOB_VOLUMES; i++)
+      if (job->Volume[i] >= 0)
+        m_InFlight[job->Volume[i]]--;
+
+    job->State = COPYSTATE_DONE;
+    FlushLog();
+
+// Releasing the volumes may let another worker run a job
+
+    WakeAllConditionVariable(&m_WorkReady);
+  }
+
+  LeaveCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// NextJob
+// -------
+// Find the first pending job whose volumes are all below the limit.
+// Must be called with the lock held.
+//**********************************************************************
+
+COPYJOB* CCopyEngine::NextJob(void)
+{ int i;
+  COPYJOB* job;
+
+  for (job = m_Head; job; job = job->Next)
+  { if (job->State != COPYSTATE_PENDING)
+      continue;
+
+    for (i = 0; i < COPYJOB_VOLUMES; i++)
+      if (job->Volume[i] >= 0 && m_InFlight[job->Volume[i]] >= m_VolumeDepth)
+        break;
+
+    if (i == COPYJOB_VOLUMES)
+      return job;
+  }
+
+  return NULL;
+}
+
+
+//**********************************************************************
+// RunJob
+// ------
+// Do the work and log the result. This runs on a worker thread.
+//
+// When resuming from a journal an update that was archived last time
+// isn't archived again, because the destination may now be a partial
+// copy. Likewise a file that has already gone counts as deleted, and
+// a file that is already at the end of its move counts as moved.
+//**********************************************************************
+
+BOOL CCopyEngine::RunJob(COPYJOB* Job)
+{ BOOL b, journal;
+  UINT64 started;
+  WCHAR errmsg[256];
+  HANDLE h;
+  SYSTEMTIME st;
+
+  journal = m_Journal && Job->Id >= 0;
+
+// Wait for the throttle. Large files are charged for their bytes a
+// chunk at a time as they are copied, and delta copies only for the
+// bytes they copy from the source.
+
+  if (m_Throttle)
+    m_Throttle->Take((Job->Type == COPYJOB_CREATE || Job->Type == COPYJOB_UPDATE) && Job->Size < LARGEFILE_SIZE && !IsDeltaJob(Job) ? Job->Size : 0, 1);
+
+  switch (Job->Type)
+  {
+
+// Copy a new file
+
+    case COPYJOB_CREATE:
+      JobPrintf(Job, L"X %s %s\r\n", Job->Source, Job->Dest);
+
+      if (!CopyJobFile(Job, errmsg, 256))
+      { JobErrPrintf(Job, L"E Cannot copy %s to %s: %s\r\n", Job->Source, Job->Dest, errmsg);
+        return FALSE;
+      }
+
+      InterlockedIncrement(&m_NumCreated);
+      break;
+
+// Update an existing file, archiving the old copy if required
+
+    case COPYJOB_UPDATE:
+      JobPrintf(Job, L"U %s %s\r\n", Job->Source, Job->Dest);
+
+      if (Job->Archive && !(journal && m_Journal->IsArchived(Job->Id)))
+      { JobPrintf(Job, L"A %s %s\r\n", Job->Dest, Job->Archive);
+
+        if (!ArchiveFile(Job->Dest, Job->Archive))
+        { ErrorMessage(GetLastError(), errmsg, 256);
+          JobErrPrintf(Job, L"E Cannot archive %s to %s: %s\r\n", Job->Dest, Job->Archive, errmsg);
+          return FALSE;
+        }
+
+        if (journal && !m_Journal->Archived(Job->Id))
+        { JobErrPrintf(Job, L"E %s\r\n", m_Journal->LastError());
+          return FALSE;
+        }
+      }
+
+      SetFileAttributes(Job->Dest, 0);
+
+      if (!CopyJobFile(Job, errmsg, 256))
+      { JobErrPrintf(Job, L"E Cannot copy %s to %s: %s\r\n", Job->Source, Job->Dest, errmsg);
+        return FALSE;
+      }
+
+      InterlockedIncrement(&m_NumUpdated);
+      break;
+
+// Delete a file, archiving it first if required
+
+    case COPYJOB_DELETE:
+      JobPrintf(Job, L"D %s\r\n", Job->Dest);
+
+      if (journal && m_Journal->Resuming() && GetFileAttributes(Job->Dest) == INVALID_FILE_ATTRIBUTES
+       && GetLastError() == ERROR_FILE_NOT_FOUND)
+      { InterlockedIncrement(&m_NumDeleted);
+        break;
+      }
+
+      if (Job->Archive)
+      { JobPrintf(Job, L"A %s %s\r\n", Job->Dest, Job->Archive);
+
+        if (!ArchiveFile(Job->Dest, Job->Archive))
+        { ErrorMessage(GetLastError(), errmsg, 256);
+          JobErrPrintf(Job, L"E Cannot archive %s to %s: %s\r\n", Job->Dest, Job->Archive, errmsg);
+          return FALSE;
+        }
+      }
+
+      SetFileAttributes(Job->Dest, 0);
+
+      if (!DeleteFile(Job->Dest))
+      { ErrorMessage(GetLastError(), errmsg, 256);
+        JobErrPrintf(Job, L"E Cannot delete file %s: %s\r\n", Job->Dest, errmsg);
+        return FALSE;
+      }
+
+      InterlockedIncrement(&m_NumDeleted);
+      break;
+
+// Move a file within the destination. The source is the old name and
+// the file is archived under that name, as it would have been if it had
+// been deleted. MoveFile won't overwrite an existing file.
+
+    case COPYJOB_MOVE:
+      JobPrintf(Job, L"V %s %s\r\n", Job->Source, Job->Dest);
+
+      if (journal && m_Journal->Resuming() && GetFileAttributes(Job->Source) == INVALID_FILE_ATTRIBUTES
+       && GetLastError() == ERROR_FILE_NOT_FOUND && GetFileAttributes(Job->Dest) != INVALID_FILE_ATTRIBUTES)
+      { InterlockedIncrement(&m_NumMoved);
+        break;
+      }
+
+      if (Job->Archive && !(journal && m_Journal->IsArchived(Job->Id)))
+      { JobPrintf(Job, L"A %s %s\r\n", Job->Source, Job->Archive);
+
+        if (!ArchiveFile(Job->Source, Job->Archive))
+        { ErrorMessage(GetLastError(), errmsg, 256);
+          JobErrPrintf(Job, L"E Cannot archive %s to %s: %s\r\n", Job->Source, Job->Archive, errmsg);
+          return FALSE;
+        }
+
+        if (journal && !m_Journal->Archived(Job->Id))
+        { JobErrPrintf(Job, L"E %s\r\n", m_Journal->LastError());
+          return FALSE;
+        }
+      }
+
+      if (!MoveFile(Job->Source, Job->Dest))
+      { ErrorMessage(GetLastError(), errmsg, 256);
+        JobErrPrintf(Job, L"E Cannot move %s to %s: %s\r\n", Job->Source, Job->Dest, errmsg);
+        return FALSE;
+      }
+
+      InterlockedIncrement(&m_NumMoved);
+      break;
+
+// Set the times. Opening for FILE_WRITE_ATTRIBUTES works even if the
+// file is read-only.
+
+    case COPYJOB_TIMESTAMP:
+      FileTimeToSystemTime(&Job->Modified, &st);
+      JobPrintf(Job, L"T %s %s %i/%i/%i %02i:%02i:%02i\r\n", Job->Source, Job->Dest, st.wDay, st.wMonth, st.wYear%100, st.wHour, st.wMinute, st.wSecond);
+
+      started = m_Stats ? m_Stats->Now() : 0;
+      h = CreateFile(Job->Dest, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+      b = h != INVALID_HANDLE_VALUE;
+
+      if (b && m_Stats)
+        m_Stats->Opened(Job->Dest, started);
+
+      if (b)
+      { b = SetFileTime(h, Job->SetCreated ? &Job->Created : NULL, NULL, &Job->Modified);
+        if (!b)
+          ErrorMessage(GetLastError(), errmsg, 256);
+        CloseHandle(h);
+      }
+      else
+      { ErrorMessage(GetLastError(), errmsg, 256);
+      }
+
+      if (!b)
+      { JobErrPrintf(Job, L"E Cannot timestamp %s to match %s: %s\r\n", Job->Dest, Job->Source, errmsg);
+        return FALSE;
+      }
+
+      InterlockedIncrement(&m_NumTimeStamped);
+      break;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// IsDeltaJob
+// ----------
+// When updating a big file in delta mode copy just the changes. The
+// size is only used to choose how to copy, so it doesn't matter if the
+// file has changed since it was listed.
+//**********************************************************************
+
+BOOL CCopyEngine::IsDeltaJob(COPYJOB* Job)
+{
+  return Job->Type == COPYJOB_UPDATE && m_DeltaMode != DELTA_NONE && Job->Size >= DELTA_MINSIZE;
+}
+
+
+//**********************************************************************
+// CopyJobFile
+// -----------
+// Copy the job's source file to its destination, and its access control
+// list if required. On failure the error message is returned in ErrMsg.
+//**********************************************************************
+
+BOOL CCopyEngine::CopyJobFile(COPYJOB* Job, WCHAR* ErrMsg, int ErrLen)
+{ BOOL b;
+  UINT64 copied;
+  ULONGLONG started;
+  CDeltaCopy delta;
+
+// A delta copy charges the throttle for the bytes it copies from the
+// source as it writes them, and only those bytes count as copied.
+
+  if (IsDeltaJob(Job))
+  { delta.SetThrottle(m_Throttle);
+    b = delta.Copy(Job->Source, Job->Dest, m_DeltaMode);
+    if (b)
+    { InterlockedExchangeAdd64(&m_DeltaLiteral, (LONGLONG) delta.LiteralBytes());
+      InterlockedExchangeAdd64(&m_DeltaMatched, (LONGLONG) delta.MatchedBytes());
+    }
+    copied = delta.LiteralBytes();
+  }
+  else if (Job->Size >= LARGEFILE_SIZE)
+  { b = CopyLargeFile(Job);
+    copied = Job->Size;
+  }
+  else
+  { copied = Job->Size;
+    started = GetTickCount64();
+    b = CopyFile(Job->Source, Job->Dest, FALSE);
+
+// The time taken to copy a small file is a fair measure of the latency
+
+    if (b && m_Throttle && Job->Size <= LARGEFILE_CHUNK)
+      m_Throttle->Latency((DWORD) (GetTickCount64() - started));
+  }
+
+  if (b && (m_CopyOptions & COPYOPT_SECURITY))
+    b = CopySecurity(Job->Source, Job->Dest);
+
+  if (b && m_Stats)
+    m_Stats->Copied(copied);
+
+  if (!b)
+    ErrorMessage(GetLastError(), ErrMsg, ErrLen);
+
+  return b;
+}
+
+
+//**********************************************************************
+// CopyLargeFile
+// -------------
+// Copy a file in chunks with several reads and writes in progress at
+// once. The chunks go round a ring of buffers. When a read completes
+// its write is started, and the buffer behind it is reused for the
+// next read once its write has finished. The destination gets the
+// source's attributes and modified time, as it would with CopyFile.
+//
+// Unless it's turned off the files are opened without buffering, so a
+// big copy doesn't push everything else out of the file cache. The
+// reads and writes are then rounded up to whole sectors, and the
+// destination is cut back to the right size at the end. If a file
+// can't be opened unbuffered it's opened normally.
+//
+// For a sparse file only the ranges the file system says are allocated
+// are read, and the destination is made sparse so the holes don't take
+// up space there either. Anything else is copied as one range covering
+// the whole file.
+//
+// When there is a journal the copy records its progress every so often,
+// once the destination has been flushed up to that point. A copy that
+// was interrupted carries on from the last recorded offset, as long as
+// the source hasn't changed since.
+//**********************************************************************
+
+#define SLOT_IDLE    0
+#define SLOT_READING 1
+#define SLOT_WRITING 2
+
+typedef struct
+{ BYTE* buf;
+  UINT64 offset;
+  DWORD len, datalen;
+  int state;
+  ULONGLONG started;
+  OVERLAPPED ov;
+} COPYSLOT;
+
+typedef struct
+{ UINT64 start, end;
+} COPYRANGE;
+
+typedef struct
+{ COPYRANGE* range;
+  int num, max, cur;
+  UINT64 next;
+} COPYRANGES;
+
+static BOOL AddCopyRange(COPYRANGES* Ranges, UINT64 Start, UINT64 End, UINT64 Align)
+{ COPYRANGE* r;
+
+  Start &= ~(Align - 1);
+  End = (End + Align - 1) & ~(Align - 1);
+
+// Join it to the last range if they touch once they've been aligned
+
+  if (Ranges->num > 0 && Start <= Ranges->range[Ranges->num-1].end)
+  { if (End > Ranges->range[Ranges->num-1].end)
+      Ranges->range[Ranges->num-1].end = End;
+    return TRUE;
+  }
+
+  if (Ranges->num >= Ranges->max)
+  { r = (COPYRANGE*) realloc(Ranges->range, (Ranges->max + 64)*sizeof(COPYRANGE));
+    if (!r)
+      return FALSE;
+    Ranges->range = r;
+    Ranges->max += 64;
+  }
+
+  Ranges->range[Ranges->num].start = Start;
+  Ranges->range[Ranges->num].end = End;
+  Ranges->num++;
+
+  return TRUE;
+}
+
+static BOOL GetCopyRanges(HANDLE h, HANDLE Event, UINT64 Size, BOOL Sparse, UINT64 Align, COPYRANGES* Ranges)
+{ int i, n;
+  BOOL ok;
+  DWORD err, numdone;
+  UINT64 from;
+  OVERLAPPED ov;
+  FILE_ALLOCATED_RANGE_BUFFER query, found[64];
+
+  Ranges->num = Ranges->cur = 0;
+
+// Ask for the allocated ranges a block at a time. If the file system
+// can't say, copy the whole file.
+
+  for (from = 0; Sparse && from < Size; )
+  { query.FileOffset.QuadPart = (LONGLONG) from;
+    query.Length.QuadPart = (LONGLONG) (Size - from);
+
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = Event;
+    ResetEvent(Event);
+    numdone = 0;
+
+    ok = DeviceIoControl(h, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), found, sizeof(found), &numdone, &ov);
+    err = ok ? ERROR_SUCCESS : GetLastError();
+
+    if (err == ERROR_IO_PENDING || err == ERROR_MORE_DATA)
+    { ok = GetOverlappedResult(h, &ov, &numdone, TRUE);
+      err = ok ? ERROR_SUCCESS : GetLastError();
+    }
+
+    if (err != ERROR_SUCCESS && err != ERROR_MORE_DATA)
+    { Ranges->num = 0;
+      Sparse = FALSE;
+      break;
+    }
+
+    n = (int) (numdone/sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+
+    for (i = 0; i < n; i++)
+      if (!AddCopyRange(Ranges, (UINT64) found[i].FileOffset.QuadPart, (UINT64) (found[i].FileOffset.QuadPart + found[i].Length.QuadPart), Align))
+        return FALSE;
+
+    if (err == ERROR_SUCCESS || n == 0)
+      break;
+
+    from = (UINT64) (found[n-1].FileOffset.QuadPart + found[n-1].Length.QuadPart);
+  }
+
+  if (!Sparse && Size > 0)
+    return AddCopyRange(Ranges, 0, Size, Align);
+
+  return TRUE;
+}
+
+static BOOL StartSlotIO(COPYSLOT* Slot, HANDLE h, BOOL Write)
+{
+  Slot->ov.Offset = (DWORD) Slot->offset;
+  Slot->ov.OffsetHigh = (DWORD) (Slot->offset >> 32);
+  ResetEvent(Slot->ov.hEvent);
+  Slot->started = GetTickCount64();
+
+  if (!(Write ? WriteFile(h, Slot->buf, Slot->len, NULL, &Slot->ov)
+              : ReadFile(h, Slot->buf, Slot->len, NULL, &Slot->ov)))
+  { if (GetLastError() != ERROR_IO_PENDING)
+    { Slot->state = SLOT_IDLE;
+      return FALSE;
+    }
+  }
+
+  Slot->state = Write ? SLOT_WRITING : SLOT_READING;
+  return TRUE;
+}
+
+// Start reading the next chunk of the current range. A rounded up read
+// at the end of the file returns fewer bytes, and datalen is the number
+// it should return.
+
+static BOOL StartSlotRead(COPYSLOT* Slot, HANDLE h, COPYRANGES* Ranges, DWORD ChunkSize, UINT64 Size, CThrottle* Throttle)
+{ COPYRANGE* r;
+
+  for (;;)
+  { if (Ranges->cur >= Ranges->num)
+    { Slot->state = SLOT_IDLE;
+      return TRUE;
+    }
+
+    r = Ranges->range + Ranges->cur;
+    if (Ranges->next < r->start)
+      Ranges->next = r->start;
+    if (Ranges->next < r->end)
+      break;
+
+    Ranges->cur++;
+  }
+
+  Slot->offset = Ranges->next;
+  Slot->len = r->end - Ranges->next < ChunkSize ? (DWORD) (r->end - Ranges->next) : ChunkSize;
+  Slot->datalen = Size - Slot->offset < Slot->len ? (DWORD) (Size - Slot->offset) : Slot->len;
+  Ranges->next += Slot->len;
+
+  if (Throttle)
+    Throttle->Take(Slot->datalen, 0);
+
+  return StartSlotIO(Slot, h, FALSE);
+}
+
+static HANDLE OpenCopyFile(const WCHAR* FileName, DWORD Access, DWORD Share, DWORD Disposition, DWORD Flags, BOOL* Unbuffered, CReconcileStats* Stats)
+{ UINT64 started;
+  HANDLE h;
+
+  started = Stats ? Stats->Now() : 0;
+  h = INVALID_HANDLE_VALUE;
+
+  if (*Unbuffered)
+  { h = CreateFile(FileName, Access, Share, NULL, Disposition, Flags | FILE_FLAG_NO_BUFFERING, NULL);
+    if (h == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_NOT_FOUND)
+      *Unbuffered = FALSE;
+  }
+
+  if (!*Unbuffered)
+    h = CreateFile(FileName, Access, Share, NULL, Disposition, Flags, NULL);
+
+  if (h != INVALID_HANDLE_VALUE && Stats)
+    Stats->Opened(FileName, started);
+
+  return h;
+}
+
+BOOL CCopyEngine::CopyLargeFile(COPYJOB* Job)
+{ int i, prev;
+  BOOL success, journal, sparse, srcunbuffered, destunbuffered;
+  DWORD err, numdone;
+  UINT64 size, iosize, align, start, confirmed, checkpoint;
+  ULONGLONG lastprogress;
+  HANDLE src, dest;
+  LARGE_INTEGER li;
+  FILETIME ft;
+  OVERLAPPED ov;
+  FILE_END_OF_FILE_INFO eof;
+  BY_HANDLE_FILE_INFORMATION info;
+  COPYRANGES ranges;
+  COPYSLOT slot[LARGEFILE_SLOTS];
+
+// Open the source
+
+  srcunbuffered = destunbuffered = (m_CopyOptions & COPYOPT_UNBUFFERED) != 0;
+
+  src = OpenCopyFile(Job->Source, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, &srcunbuffered, m_Stats);
+  if (src == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  if (!GetFileInformationByHandle(src, &info))
+  { err = GetLastError();
+    CloseHandle(src);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  size = ((UINT64) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  sparse = (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+
+// Unbuffered I/O goes in whole sectors, so the end of the last chunk
+// can be past the end of the file
+
+  align = srcunbuffered || destunbuffered ? LARGEFILE_ALIGN : 1;
+  iosize = (size + align - 1) & ~(align - 1);
+
+// See if an earlier run got part way through. The partial destination
+// must still be there and the full size, or the rounded up size if the
+// run stopped after writing the last chunk.
+
+  journal = m_Journal && Job->Id >= 0;
+  start = journal ? m_Journal->Progress(Job->Id, size, &info.ftLastWriteTime) : 0;
+  start &= ~(align - 1);
+  dest = INVALID_HANDLE_VALUE;
+
+  if (start > 0)
+  { dest = OpenCopyFile(Job->Dest, GENERIC_WRITE, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, &destunbuffered, m_Stats);
+
+    if (dest != INVALID_HANDLE_VALUE)
+    { if (!GetFileSizeEx(dest, &li) || ((UINT64) li.QuadPart != size && (UINT64) li.QuadPart != iosize))
+      { CloseHandle(dest);
+        dest = INVALID_HANDLE_VALUE;
+      }
+    }
+
+    if (dest == INVALID_HANDLE_VALUE)
+      start = 0;
+  }
+
+  if (dest == INVALID_HANDLE_VALUE)
+    dest = OpenCopyFile(Job->Dest, GENERIC_WRITE, 0, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, &destunbuffered, m_Stats);
+
+  if (dest == INVALID_HANDLE_VALUE)
+  { err = GetLastError();
+    CloseHandle(src);
+    SetLastError(err);
+    return FALSE;
+  }
+
+// If the source is sparse make the destination sparse before setting
+// its size. If the file system doesn't do sparse files the holes are
+// filled with zeros, which is still a good copy.
+
+  ZeroMemory(&ov, sizeof(ov));
+  ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+  if (sparse && ov.hEvent)
+  { if (!DeviceIoControl(dest, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &numdone, &ov) && GetLastError() == ERROR_IO_PENDING)
+      GetOverlappedResult(dest, &ov, &numdone, TRUE);
+  }
+
+// Set the size up front. This avoids fragmenting the destination and
+// means the writes don't have to extend the file.
+
+  li.QuadPart = (LONGLONG) size;
+  SetFilePointerEx(dest, li, NULL, FILE_BEGIN);
+  SetEndOfFile(dest);
+
+// Set the modified time to the distant past and stop the writes
+// updating it. If we stop part way through the file looks out of date
+// and the next run will copy it again.
+
+  ft.dwLowDateTime = 1;
+  ft.dwHighDateTime = 0;
+  SetFileTime(dest, NULL, NULL, &ft);
+
+  ft.dwLowDateTime = ft.dwHighDateTime = 0xFFFFFFFF;
+  SetFileTime(dest, NULL, NULL, &ft);
+
+// Find the ranges to copy and allocate the buffers. VirtualAlloc gives
+// page aligned buffers, as unbuffered I/O needs.
+
+  success = TRUE;
+  err = ERROR_SUCCESS;
+  checkpoint = start;
+  lastprogress = GetTickCount64();
+
+  ZeroMemory(&ranges, sizeof(ranges));
+  ranges.next = start;
+
+  if (!ov.hEvent || !GetCopyRanges(src, ov.hEvent, size, sparse, align, &ranges))
+  { success = FALSE;
+    err = ERROR_NOT_ENOUGH_MEMORY;
+  }
+
+  for (i = 0; i < LARGEFILE_SLOTS; i++)
+  { ZeroMemory(&slot[i], sizeof(COPYSLOT));
+    slot[i].buf = (BYTE*) VirtualAlloc(NULL, m_ChunkSize, MEM_COMMIT, PAGE_READWRITE);
+    slot[i].ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (!slot[i].buf || !slot[i].ov.hEvent)
+    { success = FALSE;
+      err = ERROR_NOT_ENOUGH_MEMORY;
+    }
+  }
+
+// Start the first reads
+
+  for (i = 0; i < LARGEFILE_SLOTS && success; i++)
+  { if (!StartSlotRead(&slot[i], src, &ranges, m_ChunkSize, size, m_Throttle))
+    { err = GetLastError();
+      success = FALSE;
+    }
+  }
+
+// Go round the ring. The reads are started in ring order so the first
+// idle slot we come to means the whole file has been read.
+
+  for (i = 0; success && slot[i].state == SLOT_READING; i = (i + 1) % LARGEFILE_SLOTS)
+  { slot[i].state = SLOT_IDLE;
+
+    if (!GetOverlappedResult(src, &slot[i].ov, &numdone, TRUE) || numdone != slot[i].datalen)
+    { err = GetLastError();
+      if (err == ERROR_SUCCESS)
+        err = ERROR_HANDLE_EOF;
+      success = FALSE;
+      break;
+    }
+
+    if (m_Throttle)
+      m_Throttle->Latency((DWORD) (GetTickCount64() - slot[i].started));
+
+    if (!StartSlotIO(&slot[i], dest, TRUE))
+    { err = GetLastError();
+      success = FALSE;
+      break;
+    }
+
+    prev = (i + LARGEFILE_SLOTS - 1) % LARGEFILE_SLOTS;
+
+    if (slot[prev].state == SLOT_WRITING)
+    { slot[prev].state = SLOT_IDLE;
+
+      if (!GetOverlappedResult(dest, &slot[prev].ov, &numdone, TRUE) || numdone != slot[prev].len)
+      { err = GetLastError();
+        success = FALSE;
+        break;
+      }
+
+      if (m_Throttle)
+        m_Throttle->Latency((DWORD) (GetTickCount64() - slot[prev].started));
+
+// The writes finish in ring order, so everything up to the end of this
+// one has been written. If the journal can't be written we just stop
+// recording the progress.
+
+      confirmed = slot[prev].offset + slot[prev].len;
+      if (confirmed > size)
+        confirmed = size;
+
+      if (journal && confirmed - checkpoint >= LARGEFILE_CHECKPOINT)
+      { if (!FlushFileBuffers(dest))
+        { err = GetLastError();
+          success = FALSE;
+          break;
+        }
+
+        if (m_Journal->SetProgress(Job->Id, confirmed, size, &info.ftLastWriteTime))
+          checkpoint = confirmed;
+        else
+          journal = FALSE;
+      }
+
+      if (m_Progress && GetTickCount64() - lastprogress >= LARGEFILE_PROGRESS)
+      { m_Progress(m_ProgressContext, Job->Dest, confirmed, size);
+        lastprogress = GetTickCount64();
+      }
+
+// An abort normally lets the copies in progress finish, but a large
+// copy can stop now because the journal lets the next run carry on
+
+      if (journal && RhsIO.GetAbort())
+      { err = ERROR_OPERATION_ABORTED;
+        success = FALSE;
+        break;
+      }
+
+      if (!StartSlotRead(&slot[prev], src, &ranges, m_ChunkSize, size, m_Throttle))
+      { err = GetLastError();
+        success = FALSE;
+        break;
+      }
+    }
+  }
+
+// Wait for anything still in progress, even after an error, because
+// the buffers can't be freed until the I/O has finished.
+
+  if (!success)
+  { CancelIo(src);
+    CancelIo(dest);
+  }
+
+  for (i = 0; i < LARGEFILE_SLOTS; i++)
+  { if (slot[i].state == SLOT_READING)
+      GetOverlappedResult(src, &slot[i].ov, &numdone, TRUE);
+
+    if (slot[i].state == SLOT_WRITING)
+    { if (!GetOverlappedResult(dest, &slot[i].ov, &numdone, TRUE) || numdone != slot[i].len)
+      { if (success)
+          err = GetLastError();
+        success = FALSE;
+      }
+    }
+
+    if (slot[i].buf)
+      VirtualFree(slot[i].buf, 0, MEM_RELEASE);
+    if (slot[i].ov.hEvent)
+      CloseHandle(slot[i].ov.hEvent);
+  }
+
+  if (ranges.range)
+    free(ranges.range);
+  if (ov.hEvent)
+    CloseHandle(ov.hEvent);
+
+// Cut off anything written past the end by the last unbuffered write
+
+  if (success && iosize != size)
+  { eof.EndOfFile.QuadPart = (LONGLONG) size;
+    if (!SetFileInformationByHandle(dest, FileEndOfFileInfo, &eof, sizeof(eof)))
+    { err = GetLastError();
+      success = FALSE;
+    }
+  }
+
+// Copy the streams before setting the modified time because writing
+// them changes it
+
+  if (success && (m_CopyOptions & COPYOPT_STREAMS))
+  { if (!CopyStreams(Job->Source, Job->Dest))
+    { err = GetLastError();
+      success = FALSE;
+    }
+  }
+
+// Set the modified time to match the source, as CopyFile does
+
+  if (success)
+  { SetFileTime(dest, NULL, NULL, &info.ftLastWriteTime);
+
+    if (m_Progress)
+      m_Progress(m_ProgressContext, Job->Dest, size, size);
+  }
+
+  CloseHandle(src);
+  CloseHandle(dest);
+
+// Don't leave a partial file behind unless the journal says how much
+// of it can be kept
+
+  if (!success)
+  { if (checkpoint == 0)
+      DeleteFile(Job->Dest);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  SetFileAttributes(Job->Dest, info.dwFileAttributes);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CopyStreams
+// -----------
+// Copy the alternate data streams of a file. CopyFile does this for
+// small files. If the streams can't be listed, for example because the
+// source isn't on NTFS, there is nothing to copy.
+//**********************************************************************
+
+BOOL CCopyEngine::CopyStreams(const WCHAR* Source, const WCHAR* Dest)
+{ BOOL success, more;
+  DWORD err, numread, numwritten;
+  HANDLE hfind, src, dest;
+  WCHAR* from;
+  WCHAR* to;
+  BYTE* buf;
+  WIN32_FIND_STREAM_DATA fsd;
+
+  hfind = FindFirstStreamW(Source, FindStreamInfoStandard, &fsd, 0);
+  if (hfind == INVALID_HANDLE_VALUE)
+    return TRUE;
+
+  from = (WCHAR*) malloc((lstrlen(Source) + MAX_PATH + 40)*sizeof(WCHAR));
+  to = (WCHAR*) malloc((lstrlen(Dest) + MAX_PATH + 40)*sizeof(WCHAR));
+  buf = (BYTE*) malloc(STREAM_BUFSIZE);
+
+  success = from && to && buf;
+  err = ERROR_NOT_ENOUGH_MEMORY;
+
+  for (more = success; more; more = success && FindNextStreamW(hfind, &fsd))
+  {
+
+// The unnamed stream is the file itself
+
+    if (lstrcmpi(fsd.cStreamName, L"::$DATA") == 0)
+      continue;
+
+    lstrcpy(from, Source);
+    lstrcat(from, fsd.cStreamName);
+    lstrcpy(to, Dest);
+    lstrcat(to, fsd.cStreamName);
+
+    src = CreateFile(from, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (src == INVALID_HANDLE_VALUE)
+    { err = GetLastError();
+      success = FALSE;
+      continue;
+    }
+
+    dest = CreateFile(to, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (dest == INVALID_HANDLE_VALUE)
+    { err = GetLastError();
+      CloseHandle(src);
+      success = FALSE;
+      continue;
+    }
+
+    for (;;)
+    { if (!ReadFile(src, buf, STREAM_BUFSIZE, &numread, NULL))
+      { err = GetLastError();
+        success = FALSE;
+        break;
+      }
+
+      if (numread == 0)
+        break;
+
+      if (!WriteFile(dest, buf, numread, &numwritten, NULL) || numwritten != numread)
+      { err = GetLastError();
+        success = FALSE;
+        break;
+      }
+    }
+
+    CloseHandle(src);
+    CloseHandle(dest);
+  }
+
+  FindClose(hfind);
+
+  if (from)
+    free(from);
+  if (to)
+    free(to);
+  if (buf)
+    free(buf);
+
+  if (!success)
+    SetLastError(err);
+
+  return success;
+}
+
+
+//**********************************************************************
+// CopySecurity
+// ------------
+// Copy the access control list. Only the DACL is copied because setting
+// the owner needs privileges we can't count on having.
+//**********************************************************************
+
+BOOL CCopyEngine::CopySecurity(const WCHAR* Source, const WCHAR* Dest)
+{ BOOL success;
+  DWORD err, needed;
+  PSECURITY_DESCRIPTOR sd;
+
+// The first call fails with ERROR_INSUFFICIENT_BUFFER and gets the
+// size. Any other error is returned as it is, and if the size still
+// comes back as 0 there is no descriptor to copy.
+
+  needed = 0;
+  if (!GetFileSecurity(Source, DACL_SECURITY_INFORMATION, NULL, 0, &needed) && GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    return FALSE;
+
+  if (needed == 0)
+  { SetLastError(ERROR_INVALID_SECURITY_DESCR);
+    return FALSE;
+  }
+
+  sd = (PSECURITY_DESCRIPTOR) malloc(needed);
+  if (!sd)
+  { SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+
+  success = GetFileSecurity(Source, DACL_SECURITY_INFORMATION, sd, needed, &needed)
+         && SetFileSecurity(Dest, DACL_SECURITY_INFORMATION, sd);
+  err = success ? ERROR_SUCCESS : GetLastError();
+
+  free(sd);
+
+  if (!success)
+    SetLastError(err);
+
+  return success;
+}
+
+
+//**********************************************************************
+// ArchiveFile
+// -----------
+// Archive a destination file, timing it for the statistics
+//**********************************************************************
+
+BOOL CCopyEngine::ArchiveFile(WCHAR* File, WCHAR* Archive)
+{ BOOL b;
+  DWORD err;
+  UINT64 started;
+
+  if (!m_Stats)
+    return ReconcileArchiveFile(File, Archive);
+
+  started = m_Stats->Now();
+  b = ReconcileArchiveFile(File, Archive);
+  err = GetLastError();
+
+  m_Stats->Archived(started, 1);
+
+  SetLastError(err);
+  return b;
+}
+
+
+//**********************************************************************
+// NewJob
+// ------
+//**********************************************************************
+
+COPYJOB* CCopyEngine::NewJob(int Type, const WCHAR* Source, const WCHAR* Dest, const WCHAR* Archive)
+{ int len;
+  COPYJOB* job;
+
+  len = lstrlen(Source) + lstrlen(Dest) + 2;
+  if (Archive)
+    len += lstrlen(Archive) + 1;
+
+  job = (COPYJOB*) malloc(sizeof(COPYJOB) + len*sizeof(WCHAR));
+  if (!job)
+    return NULL;
+
+  ZeroMemory(job, sizeof(COPYJOB));
+  job->Type = Type;
+  job->State = COPYSTATE_PENDING;
+
+  job->Source = (WCHAR*) (job + 1);
+  lstrcpy(job->Source, Source);
+
+  job->Dest = job->Source + lstrlen(Source) + 1;
+  lstrcpy(job->Dest, Dest);
+
+  if (Archive)
+  { job->Archive = job->Dest + lstrlen(Dest) + 1;
+    lstrcpy(job->Archive, Archive);
+  }
+
+  return job;
+}
+
+
+//**********************************************************************
+// AddJob
+// ------
+// Must be called with the lock held
+//**********************************************************************
+
+void CCopyEngine::AddJob(COPYJOB* Job)
+{
+  if (m_Tail)
+    m_Tail->Next = Job;
+  else
+    m_Head = Job;
+
+  m_Tail = Job;
+  m_NumQueued++;
+}
+
+
+//**********************************************************************
+// FlushLog
+// --------
+// Print and remove the finished jobs at the head of the list. Must be
+// called with the lock held, which also serialises the output.
+//**********************************************************************
+
+void CCopyEngine::FlushLog(void)
+{ COPYJOB* job;
+  COPYLOGLINE* line;
+
+  if (!m_Head || m_Head->State != COPYSTATE_DONE)
+    return;
+
+  while (m_Head && m_Head->State == COPYSTATE_DONE)
+  { job = m_Head;
+
+    for (line = job->LogHead; line; line = line->Next)
+    { if (line->Error)
+        RhsIO.errprintf(L"%s", line->Text);
+      else
+        RhsIO.printf(L"%s", line->Text);
+    }
+
+    m_Head = job->Next;
+    if (!m_Head)
+      m_Tail = NULL;
+    m_NumQueued--;
+
+    FreeJob(job);
+  }
+
+  WakeAllConditionVariable(&m_JobDone);
+}
+
+
+//**********************************************************************
+// FreeJob
+// -------
+//**********************************************************************
+
+void CCopyEngine::FreeJob(COPYJOB* Job)
+{ COPYLOGLINE* line;
+
+  while (Job->LogHead)
+  { line = Job->LogHead;
+    Job->LogHead = line->Next;
+    free(line);
+  }
+
+  free(Job);
+}
+
+
+//**********************************************************************
+// JobLog
+// ------
+// Add a line to the job's log
+//**********************************************************************
+
+void CCopyEngine::JobLog(COPYJOB* Job, BOOL Error, const WCHAR* Format, va_list ap)
+{ int len;
+  WCHAR s[LEN_LOGLINE];
+  COPYLOGLINE* line;
+
+  vswprintf(s, LEN_LOGLINE, Format, ap);
+  s[LEN_LOGLINE-1] = '\0';
+
+  len = lstrlen(s);
+  line = (COPYLOGLINE*) malloc(sizeof(COPYLOGLINE) + len*sizeof(WCHAR));
+  if (!line)
+    return;
+
+  line->Next = NULL;
+  line->Error = Error;
+  lstrcpy(line->Text, s);
+
+  if (Job->LogTail)
+    Job->LogTail->Next = line;
+  else
+    Job->LogHead = line;
+  Job->LogTail = line;
+}
+
+
+//**********************************************************************
+// JobPrintf
+// ---------
+//**********************************************************************
+
+void CCopyEngine::JobPrintf(COPYJOB* Job, const WCHAR* Format, ...)
+{ va_list ap;
+
+  if (m_Quiet)
+    return;
+
+  va_start(ap, Format);
+  JobLog(Job, FALSE, Format, ap);
+  va_end(ap);
+}
+
+
+//**********************************************************************
+// JobErrPrintf
+// ------------
+//**********************************************************************
+
+void CCopyEngine::JobErrPrintf(COPYJOB* Job, const WCHAR* Format, ...)
+{ va_list ap;
+
+  if (m_Quiet)
+    return;
+
+  va_start(ap, Format);
+  JobLog(Job, TRUE, Format, ap);
+  va_end(ap);
+}
+
+
+//**********************************************************************
+// VolumeIndex
+// -----------
+// Return the index of the volume a path is on, adding it to the table
+// if necessary. Returns -1 if the volume can't be identified or the
+// table is full, in which case the path doesn't count against any
+// limit. Must be called with the lock held.
+//**********************************************************************
+
+int CCopyEngine::VolumeIndex(const WCHAR* Path)
+{ int i;
+  WCHAR volume[MAX_PATH+1];
+
+  if (!VolumeName(Path, volume))
+    return -1;
+
+  for (i = 0; i < m_NumVolumes; i++)
+    if (lstrcmpi(m_Volume[i], volume) == 0)
+      return i;
+
+  if (m_NumVolumes == MAX_COPYVOLUMES)
+    return -1;
+
+  m_Volume[m_NumVolumes] = (WCHAR*) malloc((lstrlen(volume) + 1)*sizeof(WCHAR));
+  if (!m_Volume[m_NumVolumes])
+    return -1;
+
+  lstrcpy(m_Volume[m_NumVolumes], volume);
+  m_InFlight[m_NumVolumes] = 0;
+
+  return m_NumVolumes++;
+}
+
+
+//**********************************************************************
+// VolumeName
+// ----------
+// Get the volume a path is on, i.e. the drive letter or \\server\share.
+// Volume must have room for MAX_PATH+1 characters. Returns FALSE if the
+// path doesn't start with a drive or share.
+//**********************************************************************
+
+BOOL CCopyEngine::VolumeName(const WCHAR* Path, WCHAR* Volume)
+{ int i, len;
+  const WCHAR* p;
+
+// Strip any \\?\ or \\?\UNC\ prefix
+
+  p = Path;
+  lstrcpy(Volume, L"");
+
+  if (p[0] == '\\' && p[1] == '\\' && p[2] == '?' && p[3] == '\\')
+  { p += 4;
+    if ((p[0] == 'U' || p[0] == 'u') && (p[1] == 'N' || p[1] == 'n') && (p[2] == 'C' || p[2] == 'c') && p[3] == '\\')
+    { p += 4;
+      lstrcpy(Volume, L"\\\\");
+    }
+  }
+  else if (p[0] == '\\' && p[1] == '\\')
+  { p += 2;
+    lstrcpy(Volume, L"\\\\");
+  }
+
+// Drive letter
+
+  if (lstrlen(Volume) == 0)
+  { if (p[0] == '\0' || p[1] != ':')
+      return FALSE;
+
+    Volume[0] = p[0];
+    Volume[1] = ':';
+    Volume[2] = '\0';
+  }
+
+// Server and share
+
+  else
+  { len = 2;
+
+    for (i = 0; p[i] != '\0' && p[i] != '\\' && len < MAX_PATH; i++)
+      Volume[len++] = p[i];
+
+    if (p[i] == '\\')
+    { Volume[len++] = '\\';
+      for (i++; p[i] != '\0' && p[i] != '\\' && len < MAX_PATH; i++)
+        Volume[len++] = p[i];
+    }
+
+    Volume[len] = '\0';
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// ErrorMessage
+// ------------
+// Thread safe version of GetLastErrorMessage
+//**********************************************************************
+
+void CCopyEngine::ErrorMessage(DWORD Error, WCHAR* Buf, int BufLen)
+{ int i;
+
+  lstrcpy(Buf, L"<unknown error>");
+  FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, 0, Error, 0, Buf, BufLen - 1, NULL);
+
+  for (i = lstrlen(Buf); i > 0 && (Buf[i-1] == '\r' || Buf[i-1] == '\n'); i--)
+    Buf[i-1] = '\0';
+}
@@ -0,0 +1,217 @@
+//**********************************************************************
+// CCopyEngine.h
+// =============
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CCOPYENGINE
+#define _INC_CCOPYENGINE
+
+class CReconcileJournal;
+class CReconcileStats;
+class CThrottle;
+
+
+//**********************************************************************
+// Job types
+//**********************************************************************
+
+#define COPYJOB_MESSAGE 0  // Just a log message
+#define COPYJOB_CREATE  1  // Copy a file that isn't in the destination
+#define COPYJOB_UPDATE  2  // Overwrite an older file, archiving it first
+#define COPYJOB_DELETE  3  // Delete a file, archiving it first
+#define COPYJOB_TIMESTAMP 4  // Set a file's times from the source
+#define COPYJOB_MOVE    5  // Move a destination file, archiving it first
+
+// Copy options
+
+#define COPYOPT_UNBUFFERED 0x01  // Copy large files without the file cache
+#define COPYOPT_STREAMS    0x02  // Copy the alternate data streams of large files
+#define COPYOPT_SECURITY   0x04  // Copy the access control list
+
+#define COPYSTATE_PENDING 0
+#define COPYSTATE_RUNNING 1
+#define COPYSTATE_DONE    2
+
+
+//**********************************************************************
+// COPYLOGLINE
+// -----------
+// Jobs buffer their log output until they can be printed in order
+//**********************************************************************
+
+typedef struct _COPYLOGLINE
+{ struct _COPYLOGLINE* Next;
+  BOOL  Error;
+  WCHAR Text[1];
+
+} COPYLOGLINE;
+
+
+//**********************************************************************
+// COPYJOB
+// -------
+// The strings are allocated in the same block as the structure. Id is
+// the action's index in the journal, or -1 if it isn't journalled.
+//**********************************************************************
+
+#define COPYJOB_VOLUMES 3
+
+typedef struct _COPYJOB
+{ struct _COPYJOB* Next;
+
+  int  Type;
+  int  Id;
+  int  State;
+  BOOL Failed;
+
+  WCHAR* Source;
+  WCHAR* Dest;
+  WCHAR* Archive;
+
+  int Volume[COPYJOB_VOLUMES];
+
+  UINT64 Size;
+
+  BOOL SetCreated;
+  FILETIME Created, Modified;
+
+  COPYLOGLINE* LogHead;
+  COPYLOGLINE* LogTail;
+
+} COPYJOB;
+
+
+//**********************************************************************
+// COPYPROGRESS
+// ------------
+// Called from the copy threads every so often while a large file is
+// being copied.
+//**********************************************************************
+
+typedef void (*COPYPROGRESS)(void* Context, const WCHAR* Dest, UINT64 Done, UINT64 Total);
+
+
+//**********************************************************************
+// CCopyEngine
+// -----------
+// Runs copies, deletes and timestamps on a pool of worker threads. The
+// number of jobs in progress on any one volume is limited so a slow
+// share isn't swamped. The log output from the jobs is printed in the
+// order the jobs were submitted, so the output is the same as if the
+// jobs had been done one after another.
+//**********************************************************************
+
+#define MAX_COPYTHREADS 64
+#define MAX_COPYVOLUMES 64
+
+class CCopyEngine
+{
+  public:
+    CCopyEngine();
+    ~CCopyEngine();
+
+    BOOL Start(int Threads, int VolumeDepth, BOOL Quiet, BOOL FailOnError);
+    BOOL Wait(void);
+    void Stop(void);
+
+    BOOL Submit(int Type, const WCHAR* Source, const WCHAR* Dest, const WCHAR* Archive, UINT64 Size, int Id);
+    BOOL SubmitTimeStamp(const WCHAR* Source, const WCHAR* Dest, const FILETIME* Created, const FILETIME* Modified, int Id);
+
+    void printf(const WCHAR* Format, ...);
+    void errprintf(const WCHAR* Format, ...);
+
+    inline void SetDeltaMode(int Mode) { m_DeltaMode = Mode; }
+    inline void SetJournal(CReconcileJournal* Journal) { m_Journal = Journal; }
+    inline void SetThrottle(CThrottle* Throttle) { m_Throttle = Throttle; }
+    inline void SetStats(CReconcileStats* Stats) { m_Stats = Stats; }
+    inline void SetProgress(COPYPROGRESS Progress, void* Context) { m_Progress = Progress; m_ProgressContext = Context; }
+    void SetCopyOptions(DWORD Options, DWORD ChunkSize);
+
+    inline BOOL Failed(void) { return m_Failed; }
+
+    inline int NumCreated(void) { return (int) m_NumCreated; }
+    inline int NumUpdated(void) { return (int) m_NumUpdated; }
+    inline int NumDeleted(void) { return (int) m_NumDeleted; }
+    inline int NumTimeStamped(void) { return (int) m_NumTimeStamped; }
+    inline int NumMoved(void) { return (int) m_NumMoved; }
+
+    inline UINT64 DeltaLiteralBytes(void) { return (UINT64) m_DeltaLiteral; }
+    inline UINT64 DeltaMatchedBytes(void) { return (UINT64) m_DeltaMatched; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+    static BOOL VolumeName(const WCHAR* Path, WCHAR* Volume);
+
+  private:
+    static DWORD WINAPI WorkerThread(LPVOID Param);
+    void Worker(void);
+
+    COPYJOB* NextJob(void);
+    BOOL RunJob(COPYJOB* Job);
+    BOOL IsDeltaJob(COPYJOB* Job);
+    BOOL CopyJobFile(COPYJOB* Job, WCHAR* ErrMsg, int ErrLen);
+    BOOL CopyLargeFile(COPYJOB* Job);
+    BOOL CopyStreams(const WCHAR* Source, const WCHAR* Dest);
+    BOOL CopySecurity(const WCHAR* Source, const WCHAR* Dest);
+    BOOL ArchiveFile(WCHAR* File, WCHAR* Archive);
+
+    COPYJOB* NewJob(int Type, const WCHAR* Source, const WCHAR* Dest, const WCHAR* Archive);
+    BOOL QueueJob(COPYJOB* Job);
+    void AddJob(COPYJOB* Job);
+    void FlushLog(void);
+    void FreeJob(COPYJOB* Job);
+
+    void JobLog(COPYJOB* Job, BOOL Error, const WCHAR* Format, va_list ap);
+    void JobPrintf(COPYJOB* Job, const WCHAR* Format, ...);
+    void JobErrPrintf(COPYJOB* Job, const WCHAR* Format, ...);
+    void Message(BOOL Error, const WCHAR* Format, va_list ap);
+
+    int  VolumeIndex(const WCHAR* Path);
+    static void ErrorMessage(DWORD Error, WCHAR* Buf, int BufLen);
+
+  private:
+    HANDLE m_Thread[MAX_COPYTHREADS];
+    int m_NumThreads;
+
+    int  m_VolumeDepth;
+    BOOL m_Quiet, m_FailOnError;
+    int  m_DeltaMode;
+    CReconcileJournal* m_Journal;
+    CThrottle* m_Throttle;
+    CReconcileStats* m_Stats;
+    DWORD m_CopyOptions, m_ChunkSize;
+    COPYPROGRESS m_Progress;
+    void* m_ProgressContext;
+
+// The job list holds every job that hasn't been printed yet, in the
+// order the jobs were submitted.
+
+    CRITICAL_SECTION m_Lock;
+    CONDITION_VARIABLE m_WorkReady, m_JobDone;
+
+    COPYJOB* m_Head;
+    COPYJOB* m_Tail;
+    int m_NumQueued;
+    BOOL m_Shutdown;
+
+    WCHAR* m_Volume[MAX_COPYVOLUMES];
+    int m_InFlight[MAX_COPYVOLUMES];
+    int m_NumVolumes;
+
+    volatile BOOL m_Failed;
+    volatile LONG m_NumCreated, m_NumUpdated, m_NumDeleted, m_NumTimeStamped, m_NumMoved;
+    volatile LONGLONG m_DeltaLiteral, m_DeltaMatched;
+
+    WCHAR m_LastError[256];
+};
+
+
+//**********************************************************************
+// End of CCopyEngine
+// ------------------
+//**********************************************************************
+
+#endif // _INC_CCOPYENGINE
@@ -0,0 +1,619 @@
+//**********************************************************************
+// CDeltaCopy
+// ==========
+// Update a file by copying only the changes, in the style of rsync.
+//
+// The destination (the old version of the file) is split into blocks
+// and each block gets a weak checksum, that can be rolled along a byte
+// at a time, and an MD5 hash. Then we slide a window the size of a
+// block along the source. Where the weak checksum of the window matches
+// a block, and the MD5 hash confirms it, the block is copied from the
+// old file and the window jumps a whole block. Otherwise the window
+// moves on a byte and that byte is copied from the source.
+//
+// In place mode writes straight into the destination. A block can only
+// be reused if it hasn't been overwritten yet, i.e. if it's at or after
+// the current write position, and a block that's already in the right
+// place doesn't need writing at all. Temporary file mode builds the
+// new file alongside the old one and renames it over the old one at
+// the end, so any block can be reused.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <math.h>
+#include "CThrottle.h"
+#include "CDeltaCopy.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+// The block size is about the square root of the file size
+
+#define DELTA_MINBLOCK 0x800
+#define DELTA_MAXBLOCK 0x20000
+
+#define DELTA_BUCKETS 0x10000
+
+// Size of the buffer used to scan the source and how many literal
+// bytes to collect before writing them.
+
+#define LEN_SCANBUF   0x100000
+#define LEN_LITERALS  0x10000
+
+#define DELTA_TEMPEXT L".rcntmp"
+
+#define WEAK_BUCKET(w) (((w) ^ ((w) >> 16)) & (DELTA_BUCKETS - 1))
+
+
+//**********************************************************************
+// CDeltaCopy
+// ----------
+//**********************************************************************
+
+CDeltaCopy::CDeltaCopy()
+{
+  m_InPlace = FALSE;
+  m_Basis = m_Out = INVALID_HANDLE_VALUE;
+  m_OutPos = 0;
+
+  m_BlockSize = 0;
+  m_NumBlocks = 0;
+  m_Sigs = NULL;
+  m_Buckets = NULL;
+  m_BlockBuf = NULL;
+
+  m_Prov = 0;
+  m_Throttle = NULL;
+
+  m_LiteralBytes = m_MatchedBytes = 0;
+}
+
+CDeltaCopy::~CDeltaCopy()
+{
+  Close();
+}
+
+
+//**********************************************************************
+// Copy
+// ----
+// Update Dest to match Source. Returns FALSE with the Windows error set
+// if anything goes wrong.
+//**********************************************************************
+
+BOOL CDeltaCopy::Copy(const WCHAR* Source, const WCHAR* Dest, int Mode)
+{ BOOL success;
+  DWORD err;
+  HANDLE src;
+  LARGE_INTEGER li;
+  FILETIME ft;
+  BY_HANDLE_FILE_INFORMATION info;
+  WCHAR* tempfile;
+
+  Close();
+  m_InPlace = Mode == DELTA_INPLACE;
+  m_LiteralBytes = m_MatchedBytes = 0;
+  tempfile = NULL;
+
+// Get the provider for the MD5 hashes
+
+  if (!CryptAcquireContext(&m_Prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+  { m_Prov = 0;
+    return FALSE;
+  }
+
+// Open the source
+
+  src = CreateFile(Source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (src == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  if (!GetFileInformationByHandle(src, &info))
+  { err = GetLastError();
+    CloseHandle(src);
+    SetLastError(err);
+    return FALSE;
+  }
+
+// Open the old file. In place the old file is also the output.
+
+  if (m_InPlace)
+  { m_Basis = CreateFile(Dest, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    m_Out = m_Basis;
+  }
+  else
+  { m_Basis = CreateFile(Dest, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  }
+
+  if (m_Basis == INVALID_HANDLE_VALUE)
+  { err = GetLastError();
+    CloseHandle(src);
+    SetLastError(err);
+    return FALSE;
+  }
+
+  success = GetFileSizeEx(m_Basis, &li) && BuildSignatures((UINT64) li.QuadPart);
+
+// In place, set the modified time to the distant past and stop writes
+// updating it. If we fail part way through the file looks out of date
+// and the next run will update it again.
+
+  if (success && m_InPlace)
+  { ft.dwLowDateTime = 1;
+    ft.dwHighDateTime = 0;
+    SetFileTime(m_Out, NULL, NULL, &ft);
+
+    ft.dwLowDateTime = ft.dwHighDateTime = 0xFFFFFFFF;
+    SetFileTime(m_Out, NULL, NULL, &ft);
+  }
+
+// Otherwise create the temporary file in the same directory
+
+  if (success && !m_InPlace)
+  { tempfile = (WCHAR*) malloc((lstrlen(Dest) + lstrlen(DELTA_TEMPEXT) + 1)*sizeof(WCHAR));
+
+    if (!tempfile)
+    { SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+      success = FALSE;
+    }
+    else
+    { lstrcpy(tempfile, Dest);
+      lstrcat(tempfile, DELTA_TEMPEXT);
+
+      m_Out = CreateFile(tempfile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+      if (m_Out == INVALID_HANDLE_VALUE)
+        success = FALSE;
+    }
+  }
+
+// Build the new file
+
+  if (success)
+    success = Scan(src);
+
+// Set the length and the modified time
+
+  if (success)
+  { li.QuadPart = (LONGLONG) m_OutPos;
+    success = SetFilePointerEx(m_Out, li, NULL, FILE_BEGIN) && SetEndOfFile(m_Out);
+  }
+
+  if (success)
+    success = SetFileTime(m_Out, NULL, NULL, &info.ftLastWriteTime);
+
+// Close everything, keeping the error if there was one
+
+  err = success ? ERROR_SUCCESS : GetLastError();
+
+  CloseHandle(src);
+  Close();
+
+// Put the temporary file in place of the old one
+
+  if (tempfile)
+  { if (success)
+    { if (!MoveFileEx(tempfile, Dest, MOVEFILE_REPLACE_EXISTING))
+      { err = GetLastError();
+        success = FALSE;
+      }
+    }
+
+    if (!success)
+      DeleteFile(tempfile);
+
+    free(tempfile);
+  }
+
+  if (!success)
+  { SetLastError(err);
+    return FALSE;
+  }
+
+  SetFileAttributes(Dest, info.dwFileAttributes);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Scan
+// ----
+// Slide a window along the source looking for blocks that match the
+// old file, and write the new file as we go.
+//**********************************************************************
+
+BOOL CDeltaCopy::Scan(HANDLE Source)
+{ int block;
+  BOOL eof, done, haveweak;
+  DWORD bufsize, avail, ws, litstart, numread, i, a, b, weak;
+  BYTE* buf;
+
+// The buffer must hold several blocks so we aren't forever refilling it
+
+  bufsize = m_BlockSize*4 > LEN_SCANBUF ? m_BlockSize*4 : LEN_SCANBUF;
+  buf = (BYTE*) malloc(bufsize);
+  if (!buf)
+  { SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+
+// ws is the start of the window and litstart is the start of the bytes
+// that didn't match anything and haven't been written yet.
+
+  avail = ws = litstart = 0;
+  a = b = weak = 0;
+  eof = done = haveweak = FALSE;
+
+  for (;;)
+  {
+
+// If there isn't a whole window in the buffer write any literal bytes,
+// move what's left to the start of the buffer and read some more.
+
+    if (ws + m_BlockSize > avail)
+    { if (eof)
+      { done = TRUE;
+        break;
+      }
+
+      if (!WriteLiteral(buf + litstart, ws - litstart))
+        break;
+
+      MoveMemory(buf, buf + ws, avail - ws);
+      avail -= ws;
+      ws = litstart = 0;
+
+      while (avail < bufsize)
+      { if (!ReadFile(Source, buf + avail, bufsize - avail, &numread, NULL))
+        { free(buf);
+          return FALSE;
+        }
+
+        if (numread == 0)
+        { eof = TRUE;
+          break;
+        }
+
+        avail += numread;
+      }
+
+      haveweak = FALSE;
+      continue;
+    }
+
+// Calculate the weak checksum from scratch if we have to
+
+    if (!haveweak)
+    { a = b = 0;
+      for (i = 0; i < m_BlockSize; i++)
+      { a += buf[ws + i];
+        b += (m_BlockSize - i)*buf[ws + i];
+      }
+      a &= 0xFFFF;
+      b &= 0xFFFF;
+      haveweak = TRUE;
+    }
+
+    weak = a | (b << 16);
+
+// If the window matches a block copy the block and jump past it. The
+// literal bytes not yet written come before the block so allow for
+// them in the position.
+
+    block = m_NumBlocks > 0 ? FindMatch(weak, buf + ws, m_OutPos + (ws - litstart)) : -1;
+
+    if (block >= 0)
+    { if (!WriteLiteral(buf + litstart, ws - litstart))
+        break;
+
+      if (!CopyBlock(block))
+        break;
+
+      ws += m_BlockSize;
+      litstart = ws;
+      haveweak = FALSE;
+      continue;
+    }
+
+// Otherwise roll the checksum on one byte
+
+    if (ws + m_BlockSize < avail)
+    { a = (a - buf[ws] + buf[ws + m_BlockSize]) & 0xFFFF;
+      b = (b - m_BlockSize*buf[ws] + a) & 0xFFFF;
+    }
+    else
+    { haveweak = FALSE;
+    }
+
+    ws++;
+
+    if (ws - litstart >= LEN_LITERALS)
+    { if (!WriteLiteral(buf + litstart, ws - litstart))
+        break;
+      litstart = ws;
+    }
+  }
+
+// Whatever is left didn't match
+
+  if (done)
+    done = WriteLiteral(buf + litstart, avail - litstart);
+
+  free(buf);
+
+  return done;
+}
+
+
+//**********************************************************************
+// BuildSignatures
+// ---------------
+// Read the old file and calculate the checksums of each whole block.
+// Any part block at the end is ignored.
+//**********************************************************************
+
+BOOL CDeltaCopy::BuildSignatures(UINT64 Size)
+{ int i;
+  DWORD j, numread, a, b;
+  LARGE_INTEGER li;
+
+// Choose the block size
+
+  m_BlockSize = (DWORD) sqrt((double) Size);
+  m_BlockSize = (m_BlockSize + 0x3FF) & ~0x3FF;
+  if (m_BlockSize < DELTA_MINBLOCK)
+    m_BlockSize = DELTA_MINBLOCK;
+  if (m_BlockSize > DELTA_MAXBLOCK)
+    m_BlockSize = DELTA_MAXBLOCK;
+
+  m_NumBlocks = (int) (Size/m_BlockSize);
+
+// Allocate the tables
+
+  m_BlockBuf = (BYTE*) malloc(m_BlockSize);
+  m_Buckets = (int*) malloc(DELTA_BUCKETS*sizeof(int));
+  m_Sigs = (DELTASIG*) malloc((m_NumBlocks + 1)*sizeof(DELTASIG));
+
+  if (!m_BlockBuf || !m_Buckets || !m_Sigs)
+  { SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+
+  for (i = 0; i < DELTA_BUCKETS; i++)
+    m_Buckets[i] = -1;
+
+// Read the blocks
+
+  li.QuadPart = 0;
+  if (!SetFilePointerEx(m_Basis, li, NULL, FILE_BEGIN))
+    return FALSE;
+
+  for (i = 0; i < m_NumBlocks; i++)
+  { if (!ReadFile(m_Basis, m_BlockBuf, m_BlockSize, &numread, NULL))
+      return FALSE;
+
+// If the file has shrunk just use the blocks we've got
+
+    if (numread < m_BlockSize)
+    { m_NumBlocks = i;
+      break;
+    }
+
+    a = b = 0;
+    for (j = 0; j < m_BlockSize; j++)
+    { a += m_BlockBuf[j];
+      b += (m_BlockSize - j)*m_BlockBuf[j];
+    }
+
+    m_Sigs[i].weak = (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+    if (!StrongHash(m_BlockBuf, m_BlockSize, m_Sigs[i].strong))
+      return FALSE;
+
+    m_Sigs[i].next = m_Buckets[WEAK_BUCKET(m_Sigs[i].weak)];
+    m_Buckets[WEAK_BUCKET(m_Sigs[i].weak)] = i;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// FindMatch
+// ---------
+// Find a block matching the window. The MD5 of the window is only
+// calculated if a weak checksum matches. Pos is where the block would
+// be written. Returns -1 if there is no usable match.
+//**********************************************************************
+
+int CDeltaCopy::FindMatch(DWORD Weak, const BYTE* Window, UINT64 Pos)
+{ int i, best;
+  BOOL havestrong;
+  BYTE strong[DELTA_STRONGLEN];
+
+  best = -1;
+  havestrong = FALSE;
+
+  for (i = m_Buckets[WEAK_BUCKET(Weak)]; i >= 0; i = m_Sigs[i].next)
+  { if (m_Sigs[i].weak != Weak)
+      continue;
+
+// In place, blocks before the write position have been overwritten
+
+    if (m_InPlace && (UINT64) i*m_BlockSize < Pos)
+      continue;
+
+    if (!havestrong)
+    { if (!StrongHash(Window, m_BlockSize, strong))
+        return -1;
+      havestrong = TRUE;
+    }
+
+    if (memcmp(strong, m_Sigs[i].strong, DELTA_STRONGLEN) != 0)
+      continue;
+
+// A block already in the right place is the best match of all
+
+    if (!m_InPlace || (UINT64) i*m_BlockSize == Pos)
+      return i;
+
+    if (best < 0)
+      best = i;
+  }
+
+  return best;
+}
+
+
+//**********************************************************************
+// StrongHash
+// ----------
+//**********************************************************************
+
+BOOL CDeltaCopy::StrongHash(const BYTE* Data, DWORD Len, BYTE* Hash)
+{ BOOL success;
+  DWORD hashlen;
+  HCRYPTHASH hash;
+
+  if (!CryptCreateHash(m_Prov, CALG_MD5, 0, 0, &hash))
+    return FALSE;
+
+  hashlen = DELTA_STRONGLEN;
+  success = CryptHashData(hash, Data, Len, 0) && CryptGetHashParam(hash, HP_HASHVAL, Hash, &hashlen, 0);
+
+  CryptDestroyHash(hash);
+
+  return success;
+}
+
+
+//**********************************************************************
+// WriteLiteral
+// ------------
+// Write bytes from the source at the current position
+//**********************************************************************
+
+BOOL CDeltaCopy::WriteLiteral(const BYTE* Data, DWORD Len)
+{
+  if (Len == 0)
+    return TRUE;
+
+  if (m_Throttle)
+    m_Throttle->Take(Len, 0);
+
+  if (!WriteAt(m_OutPos, Data, Len))
+    return FALSE;
+
+  m_OutPos += Len;
+  m_LiteralBytes += Len;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CopyBlock
+// ---------
+// Copy a block of the old file to the current position
+//**********************************************************************
+
+BOOL CDeltaCopy::CopyBlock(int Block)
+{ UINT64 offset;
+
+  offset = (UINT64) Block*m_BlockSize;
+
+  if (!m_InPlace || offset != m_OutPos)
+  { if (!ReadAt(offset, m_BlockBuf, m_BlockSize))
+      return FALSE;
+
+    if (!WriteAt(m_OutPos, m_BlockBuf, m_BlockSize))
+      return FALSE;
+  }
+
+  m_OutPos += m_BlockSize;
+  m_MatchedBytes += m_BlockSize;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// WriteAt
+// -------
+// In place the input and output are the same handle so always seek
+//**********************************************************************
+
+BOOL CDeltaCopy::WriteAt(UINT64 Offset, const BYTE* Data, DWORD Len)
+{ DWORD numwritten;
+  LARGE_INTEGER li;
+
+  li.QuadPart = (LONGLONG) Offset;
+  if (!SetFilePointerEx(m_Out, li, NULL, FILE_BEGIN))
+    return FALSE;
+
+  if (!WriteFile(m_Out, Data, Len, &numwritten, NULL))
+    return FALSE;
+
+  if (numwritten != Len)
+  { SetLastError(ERROR_WRITE_FAULT);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// ReadAt
+// ------
+//**********************************************************************
+
+BOOL CDeltaCopy::ReadAt(UINT64 Offset, BYTE* Data, DWORD Len)
+{ DWORD numread;
+  LARGE_INTEGER li;
+
+  li.QuadPart = (LONGLONG) Offset;
+  if (!SetFilePointerEx(m_Basis, li, NULL, FILE_BEGIN))
+    return FALSE;
+
+  if (!ReadFile(m_Basis, Data, Len, &numread, NULL))
+    return FALSE;
+
+  if (numread != Len)
+  { SetLastError(ERROR_HANDLE_EOF);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Close
+// -----
+//**********************************************************************
+
+void CDeltaCopy::Close(void)
+{
+  if (m_Out != INVALID_HANDLE_VALUE && m_Out != m_Basis)
+    CloseHandle(m_Out);
+  if (m_Basis != INVALID_HANDLE_VALUE)
+    CloseHandle(m_Basis);
+  m_Basis = m_Out = INVALID_HANDLE_VALUE;
+
+  if (m_Sigs)     free(m_Sigs);
+  if (m_Buckets)  free(m_Buckets);
+  if (m_BlockBuf) free(m_BlockBuf);
+  m_Sigs = NULL;
+  m_Buckets = NULL;
+  m_BlockBuf = NULL;
+  m_NumBlocks = 0;
+
+  if (m_Prov)
+    CryptReleaseContext(m_Prov, 0);
+  m_Prov = 0;
+}
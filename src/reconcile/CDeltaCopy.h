@@ -0,0 +1,101 @@
+//**********************************************************************
+// CDeltaCopy.h
+// ============
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CDELTACOPY
+#define _INC_CDELTACOPY
+
+class CThrottle;
+
+
+//**********************************************************************
+// Delta modes
+//**********************************************************************
+
+#define DELTA_NONE     0  // Copy the whole file
+#define DELTA_INPLACE  1  // Patch the destination file in place
+#define DELTA_TEMPFILE 2  // Build the new file in a temporary file
+
+#define DELTA_STRONGLEN 16
+
+
+//**********************************************************************
+// DELTASIG
+// --------
+// Signature of one block of the destination file
+//**********************************************************************
+
+typedef struct
+{ DWORD weak;
+  int   next;
+  BYTE  strong[DELTA_STRONGLEN];
+
+} DELTASIG;
+
+
+//**********************************************************************
+// CDeltaCopy
+// ----------
+// Update a file using only the parts of the source that aren't already
+// in the destination, rsync style. The destination is split into
+// blocks, each block gets a weak rolling checksum and an MD5 hash, and
+// the source is scanned for blocks that match. Matching blocks are
+// copied from within the destination and only the rest is copied from
+// the source. If there is a throttle it is charged for the bytes
+// copied from the source as they are written.
+//**********************************************************************
+
+class CDeltaCopy
+{
+  public:
+    CDeltaCopy();
+    ~CDeltaCopy();
+
+    BOOL Copy(const WCHAR* Source, const WCHAR* Dest, int Mode);
+
+    inline void SetThrottle(CThrottle* Throttle) { m_Throttle = Throttle; }
+
+    inline UINT64 LiteralBytes(void) { return m_LiteralBytes; }
+    inline UINT64 MatchedBytes(void) { return m_MatchedBytes; }
+
+  private:
+    BOOL Scan(HANDLE Source);
+    BOOL BuildSignatures(UINT64 Size);
+    int  FindMatch(DWORD Weak, const BYTE* Window, UINT64 Pos);
+    BOOL StrongHash(const BYTE* Data, DWORD Len, BYTE* Hash);
+
+    BOOL WriteLiteral(const BYTE* Data, DWORD Len);
+    BOOL CopyBlock(int Block);
+    BOOL WriteAt(UINT64 Offset, const BYTE* Data, DWORD Len);
+    BOOL ReadAt(UINT64 Offset, BYTE* Data, DWORD Len);
+
+    void Close(void);
+
+  private:
+    BOOL m_InPlace;
+    HANDLE m_Basis, m_Out;
+    UINT64 m_OutPos;
+
+    DWORD m_BlockSize;
+    int m_NumBlocks;
+    DELTASIG* m_Sigs;
+    int* m_Buckets;
+    BYTE* m_BlockBuf;
+
+    HCRYPTPROV m_Prov;
+    CThrottle* m_Throttle;
+
+    UINT64 m_LiteralBytes, m_MatchedBytes;
+};
+
+
+//**********************************************************************
+// End of CDeltaCopy
+// -----------------
+//**********************************************************************
+
+#endif // _INC_CDELTACOPY
@@ -0,0 +1,303 @@
+//**********************************************************************
+// CDirCache
+// =========
+// Remember which archive directories exist so they are only checked
+// and created once per run.
+//
+// Archiving a file needs its directory in the archive to exist. Doing
+// this by checking every component of the path for every file meant
+// tens of thousands of metadata calls when archiving a big directory,
+// which is slow when the archive is on a network share. Now the first
+// file in a directory costs one CreateDirectory call, plus one for each
+// parent that's missing, and every file after it costs a hash lookup.
+//
+// The hash folds ASCII letters to upper case to match the case
+// insensitive comparison. Names that differ only in the case of other
+// letters hash differently, which just means the directory is checked
+// again.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdlib.h>
+#include "CDirCache.h"
+
+
+//**********************************************************************
+// CDirCache
+// ---------
+//**********************************************************************
+
+CDirCache::CDirCache()
+{
+  InitializeSRWLock(&m_Lock);
+
+  m_Bucket = NULL;
+  m_NumBuckets = m_NumEntries = 0;
+}
+
+CDirCache::~CDirCache()
+{
+  Clear();
+}
+
+
+//**********************************************************************
+// Ensure
+// ------
+// Make sure the first Len characters of Dir name a directory that
+// exists, creating it and its parents if necessary. Returns FALSE with
+// the Windows error set if it can't be created.
+//**********************************************************************
+
+BOOL CDirCache::Ensure(const WCHAR* Dir, int Len)
+{ WCHAR path[DIRCACHE_MAXPATH+1];
+
+  if (Len > DIRCACHE_MAXPATH)
+  { SetLastError(ERROR_FILENAME_EXCED_RANGE);
+    return FALSE;
+  }
+
+  CopyMemory(path, Dir, Len*sizeof(WCHAR));
+  path[Len] = '\0';
+
+  return EnsurePath(path, Len);
+}
+
+
+//**********************************************************************
+// Clear
+// -----
+//**********************************************************************
+
+void CDirCache::Clear(void)
+{ int i;
+  DIRCACHEENTRY* e;
+  DIRCACHEENTRY* next;
+
+  AcquireSRWLockExclusive(&m_Lock);
+
+  for (i = 0; i < m_NumBuckets; i++)
+  { for (e = m_Bucket[i]; e; e = next)
+    { next = e->Next;
+      free(e);
+    }
+  }
+
+  if (m_Bucket)
+    free(m_Bucket);
+
+  m_Bucket = NULL;
+  m_NumBuckets = m_NumEntries = 0;
+
+  ReleaseSRWLockExclusive(&m_Lock);
+}
+
+
+//**********************************************************************
+// EnsurePath
+// ----------
+// Path is a buffer holding the directory name in the first Len
+// characters. Try to create the directory, and only if its parent is
+// missing go up a level. The buffer is cut short to name the parent
+// and put back afterwards.
+//**********************************************************************
+
+BOOL CDirCache::EnsurePath(WCHAR* Path, int Len)
+{ int parent;
+  BOOL ok;
+  DWORD hash, err;
+  WCHAR save;
+
+  hash = HashName(Path, Len);
+
+  if (Contains(Path, Len, hash))
+    return TRUE;
+
+// The root always exists
+
+  if (Len <= RootLength(Path))
+    return TRUE;
+
+  save = Path[Len];
+  Path[Len] = '\0';
+
+  ok = CreateDirectory(Path, NULL);
+  err = ok ? 0 : GetLastError();
+
+  if (err == ERROR_ALREADY_EXISTS)
+  { ok = TRUE;
+  }
+  else if (err == ERROR_PATH_NOT_FOUND)
+  { for (parent = Len; parent > 0 && Path[parent-1] != '\\'; parent--);
+
+    if (parent > 1 && EnsurePath(Path, parent - 1))
+    { ok = CreateDirectory(Path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+      err = ok ? 0 : GetLastError();
+    }
+  }
+
+  Path[Len] = save;
+
+  if (!ok)
+  { SetLastError(err);
+    return FALSE;
+  }
+
+  Add(Path, Len, hash);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Contains
+// --------
+//**********************************************************************
+
+BOOL CDirCache::Contains(const WCHAR* Path, int Len, DWORD Hash)
+{ BOOL found;
+  DIRCACHEENTRY* e;
+
+  found = FALSE;
+
+  AcquireSRWLockShared(&m_Lock);
+
+  if (m_NumBuckets > 0)
+  { for (e = m_Bucket[Hash & (m_NumBuckets - 1)]; e; e = e->Next)
+    { if (e->Hash == Hash && e->Len == Len && CompareStringOrdinal(e->Name, Len, Path, Len, TRUE) == CSTR_EQUAL)
+      { found = TRUE;
+        break;
+      }
+    }
+  }
+
+  ReleaseSRWLockShared(&m_Lock);
+
+  return found;
+}
+
+
+//**********************************************************************
+// Add
+// ---
+// Add a directory. The table doubles in size when it gets full. If
+// another thread added the same directory first it ends up in the table
+// twice, which does no harm.
+//**********************************************************************
+
+void CDirCache::Add(const WCHAR* Path, int Len, DWORD Hash)
+{ int i, newnum;
+  DIRCACHEENTRY** newbucket;
+  DIRCACHEENTRY* e;
+  DIRCACHEENTRY* move;
+  DIRCACHEENTRY* next;
+
+  e = (DIRCACHEENTRY*) malloc(sizeof(DIRCACHEENTRY) + Len*sizeof(WCHAR));
+  if (!e)
+    return;
+
+  e->Hash = Hash;
+  e->Len = Len;
+  CopyMemory(e->Name, Path, Len*sizeof(WCHAR));
+  e->Name[Len] = '\0';
+
+  AcquireSRWLockExclusive(&m_Lock);
+
+  if (m_NumEntries >= m_NumBuckets)
+  { newnum = m_NumBuckets ? m_NumBuckets*2 : DIRCACHE_BUCKETS;
+    newbucket = (DIRCACHEENTRY**) calloc(newnum, sizeof(DIRCACHEENTRY*));
+
+    if (newbucket)
+    { for (i = 0; i < m_NumBuckets; i++)
+      { for (move = m_Bucket[i]; move; move = next)
+        { next = move->Next;
+          move->Next = newbucket[move->Hash & (newnum - 1)];
+          newbucket[move->Hash & (newnum - 1)] = move;
+        }
+      }
+
+      if (m_Bucket)
+        free(m_Bucket);
+      m_Bucket = newbucket;
+      m_NumBuckets = newnum;
+    }
+  }
+
+  if (m_NumBuckets > 0)
+  { e->Next = m_Bucket[Hash & (m_NumBuckets - 1)];
+    m_Bucket[Hash & (m_NumBuckets - 1)] = e;
+    m_NumEntries++;
+  }
+  else
+  { free(e);
+  }
+
+  ReleaseSRWLockExclusive(&m_Lock);
+}
+
+
+//**********************************************************************
+// HashName
+// --------
+// FNV-1a hash of the name with ASCII letters in upper case
+//**********************************************************************
+
+DWORD CDirCache::HashName(const WCHAR* Path, int Len)
+{ int i;
+  DWORD hash;
+  WCHAR c;
+
+  hash = 2166136261UL;
+
+  for (i = 0; i < Len; i++)
+  { c = Path[i];
+    if (c >= 'a' && c <= 'z')
+      c -= 'a' - 'A';
+
+    hash = (hash ^ c)*16777619UL;
+  }
+
+  return hash;
+}
+
+
+//**********************************************************************
+// RootLength
+// ----------
+// The length of the part of the path that can't be created: the
+// \\server\share of a UNC name or the drive of a drive letter name,
+// with or without the \\?\ prefix.
+//**********************************************************************
+
+int CDirCache::RootLength(const WCHAR* Path)
+{ int i;
+
+// \\?\UNC\server\share or \\server\share
+
+  if (lstrlen(Path) >= 8 && CompareStringOrdinal(Path, 8, L"\\\\?\\UNC\\", 8, TRUE) == CSTR_EQUAL)
+    i = 8;
+  else if (Path[0] == '\\' && Path[1] == '\\' && Path[2] != '?')
+    i = 2;
+  else
+    i = -1;
+
+  if (i >= 0)
+  { for (; Path[i] != '\\' && Path[i] != '\0'; i++);
+    if (Path[i] != '\0')
+      for (i++; Path[i] != '\\' && Path[i] != '\0'; i++);
+
+    return i;
+  }
+
+// \\?\c: or c:
+
+  i = Path[0] == '\\' && Path[1] == '\\' && Path[2] == '?' && Path[3] == '\\' ? 4 : 0;
+
+  if (Path[i] != '\0' && Path[i+1] == ':')
+    return i + 2;
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+//**********************************************************************
+// CDirCache.h
+// ===========
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CDIRCACHE
+#define _INC_CDIRCACHE
+
+
+//**********************************************************************
+// DIRCACHEENTRY
+// -------------
+// A directory known to exist. The name is allocated with the entry.
+//**********************************************************************
+
+typedef struct _DIRCACHEENTRY
+{ struct _DIRCACHEENTRY* Next;
+  DWORD Hash;
+  int   Len;
+  WCHAR Name[1];
+
+} DIRCACHEENTRY;
+
+
+//**********************************************************************
+// CDirCache
+// ---------
+// A hashed set of the directories that have been created, or found to
+// exist already, during the run. Ensure makes sure a directory and all
+// its parents exist, and only goes to the file system for directories
+// it hasn't seen before. It can be called from the copy threads.
+//**********************************************************************
+
+#define DIRCACHE_MAXPATH  4096
+#define DIRCACHE_BUCKETS  1024
+
+class CDirCache
+{
+  public:
+    CDirCache();
+    ~CDirCache();
+
+    BOOL Ensure(const WCHAR* Dir, int Len);
+    void Clear(void);
+
+    inline int NumDirs(void) { return m_NumEntries; }
+
+  private:
+    BOOL EnsurePath(WCHAR* Path, int Len);
+    BOOL Contains(const WCHAR* Path, int Len, DWORD Hash);
+    void Add(const WCHAR* Path, int Len, DWORD Hash);
+
+    static DWORD HashName(const WCHAR* Path, int Len);
+    static int RootLength(const WCHAR* Path);
+
+  private:
+    SRWLOCK m_Lock;
+
+    DIRCACHEENTRY** m_Bucket;
+    int m_NumBuckets, m_NumEntries;
+};
+
+
+//**********************************************************************
+// End of CDirCache
+// ----------------
+//**********************************************************************
+
+#endif // _INC_CDIRCACHE
@@ -0,0 +1,586 @@
+//**********************************************************************
+// CReconcileJournal
+// =================
+// Keep a record of the actions done so far so an interrupted reconcile
+// can carry on where it stopped.
+//
+// The journal file starts with the plan, written by CReconcilePlan, so
+// a resumed run needs neither the directory listings nor the original
+// command line. After the plan comes one line per record:
+//
+// C <id>                               the action completed
+// A <id>                               the file has been archived
+// P <id> <offset> <size> <modified>    a large copy got this far
+//
+// The id is the index of the action in the plan. Completed actions are
+// buffered and written out every few seconds. The archive and progress
+// records are written out and flushed to disk straight away, because
+// the copy mustn't go any further until they are safe: archiving a
+// half copied file on the next run would overwrite the good archive.
+//
+// If the last line was only partly written when the run stopped it is
+// cut off when the journal is opened again.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "CReconcilePlan.h"
+#include "CReconcileJournal.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+#define LEN_JOURNALLINE 256
+
+
+//**********************************************************************
+// CReconcileJournal
+// -----------------
+//**********************************************************************
+
+CReconcileJournal::CReconcileJournal()
+{
+  lstrcpy(m_FileName, L"");
+  m_File = INVALID_HANDLE_VALUE;
+
+  InitializeCriticalSection(&m_Lock);
+
+  m_Flags = NULL;
+  m_NumActions = m_NumDone = 0;
+
+  m_Progress = NULL;
+  m_NumProgress = m_MaxProgress = 0;
+
+  m_BufLen = 0;
+  m_LastFlush = 0;
+
+  m_Resuming = FALSE;
+  m_Failed = FALSE;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CReconcileJournal::~CReconcileJournal()
+{
+  Close(FALSE);
+
+  if (m_Flags)
+    free(m_Flags);
+  if (m_Progress)
+    free(m_Progress);
+
+  DeleteCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// Create
+// ------
+// Start a new journal for a plan. Any existing file is overwritten.
+//**********************************************************************
+
+BOOL CReconcileJournal::Create(const WCHAR* FileName, CReconcilePlan* Plan)
+{
+  if (!Init(FileName, Plan->NumActions()))
+    return FALSE;
+
+  if (!Plan->Save(FileName))
+  { lstrcpy(m_LastError, Plan->LastError());
+    return FALSE;
+  }
+
+  m_Resuming = FALSE;
+
+  return OpenForAppend(FALSE, 0);
+}
+
+
+//**********************************************************************
+// Open
+// ----
+// Load the plan from an existing journal and read back what has been
+// done already
+//**********************************************************************
+
+BOOL CReconcileJournal::Open(const WCHAR* FileName, CReconcilePlan* Plan)
+{ UINT64 length;
+
+  if (!Plan->Load(FileName))
+  { lstrcpy(m_LastError, Plan->LastError());
+    return FALSE;
+  }
+
+  if (!Init(FileName, Plan->NumActions()))
+    return FALSE;
+
+  if (!ReadRecords(FileName, &length))
+    return FALSE;
+
+  m_Resuming = TRUE;
+
+  return OpenForAppend(TRUE, length);
+}
+
+
+//**********************************************************************
+// Close
+// -----
+// Write out anything still buffered. The journal is deleted once it is
+// no longer needed.
+//**********************************************************************
+
+BOOL CReconcileJournal::Close(BOOL Delete)
+{ BOOL success;
+
+  if (m_File == INVALID_HANDLE_VALUE)
+    return TRUE;
+
+  success = Flush();
+
+  CloseHandle(m_File);
+  m_File = INVALID_HANDLE_VALUE;
+
+  if (Delete)
+  { if (!DeleteFile(m_FileName))
+    { SetError(L"delete");
+      success = FALSE;
+    }
+  }
+
+  return success;
+}
+
+
+//**********************************************************************
+// Done
+// ----
+// Record a completed action. This is called for every action so it
+// just buffers the record, and writes the buffer out when it's full or
+// the last checkpoint was long enough ago.
+//**********************************************************************
+
+void CReconcileJournal::Done(int Id)
+{
+  EnterCriticalSection(&m_Lock);
+
+  if (!(m_Flags[Id] & JOURNALFLAG_DONE))
+  { m_Flags[Id] |= JOURNALFLAG_DONE;
+    m_NumDone++;
+  }
+
+  RemoveProgress(Id);
+
+  AddRecord("%c %i\r\n", JOURNAL_DONE, Id);
+
+  if (m_BufLen > JOURNAL_BUFSIZE/2 || GetTickCount64() - m_LastFlush >= JOURNAL_INTERVAL)
+    Flush();
+
+  LeaveCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// Archived
+// --------
+// Record that an update has archived the old destination file. This
+// must be on disk before the destination is overwritten.
+//**********************************************************************
+
+BOOL CReconcileJournal::Archived(int Id)
+{ BOOL success;
+
+  EnterCriticalSection(&m_Lock);
+
+  m_Flags[Id] |= JOURNALFLAG_ARCHIVED;
+
+  success = AddRecord("%c %i\r\n", JOURNAL_ARCHIVED, Id) && Flush();
+
+  LeaveCriticalSection(&m_Lock);
+
+  return success;
+}
+
+
+//**********************************************************************
+// SetProgress
+// -----------
+// Record how far a large copy has got. The caller must have flushed
+// the destination up to Offset first.
+//**********************************************************************
+
+BOOL CReconcileJournal::SetProgress(int Id, UINT64 Offset, UINT64 Size, const FILETIME* Modified)
+{ BOOL success;
+  JOURNALPROGRESS* p;
+
+  EnterCriticalSection(&m_Lock);
+
+  p = FindProgress(Id, TRUE);
+  if (p)
+  { p->Offset = Offset;
+    p->Size = Size;
+    p->Modified = *Modified;
+  }
+
+  success = AddRecord("%c %i %.0f %.0f %08lx%08lx\r\n", JOURNAL_PROGRESS, Id, (double) Offset, (double) Size,
+                      (unsigned long) Modified->dwHighDateTime, (unsigned long) Modified->dwLowDateTime)
+         && Flush();
+
+  LeaveCriticalSection(&m_Lock);
+
+  return success;
+}
+
+
+//**********************************************************************
+// Progress
+// --------
+// Get the offset a large copy can be resumed from. It's zero unless the
+// source has the same size and modified time as when it was recorded.
+//**********************************************************************
+
+UINT64 CReconcileJournal::Progress(int Id, UINT64 Size, const FILETIME* Modified)
+{ UINT64 offset;
+  JOURNALPROGRESS* p;
+
+  offset = 0;
+
+  EnterCriticalSection(&m_Lock);
+
+  p = FindProgress(Id, FALSE);
+  if (p)
+    if (p->Size == Size && CompareFileTime(&p->Modified, Modified) == 0 && p->Offset <= Size)
+      offset = p->Offset;
+
+  LeaveCriticalSection(&m_Lock);
+
+  return offset;
+}
+
+
+//**********************************************************************
+// Checkpoint
+// ----------
+// Write out anything buffered
+//**********************************************************************
+
+BOOL CReconcileJournal::Checkpoint(void)
+{ BOOL success;
+
+  EnterCriticalSection(&m_Lock);
+  success = Flush();
+  LeaveCriticalSection(&m_Lock);
+
+  return success;
+}
+
+
+//**********************************************************************
+// Init
+// ----
+//**********************************************************************
+
+BOOL CReconcileJournal::Init(const WCHAR* FileName, int NumActions)
+{
+  Close(FALSE);
+
+  if (lstrlen(FileName) > PLAN_MAXPATH)
+  { lstrcpy(m_LastError, L"The journal file name is too long");
+    return FALSE;
+  }
+  lstrcpy(m_FileName, FileName);
+
+  if (m_Flags)
+    free(m_Flags);
+
+  m_Flags = (BYTE*) malloc(NumActions + 1);
+  if (!m_Flags)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  ZeroMemory(m_Flags, NumActions + 1);
+  m_NumActions = NumActions;
+  m_NumDone = 0;
+
+  m_NumProgress = 0;
+  m_BufLen = 0;
+  m_LastFlush = GetTickCount64();
+  m_Failed = FALSE;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// ReadRecords
+// -----------
+// Read the records that follow the plan. Length is set to the length
+// of the file up to the end of the last complete line.
+//**********************************************************************
+
+BOOL CReconcileJournal::ReadRecords(const WCHAR* FileName, UINT64* Length)
+{ int len, linenum, id;
+  BOOL inplan, atstart, torn;
+  UINT64 modified;
+  char line[LEN_JOURNALLINE];
+  char* p;
+  FILE* f;
+  JOURNALPROGRESS* prog;
+
+  f = _wfopen(FileName, L"rb");
+  if (!f)
+  { SetError(L"open");
+    return FALSE;
+  }
+
+  inplan = atstart = TRUE;
+  torn = FALSE;
+  *Length = 0;
+
+  for (linenum = 1; fgets(line, LEN_JOURNALLINE, f); linenum++)
+  {
+
+// A plan line can be longer than our buffer so read up to the end of
+// the plan a piece at a time
+
+    len = lstrlenA(line);
+    torn = len == 0 || line[len-1] != '\n';
+
+    if (inplan)
+    { if (atstart && (lstrcmpA(line, "END\r\n") == 0 || lstrcmpA(line, "END\n") == 0))
+        inplan = FALSE;
+      if (torn)
+        linenum--;
+      atstart = !torn;
+      *Length += len;
+      continue;
+    }
+
+// A line without a line end was cut short so it's ignored
+
+    if (torn)
+      break;
+
+    *Length += len;
+
+    while (len > 0 && (line[len-1] == '\r' || line[len-1] == '\n'))
+      line[--len] = '\0';
+
+    if (len == 0)
+      continue;
+
+// Check the id
+
+    if (line[1] != ' ')
+      break;
+
+    id = (int) strtol(line + 2, &p, 10);
+    if (id < 0 || id >= m_NumActions)
+      break;
+
+    if (line[0] == JOURNAL_DONE)
+    { if (!(m_Flags[id] & JOURNALFLAG_DONE))
+      { m_Flags[id] |= JOURNALFLAG_DONE;
+        m_NumDone++;
+      }
+      RemoveProgress(id);
+    }
+    else if (line[0] == JOURNAL_ARCHIVED)
+    { m_Flags[id] |= JOURNALFLAG_ARCHIVED;
+    }
+    else if (line[0] == JOURNAL_PROGRESS)
+    { prog = FindProgress(id, TRUE);
+      if (!prog)
+      { fclose(f);
+        lstrcpy(m_LastError, L"Out of memory");
+        return FALSE;
+      }
+
+      prog->Offset = _strtoui64(p, &p, 10);
+      prog->Size = _strtoui64(p, &p, 10);
+      modified = _strtoui64(p, &p, 16);
+      prog->Modified.dwHighDateTime = (DWORD) (modified >> 32);
+      prog->Modified.dwLowDateTime  = (DWORD) (modified & 0xFFFFFFFF);
+    }
+    else
+    { break;
+    }
+  }
+
+// We should have read the whole file
+
+  if (!feof(f) || inplan)
+  { swprintf(m_LastError, PLAN_MAXPATH+256, L"%s is not a valid journal (line %i)", FileName, linenum);
+    fclose(f);
+    return FALSE;
+  }
+
+  fclose(f);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// OpenForAppend
+// -------------
+// Open the file to add records to the end of it. If Truncate is set
+// anything after Length is thrown away first.
+//**********************************************************************
+
+BOOL CReconcileJournal::OpenForAppend(BOOL Truncate, UINT64 Length)
+{ LARGE_INTEGER li;
+
+  m_File = CreateFile(m_FileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+  if (m_File == INVALID_HANDLE_VALUE)
+  { SetError(L"open");
+    return FALSE;
+  }
+
+  li.QuadPart = Truncate ? (LONGLONG) Length : 0;
+
+  if (!SetFilePointerEx(m_File, li, NULL, Truncate ? FILE_BEGIN : FILE_END)
+   || (Truncate && !SetEndOfFile(m_File)))
+  { SetError(L"open");
+    CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// AddRecord
+// ---------
+// Add a record to the buffer. Must be called with the lock held.
+//**********************************************************************
+
+BOOL CReconcileJournal::AddRecord(const char* Format, ...)
+{ int len;
+  va_list ap;
+
+  if (m_BufLen > JOURNAL_BUFSIZE - LEN_JOURNALLINE)
+    if (!Flush())
+      return FALSE;
+
+  va_start(ap, Format);
+  len = _vsnprintf(m_Buffer + m_BufLen, LEN_JOURNALLINE, Format, ap);
+  va_end(ap);
+
+  if (len > 0)
+    m_BufLen += len;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Flush
+// -----
+// Write the buffer to the file and make sure it's on the disk. Must be
+// called with the lock held. Once a write has failed the journal is
+// no use, so nothing more is written.
+//**********************************************************************
+
+BOOL CReconcileJournal::Flush(void)
+{ DWORD written;
+
+  if (m_Failed || m_File == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  m_LastFlush = GetTickCount64();
+
+  if (m_BufLen == 0)
+    return TRUE;
+
+  if (!WriteFile(m_File, m_Buffer, m_BufLen, &written, NULL) || written != (DWORD) m_BufLen
+   || !FlushFileBuffers(m_File))
+  { SetError(L"write");
+    m_Failed = TRUE;
+    return FALSE;
+  }
+
+  m_BufLen = 0;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// FindProgress
+// ------------
+// Find the progress entry for an action, optionally adding one if there
+// isn't one. There are only ever a few so a linear search is fine.
+//**********************************************************************
+
+JOURNALPROGRESS* CReconcileJournal::FindProgress(int Id, BOOL Add)
+{ int i;
+  JOURNALPROGRESS* p;
+
+  for (i = 0; i < m_NumProgress; i++)
+    if (m_Progress[i].Id == Id)
+      return m_Progress + i;
+
+  if (!Add)
+    return NULL;
+
+  if (m_NumProgress >= m_MaxProgress)
+  { p = (JOURNALPROGRESS*) realloc(m_Progress, (m_MaxProgress + 16)*sizeof(JOURNALPROGRESS));
+    if (!p)
+      return NULL;
+    m_Progress = p;
+    m_MaxProgress += 16;
+  }
+
+  p = m_Progress + m_NumProgress++;
+  ZeroMemory(p, sizeof(JOURNALPROGRESS));
+  p->Id = Id;
+
+  return p;
+}
+
+
+//**********************************************************************
+// RemoveProgress
+// --------------
+//**********************************************************************
+
+void CReconcileJournal::RemoveProgress(int Id)
+{ int i;
+
+  for (i = 0; i < m_NumProgress; i++)
+  { if (m_Progress[i].Id == Id)
+    { m_Progress[i] = m_Progress[--m_NumProgress];
+      break;
+    }
+  }
+}
+
+
+//**********************************************************************
+// SetError
+// --------
+//**********************************************************************
+
+void CReconcileJournal::SetError(const WCHAR* Action)
+{ int i;
+  WCHAR errmsg[256];
+
+  lstrcpy(errmsg, L"<unknown error>");
+  FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, 0, GetLastError(), 0, errmsg, 255, NULL);
+
+  for (i = lstrlen(errmsg); i > 0 && (errmsg[i-1] == '\r' || errmsg[i-1] == '\n'); i--)
+    errmsg[i-1] = '\0';
+
+  swprintf(m_LastError, PLAN_MAXPATH+256, L"Cannot %s journal %s: %s", Action, m_FileName, errmsg);
+}
@@ -0,0 +1,125 @@
+//**********************************************************************
+// CReconcileJournal.h
+// ===================
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CRECONCILEJOURNAL
+#define _INC_CRECONCILEJOURNAL
+
+#include "CReconcilePlan.h"
+
+
+//**********************************************************************
+// Record types
+// The types are the letters used for them in the journal file
+//**********************************************************************
+
+#define JOURNAL_DONE     'C'  // The action completed
+#define JOURNAL_ARCHIVED 'A'  // The old destination file has been archived
+#define JOURNAL_PROGRESS 'P'  // A large copy has reached a confirmed offset
+
+#define JOURNALFLAG_DONE     0x01
+#define JOURNALFLAG_ARCHIVED 0x02
+
+
+//**********************************************************************
+// JOURNALPROGRESS
+// ---------------
+// How far a large copy got. The source size and time are kept so the
+// copy is only resumed if the source hasn't changed.
+//**********************************************************************
+
+typedef struct
+{ int      Id;
+  UINT64   Offset;
+  UINT64   Size;
+  FILETIME Modified;
+
+} JOURNALPROGRESS;
+
+
+//**********************************************************************
+// CReconcileJournal
+// -----------------
+// Records the progress of a plan so an interrupted run can be resumed.
+// The journal file is the saved plan followed by one short line per
+// record: a C record when an action completes, an A record when the
+// old destination file has been archived, and a P record with the
+// confirmed offset of a large copy. C records are buffered and written
+// out at checkpoints, so a crash loses at most the last few seconds of
+// work and those actions are simply done again. A and P records are
+// flushed to disk straight away.
+//
+// The methods that record progress can be called from the copy threads.
+//**********************************************************************
+
+#define JOURNAL_BUFSIZE  0x10000
+#define JOURNAL_INTERVAL 5000
+
+class CReconcileJournal
+{
+  public:
+    CReconcileJournal();
+    ~CReconcileJournal();
+
+    BOOL Create(const WCHAR* FileName, CReconcilePlan* Plan);
+    BOOL Open(const WCHAR* FileName, CReconcilePlan* Plan);
+    BOOL Close(BOOL Delete);
+
+    void Done(int Id);
+    BOOL Archived(int Id);
+    BOOL SetProgress(int Id, UINT64 Offset, UINT64 Size, const FILETIME* Modified);
+    BOOL Checkpoint(void);
+
+    inline BOOL IsDone(int Id) { return (m_Flags[Id] & JOURNALFLAG_DONE) != 0; }
+    inline BOOL IsArchived(int Id) { return (m_Flags[Id] & JOURNALFLAG_ARCHIVED) != 0; }
+    UINT64 Progress(int Id, UINT64 Size, const FILETIME* Modified);
+
+    inline BOOL Resuming(void) { return m_Resuming; }
+    inline int NumDone(void) { return m_NumDone; }
+    inline BOOL Failed(void) { return m_Failed; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL Init(const WCHAR* FileName, int NumActions);
+    BOOL ReadRecords(const WCHAR* FileName, UINT64* Length);
+    BOOL OpenForAppend(BOOL Truncate, UINT64 Length);
+    BOOL AddRecord(const char* Format, ...);
+    BOOL Flush(void);
+    JOURNALPROGRESS* FindProgress(int Id, BOOL Add);
+    void RemoveProgress(int Id);
+    void SetError(const WCHAR* Action);
+
+  private:
+    WCHAR m_FileName[PLAN_MAXPATH+1];
+    HANDLE m_File;
+
+    CRITICAL_SECTION m_Lock;
+
+    BYTE* m_Flags;
+    int m_NumActions, m_NumDone;
+
+    JOURNALPROGRESS* m_Progress;
+    int m_NumProgress, m_MaxProgress;
+
+    char m_Buffer[JOURNAL_BUFSIZE];
+    int m_BufLen;
+    ULONGLONG m_LastFlush;
+
+    BOOL m_Resuming;
+    volatile BOOL m_Failed;
+
+    WCHAR m_LastError[PLAN_MAXPATH+256];
+};
+
+
+//**********************************************************************
+// End of CReconcileJournal
+// ------------------------
+//**********************************************************************
+
+#endif // _INC_CRECONCILEJOURNAL
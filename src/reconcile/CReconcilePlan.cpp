@@ -0,0 +1,1214 @@
+//**********************************************************************
+// CReconcilePlan
+// ==============
+// Work out what reconcile has to do before doing any of it.
+//
+// Each directory is listed once on the source side and once on the
+// destination side. The two listings are sorted by name, ignoring case
+// but otherwise comparing the names as the file system does, and
+// walked together, so every name falls into one of three groups: only
+// in the source, only in the destination, or in both. The action for
+// each name follows from its group and the reconcile options, and no
+// other calls are made to the file system while planning.
+//
+// If a directory can't be listed nothing below it is planned. This
+// matters for deletes, because a listing that fails part way through,
+// e.g. when a network connection drops, would otherwise make the
+// destination files look as if they were no longer in the source.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <CRhsIO/CRhsIO.h>
+#include "CReconcilePlan.h"
+#include "CReconcileStats.h"
+
+
+//**********************************************************************
+// Constants
+//**********************************************************************
+
+#define PLAN_SIGNATURE "RHSPLAN 1"
+#define PLAN_END       "END"
+
+#define LEN_PLANLINE ((PLAN_MAXPATH+1)*8 + 128)
+
+// FILETIMEs are in 100ns units
+
+#define PLAN_SECOND 10000000
+
+// Files are read this much at a time to hash them
+
+#define PLAN_HASHBUF 0x100000
+
+
+//**********************************************************************
+// External functions from reconcile.cpp
+//**********************************************************************
+
+extern CRhsIO RhsIO;
+
+int ReconcileCompareTime(const FILETIME* One, const FILETIME* Two, BOOL DosTime);
+const WCHAR* GetLastErrorMessage(void);
+
+
+//**********************************************************************
+// Local functions
+//**********************************************************************
+
+static int CompareNames(const WCHAR* One, const WCHAR* Two);
+static int __cdecl CompareEntry(const void* One, const void* Two);
+static int __cdecl CompareMove(const void* One, const void* Two);
+static BOOL ParseNumber(WCHAR** Text, int Radix, UINT64* Value);
+
+#define IsPlanDir(e) (((e)->Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+
+
+//**********************************************************************
+// CReconcilePlan
+// --------------
+//**********************************************************************
+
+CReconcilePlan::CReconcilePlan()
+{
+  lstrcpy(m_Source, L"");
+  lstrcpy(m_Dest, L"");
+  lstrcpy(m_Archive, L"");
+
+  m_Options = 0;
+  m_Stats = NULL;
+
+  m_Action = NULL;
+  m_NumActions = m_MaxActions = 0;
+
+  m_Strings = NULL;
+  m_StringsUsed = 0;
+
+  m_NumErrors = 0;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CReconcilePlan::~CReconcilePlan()
+{
+  Clear();
+}
+
+
+//**********************************************************************
+// Build
+// -----
+// Plan the reconcile of Source to Dest. Archive may be NULL or empty.
+// Returns FALSE if an error stopped the planning. Errors that don't
+// stop it are printed and counted.
+//**********************************************************************
+
+BOOL CReconcilePlan::Build(const WCHAR* Source, const WCHAR* Dest, const WCHAR* Archive, DWORD Options)
+{ BOOL changed;
+  WCHAR relpath[PLAN_MAXPATH+1];
+  WIN32_FILE_ATTRIBUTE_DATA fad;
+  PLANENTRY src, dest;
+
+  Clear();
+
+  if (!SetRoot(m_Source, Source) || !SetRoot(m_Dest, Dest) || !SetRoot(m_Archive, Archive ? Archive : L""))
+    return FALSE;
+
+  m_Options = Options;
+
+// Plan the tree
+
+  lstrcpy(relpath, L"");
+  changed = FALSE;
+
+  if (!PlanDirectory(relpath, TRUE, TRUE, &changed))
+    return FALSE;
+
+// Turn copies of files that are already in the destination under a
+// different name into moves
+
+  if ((m_Options & PLANOPT_MOVES) && (m_Options & PLANOPT_CREATE) && (m_Options & PLANOPT_DELETE))
+    if (!DetectMoves())
+      return FALSE;
+
+// The roots are timestamped like any other directory
+
+  if (m_Options & PLANOPT_TIMESTAMP)
+  { ZeroMemory(&src, sizeof(PLANENTRY));
+    ZeroMemory(&dest, sizeof(PLANENTRY));
+
+    if (GetFileAttributesEx(m_Source, GetFileExInfoStandard, &fad))
+    { src.Attributes = fad.dwFileAttributes;
+      src.Created    = fad.ftCreationTime;
+      src.Modified   = fad.ftLastWriteTime;
+
+      if (GetFileAttributesEx(m_Dest, GetFileExInfoStandard, &fad))
+      { dest.Attributes = fad.dwFileAttributes;
+        dest.Created    = fad.ftCreationTime;
+        dest.Modified   = fad.ftLastWriteTime;
+
+        if (!PlanTimeStamp(relpath, &src, &dest, changed, FALSE))
+          return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// PlanDirectory
+// -------------
+// Plan one directory and, recursively, the directories below it.
+// RelPath is a buffer of PLAN_MAXPATH+1 characters that's used to build
+// the paths of the entries and is restored before returning. InSource
+// and InDest say which sides the directory exists on. Changed is set if
+// any entries will be added or removed in the destination directory.
+//**********************************************************************
+
+BOOL CReconcilePlan::PlanDirectory(WCHAR* RelPath, BOOL InSource, BOOL InDest, BOOL* Changed)
+{ int i, j, c, rellen;
+  BOOL success;
+  const WCHAR* name;
+  PLANENTRY* s;
+  PLANENTRY* d;
+  PLANLISTING src, dest;
+
+  *Changed = FALSE;
+
+  ZeroMemory(&src, sizeof(PLANLISTING));
+  ZeroMemory(&dest, sizeof(PLANLISTING));
+
+// List both sides
+
+  if (InSource && !ListDirectory(m_Source, RelPath, &src))
+  { FreeListing(&src);
+    return PlanError(L"Cannot list directory %s%s: %s", m_Source, RelPath, GetLastErrorMessage());
+  }
+
+  if (InDest && !ListDirectory(m_Dest, RelPath, &dest))
+  { FreeListing(&src);
+    FreeListing(&dest);
+    return PlanError(L"Cannot list directory %s%s: %s", m_Dest, RelPath, GetLastErrorMessage());
+  }
+
+// Walk the two sorted listings together
+
+  rellen = lstrlen(RelPath);
+  success = TRUE;
+  i = j = 0;
+
+  while (i < src.NumEntries || j < dest.NumEntries)
+  { if (RhsIO.GetAbort())
+    { lstrcpy(m_LastError, L"The reconcile was aborted");
+      success = FALSE;
+      break;
+    }
+
+    s = i < src.NumEntries ? src.Entry + i : NULL;
+    d = j < dest.NumEntries ? dest.Entry + j : NULL;
+
+    if (s && d)
+      c = CompareNames(s->Name, d->Name);
+    else
+      c = s ? -1 : 1;
+
+    if (c < 0)
+    { d = NULL;
+      i++;
+    }
+    else if (c > 0)
+    { s = NULL;
+      j++;
+    }
+    else
+    { i++;
+      j++;
+    }
+
+// Build the relative path of the entry
+
+    name = s ? s->Name : d->Name;
+
+    if (rellen + 1 + lstrlen(name) > PLAN_MAXPATH)
+    { success = PlanError(L"Cannot reconcile %s%s\\%s: The path is too long", s ? m_Source : m_Dest, RelPath, name);
+      if (!success)
+        break;
+      continue;
+    }
+
+    RelPath[rellen] = '\\';
+    lstrcpy(RelPath + rellen + 1, name);
+
+    success = PlanEntry(RelPath, s, d, Changed);
+
+    RelPath[rellen] = '\0';
+
+    if (!success)
+      break;
+  }
+
+  FreeListing(&src);
+  FreeListing(&dest);
+
+  return success;
+}
+
+
+//**********************************************************************
+// PlanEntry
+// ---------
+// Plan one name from a directory. Src or Dest is NULL if the name is
+// only on one side.
+//**********************************************************************
+
+BOOL CReconcilePlan::PlanEntry(WCHAR* RelPath, const PLANENTRY* Src, const PLANENTRY* Dest, BOOL* Changed)
+{ BOOL subchanged, copied;
+
+// Only in the source
+
+  if (!Dest)
+  { if (!(m_Options & PLANOPT_CREATE))
+      return TRUE;
+
+    *Changed = TRUE;
+
+// New directories are given the source times when they are complete,
+// so they don't need a timestamp action
+
+    if (IsPlanDir(Src))
+    { if (!AddAction(PLAN_MKDIR, PLANFLAG_DIR, Src, RelPath))
+        return FALSE;
+
+      return PlanDirectory(RelPath, TRUE, FALSE, &subchanged);
+    }
+
+    if (!AddAction(PLAN_CREATE, 0, Src, RelPath))
+      return FALSE;
+
+    if (m_Options & PLANOPT_TIMESTAMP)
+      return PlanTimeStamp(RelPath, Src, NULL, FALSE, TRUE);
+
+    return TRUE;
+  }
+
+// Only in the destination
+
+  if (!Src)
+  { if (!(m_Options & PLANOPT_DELETE))
+      return TRUE;
+
+    *Changed = TRUE;
+
+    if (IsPlanDir(Dest))
+    { if (!PlanDirectory(RelPath, FALSE, TRUE, &subchanged))
+        return FALSE;
+
+      return AddAction(PLAN_RMDIR, PLANFLAG_DIR, Dest, RelPath);
+    }
+
+    return AddAction(PLAN_DELETE, 0, Dest, RelPath);
+  }
+
+// In both, but a directory on one side and a file on the other
+
+  if (IsPlanDir(Src) != IsPlanDir(Dest))
+    return PlanError(L"Cannot reconcile %s%s: It is a directory in one tree and a file in the other", m_Source, RelPath);
+
+// Directories in both
+
+  if (IsPlanDir(Src))
+  { if (!PlanDirectory(RelPath, TRUE, TRUE, &subchanged))
+      return FALSE;
+
+    if (m_Options & PLANOPT_TIMESTAMP)
+      return PlanTimeStamp(RelPath, Src, Dest, subchanged, FALSE);
+
+    return TRUE;
+  }
+
+// Files in both
+
+  copied = FALSE;
+
+  if (m_Options & PLANOPT_UPDATE)
+  { if (ReconcileCompareTime(&Src->Modified, &Dest->Modified, m_Options & PLANOPT_FATTIME) > 0)
+    { if (!AddAction(PLAN_UPDATE, 0, Src, RelPath))
+        return FALSE;
+      copied = TRUE;
+    }
+  }
+
+  if (m_Options & PLANOPT_TIMESTAMP)
+    return PlanTimeStamp(RelPath, Src, Dest, FALSE, copied);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// PlanTimeStamp
+// -------------
+// Add a timestamp action if the destination times won't match the
+// source once the other actions have been done. Dest is NULL if the
+// destination is being created. Changed means entries are being added
+// to or removed from a directory, which changes its modified time.
+// Copied means a file is being copied, which keeps the modified time
+// but not the created time.
+//**********************************************************************
+
+BOOL CReconcilePlan::PlanTimeStamp(const WCHAR* RelPath, const PLANENTRY* Src, const PLANENTRY* Dest, BOOL Changed, BOOL Copied)
+{ BOOL fat, all, needed;
+
+  fat = (m_Options & PLANOPT_FATTIME) != 0;
+  all = (m_Options & PLANOPT_TIMESTAMPALL) != 0;
+
+// Directories always get both times
+
+  if (IsPlanDir(Src))
+  { needed = Changed;
+
+    if (!needed && Dest)
+      needed = ReconcileCompareTime(&Src->Modified, &Dest->Modified, fat) != 0
+            || ReconcileCompareTime(&Src->Created, &Dest->Created, fat) != 0;
+
+    if (needed)
+      return AddAction(PLAN_TIMESTAMP, PLANFLAG_DIR | PLANFLAG_CREATED, Src, RelPath);
+
+    return TRUE;
+  }
+
+// Files get the modified time, or both if -ta was used
+
+  if (Copied || !Dest)
+    needed = all;
+  else
+    needed = ReconcileCompareTime(&Src->Modified, &Dest->Modified, fat) != 0
+          || (all && ReconcileCompareTime(&Src->Created, &Dest->Created, fat) != 0);
+
+  if (needed)
+    return AddAction(PLAN_TIMESTAMP, all ? PLANFLAG_CREATED : 0, Src, RelPath);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// DetectMoves
+// -----------
+// Find files that have been moved or renamed in the source, and move
+// them in the destination instead of copying them again and deleting
+// the old copy. The new files and the deleted files are sorted by size
+// and time and walked together, so only files of the same size and
+// close times are compared.
+//
+// Without PLANOPT_MOVEHASH a pair is only used if neither file matches
+// any other, because otherwise we can't tell which file went where.
+// With it the contents are hashed and any pair with the same contents
+// is used.
+//**********************************************************************
+
+BOOL CReconcilePlan::DetectMoves(void)
+{ int i, j, first, numcreates, numdeletes, nummatches;
+  BOOL fat;
+  HCRYPTPROV prov;
+  PLANMOVE* creates;
+  PLANMOVE* deletes;
+  PLANMOVE* c;
+  PLANMOVE* d;
+  PLANMOVE* match;
+
+  fat = (m_Options & PLANOPT_FATTIME) != 0;
+
+  creates = MoveCandidates(PLAN_CREATE, &numcreates);
+  deletes = MoveCandidates(PLAN_DELETE, &numdeletes);
+
+  if (!creates || !deletes)
+  { if (creates)
+      free(creates);
+    if (deletes)
+      free(deletes);
+    lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  prov = 0;
+
+  if ((m_Options & PLANOPT_MOVEHASH) && numcreates > 0 && numdeletes > 0)
+  { if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+    { swprintf(m_LastError, PLAN_MAXPATH+256, L"Cannot hash files to detect moves: %s", GetLastErrorMessage());
+      free(creates);
+      free(deletes);
+      return FALSE;
+    }
+  }
+
+  first = 0;
+
+  for (i = 0; i < numcreates; i++)
+  { c = creates + i;
+
+    if (RhsIO.GetAbort())
+      break;
+
+// Skip the deletes that are too small or too old to match this create,
+// or any create after it
+
+    while (first < numdeletes
+        && (deletes[first].Size < c->Size
+         || (deletes[first].Size == c->Size && deletes[first].Seconds + 2 < c->Seconds)))
+      first++;
+
+    match = NULL;
+    nummatches = 0;
+
+    for (j = first; j < numdeletes; j++)
+    { d = deletes + j;
+
+      if (d->Size != c->Size || d->Seconds > c->Seconds + 2)
+        break;
+      if (d->Used)
+        continue;
+      if (ReconcileCompareTime(&m_Action[c->Action].Modified, &m_Action[d->Action].Modified, fat) != 0)
+        continue;
+
+      if (prov)
+      { if (MoveMatches(c, d, prov))
+        { match = d;
+          break;
+        }
+      }
+      else
+      { match = d;
+        nummatches++;
+      }
+    }
+
+// Without hashes the delete must not match the creates either side of
+// this one. The creates that match a delete are all next to each other
+// in the sorted list so there's no need to look further.
+
+    if (!prov && match)
+    { if (nummatches != 1)
+        match = NULL;
+      else if (i > 0 && creates[i-1].Size == c->Size
+            && ReconcileCompareTime(&m_Action[creates[i-1].Action].Modified, &m_Action[match->Action].Modified, fat) == 0)
+        match = NULL;
+      else if (i < numcreates - 1 && creates[i+1].Size == c->Size
+            && ReconcileCompareTime(&m_Action[creates[i+1].Action].Modified, &m_Action[match->Action].Modified, fat) == 0)
+        match = NULL;
+    }
+
+// Turn the copy into a move and drop the delete
+
+    if (match)
+    { match->Used = TRUE;
+      m_Action[c->Action].Type = PLAN_MOVE;
+      m_Action[c->Action].From = m_Action[match->Action].Path;
+      m_Action[match->Action].Type = 0;
+    }
+  }
+
+  if (prov)
+    CryptReleaseContext(prov, 0);
+
+  free(creates);
+  free(deletes);
+
+  if (RhsIO.GetAbort())
+  { lstrcpy(m_LastError, L"The reconcile was aborted");
+    return FALSE;
+  }
+
+// Remove the dropped deletes. The order of the rest doesn't change.
+
+  for (i = j = 0; i < m_NumActions; i++)
+    if (m_Action[i].Type != 0)
+      m_Action[j++] = m_Action[i];
+
+  m_NumActions = j;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// MoveCandidates
+// --------------
+// Make a list of the files with actions of the given type, sorted by
+// size and modified time. Empty files are left out because they all
+// look the same.
+//**********************************************************************
+
+PLANMOVE* CReconcilePlan::MoveCandidates(WCHAR Type, int* NumCandidates)
+{ int i, n;
+  PLANMOVE* list;
+  const PLANACTION* a;
+
+  list = (PLANMOVE*) malloc((m_NumActions + 1)*sizeof(PLANMOVE));
+  if (!list)
+    return NULL;
+
+  n = 0;
+
+  for (i = 0; i < m_NumActions; i++)
+  { a = m_Action + i;
+    if (a->Type != Type || (a->Flags & PLANFLAG_DIR) || a->Size == 0)
+      continue;
+
+    list[n].Action  = i;
+    list[n].Size    = a->Size;
+    list[n].Seconds = ((((UINT64) a->Modified.dwHighDateTime) << 32) | a->Modified.dwLowDateTime)/PLAN_SECOND;
+    list[n].Used    = FALSE;
+    list[n].Hashed  = FALSE;
+    n++;
+  }
+
+  qsort(list, n, sizeof(PLANMOVE), CompareMove);
+
+  *NumCandidates = n;
+  return list;
+}
+
+
+//**********************************************************************
+// MoveMatches
+// -----------
+// Compare the contents of a new source file and a deleted destination
+// file. Each file is only hashed once however many files it's compared
+// with. A file that can't be read doesn't match anything.
+//**********************************************************************
+
+BOOL CReconcilePlan::MoveMatches(PLANMOVE* Create, PLANMOVE* Delete, HCRYPTPROV Prov)
+{
+  if (!Create->Hashed)
+  { if (!HashFile(m_Source, m_Action[Create->Action].Path, Prov, Create->Hash))
+      return FALSE;
+    Create->Hashed = TRUE;
+  }
+
+  if (!Delete->Hashed)
+  { if (!HashFile(m_Dest, m_Action[Delete->Action].Path, Prov, Delete->Hash))
+      return FALSE;
+    Delete->Hashed = TRUE;
+  }
+
+  return memcmp(Create->Hash, Delete->Hash, PLAN_HASHLEN) == 0;
+}
+
+
+//**********************************************************************
+// HashFile
+// --------
+// Get the MD5 hash of a file
+//**********************************************************************
+
+BOOL CReconcilePlan::HashFile(const WCHAR* Root, const WCHAR* RelPath, HCRYPTPROV Prov, BYTE* Hash)
+{ BOOL success;
+  DWORD bytesread, hashlen;
+  BYTE* buf;
+  WCHAR path[PLAN_MAXPATH*2+1];
+  HANDLE h;
+  HCRYPTHASH hash;
+
+  lstrcpy(path, Root);
+  lstrcat(path, RelPath);
+
+  h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  buf = (BYTE*) malloc(PLAN_HASHBUF);
+  if (!buf)
+  { CloseHandle(h);
+    return FALSE;
+  }
+
+  if (!CryptCreateHash(Prov, CALG_MD5, 0, 0, &hash))
+  { free(buf);
+    CloseHandle(h);
+    return FALSE;
+  }
+
+  success = TRUE;
+
+  for (;;)
+  { if (!ReadFile(h, buf, PLAN_HASHBUF, &bytesread, NULL) || RhsIO.GetAbort())
+    { success = FALSE;
+      break;
+    }
+
+    if (bytesread == 0)
+      break;
+
+    if (!CryptHashData(hash, buf, bytesread, 0))
+    { success = FALSE;
+      break;
+    }
+  }
+
+  hashlen = PLAN_HASHLEN;
+  if (success)
+    success = CryptGetHashParam(hash, HP_HASHVAL, Hash, &hashlen, 0);
+
+  CryptDestroyHash(hash);
+  free(buf);
+  CloseHandle(h);
+
+  return success;
+}
+
+
+//**********************************************************************
+// ListDirectory
+// -------------
+// List a directory and sort the entries by name. Returns FALSE, with
+// the Windows error set, if the listing fails or is incomplete.
+//**********************************************************************
+
+BOOL CReconcilePlan::ListDirectory(const WCHAR* Root, const WCHAR* RelPath, PLANLISTING* List)
+{ int i, len, newmax;
+  DWORD err;
+  UINT64 started, latency;
+  WCHAR* p;
+  WCHAR path[PLAN_MAXPATH*2+3];
+  HANDLE h;
+  WIN32_FIND_DATA wfd;
+  PLANENTRY* e;
+
+  lstrcpy(path, Root);
+  lstrcat(path, RelPath);
+  lstrcat(path, L"\\*");
+
+  started = m_Stats ? m_Stats->Now() : 0;
+  h = FindFirstFile(path, &wfd);
+  latency = m_Stats ? m_Stats->Now() - started : 0;
+
+// An empty drive root has no . or .. entries so FindFirstFile finds
+// nothing at all
+
+  if (h == INVALID_HANDLE_VALUE)
+    return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+  do
+  { if (lstrcmp(wfd.cFileName, L".") == 0 || lstrcmp(wfd.cFileName, L"..") == 0)
+      continue;
+
+// Make room for the entry and its name
+
+    if (List->NumEntries == List->MaxEntries)
+    { newmax = List->MaxEntries ? List->MaxEntries*2 : 64;
+      e = (PLANENTRY*) realloc(List->Entry, newmax*sizeof(PLANENTRY));
+      if (!e)
+      { FindClose(h);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+      }
+      List->Entry = e;
+      List->MaxEntries = newmax;
+    }
+
+    len = lstrlen(wfd.cFileName) + 1;
+
+    if (List->NamesLen + len > List->MaxNamesLen)
+    { newmax = List->MaxNamesLen ? List->MaxNamesLen*2 : 0x1000;
+      while (List->NamesLen + len > newmax)
+        newmax *= 2;
+      p = (WCHAR*) realloc(List->Names, newmax*sizeof(WCHAR));
+      if (!p)
+      { FindClose(h);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+      }
+      List->Names = p;
+      List->MaxNamesLen = newmax;
+    }
+
+// Add it
+
+    e = List->Entry + List->NumEntries++;
+    e->Attributes = wfd.dwFileAttributes;
+    e->Created    = wfd.ftCreationTime;
+    e->Modified   = wfd.ftLastWriteTime;
+    e->Size       = ((UINT64) wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow;
+    e->Name       = NULL;
+
+    lstrcpy(List->Names + List->NamesLen, wfd.cFileName);
+    List->NamesLen += len;
+  } while (FindNextFile(h, &wfd));
+
+  err = GetLastError();
+  FindClose(h);
+
+  if (err != ERROR_NO_MORE_FILES)
+  { SetLastError(err);
+    return FALSE;
+  }
+
+// The name buffer may have moved while it was growing, so point the
+// entries at their names now. The names are in the same order as the
+// entries.
+
+  p = List->Names;
+  for (i = 0; i < List->NumEntries; i++)
+  { List->Entry[i].Name = p;
+    p += lstrlen(p) + 1;
+  }
+
+  qsort(List->Entry, List->NumEntries, sizeof(PLANENTRY), CompareEntry);
+
+  if (m_Stats)
+    m_Stats->Listed(Root, latency, List->NumEntries);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// FreeListing
+// -----------
+//**********************************************************************
+
+void CReconcilePlan::FreeListing(PLANLISTING* List)
+{
+  if (List->Entry)
+    free(List->Entry);
+  if (List->Names)
+    free(List->Names);
+
+  ZeroMemory(List, sizeof(PLANLISTING));
+}
+
+
+//**********************************************************************
+// Save
+// ----
+// Write the plan to a UTF-8 text file. The file starts with the
+// SOURCE, DEST and ARCHIVE roots and then has one line per action:
+//
+// <type> <flags> <created> <modified> <size> <path>
+//
+// Moves have the path the file is moved from after the path, separated
+// by a '|' as that can't appear in a file name.
+//
+// The times are FILETIMEs in hex. The path comes last so it can contain
+// spaces. The plan finishes with an END line, and a journal can follow
+// it in the same file.
+//**********************************************************************
+
+BOOL CReconcilePlan::Save(const WCHAR* FileName)
+{ int i;
+  BOOL success;
+  char path[(PLAN_MAXPATH+1)*4],
+       from[(PLAN_MAXPATH+1)*4];
+  FILE* f;
+  const PLANACTION* a;
+
+  f = _wfopen(FileName, L"wb");
+  if (!f)
+  { swprintf(m_LastError, PLAN_MAXPATH+256, L"Cannot create %s: %s", FileName, GetLastErrorMessage());
+    return FALSE;
+  }
+
+  fprintf(f, "%s\r\n", PLAN_SIGNATURE);
+
+  WideCharToMultiByte(CP_UTF8, 0, m_Source, -1, path, sizeof(path), NULL, NULL);
+  fprintf(f, "SOURCE %s\r\n", path);
+  WideCharToMultiByte(CP_UTF8, 0, m_Dest, -1, path, sizeof(path), NULL, NULL);
+  fprintf(f, "DEST %s\r\n", path);
+  WideCharToMultiByte(CP_UTF8, 0, m_Archive, -1, path, sizeof(path), NULL, NULL);
+  fprintf(f, "ARCHIVE %s\r\n", path);
+
+  for (i = 0; i < m_NumActions; i++)
+  { a = m_Action + i;
+    WideCharToMultiByte(CP_UTF8, 0, a->Path, -1, path, sizeof(path), NULL, NULL);
+
+    fprintf(f, "%c %lu %08lx%08lx %08lx%08lx %.0f %s",
+            (char) a->Type, (unsigned long) a->Flags,
+            (unsigned long) a->Created.dwHighDateTime, (unsigned long) a->Created.dwLowDateTime,
+            (unsigned long) a->Modified.dwHighDateTime, (unsigned long) a->Modified.dwLowDateTime,
+            (double) a->Size, path);
+
+    if (a->Type == PLAN_MOVE)
+    { WideCharToMultiByte(CP_UTF8, 0, a->From, -1, from, sizeof(from), NULL, NULL);
+      fprintf(f, "|%s", from);
+    }
+
+    fprintf(f, "\r\n");
+  }
+
+  fprintf(f, "%s\r\n", PLAN_END);
+
+  success = !ferror(f);
+  if (fclose(f) != 0)
+    success = FALSE;
+
+  if (!success)
+    swprintf(m_LastError, PLAN_MAXPATH+256, L"Error writing %s", FileName);
+
+  return success;
+}
+
+
+//**********************************************************************
+// Load
+// ----
+// Read a plan written by Save
+//**********************************************************************
+
+BOOL CReconcilePlan::Load(const WCHAR* FileName)
+{ int len, linenum;
+  BOOL ended;
+  UINT64 flags, created, modified, size;
+  char line[LEN_PLANLINE];
+  WCHAR wline[LEN_PLANLINE];
+  WCHAR* p;
+  WCHAR* from;
+  FILE* f;
+  PLANENTRY e;
+
+  Clear();
+
+  f = _wfopen(FileName, L"rb");
+  if (!f)
+  { swprintf(m_LastError, PLAN_MAXPATH+256, L"Cannot open %s: %s", FileName, GetLastErrorMessage());
+    return FALSE;
+  }
+
+  ended = FALSE;
+
+  for (linenum = 1; fgets(line, LEN_PLANLINE, f); linenum++)
+  {
+
+// Strip the line end and convert to UNICODE
+
+    len = lstrlenA(line);
+    while (len > 0 && (line[len-1] == '\r' || line[len-1] == '\n'))
+      line[--len] = '\0';
+
+    if (MultiByteToWideChar(CP_UTF8, 0, line, -1, wline, LEN_PLANLINE) == 0)
+      break;
+
+// The first line must be the signature
+
+    if (linenum == 1)
+    { if (lstrcmpA(line, PLAN_SIGNATURE) != 0)
+        break;
+      continue;
+    }
+
+// Blank lines are allowed
+
+    if (len == 0)
+      continue;
+
+// Anything after the end line, e.g. a journal, is not part of the plan
+
+    if (lstrcmpA(line, PLAN_END) == 0)
+    { ended = TRUE;
+      break;
+    }
+
+// The roots
+
+    if (CompareStringOrdinal(wline, 7, L"SOURCE ", 7, FALSE) == CSTR_EQUAL)
+    { if (!SetRoot(m_Source, wline + 7))
+        break;
+      continue;
+    }
+    else if (CompareStringOrdinal(wline, 5, L"DEST ", 5, FALSE) == CSTR_EQUAL)
+    { if (!SetRoot(m_Dest, wline + 5))
+        break;
+      continue;
+    }
+    else if (CompareStringOrdinal(wline, 8, L"ARCHIVE ", 8, FALSE) == CSTR_EQUAL)
+    { if (!SetRoot(m_Archive, wline + 8))
+        break;
+      continue;
+    }
+
+// An action
+
+    if (wline[1] != ' ')
+      break;
+
+    if (wline[0] != PLAN_MKDIR && wline[0] != PLAN_CREATE && wline[0] != PLAN_UPDATE
+     && wline[0] != PLAN_DELETE && wline[0] != PLAN_RMDIR && wline[0] != PLAN_TIMESTAMP
+     && wline[0] != PLAN_MOVE)
+      break;
+
+    p = wline + 2;
+    if (!ParseNumber(&p, 10, &flags) || !ParseNumber(&p, 16, &created)
+     || !ParseNumber(&p, 16, &modified) || !ParseNumber(&p, 10, &size))
+      break;
+
+    e.Attributes = (flags & PLANFLAG_DIR) ? FILE_ATTRIBUTE_DIRECTORY : 0;
+    e.Created.dwHighDateTime  = (DWORD) (created >> 32);
+    e.Created.dwLowDateTime   = (DWORD) (created & 0xFFFFFFFF);
+    e.Modified.dwHighDateTime = (DWORD) (modified >> 32);
+    e.Modified.dwLowDateTime  = (DWORD) (modified & 0xFFFFFFFF);
+    e.Size = size;
+
+// Moves have a second path after a '|'
+
+    from = NULL;
+
+    if (wline[0] == PLAN_MOVE)
+    { from = wcschr(p, '|');
+      if (!from)
+        break;
+      *from++ = '\0';
+      if (lstrlen(from) > PLAN_MAXPATH)
+        break;
+    }
+
+    if (lstrlen(p) > PLAN_MAXPATH)
+      break;
+
+    if (!AddAction(wline[0], (DWORD) flags, &e, p))
+    { fclose(f);
+      return FALSE;
+    }
+
+    if (from)
+    { m_Action[m_NumActions-1].From = AddString(from);
+      if (!m_Action[m_NumActions-1].From)
+      { lstrcpy(m_LastError, L"Out of memory");
+        fclose(f);
+        return FALSE;
+      }
+    }
+  }
+
+// If we stopped early the file isn't a valid plan
+
+  if ((!ended && !feof(f)) || linenum == 1 || lstrlen(m_Source) == 0 || lstrlen(m_Dest) == 0)
+  { swprintf(m_LastError, PLAN_MAXPATH+256, L"%s is not a valid plan file (line %i)", FileName, linenum);
+    fclose(f);
+    Clear();
+    return FALSE;
+  }
+
+  fclose(f);
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Clear
+// -----
+//**********************************************************************
+
+void CReconcilePlan::Clear(void)
+{ PLANSTRINGS* next;
+
+  if (m_Action)
+    free(m_Action);
+  m_Action = NULL;
+  m_NumActions = m_MaxActions = 0;
+
+  while (m_Strings)
+  { next = m_Strings->Next;
+    free(m_Strings);
+    m_Strings = next;
+  }
+  m_StringsUsed = 0;
+
+  lstrcpy(m_Source, L"");
+  lstrcpy(m_Dest, L"");
+  lstrcpy(m_Archive, L"");
+
+  m_NumErrors = 0;
+}
+
+
+//**********************************************************************
+// AddAction
+// ---------
+//**********************************************************************
+
+BOOL CReconcilePlan::AddAction(WCHAR Type, DWORD Flags, const PLANENTRY* Entry, const WCHAR* RelPath)
+{ int newmax;
+  PLANACTION* a;
+
+  if (m_NumActions == m_MaxActions)
+  { newmax = m_MaxActions ? m_MaxActions*2 : 0x400;
+    a = (PLANACTION*) realloc(m_Action, newmax*sizeof(PLANACTION));
+    if (!a)
+    { lstrcpy(m_LastError, L"Out of memory");
+      return FALSE;
+    }
+    m_Action = a;
+    m_MaxActions = newmax;
+  }
+
+  a = m_Action + m_NumActions;
+
+  a->Path = AddString(RelPath);
+  if (!a->Path)
+  { lstrcpy(m_LastError, L"Out of memory");
+    return FALSE;
+  }
+
+  a->Type     = Type;
+  a->Flags    = Flags;
+  a->Created  = Entry->Created;
+  a->Modified = Entry->Modified;
+  a->Size     = Entry->Size;
+  a->From     = NULL;
+
+  m_NumActions++;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// AddString
+// ---------
+// Allocate a copy of a string from the string blocks
+//**********************************************************************
+
+WCHAR* CReconcilePlan::AddString(const WCHAR* s)
+{ int len;
+  WCHAR* p;
+  PLANSTRINGS* block;
+
+  len = lstrlen(s) + 1;
+  if (len > PLAN_STRINGBLOCK)
+    return NULL;
+
+  if (!m_Strings || m_StringsUsed + len > PLAN_STRINGBLOCK)
+  { block = (PLANSTRINGS*) malloc(sizeof(PLANSTRINGS));
+    if (!block)
+      return NULL;
+
+    block->Next = m_Strings;
+    m_Strings = block;
+    m_StringsUsed = 0;
+  }
+
+  p = m_Strings->Text + m_StringsUsed;
+  lstrcpy(p, s);
+  m_StringsUsed += len;
+
+  return p;
+}
+
+
+//**********************************************************************
+// PlanError
+// ---------
+// Print and count an error. Returns FALSE if errors are fatal.
+//**********************************************************************
+
+BOOL CReconcilePlan::PlanError(const WCHAR* Format, ...)
+{ int i;
+  va_list ap;
+
+  va_start(ap, Format);
+  vswprintf(m_LastError, PLAN_MAXPATH+256, Format, ap);
+  va_end(ap);
+  m_LastError[PLAN_MAXPATH+255] = '\0';
+
+// System error messages end with a line break
+
+  for (i = lstrlen(m_LastError); i > 0 && (m_LastError[i-1] == '\r' || m_LastError[i-1] == '\n'); i--)
+    m_LastError[i-1] = '\0';
+
+  RhsIO.errprintf(L"E %s\r\n", m_LastError);
+  m_NumErrors++;
+
+  return (m_Options & PLANOPT_FAILONERROR) == 0;
+}
+
+
+//**********************************************************************
+// SetRoot
+// -------
+//**********************************************************************
+
+BOOL CReconcilePlan::SetRoot(WCHAR* Root, const WCHAR* Path)
+{
+  if (lstrlen(Path) > PLAN_MAXPATH)
+  { lstrcpy(m_LastError, L"The path is too long");
+    return FALSE;
+  }
+
+  lstrcpy(Root, Path);
+  return TRUE;
+}
+
+
+//**********************************************************************
+// CompareNames
+// ------------
+// Compare two file names ignoring case. This is an ordinal comparison,
+// which matches the way the file system decides if two names are the
+// same. lstrcmpi uses the language rules, which can order names
+// differently or treat different names as equal, and that would throw
+// the merge of the listings out.
+//**********************************************************************
+
+static int CompareNames(const WCHAR* One, const WCHAR* Two)
+{
+  return CompareStringOrdinal(One, -1, Two, -1, TRUE) - CSTR_EQUAL;
+}
+
+
+//**********************************************************************
+// CompareEntry
+// ------------
+// qsort callback to sort a listing by name
+//**********************************************************************
+
+static int __cdecl CompareEntry(const void* One, const void* Two)
+{
+  return CompareNames(((const PLANENTRY*) One)->Name, ((const PLANENTRY*) Two)->Name);
+}
+
+
+//**********************************************************************
+// CompareMove
+// -----------
+// qsort comparison function to sort move candidates by size and time
+//**********************************************************************
+
+static int __cdecl CompareMove(const void* One, const void* Two)
+{ const PLANMOVE* m1 = (const PLANMOVE*) One;
+  const PLANMOVE* m2 = (const PLANMOVE*) Two;
+
+  if (m1->Size != m2->Size)
+    return m1->Size < m2->Size ? -1 : 1;
+
+  if (m1->Seconds != m2->Seconds)
+    return m1->Seconds < m2->Seconds ? -1 : 1;
+
+  return 0;
+}
+
+
+//**********************************************************************
+// ParseNumber
+// -----------
+// Parse a number followed by a space and step past both
+//**********************************************************************
+
+static BOOL ParseNumber(WCHAR** Text, int Radix, UINT64* Value)
+{ WCHAR* end;
+
+  *Value = _wcstoui64(*Text, &end, Radix);
+
+  if (end == *Text || *end != ' ')
+    return FALSE;
+
+  *Text = end + 1;
+  return TRUE;
+}
@@ -0,0 +1,213 @@
+//**********************************************************************
+// CReconcilePlan.h
+// ================
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CRECONCILEPLAN
+#define _INC_CRECONCILEPLAN
+
+class CReconcileStats;
+
+
+//**********************************************************************
+// Action types
+// The types are the letters used for them in a saved plan
+//**********************************************************************
+
+#define PLAN_MKDIR     'M'  // Create a destination directory
+#define PLAN_CREATE    'X'  // Copy a file that isn't in the destination
+#define PLAN_UPDATE    'U'  // Overwrite an older destination file
+#define PLAN_DELETE    'D'  // Delete a file not in the source
+#define PLAN_RMDIR     'R'  // Remove a directory not in the source
+#define PLAN_TIMESTAMP 'T'  // Set the destination times from the source
+#define PLAN_MOVE      'V'  // Move a destination file instead of copying it
+
+#define PLANFLAG_DIR     0x01  // The action is on a directory
+#define PLANFLAG_CREATED 0x02  // Set the created time as well as modified
+
+
+//**********************************************************************
+// Options for Build
+//**********************************************************************
+
+#define PLANOPT_CREATE       0x01
+#define PLANOPT_UPDATE       0x02
+#define PLANOPT_DELETE       0x04
+#define PLANOPT_TIMESTAMP    0x08
+#define PLANOPT_TIMESTAMPALL 0x10
+#define PLANOPT_FATTIME      0x20
+#define PLANOPT_FAILONERROR  0x40
+#define PLANOPT_MOVES        0x80
+#define PLANOPT_MOVEHASH     0x100
+
+
+//**********************************************************************
+// PLANACTION
+// ----------
+// Path is relative to the source and destination roots. It starts with
+// a '\' or is empty for the roots themselves. The times and size are
+// those of the source file, or of the destination file for deletes.
+// From is only used by moves, and is the path of the destination file
+// that is moved to Path.
+//**********************************************************************
+
+typedef struct
+{ WCHAR    Type;
+  DWORD    Flags;
+  FILETIME Created,
+           Modified;
+  UINT64   Size;
+  WCHAR*   Path;
+  WCHAR*   From;
+
+} PLANACTION;
+
+
+//**********************************************************************
+// PLANENTRY
+// ---------
+// One entry in a directory listing
+//**********************************************************************
+
+typedef struct
+{ DWORD    Attributes;
+  FILETIME Created,
+           Modified;
+  UINT64   Size;
+  WCHAR*   Name;
+
+} PLANENTRY;
+
+typedef struct
+{ PLANENTRY* Entry;
+  int NumEntries, MaxEntries;
+  WCHAR* Names;
+  int NamesLen, MaxNamesLen;
+
+} PLANLISTING;
+
+
+//**********************************************************************
+// PLANMOVE
+// --------
+// A file that might have been moved. The candidates are sorted by size
+// and modified time.
+//**********************************************************************
+
+#define PLAN_HASHLEN 16
+
+typedef struct
+{ int    Action;
+  UINT64 Size,
+         Seconds;
+  BOOL   Used,
+         Hashed;
+  BYTE   Hash[PLAN_HASHLEN];
+
+} PLANMOVE;
+
+
+//**********************************************************************
+// PLANSTRINGS
+// -----------
+// The action paths are allocated from a chain of blocks that are all
+// freed together
+//**********************************************************************
+
+#define PLAN_STRINGBLOCK 0x8000
+
+typedef struct _PLANSTRINGS
+{ struct _PLANSTRINGS* Next;
+  WCHAR Text[PLAN_STRINGBLOCK];
+
+} PLANSTRINGS;
+
+
+//**********************************************************************
+// CReconcilePlan
+// --------------
+// Works out what has to be done to reconcile two directory trees. Each
+// directory is listed once on each side, the listings are sorted and
+// merged, and the differences become a list of actions. The plan can
+// be saved to a file and loaded again later.
+//
+// Actions are in tree order, with directory removes and timestamps
+// after the directory contents.
+//
+// If moves are being detected, a file that is only in the source is
+// matched with a file that is only in the destination and has the same
+// size and modified time, and optionally the same contents. The copy
+// and the delete are replaced by a move in the destination.
+//**********************************************************************
+
+#define PLAN_MAXPATH 2048
+
+class CReconcilePlan
+{
+  public:
+    CReconcilePlan();
+    ~CReconcilePlan();
+
+    BOOL Build(const WCHAR* Source, const WCHAR* Dest, const WCHAR* Archive, DWORD Options);
+    BOOL Save(const WCHAR* FileName);
+    BOOL Load(const WCHAR* FileName);
+    void Clear(void);
+
+    inline const WCHAR* Source(void) { return m_Source; }
+    inline const WCHAR* Dest(void) { return m_Dest; }
+    inline const WCHAR* Archive(void) { return m_Archive; }
+
+    inline void SetStats(CReconcileStats* Stats) { m_Stats = Stats; }
+
+    inline int NumActions(void) { return m_NumActions; }
+    inline const PLANACTION* Action(int i) { return m_Action + i; }
+    inline int NumErrors(void) { return m_NumErrors; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    BOOL PlanDirectory(WCHAR* RelPath, BOOL InSource, BOOL InDest, BOOL* Changed);
+    BOOL ListDirectory(const WCHAR* Root, const WCHAR* RelPath, PLANLISTING* List);
+    void FreeListing(PLANLISTING* List);
+    BOOL PlanTimeStamp(const WCHAR* RelPath, const PLANENTRY* Src, const PLANENTRY* Dest, BOOL Changed, BOOL Copied);
+
+    BOOL DetectMoves(void);
+    PLANMOVE* MoveCandidates(WCHAR Type, int* NumCandidates);
+    BOOL MoveMatches(PLANMOVE* Create, PLANMOVE* Delete, HCRYPTPROV Prov);
+    BOOL HashFile(const WCHAR* Root, const WCHAR* RelPath, HCRYPTPROV Prov, BYTE* Hash);
+
+    BOOL AddAction(WCHAR Type, DWORD Flags, const PLANENTRY* Entry, const WCHAR* RelPath);
+    WCHAR* AddString(const WCHAR* s);
+    BOOL PlanEntry(WCHAR* RelPath, const PLANENTRY* Src, const PLANENTRY* Dest, BOOL* Changed);
+    BOOL PlanError(const WCHAR* Format, ...);
+    BOOL SetRoot(WCHAR* Root, const WCHAR* Path);
+
+  private:
+    WCHAR m_Source[PLAN_MAXPATH+1],
+          m_Dest[PLAN_MAXPATH+1],
+          m_Archive[PLAN_MAXPATH+1];
+
+    DWORD m_Options;
+    CReconcileStats* m_Stats;
+
+    PLANACTION* m_Action;
+    int m_NumActions, m_MaxActions;
+
+    PLANSTRINGS* m_Strings;
+    int m_StringsUsed;
+
+    int m_NumErrors;
+
+    WCHAR m_LastError[PLAN_MAXPATH+256];
+};
+
+
+//**********************************************************************
+// End of CReconcilePlan
+// ---------------------
+//**********************************************************************
+
+#endif // _INC_CRECONCILEPLAN
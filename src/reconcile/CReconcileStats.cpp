@@ -0,0 +1,383 @@
+//**********************************************************************
+// CReconcileStats
+// ===============
+// Timers and counters for a reconcile run.
+//
+// Each phase of the run is timed with the performance counter. The
+// plan counts the directories it lists and the files in them, and the
+// copy threads count the bytes they copy and the time spent archiving.
+// The latency of listing a directory, i.e. the time FindFirstFile takes
+// to come back, and of opening a file is kept for each drive or share,
+// because a slow run is often down to one slow server.
+//
+// The archive time is added up over all the copy threads, so it can be
+// more than the time the copies took.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <CRhsIO/CRhsIO.h>
+#include "CCopyEngine.h"
+#include "CReconcileStats.h"
+
+
+//**********************************************************************
+// External functions from reconcile.cpp
+//**********************************************************************
+
+extern CRhsIO RhsIO;
+
+const WCHAR* GetLastErrorMessage(void);
+
+
+//**********************************************************************
+// Local functions
+//**********************************************************************
+
+static void WriteJsonString(FILE* f, const WCHAR* s);
+
+static const WCHAR* PHASENAME[STATS_PHASES] =
+{ L"Listing",
+  L"Copying",
+  L"Deleting",
+  L"Removing directories",
+  L"Timestamping"
+};
+
+static const char* PHASEKEY[STATS_PHASES] =
+{ "plan",
+  "copy",
+  "delete",
+  "rmdir",
+  "timestamp"
+};
+
+
+//**********************************************************************
+// CReconcileStats
+// ---------------
+//**********************************************************************
+
+CReconcileStats::CReconcileStats()
+{ int i;
+  LARGE_INTEGER li;
+
+  m_Frequency = QueryPerformanceFrequency(&li) && li.QuadPart > 0 ? (UINT64) li.QuadPart : 1000;
+
+  for (i = 0; i < STATS_PHASES; i++)
+  { m_PhaseStart[i] = m_PhaseTime[i] = 0;
+    m_PhaseRun[i] = FALSE;
+  }
+
+  m_DirsListed = m_FilesScanned = 0;
+  m_FilesCopied = m_BytesCopied = 0;
+  m_FilesArchived = m_ArchiveTime = 0;
+
+  InitializeSRWLock(&m_Lock);
+  m_NumVolumes = 0;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CReconcileStats::~CReconcileStats()
+{
+}
+
+
+//**********************************************************************
+// StartPhase
+// EndPhase
+// ----------
+// Phases are only timed on the main thread
+//**********************************************************************
+
+void CReconcileStats::StartPhase(int Phase)
+{
+  m_PhaseStart[Phase] = Now();
+  m_PhaseRun[Phase] = TRUE;
+}
+
+void CReconcileStats::EndPhase(int Phase)
+{
+  m_PhaseTime[Phase] += Now() - m_PhaseStart[Phase];
+}
+
+
+//**********************************************************************
+// Now
+// ---
+//**********************************************************************
+
+UINT64 CReconcileStats::Now(void)
+{ LARGE_INTEGER li;
+
+  QueryPerformanceCounter(&li);
+  return (UINT64) li.QuadPart;
+}
+
+
+//**********************************************************************
+// Listed
+// ------
+// A directory on Path has been listed. Latency is how long FindFirstFile
+// took, in ticks.
+//**********************************************************************
+
+void CReconcileStats::Listed(const WCHAR* Path, UINT64 Latency, int NumEntries)
+{ STATSVOLUME* v;
+
+  InterlockedIncrement64(&m_DirsListed);
+  InterlockedExchangeAdd64(&m_FilesScanned, NumEntries);
+
+  v = Volume(Path);
+  if (v)
+  { InterlockedIncrement64(&v->NumLists);
+    InterlockedExchangeAdd64(&v->ListTime, (LONGLONG) Latency);
+  }
+}
+
+
+//**********************************************************************
+// Opened
+// ------
+// A file on Path has been opened. Started is when CreateFile was called
+// and this is called when it returns.
+//**********************************************************************
+
+void CReconcileStats::Opened(const WCHAR* Path, UINT64 Started)
+{ STATSVOLUME* v;
+
+  v = Volume(Path);
+  if (v)
+  { InterlockedIncrement64(&v->NumOpens);
+    InterlockedExchangeAdd64(&v->OpenTime, (LONGLONG) (Now() - Started));
+  }
+}
+
+
+//**********************************************************************
+// Copied
+// ------
+//**********************************************************************
+
+void CReconcileStats::Copied(UINT64 Bytes)
+{
+  InterlockedIncrement64(&m_FilesCopied);
+  InterlockedExchangeAdd64(&m_BytesCopied, (LONGLONG) Bytes);
+}
+
+
+//**********************************************************************
+// Archived
+// --------
+//**********************************************************************
+
+void CReconcileStats::Archived(UINT64 Started, int NumFiles)
+{
+  InterlockedExchangeAdd64(&m_FilesArchived, NumFiles);
+  InterlockedExchangeAdd64(&m_ArchiveTime, (LONGLONG) (Now() - Started));
+}
+
+
+//**********************************************************************
+// Print
+// -----
+// Print a summary of the run
+//**********************************************************************
+
+void CReconcileStats::Print(void)
+{ int i;
+  STATSVOLUME* v;
+
+  RhsIO.printf(L"\r\n");
+
+  for (i = 0; i < STATS_PHASES; i++)
+    if (m_PhaseRun[i])
+      RhsIO.printf(L"%-22s%.2fs\r\n", PHASENAME[i], Seconds(m_PhaseTime[i]));
+
+  RhsIO.printf(L"%.0f directories listed and %.0f files scanned\r\n", (double) m_DirsListed, (double) m_FilesScanned);
+
+  if (m_PhaseRun[STATS_COPY])
+    RhsIO.printf(L"%.0f files and %.1fMB copied at %.1fMB/s\r\n", (double) m_FilesCopied, (double) m_BytesCopied/0x100000, CopyRate());
+
+  if (m_FilesArchived > 0)
+    RhsIO.printf(L"%.0f files archived in %.2fs\r\n", (double) m_FilesArchived, Seconds((UINT64) m_ArchiveTime));
+
+  for (i = 0; i < m_NumVolumes; i++)
+  { v = m_Volume + i;
+    RhsIO.printf(L"%s %.0f listings averaging %.1fms, %.0f opens averaging %.1fms\r\n",
+                 v->Name, (double) v->NumLists, Millisecs((UINT64) v->ListTime, (UINT64) v->NumLists),
+                 (double) v->NumOpens, Millisecs((UINT64) v->OpenTime, (UINT64) v->NumOpens));
+  }
+}
+
+
+//**********************************************************************
+// WriteJson
+// ---------
+// Write the statistics to a file as JSON so runs can be compared by a
+// script. Times are in seconds, except the latencies which are in
+// milliseconds.
+//**********************************************************************
+
+BOOL CReconcileStats::WriteJson(const WCHAR* FileName)
+{ int i;
+  BOOL first;
+  FILE* f;
+  STATSVOLUME* v;
+
+  f = _wfopen(FileName, L"wb");
+  if (!f)
+  { swprintf(m_LastError, MAX_PATH+256, L"Cannot create the statistics file %.*s: %s", MAX_PATH, FileName, GetLastErrorMessage());
+    return FALSE;
+  }
+
+  fprintf(f, "{\r\n  \"phases\": {");
+
+  first = TRUE;
+  for (i = 0; i < STATS_PHASES; i++)
+  { if (m_PhaseRun[i])
+    { fprintf(f, "%s\"%s\": %.3f", first ? "" : ", ", PHASEKEY[i], Seconds(m_PhaseTime[i]));
+      first = FALSE;
+    }
+  }
+
+  fprintf(f, "},\r\n");
+  fprintf(f, "  \"dirsListed\": %.0f,\r\n", (double) m_DirsListed);
+  fprintf(f, "  \"filesScanned\": %.0f,\r\n", (double) m_FilesScanned);
+  fprintf(f, "  \"filesCopied\": %.0f,\r\n", (double) m_FilesCopied);
+  fprintf(f, "  \"bytesCopied\": %.0f,\r\n", (double) m_BytesCopied);
+  fprintf(f, "  \"copyMBPerSec\": %.3f,\r\n", CopyRate());
+  fprintf(f, "  \"filesArchived\": %.0f,\r\n", (double) m_FilesArchived);
+  fprintf(f, "  \"archiveSeconds\": %.3f,\r\n", Seconds((UINT64) m_ArchiveTime));
+  fprintf(f, "  \"volumes\": [");
+
+  for (i = 0; i < m_NumVolumes; i++)
+  { v = m_Volume + i;
+    fprintf(f, "%s\r\n    {\"name\": ", i > 0 ? "," : "");
+    WriteJsonString(f, v->Name);
+    fprintf(f, ", \"listings\": %.0f, \"listMs\": %.3f, \"opens\": %.0f, \"openMs\": %.3f}",
+            (double) v->NumLists, Millisecs((UINT64) v->ListTime, (UINT64) v->NumLists),
+            (double) v->NumOpens, Millisecs((UINT64) v->OpenTime, (UINT64) v->NumOpens));
+  }
+
+  fprintf(f, "%s]\r\n}\r\n", m_NumVolumes > 0 ? "\r\n  " : "");
+
+  if (ferror(f))
+  { fclose(f);
+    swprintf(m_LastError, MAX_PATH+256, L"Cannot write the statistics file %.*s", MAX_PATH, FileName);
+    return FALSE;
+  }
+
+  fclose(f);
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Volume
+// ------
+// Find the drive or share a path is on, adding it if it's new. Returns
+// NULL if the path isn't on a drive or share or the table is full.
+//**********************************************************************
+
+STATSVOLUME* CReconcileStats::Volume(const WCHAR* Path)
+{ int i;
+  WCHAR name[MAX_PATH+1];
+  STATSVOLUME* v;
+
+  if (!CCopyEngine::VolumeName(Path, name))
+    return NULL;
+
+  v = NULL;
+
+  AcquireSRWLockShared(&m_Lock);
+
+  for (i = 0; i < m_NumVolumes && !v; i++)
+    if (CompareStringOrdinal(m_Volume[i].Name, -1, name, -1, TRUE) == CSTR_EQUAL)
+      v = m_Volume + i;
+
+  ReleaseSRWLockShared(&m_Lock);
+
+  if (v)
+    return v;
+
+// Check again with the lock held in case another thread just added it
+
+  AcquireSRWLockExclusive(&m_Lock);
+
+  for (i = 0; i < m_NumVolumes && !v; i++)
+    if (CompareStringOrdinal(m_Volume[i].Name, -1, name, -1, TRUE) == CSTR_EQUAL)
+      v = m_Volume + i;
+
+  if (!v && m_NumVolumes < STATS_MAXVOLUMES)
+  { v = m_Volume + m_NumVolumes++;
+    ZeroMemory(v, sizeof(STATSVOLUME));
+    lstrcpy(v->Name, name);
+  }
+
+  ReleaseSRWLockExclusive(&m_Lock);
+
+  return v;
+}
+
+
+//**********************************************************************
+// Seconds
+// Millisecs
+// CopyRate
+// ---------
+//**********************************************************************
+
+double CReconcileStats::Seconds(UINT64 Ticks)
+{
+  return (double) Ticks/(double) m_Frequency;
+}
+
+double CReconcileStats::Millisecs(UINT64 Ticks, UINT64 Count)
+{
+  return Count > 0 ? Seconds(Ticks)*1000.0/(double) Count : 0.0;
+}
+
+// The copy rate is worked out from the time the copy phase took, so it
+// includes the moves and the time waiting for the throttle
+
+double CReconcileStats::CopyRate(void)
+{ double secs;
+
+  secs = Seconds(m_PhaseTime[STATS_COPY]);
+  return secs > 0 ? (double) m_BytesCopied/0x100000/secs : 0.0;
+}
+
+
+//**********************************************************************
+// WriteJsonString
+// ---------------
+// Write a string as UTF-8 in quotes, escaping the characters JSON needs
+// escaped
+//**********************************************************************
+
+static void WriteJsonString(FILE* f, const WCHAR* s)
+{ int i;
+  char utf8[MAX_PATH*4+1];
+
+  if (!WideCharToMultiByte(CP_UTF8, 0, s, -1, utf8, sizeof(utf8), NULL, NULL))
+    utf8[0] = '\0';
+
+  fputc('"', f);
+
+  for (i = 0; utf8[i] != '\0'; i++)
+  { if (utf8[i] == '"' || utf8[i] == '\\')
+      fputc('\\', f);
+
+    if ((unsigned char) utf8[i] < 0x20)
+      fprintf(f, "\\u%04x", (unsigned) utf8[i]);
+    else
+      fputc(utf8[i], f);
+  }
+
+  fputc('"', f);
+}
@@ -0,0 +1,103 @@
+//**********************************************************************
+// CReconcileStats.h
+// =================
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CRECONCILESTATS
+#define _INC_CRECONCILESTATS
+
+
+//**********************************************************************
+// Phases
+//**********************************************************************
+
+#define STATS_PLAN      0  // Listing and comparing the directories
+#define STATS_COPY      1  // Copies, updates and moves
+#define STATS_DELETE    2  // Deleting files
+#define STATS_RMDIR     3  // Removing directories
+#define STATS_TIMESTAMP 4  // Setting times
+#define STATS_PHASES    5
+
+
+//**********************************************************************
+// STATSVOLUME
+// -----------
+// The latencies seen on one drive or share. The times are in
+// performance counter ticks.
+//**********************************************************************
+
+typedef struct
+{ WCHAR Name[MAX_PATH+1];
+
+  volatile LONGLONG NumLists, ListTime;
+  volatile LONGLONG NumOpens, OpenTime;
+
+} STATSVOLUME;
+
+
+//**********************************************************************
+// CReconcileStats
+// ---------------
+// Counters and timers for a run, so a slow run can be put down to the
+// listing, copying, archiving or a slow volume. The counters are cheap
+// enough to be always on and can be updated from the copy threads.
+//
+// Times are in performance counter ticks from Now.
+//**********************************************************************
+
+#define STATS_MAXVOLUMES 64
+
+class CReconcileStats
+{
+  public:
+    CReconcileStats();
+    ~CReconcileStats();
+
+    void StartPhase(int Phase);
+    void EndPhase(int Phase);
+
+    UINT64 Now(void);
+
+    void Listed(const WCHAR* Path, UINT64 Latency, int NumEntries);
+    void Opened(const WCHAR* Path, UINT64 Started);
+    void Copied(UINT64 Bytes);
+    void Archived(UINT64 Started, int NumFiles);
+
+    void Print(void);
+    BOOL WriteJson(const WCHAR* FileName);
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    STATSVOLUME* Volume(const WCHAR* Path);
+    double Seconds(UINT64 Ticks);
+    double Millisecs(UINT64 Ticks, UINT64 Count);
+    double CopyRate(void);
+
+  private:
+    UINT64 m_Frequency;
+
+    UINT64 m_PhaseStart[STATS_PHASES], m_PhaseTime[STATS_PHASES];
+    BOOL   m_PhaseRun[STATS_PHASES];
+
+    volatile LONGLONG m_DirsListed, m_FilesScanned;
+    volatile LONGLONG m_FilesCopied, m_BytesCopied;
+    volatile LONGLONG m_FilesArchived, m_ArchiveTime;
+
+    SRWLOCK m_Lock;
+    STATSVOLUME m_Volume[STATS_MAXVOLUMES];
+    int m_NumVolumes;
+
+    WCHAR m_LastError[MAX_PATH+256];
+};
+
+
+//**********************************************************************
+// End of CReconcileStats
+// ----------------------
+//**********************************************************************
+
+#endif // _INC_CRECONCILESTATS
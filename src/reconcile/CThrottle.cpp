@@ -0,0 +1,373 @@
+//**********************************************************************
+// CThrottle
+// =========
+// Limit the rate reconcile copies at so it can run while people are
+// using the file servers.
+//
+// There is a token bucket for bytes and one for files. Each copy thread
+// takes tokens before it reads a file or a chunk of a large file, and
+// waits if the bucket is empty. The buckets hold at most one second's
+// worth of tokens so the rate can't run far ahead after a quiet spell.
+//
+// The limits come from a list of profiles like:
+//
+// 08:00-18:00@10M,50;18:00-08:00@0
+//
+// i.e. from 8am to 6pm copy no more than 10MB and 50 files a second,
+// and outside those hours copy as fast as possible. A profile without
+// a time applies all day, and the first profile that matches the time
+// of day is used.
+//
+// The copy threads also report how long their reads and writes take.
+// If the average goes over the latency target each thread pauses
+// before its next file or chunk, and the pause doubles every second
+// until the latency drops. Once the latency is well under the target
+// the pause is halved every second until it goes away.
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <CRhsIO/CRhsIO.h>
+#include "CThrottle.h"
+
+
+//**********************************************************************
+// External functions from reconcile.cpp
+//**********************************************************************
+
+extern CRhsIO RhsIO;
+
+
+//**********************************************************************
+// CThrottle
+// ---------
+//**********************************************************************
+
+CThrottle::CThrottle()
+{
+  m_NumProfiles = 0;
+  m_CurProfile = -1;
+
+  InitializeCriticalSection(&m_Lock);
+
+  m_Bytes.Rate = m_Bytes.Tokens = 0;
+  m_Files.Rate = m_Files.Tokens = 0;
+  m_LastRefill = m_LastProfile = 0;
+
+  m_Target = 0;
+  m_AvgLatency = 0;
+  m_Delay = 0;
+  m_LastAdjust = 0;
+
+  lstrcpy(m_LastError, L"");
+}
+
+CThrottle::~CThrottle()
+{
+  DeleteCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// SetProfiles
+// -----------
+// Parse a list of profiles separated by semicolons. Each one is:
+//
+// [hh:mm-hh:mm@]<bytes per sec>[K|M|G][,<files per sec>]
+//**********************************************************************
+
+BOOL CThrottle::SetProfiles(const WCHAR* Spec)
+{ BOOL valid;
+  const WCHAR* p;
+  const WCHAR* q;
+  THROTTLEPROFILE* prof;
+
+  m_NumProfiles = 0;
+  m_CurProfile = -1;
+  m_LastProfile = 0;
+
+  valid = *Spec != '\0';
+
+  for (p = Spec; *p != '\0' && valid; )
+  { if (m_NumProfiles >= THROTTLE_MAXPROFILES)
+    { swprintf(m_LastError, 256, L"No more than %i bandwidth profiles can be given", THROTTLE_MAXPROFILES);
+      return FALSE;
+    }
+
+    prof = m_Profile + m_NumProfiles;
+    prof->Start = prof->End = 0;
+    prof->FilesPerSec = 0;
+
+// The time range is optional
+
+    for (q = p; *q != '\0' && *q != ';' && *q != '@'; q++);
+
+    if (*q == '@')
+      valid = ParseTime(&p, &prof->Start) && *p++ == '-' && ParseTime(&p, &prof->End) && *p++ == '@';
+
+// Then the rates
+
+    valid = valid && ParseRate(&p, &prof->BytesPerSec, TRUE);
+
+    if (valid && *p == ',')
+    { p++;
+      valid = ParseRate(&p, &prof->FilesPerSec, FALSE);
+    }
+
+    if (valid && *p == ';')
+      p++;
+    else if (*p != '\0')
+      valid = FALSE;
+
+    m_NumProfiles++;
+  }
+
+  if (!valid)
+  { swprintf(m_LastError, 256, L"The bandwidth profile \"%.64s\" is not valid", Spec);
+    m_NumProfiles = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// Take
+// ----
+// Called by a copy thread before it copies Bytes and Files. This
+// returns when the limits allow the copy to go ahead.
+//**********************************************************************
+
+void CThrottle::Take(UINT64 Bytes, int Files)
+{
+  if (m_Delay > 0)
+    Pause(m_Delay);
+
+  if (Files > 0)
+    TakeTokens(&m_Files, (double) Files);
+
+  if (Bytes > 0)
+    TakeTokens(&m_Bytes, (double) Bytes);
+}
+
+
+//**********************************************************************
+// Latency
+// -------
+// Called by a copy thread with the time a read or write took
+//**********************************************************************
+
+void CThrottle::Latency(DWORD Ms)
+{ ULONGLONG now;
+
+  if (m_Target == 0)
+    return;
+
+  EnterCriticalSection(&m_Lock);
+
+  m_AvgLatency = m_AvgLatency == 0 ? Ms : (m_AvgLatency*7 + Ms)/8;
+
+  now = GetTickCount64();
+
+  if (now - m_LastAdjust >= 1000)
+  { if (m_AvgLatency > m_Target)
+    { m_Delay = m_Delay == 0 ? 10 : m_Delay*2;
+      if (m_Delay > THROTTLE_MAXDELAY)
+        m_Delay = THROTTLE_MAXDELAY;
+    }
+    else if (m_AvgLatency < m_Target/2)
+    { m_Delay = m_Delay < 10 ? 0 : m_Delay/2;
+    }
+
+    m_LastAdjust = now;
+  }
+
+  LeaveCriticalSection(&m_Lock);
+}
+
+
+//**********************************************************************
+// TakeTokens
+// ----------
+// Wait until the bucket isn't in debt and then take the tokens. The
+// wait is done in short sleeps so a change of profile or an abort is
+// noticed quickly.
+//**********************************************************************
+
+void CThrottle::TakeTokens(THROTTLEBUCKET* Bucket, double Amount)
+{ DWORD wait;
+
+  for (;;)
+  { EnterCriticalSection(&m_Lock);
+
+    Refill();
+
+    if (Bucket->Rate <= 0 || Bucket->Tokens >= 0)
+    { if (Bucket->Rate > 0)
+        Bucket->Tokens -= Amount;
+      LeaveCriticalSection(&m_Lock);
+      return;
+    }
+
+    wait = (DWORD) (-Bucket->Tokens*1000/Bucket->Rate) + 1;
+
+    LeaveCriticalSection(&m_Lock);
+
+    Sleep(wait < 100 ? wait : 100);
+
+    if (RhsIO.GetAbort())
+      return;
+  }
+}
+
+
+//**********************************************************************
+// Refill
+// ------
+// Add the tokens earned since the last call, and check once a second
+// whether a different profile applies. Must be called with the lock
+// held.
+//**********************************************************************
+
+void CThrottle::Refill(void)
+{ int i, minute;
+  double elapsed;
+  ULONGLONG now;
+  SYSTEMTIME st;
+  THROTTLEPROFILE* prof;
+
+  now = GetTickCount64();
+
+// Find the profile for the time of day. When it changes any debt is
+// forgotten and the buckets start empty.
+
+  if (m_LastProfile == 0 || now - m_LastProfile >= 1000)
+  { GetLocalTime(&st);
+    minute = st.wHour*60 + st.wMinute;
+
+    for (i = 0; i < m_NumProfiles; i++)
+    { prof = m_Profile + i;
+
+      if (prof->Start == prof->End)
+        break;
+      if (prof->Start < prof->End && minute >= prof->Start && minute < prof->End)
+        break;
+      if (prof->Start > prof->End && (minute >= prof->Start || minute < prof->End))
+        break;
+    }
+
+    if (i == m_NumProfiles)
+      i = -1;
+
+    if (i != m_CurProfile)
+    { m_CurProfile = i;
+      m_Bytes.Rate = i >= 0 ? m_Profile[i].BytesPerSec : 0;
+      m_Files.Rate = i >= 0 ? m_Profile[i].FilesPerSec : 0;
+      m_Bytes.Tokens = m_Files.Tokens = 0;
+    }
+
+    m_LastProfile = now;
+  }
+
+// Add the tokens, up to a second's worth
+
+  elapsed = m_LastRefill == 0 ? 0 : (now - m_LastRefill)/1000.0;
+  m_LastRefill = now;
+
+  m_Bytes.Tokens += m_Bytes.Rate*elapsed;
+  if (m_Bytes.Tokens > m_Bytes.Rate)
+    m_Bytes.Tokens = m_Bytes.Rate;
+
+  m_Files.Tokens += m_Files.Rate*elapsed;
+  if (m_Files.Tokens > m_Files.Rate)
+    m_Files.Tokens = m_Files.Rate;
+}
+
+
+//**********************************************************************
+// Pause
+// -----
+//**********************************************************************
+
+void CThrottle::Pause(DWORD Ms)
+{ DWORD wait;
+
+  while (Ms > 0 && !RhsIO.GetAbort())
+  { wait = Ms < 100 ? Ms : 100;
+    Sleep(wait);
+    Ms -= wait;
+  }
+}
+
+
+//**********************************************************************
+// ParseTime
+// ---------
+// Parse hh:mm into minutes after midnight
+//**********************************************************************
+
+BOOL CThrottle::ParseTime(const WCHAR** Text, int* Minutes)
+{ int hours, mins;
+  WCHAR* end;
+
+  hours = (int) wcstol(*Text, &end, 10);
+  if (end == *Text || *end != ':' || hours < 0 || hours > 23)
+    return FALSE;
+
+  *Text = end + 1;
+
+  mins = (int) wcstol(*Text, &end, 10);
+  if (end == *Text || mins < 0 || mins > 59)
+    return FALSE;
+
+  *Text = end;
+  *Minutes = hours*60 + mins;
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// ParseRate
+// ---------
+// Parse a rate. Byte rates can have a K, M or G suffix.
+//**********************************************************************
+
+BOOL CThrottle::ParseRate(const WCHAR** Text, double* Rate, BOOL Bytes)
+{ WCHAR* end;
+
+  *Rate = wcstod(*Text, &end);
+  if (end == *Text || *Rate < 0)
+    return FALSE;
+
+  if (Bytes)
+  { switch (*end)
+    { case 'k':
+      case 'K':
+        *Rate *= 1024;
+        end++;
+        break;
+
+      case 'm':
+      case 'M':
+        *Rate *= 1024*1024;
+        end++;
+        break;
+
+      case 'g':
+      case 'G':
+        *Rate *= 1024.0*1024*1024;
+        end++;
+        break;
+    }
+  }
+
+  *Text = end;
+
+  return TRUE;
+}
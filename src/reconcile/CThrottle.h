@@ -0,0 +1,107 @@
+//**********************************************************************
+// CThrottle.h
+// ===========
+//
+// John Rennie
+// 19/10/26
+//**********************************************************************
+
+#ifndef _INC_CTHROTTLE
+#define _INC_CTHROTTLE
+
+
+//**********************************************************************
+// THROTTLEPROFILE
+// ---------------
+// The limits for a time of day. The times are minutes after midnight
+// and if Start is after End the profile runs over midnight. A profile
+// with Start equal to End applies all day. Zero means no limit.
+//**********************************************************************
+
+typedef struct
+{ int    Start, End;
+  double BytesPerSec,
+         FilesPerSec;
+
+} THROTTLEPROFILE;
+
+
+//**********************************************************************
+// THROTTLEBUCKET
+// --------------
+// A token bucket. The tokens can go negative, so one big file is let
+// through at once and the ones after it wait for the debt to be repaid.
+//**********************************************************************
+
+typedef struct
+{ double Rate,
+         Tokens;
+
+} THROTTLEBUCKET;
+
+
+//**********************************************************************
+// CThrottle
+// ---------
+// Limits the bytes and files per second copied by all the copy threads
+// together. The limits can vary with the time of day. If a latency
+// target is set the throttle also backs off, by pausing before each
+// file or chunk, when the reads and writes start taking longer than the
+// target, and eases off again when they speed up.
+//**********************************************************************
+
+#define THROTTLE_MAXPROFILES 16
+#define THROTTLE_MAXDELAY    2000
+
+class CThrottle
+{
+  public:
+    CThrottle();
+    ~CThrottle();
+
+    BOOL SetProfiles(const WCHAR* Spec);
+    inline void SetLatency(DWORD Ms) { m_Target = Ms; }
+    inline BOOL Enabled(void) { return m_NumProfiles > 0 || m_Target > 0; }
+
+    void Take(UINT64 Bytes, int Files);
+    void Latency(DWORD Ms);
+
+    inline DWORD Delay(void) { return m_Delay; }
+
+    inline const WCHAR* LastError(void) { return m_LastError; }
+
+  private:
+    void TakeTokens(THROTTLEBUCKET* Bucket, double Amount);
+    void Refill(void);
+    void Pause(DWORD Ms);
+
+    static BOOL ParseTime(const WCHAR** Text, int* Minutes);
+    static BOOL ParseRate(const WCHAR** Text, double* Rate, BOOL Bytes);
+
+  private:
+    THROTTLEPROFILE m_Profile[THROTTLE_MAXPROFILES];
+    int m_NumProfiles, m_CurProfile;
+
+    CRITICAL_SECTION m_Lock;
+
+    THROTTLEBUCKET m_Bytes, m_Files;
+    ULONGLONG m_LastRefill, m_LastProfile;
+
+// The latency is averaged over the last few samples and the delay is
+// adjusted at most once a second
+
+    DWORD m_Target;
+    double m_AvgLatency;
+    volatile DWORD m_Delay;
+    ULONGLONG m_LastAdjust;
+
+    WCHAR m_LastError[256];
+};
+
+
+//**********************************************************************
+// End of CThrottle
+// ----------------
+//**********************************************************************
+
+#endif // _INC_CTHROTTLE
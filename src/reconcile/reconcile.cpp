@@ -5,17 +5,27 @@
 // Reconcile is a program to keep the contents of two drives and/or
 // directories the same.  The syntax is:
 //
-// reconcil [-x -u -d -t -q -r -e -f] <source> <dest>
+// reconcil [-x -u[d[t]] -d -m[h] -t -q -r -p -e -f --journal --bwlimit --latency --stats <copy options>] <source> <dest>
+// reconcil -l<plan> [-q -e -j -ud[t] --journal --bwlimit --latency --stats <copy options>]
+// reconcil --journal=<file> --resume [-q -e -j -ud[t] --bwlimit --latency --stats <copy options>]
+// reconcil --dedup=<store> --restore [-q -e] <archive> <dest>
 //
 // -x: Any files on the source but not on the destination are copied
 //     from the source to the destination.
 //
 // -u: Any files present on the destination dated earlier than the
 //     same file on the source are copied from the source to the
-//     destination.
+//     destination. With -ud only the changed parts of large files are
+//     copied and the destination is updated in place. -udt does the
+//     same but builds the new file in a temporary file.
 //
 // -d: Any files on the destination but not on the source are deleted.
 //
+// -m: With -x and -d, files that have been moved or renamed in the
+//     source are moved in the destination instead of being copied
+//     again. -mh compares the file contents as well as the sizes and
+//     times.
+//
 // -t: Time stamps of destation files are changed to match the times of
 //     the source files. If only -t is given then only the modified
 //     time is checked/changed. If -ta is given the created time is
@@ -29,23 +39,74 @@
 // -r: List operations but do not actually do anything.  This option
 //     is useful for comparing drives/directories.
 //
+// -p: Save the list of operations to a file e.g. -pplan.txt.  With -r
+//     the operations are saved but not done.
+//
+// -l: Do the operations saved in a file by -p e.g. -lplan.txt.  The
+//     directories come from the file so they are not given.
+//
 // -e: Normally any errors are fatal.  The -e option allows processing
 //     to continue even if errors occur.
 //
 // -f: Use NTFS file date times, i.e. compare times to 1 second
 //     resolution.  The default is the 2 second resolution of FAT.
 //
+// -j: Number of copy threads and the maximum copies in progress on one
+//     volume e.g. -j8,4.  The default is -j4,4.
+//
+// --journal: Record progress in a file e.g. --journal=run.jnl so an
+//     interrupted run can be finished with --resume.
+//
+// --bwlimit: Limit the bytes and files copied per second, optionally
+//     by time of day e.g. --bwlimit=08:00-18:00@10M,50;0
+//
+// --latency: Slow down when reads and writes take longer than this
+//     many milliseconds e.g. --latency=50.
+//
+// --stats: Save the statistics printed at the end of the run to a file
+//     as JSON e.g. --stats=reconcile.json.
+//
+// --dedup: With -a, archive files as chunks in a deduplicating store
+//     e.g. --dedup=d:\chunks.  The archive holds a manifest for each
+//     file.
+//
+// --restore: Rebuild the files in an archive made with --dedup.
+//
+// The copy options are:
+//
+// --buffer: Size of the chunks large files are copied in, a multiple
+//     of 64K e.g. --buffer=4M.  The default is 1M.
+//
+// --buffered: Copy large files through the file cache.  Normally they
+//     bypass it so a big copy doesn't slow down everything else.
+//
+// --streams: Copy the alternate data streams of large files.  Small
+//     files always get their streams copied.
+//
+// --acls: Copy the access control list of each file copied.
+//
+// --progress: Print the progress of large copies on lines starting P.
+//
 // The program produces output consisting of one line per file action.
-// The lines start with X, U, D or E for -x, -u, -d actions or errors
-// so a pattern matching utility can be used to sift through the
+// The lines start with X, U, D, V or E for -x, -u, -d, -m actions or
+// errors so a pattern matching utility can be used to sift through the
 // output.
 //**********************************************************************
 
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <CRhsIO/CRhsIO.h>
 #include <Misc/CRhsFindFile.h>
 #include <Misc/CRhsDate.h>
+#include "CDeltaCopy.h"
+#include "CCopyEngine.h"
+#include "CReconcilePlan.h"
+#include "CReconcileJournal.h"
+#include "CThrottle.h"
+#include "CArchiveStore.h"
+#include "CDirCache.h"
+#include "CReconcileStats.h"
 
 
 //**********************************************************************
@@ -59,7 +120,12 @@
 typedef struct
 { WCHAR Source[MAX_FILENAMELEN+1],
        Destination[MAX_FILENAMELEN+1],
-       ArchivePath[MAX_FILENAMELEN+1];
+       ArchivePath[MAX_FILENAMELEN+1],
+       SavePlan[MAX_FILENAMELEN+1],
+       LoadPlan[MAX_FILENAMELEN+1],
+       JournalFile[MAX_FILENAMELEN+1],
+       StorePath[MAX_FILENAMELEN+1],
+       StatsFile[MAX_FILENAMELEN+1];
 
   BOOL Update,
        Create,
@@ -69,12 +135,29 @@ typedef struct
        Quiet,
        Report,
        FailOnError,
-       UseFATTimeStamp;
+       UseFATTimeStamp,
+       Resume,
+       Move, MoveHash,
+       Restore,
+       Progress;
+
+  int Threads,
+      VolumeDepth,
+      DeltaMode;
+
+  DWORD CopyOptions,
+        BufferSize;
+
+  CCopyEngine* Engine;
+  CReconcileJournal* Journal;
+  CThrottle* Throttle;
+  CReconcileStats* Stats;
 
   int Updated,
       Created,
       Deleted,
-      TimeStamped;
+      TimeStamped,
+      Moved;
 
 } RECONCILEINFO;
 
@@ -86,18 +169,27 @@ typedef struct
 
 DWORD WINAPI rhsmain(LPVOID unused);
 
-BOOL ReconcileUpdateFiles(WCHAR*, WCHAR*, WCHAR*, RECONCILEINFO*);
-BOOL ReconcileDeleteFiles(WCHAR*, WCHAR*, WCHAR*, RECONCILEINFO*);
-BOOL ReconcileTimeStampFiles(WCHAR*, WCHAR*, RECONCILEINFO*);
+BOOL ReconcileLongOption(const WCHAR* Option, RECONCILEINFO* RInfo);
+
+int  ReconcilePhase(const PLANACTION* Action);
+BOOL ReconcileRunPlan(CReconcilePlan* Plan, RECONCILEINFO* RInfo);
+BOOL ReconcileRunAction(CReconcilePlan* Plan, int Id, RECONCILEINFO* RInfo);
+void ReconcilePrintPlan(CReconcilePlan* Plan, RECONCILEINFO* RInfo);
+void ReconcilePlanPaths(CReconcilePlan* Plan, const PLANACTION* Action, WCHAR* File1, WCHAR* File2, WCHAR* File3);
+void ReconcileArchiveDirs(CReconcilePlan* Plan, RECONCILEINFO* RInfo);
+void ReconcileProgress(void* Context, const WCHAR* Dest, UINT64 Done, UINT64 Total);
+
+BOOL ReconcileRestore(const WCHAR* Archive, const WCHAR* Dest, RECONCILEINFO* RInfo);
+BOOL ReconcileRestoreFile(const WCHAR* From, const WCHAR* To, RECONCILEINFO* RInfo);
+BOOL ReconcileRestoreDir(WCHAR* From, WCHAR* To, RECONCILEINFO* RInfo);
 
 BOOL ReconcileArchiveFile(WCHAR*, WCHAR*);
 
 DWORD FileExists(const WCHAR* FileName);
 
-int  ReconcileCompareTime(SYSTEMTIME* One, SYSTEMTIME* Two, BOOL DosTime);
+int  ReconcileCompareTime(const FILETIME* One, const FILETIME* Two, BOOL DosTime);
 
-BOOL GetFileTimeByName(const WCHAR* FileName, SYSTEMTIME* Created, SYSTEMTIME* Accessed, SYSTEMTIME* Written);
-BOOL SetFileTimeByName(const WCHAR* FileName, SYSTEMTIME* Created, SYSTEMTIME* Accessed, SYSTEMTIME* Written);
+BOOL SetFileTimeByName(const WCHAR* FileName, const FILETIME* Created, const FILETIME* Written);
 
 int  GetPathFromFileName(const WCHAR* FileName, WCHAR* Path, DWORD Length);
 BOOL AddCurrentPath(WCHAR* FileName);
@@ -108,6 +200,14 @@ const WCHAR* GetLastErrorMessage(void);
 #define IsDirectory(x) \
   ((x) & FILE_ATTRIBUTE_DIRECTORY)
 
+#define IsLongOption(o, len, name) \
+  ((len) == lstrlen(name) && CompareStringOrdinal(o, len, name, len, TRUE) == CSTR_EQUAL)
+
+#define DEF_COPYTHREADS 4
+#define DEF_VOLUMEDEPTH 4
+#define DEF_BUFFERSIZE  0x100000
+#define MAX_BUFFERSIZE  0x4000000
+
 
 //**********************************************************************
 // Global variables
@@ -115,29 +215,52 @@ const WCHAR* GetLastErrorMessage(void);
 
 CRhsIO RhsIO;
 
+// The archive store and the archive directories are used by
+// ReconcileArchiveFile on the copy threads
+
+CArchiveStore ArchiveStore;
+CDirCache ArchiveDirs;
+
 #define SYNTAX \
-  L"reconcile [-x -u -d -t -a<archive> -q -r -e -f] <source> <dest>\r\n"
+  L"reconcile [-x -u[d[t]] -d -m[h] -t -a<archive> -q -r -p<plan> -e -f -j<threads>[,<depth>] --journal=<file> --bwlimit=<profiles> --latency=<ms> --stats=<file> <copy options>] <source> <dest>\r\n" \
+  L"reconcile -l<plan> [-q -e -j<threads>[,<depth>] -ud[t] --journal=<file> --bwlimit=<profiles> --latency=<ms> --stats=<file> <copy options>]\r\n" \
+  L"reconcile --journal=<file> --resume [-q -e -j<threads>[,<depth>] -ud[t] --bwlimit=<profiles> --latency=<ms> --stats=<file> <copy options>]\r\n" \
+  L"The copy options are --buffer=<size> --buffered --streams --acls --progress\r\n" \
+  L"reconcile --dedup=<store> --restore [-q -e] <archive> <dest>\r\n"
 
 
-#define LEN_HELP 39
+#define LEN_HELP 94
 static const WCHAR* HELP[LEN_HELP] =
 {
-  L"Reconcile v1.0.5\r\n",
+  L"Reconcile v1.1.0\r\n",
   L"----------------\r\n",
   L"Reconcile is a program to keep the contents of two drives and/or\r\n",
   L"directories the same.  The syntax is:\r\n",
   L"\r\n",
-  L"reconcil [-x -u -d -t -q -r -e -f] <source> <dest>\r\n",
+  L"reconcil [-x -u[d[t]] -d -m[h] -t -q -r -p -e -f -j --journal --bwlimit\r\n",
+  L"         --latency --stats <copy options>] <source> <dest>\r\n",
+  L"reconcil -l<plan> [-q -e -j -ud[t] --journal --bwlimit --latency --stats\r\n",
+  L"         <copy options>]\r\n",
+  L"reconcil --journal=<file> --resume [-q -e -j -ud[t] --bwlimit --latency\r\n",
+  L"         --stats <copy options>]\r\n",
+  L"reconcil --dedup=<store> --restore [-q -e] <archive> <dest>\r\n",
   L"\r\n",
   L"-x: Any files on the source but not on the destination are copied\r\n",
   L"    from the source to the destination.\r\n",
   L"\r\n",
   L"-u: Any files present on the destination dated earlier than the\r\n",
   L"    same file on the source are copied from the source to the\r\n",
-  L"    destination.\r\n",
+  L"    destination. With -ud only the changed parts of large files are\r\n",
+  L"    copied and the destination is updated in place. -udt does the\r\n",
+  L"    same but builds the new file in a temporary file.\r\n",
   L"\r\n",
   L"-d: Any files on the destination but not on the source are deleted.\r\n",
   L"\r\n",
+  L"-m: With -x and -d, files that have been moved or renamed in the\r\n",
+  L"    source are moved in the destination instead of being copied\r\n",
+  L"    again. -mh compares the file contents as well as the sizes and\r\n",
+  L"    times.\r\n",
+  L"\r\n",
   L"-t: Time stamps of destation files are changed to match the times of\r\n",
   L"    the source files. If only -t is given then only the modified time\r\n",
   L"    is checked/changed. If -ta is given the created time is also \r\n",
@@ -151,15 +274,57 @@ static const WCHAR* HELP[LEN_HELP] =
   L"-r: List operations but do not actually do anything.  This option\r\n",
   L"    is useful for comparing drives/directories.\r\n",
   L"\r\n",
+  L"-p: Save the list of operations to a file e.g. -pplan.txt.  With -r\r\n",
+  L"    the operations are saved but not done.\r\n",
+  L"\r\n",
+  L"-l: Do the operations saved in a file by -p e.g. -lplan.txt.  The\r\n",
+  L"    directories come from the file so they are not given.\r\n",
+  L"\r\n",
   L"-e: Normally any errors are fatal.  The -e option allows processing\r\n",
   L"    to continue even if errors occur.\r\n",
   L"\r\n",
   L"-f: Use NTFS file date times, i.e. compare times to 1 second\r\n",
   L"    resolution.  The default is the 2 second resolution of FAT.\r\n",
   L"\r\n",
+  L"-j: Number of copy threads and the maximum copies in progress on one\r\n",
+  L"    volume e.g. -j8,4.  The default is -j4,4.\r\n",
+  L"\r\n",
+  L"--journal: Record progress in a file e.g. --journal=run.jnl so an\r\n",
+  L"    interrupted run can be finished with --resume.\r\n",
+  L"\r\n",
+  L"--bwlimit: Limit the bytes and files copied per second, optionally\r\n",
+  L"    by time of day e.g. --bwlimit=08:00-18:00@10M,50;0\r\n",
+  L"\r\n",
+  L"--latency: Slow down when reads and writes take longer than this\r\n",
+  L"    many milliseconds e.g. --latency=50.\r\n",
+  L"\r\n",
+  L"--stats: Save the statistics printed at the end of the run to a file\r\n",
+  L"    as JSON e.g. --stats=reconcile.json.\r\n",
+  L"\r\n",
+  L"--dedup: With -a, archive files as chunks in a deduplicating store\r\n",
+  L"    e.g. --dedup=d:\\chunks.  The archive holds a manifest for each\r\n",
+  L"    file.\r\n",
+  L"\r\n",
+  L"--restore: Rebuild the files in an archive made with --dedup.\r\n",
+  L"\r\n",
+  L"The copy options are:\r\n",
+  L"\r\n",
+  L"--buffer: Size of the chunks large files are copied in, a multiple\r\n",
+  L"    of 64K e.g. --buffer=4M.  The default is 1M.\r\n",
+  L"\r\n",
+  L"--buffered: Copy large files through the file cache.  Normally they\r\n",
+  L"    bypass it so a big copy doesn't slow down everything else.\r\n",
+  L"\r\n",
+  L"--streams: Copy the alternate data streams of large files.  Small\r\n",
+  L"    files always get their streams copied.\r\n",
+  L"\r\n",
+  L"--acls: Copy the access control list of each file copied.\r\n",
+  L"\r\n",
+  L"--progress: Print the progress of large copies on lines starting P.\r\n",
+  L"\r\n",
   L"The program produces output consisting of one line per file action.\r\n",
-  L"The lines start with X, U, D or E for -x, -u, -d actions or errors\r\n",
-  L"so a pattern matching utility can be used to sift through the\r\n",
+  L"The lines start with X, U, D, V or E for -x, -u, -d, -m actions or\r\n",
+  L"errors so a pattern matching utility can be used to sift through the\r\n",
   L"output.\r\n"
 };
 
@@ -189,12 +354,25 @@ int wmain(int argc, WCHAR* argv[])
 
 DWORD WINAPI rhsmain(LPVOID unused)
 { int argnum, i;
+  BOOL success;
   DWORD attrib;
+  WCHAR* p;
+  DWORD options;
   RECONCILEINFO ri;
+  CCopyEngine engine;
+  CReconcilePlan plan;
+  CReconcileJournal journal;
+  CThrottle throttle;
+  CReconcileStats stats;
 
 // Set flags for the comparison
 
   lstrcpy(ri.ArchivePath, L"");
+  lstrcpy(ri.SavePlan, L"");
+  lstrcpy(ri.LoadPlan, L"");
+  lstrcpy(ri.JournalFile, L"");
+  lstrcpy(ri.StorePath, L"");
+  lstrcpy(ri.StatsFile, L"");
 
   ri.Update          = FALSE;
   ri.Create          = FALSE;
@@ -206,6 +384,20 @@ DWORD WINAPI rhsmain(LPVOID unused)
   ri.Report          = FALSE;
   ri.FailOnError     = TRUE;
   ri.UseFATTimeStamp = TRUE;
+  ri.Resume          = FALSE;
+  ri.Move            = FALSE;
+  ri.MoveHash        = FALSE;
+  ri.Restore         = FALSE;
+  ri.Progress        = FALSE;
+  ri.Threads         = DEF_COPYTHREADS;
+  ri.VolumeDepth     = DEF_VOLUMEDEPTH;
+  ri.DeltaMode       = DELTA_NONE;
+  ri.CopyOptions     = COPYOPT_UNBUFFERED;
+  ri.BufferSize      = DEF_BUFFERSIZE;
+  ri.Engine          = &engine;
+  ri.Journal         = NULL;
+  ri.Throttle        = &throttle;
+  ri.Stats           = &stats;
 
   argnum = 1;
 
@@ -213,6 +405,16 @@ DWORD WINAPI rhsmain(LPVOID unused)
   { if (RhsIO.m_argv[argnum][0] != '-')
       break;
 
+// Options starting -- are dealt with before the flag is upper cased
+// because their values can be file names
+
+    if (RhsIO.m_argv[argnum][1] == '-')
+    { if (!ReconcileLongOption(RhsIO.m_argv[argnum] + 2, &ri))
+        return 1;
+      argnum++;
+      continue;
+    }
+
     CharUpper(RhsIO.m_argv[argnum] + 1);
 
     switch (RhsIO.m_argv[argnum][1])
@@ -223,6 +425,8 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
       case 'U':
         ri.Update = TRUE;
+        if (RhsIO.m_argv[argnum][2] == 'D')
+          ri.DeltaMode = RhsIO.m_argv[argnum][3] == 'T' ? DELTA_TEMPFILE : DELTA_INPLACE;
         break;
 
       case 'X':
@@ -233,6 +437,12 @@ DWORD WINAPI rhsmain(LPVOID unused)
         ri.Delete = TRUE;
         break;
 
+      case 'M':
+        ri.Move = TRUE;
+        if (RhsIO.m_argv[argnum][2] == 'H')
+          ri.MoveHash = TRUE;
+        break;
+
       case 'T':
         ri.TimeStamp = TRUE;
         if (RhsIO.m_argv[argnum][2] == 'A')
@@ -253,6 +463,24 @@ DWORD WINAPI rhsmain(LPVOID unused)
         ri.Report = TRUE;
         break;
 
+      case 'P':
+        lstrcpyn(ri.SavePlan, RhsIO.m_argv[argnum] + 2, MAX_FILENAMELEN);
+        ri.SavePlan[MAX_FILENAMELEN] = '\0';
+        if (lstrlen(ri.SavePlan) == 0)
+        { RhsIO.printf(L"reconcile: The -p flag must be followed by a file name e.g. -pplan.txt.\r\n");
+          return 1;
+        }
+        break;
+
+      case 'L':
+        lstrcpyn(ri.LoadPlan, RhsIO.m_argv[argnum] + 2, MAX_FILENAMELEN);
+        ri.LoadPlan[MAX_FILENAMELEN] = '\0';
+        if (lstrlen(ri.LoadPlan) == 0)
+        { RhsIO.printf(L"reconcile: The -l flag must be followed by a file name e.g. -lplan.txt.\r\n");
+          return 1;
+        }
+        break;
+
       case 'E':
         ri.FailOnError = FALSE;
         break;
@@ -261,6 +489,18 @@ DWORD WINAPI rhsmain(LPVOID unused)
         ri.UseFATTimeStamp = FALSE;
         break;
 
+      case 'J':
+        ri.Threads = _wtoi(RhsIO.m_argv[argnum] + 2);
+        for (p = RhsIO.m_argv[argnum] + 2; *p != '\0' && *p != ','; p++);
+        if (*p == ',')
+          ri.VolumeDepth = _wtoi(p + 1);
+
+        if (ri.Threads < 1 || ri.Threads > MAX_COPYTHREADS || ri.VolumeDepth < 1)
+        { RhsIO.printf(L"reconcile: The -j flag must be followed by 1 to %i threads and optionally a volume depth e.g. -j8,4.\r\n", MAX_COPYTHREADS);
+          return 1;
+        }
+        break;
+
       default:
         RhsIO.printf(L"reconcile: Unknown flag \"%s\".\r\n%s", RhsIO.m_argv[argnum], SYNTAX);
         return 1;
@@ -269,13 +509,6 @@ DWORD WINAPI rhsmain(LPVOID unused)
     argnum++;
   }
 
-// Check there are two arguments left
-
-  if (RhsIO.m_argc - argnum < 2)
-  { RhsIO.printf(L"reconcile: Not enough arguments were given.\r\n%s", SYNTAX);
-    return(2);
-  }
-
 // Check quiet and report flags don't clash
 
   if (ri.Quiet && ri.Report)
@@ -283,19 +516,105 @@ DWORD WINAPI rhsmain(LPVOID unused)
     return 1;
   }
 
-// Make sure we have something to do
+// Restoring from a deduplicated archive is a separate job
+
+  if (ri.Restore)
+  { if (lstrlen(ri.StorePath) == 0)
+    { RhsIO.printf(L"reconcile: --restore needs the archive store to be given with --dedup.\r\n%s", SYNTAX);
+      return 1;
+    }
+
+    if (RhsIO.m_argc - argnum != 2 || ri.Update || ri.Create || ri.Delete || ri.TimeStamp || ri.Move || ri.Archive || ri.Report
+     || lstrlen(ri.SavePlan) > 0 || lstrlen(ri.LoadPlan) > 0 || lstrlen(ri.JournalFile) > 0)
+    { RhsIO.printf(L"reconcile: --restore needs an archive and a destination, and no other actions.\r\n%s", SYNTAX);
+      return 1;
+    }
+
+    if (!ArchiveStore.Open(ri.StorePath))
+    { RhsIO.printf(L"reconcile: %s\r\n", ArchiveStore.LastError());
+      return 1;
+    }
 
-  if (!ri.Update && !ri.Create && !ri.Delete && !ri.TimeStamp)
-  { RhsIO.printf(L"reconcile: No action was requested.");
+    return ReconcileRestore(RhsIO.m_argv[argnum], RhsIO.m_argv[argnum+1], &ri) ? 0 : 1;
+  }
+
+// Check the journal options
+
+  if (ri.Resume && lstrlen(ri.JournalFile) == 0)
+  { RhsIO.printf(L"reconcile: --resume needs the journal file to be given with --journal.\r\n%s", SYNTAX);
     return 1;
   }
 
-// Check the first argument i.e. source directory
+  if (ri.Report && lstrlen(ri.JournalFile) > 0)
+  { RhsIO.printf(L"reconcile: --journal cannot be used with -r.\r\n");
+    return 1;
+  }
+
+// If we are running a saved plan or resuming from a journal the
+// directories and the actions come from the file
+
+  if (lstrlen(ri.LoadPlan) > 0 || ri.Resume)
+  { if (RhsIO.m_argc - argnum > 0 || (ri.Update && ri.DeltaMode == DELTA_NONE) || ri.Create || ri.Delete || ri.TimeStamp || ri.Move || ri.Archive || lstrlen(ri.SavePlan) > 0
+     || (ri.Resume && lstrlen(ri.LoadPlan) > 0))
+    { RhsIO.printf(L"reconcile: Directories, actions and -p cannot be used with -l or --resume.\r\n%s", SYNTAX);
+      return 1;
+    }
+
+    if (ri.Resume)
+    { if (!journal.Open(ri.JournalFile, &plan))
+      { RhsIO.printf(L"reconcile: %s\r\n", journal.LastError());
+        return 1;
+      }
+      ri.Journal = &journal;
+    }
+    else if (!plan.Load(ri.LoadPlan))
+    { RhsIO.printf(L"reconcile: %s\r\n", plan.LastError());
+      return 1;
+    }
+
+    lstrcpy(ri.Source, plan.Source());
+    lstrcpy(ri.Destination, plan.Dest());
+    lstrcpy(ri.ArchivePath, plan.Archive());
+    ri.Archive = lstrlen(ri.ArchivePath) > 0;
+  }
+
+// Otherwise check there are two arguments left
+
+  else
+  { if (RhsIO.m_argc - argnum < 2)
+    { RhsIO.printf(L"reconcile: Not enough arguments were given.\r\n%s", SYNTAX);
+      return(2);
+    }
+
+// Make sure we have something to do
+
+    if (!ri.Update && !ri.Create && !ri.Delete && !ri.TimeStamp)
+    { RhsIO.printf(L"reconcile: No action was requested.");
+      return 1;
+    }
+
+// Moves replace a copy and a delete so both must be allowed
+
+    if (ri.Move && (!ri.Create || !ri.Delete))
+    { RhsIO.printf(L"reconcile: The -m flag needs the -x and -d flags.\r\n");
+      return 1;
+    }
+
+    lstrcpy(ri.Source, RhsIO.m_argv[argnum++]);
+    RemoveTrailingSlash(ri.Source);
+    AddCurrentPath(ri.Source);
+
+    lstrcpy(ri.Destination, RhsIO.m_argv[argnum++]);
+    RemoveTrailingSlash(ri.Destination);
+    AddCurrentPath(ri.Destination);
 
-  lstrcpy(ri.Source, RhsIO.m_argv[argnum++]);
+    if (ri.Archive)
+    { RemoveTrailingSlash(ri.ArchivePath);
+      AddCurrentPath(ri.ArchivePath);
+    }
+  }
 
-  RemoveTrailingSlash(ri.Source);
-  AddCurrentPath(ri.Source);
+// Check the source directory
 
   attrib = GetFileAttributes(ri.Source);
 
@@ -309,11 +628,7 @@ DWORD WINAPI rhsmain(LPVOID unused)
     return 1;
   }
 
-// Check the second argument i.e. destination directory
-
-  lstrcpy(ri.Destination, RhsIO.m_argv[argnum++]);
-  RemoveTrailingSlash(ri.Destination);
-  AddCurrentPath(ri.Destination);
+// Check the destination directory
 
   attrib = GetFileAttributes(ri.Destination);
 
@@ -337,10 +652,7 @@ DWORD WINAPI rhsmain(LPVOID unused)
 // If an archive directory was specified check it now
 
   if (ri.Archive)
-  { RemoveTrailingSlash(ri.ArchivePath);
-    AddCurrentPath(ri.ArchivePath);
-
-    attrib = GetFileAttributes(ri.ArchivePath);
+  { attrib = GetFileAttributes(ri.ArchivePath);
 
     if (attrib == 0xFFFFFFFF)
     { RhsIO.printf(L"reconcile: Cannot find the archive directory \"%s\".\r\n", ri.Destination);
@@ -353,6 +665,20 @@ DWORD WINAPI rhsmain(LPVOID unused)
     }
   }
 
+// Open the archive store
+
+  if (lstrlen(ri.StorePath) > 0)
+  { if (!ri.Archive)
+    { RhsIO.printf(L"reconcile: --dedup needs an archive directory to be given with -a.\r\n");
+      return 1;
+    }
+
+    if (!ArchiveStore.Open(ri.StorePath))
+    { RhsIO.printf(L"reconcile: %s\r\n", ArchiveStore.LastError());
+      return 1;
+    }
+  }
+
 // Reconcile
 
   if (!ri.Quiet)
@@ -362,22 +688,100 @@ DWORD WINAPI rhsmain(LPVOID unused)
     RhsIO.printf(L"\r\n");
   }
 
-  ri.Updated = ri.Created = ri.Deleted = ri.TimeStamped = 0;
+  ri.Updated = ri.Created = ri.Deleted = ri.TimeStamped = ri.Moved = 0;
+
+// Work out what needs doing, unless we are running a saved plan
+
+  if (lstrlen(ri.LoadPlan) == 0 && !ri.Resume)
+  { options = 0;
+    if (ri.Create)           options |= PLANOPT_CREATE;
+    if (ri.Update)           options |= PLANOPT_UPDATE;
+    if (ri.Delete)           options |= PLANOPT_DELETE;
+    if (ri.TimeStamp)        options |= PLANOPT_TIMESTAMP;
+    if (ri.TimeStampAll)     options |= PLANOPT_TIMESTAMPALL;
+    if (ri.UseFATTimeStamp)  options |= PLANOPT_FATTIME;
+    if (ri.FailOnError)      options |= PLANOPT_FAILONERROR;
+    if (ri.Move)             options |= PLANOPT_MOVES;
+    if (ri.MoveHash)         options |= PLANOPT_MOVEHASH;
+
+    plan.SetStats(&stats);
+    stats.StartPhase(STATS_PLAN);
+
+    if (!plan.Build(ri.Source, ri.Destination, ri.Archive ? ri.ArchivePath : NULL, options))
+    { RhsIO.errprintf(L"reconcile: %s\r\n", plan.LastError());
+      return 1;
+    }
+
+    stats.EndPhase(STATS_PLAN);
+  }
+
+// Save the plan if required
 
-  if (ri.Update || ri.Create)
-    if (!ReconcileUpdateFiles(ri.Source, ri.Destination, ri.ArchivePath, &ri))
+  if (lstrlen(ri.SavePlan) > 0)
+  { if (!plan.Save(ri.SavePlan))
+    { RhsIO.errprintf(L"reconcile: %s\r\n", plan.LastError());
       return 1;
+    }
+
+    if (!ri.Quiet)
+      RhsIO.printf(L"Plan of %i actions saved to %s\r\n\r\n", plan.NumActions(), ri.SavePlan);
+  }
+
+// Start a new journal if required
 
-  if (ri.Delete)
-    if (!ReconcileDeleteFiles(ri.Source, ri.Destination, ri.ArchivePath, &ri))
+  if (lstrlen(ri.JournalFile) > 0 && !ri.Resume)
+  { if (!journal.Create(ri.JournalFile, &plan))
+    { RhsIO.errprintf(L"reconcile: %s\r\n", journal.LastError());
       return 1;
+    }
+    ri.Journal = &journal;
+  }
+
+  if (ri.Resume && !ri.Quiet)
+    RhsIO.printf(L"Resuming: %i of %i actions were done by the last run\r\n\r\n", journal.NumDone(), plan.NumActions());
+
+// In report mode just list the plan, otherwise run it
+
+  if (ri.Report)
+  { ReconcilePrintPlan(&plan, &ri);
+  }
+  else
+  { success = ReconcileRunPlan(&plan, &ri);
+
+// The journal is only kept if something is left to do
+
+    if (ri.Journal)
+    { if (!journal.Close(journal.NumDone() == plan.NumActions()) || journal.Failed())
+        RhsIO.errprintf(L"reconcile: %s\r\n", journal.LastError());
 
-  if (ri.TimeStamp)
-    if (!ReconcileTimeStampFiles(ri.Source, ri.Destination, &ri))
+      if (journal.NumDone() < plan.NumActions())
+        RhsIO.printf(L"\r\n%i of %i actions done, use --resume to finish the run\r\n", journal.NumDone(), plan.NumActions());
+    }
+
+    if (!success)
       return 1;
+  }
 
   RhsIO.printf(L"\r\n%i files updated\r\n%i files created\r\n%i files deleted\r\n%i files timestamped\r\n", ri.Updated, ri.Created, ri.Deleted, ri.TimeStamped);
 
+  if (ri.Moved > 0)
+    RhsIO.printf(L"%i files moved\r\n", ri.Moved);
+
+  if (ri.DeltaMode != DELTA_NONE && !ri.Report)
+    RhsIO.printf(L"%.0f bytes copied and %.0f bytes reused by delta copies\r\n", (double) engine.DeltaLiteralBytes(), (double) engine.DeltaMatchedBytes());
+
+  if (ArchiveStore.Enabled() && !ri.Report)
+    RhsIO.printf(L"%.0f bytes archived and %.0f bytes of new chunks stored\r\n", (double) ArchiveStore.BytesArchived(), (double) ArchiveStore.BytesStored());
+
+// Print the statistics and save them if required
+
+  stats.Print();
+
+  if (lstrlen(ri.StatsFile) > 0 && !stats.WriteJson(ri.StatsFile))
+  { RhsIO.errprintf(L"reconcile: %s\r\n", stats.LastError());
+    return 1;
+  }
+
 // All done
 
   return(0);
@@ -385,576 +789,777 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
 
 //**********************************************************************
-// ReconcileUpdateFiles
-// --------------------
-// Update/Create from File1 to File2, optionally archiving to File3
+// ReconcileLongOption
+// -------------------
+// Options starting -- have a name and optionally a value after an =
+// e.g. --journal=reconcile.jnl. Option points past the --.
 //**********************************************************************
 
-BOOL ReconcileUpdateFiles(WCHAR* File1, WCHAR* File2, WCHAR* File3, RECONCILEINFO* RInfo)
-{ DWORD d;
-  WCHAR file1[MAX_FILENAMELEN+1], file2[MAX_FILENAMELEN+1], file3[MAX_FILENAMELEN+1];
-  SYSTEMTIME fcreatedate1, fmoddate1, fmoddate2;
-  HANDLE h;
-  WIN32_FIND_DATA wfd;
+BOOL ReconcileLongOption(const WCHAR* Option, RECONCILEINFO* RInfo)
+{ int namelen;
+  DWORD size;
+  const WCHAR* value;
+  const WCHAR* p;
 
-// Start the search
+  for (namelen = 0; Option[namelen] != '\0' && Option[namelen] != '='; namelen++);
+  value = Option[namelen] == '=' ? Option + namelen + 1 : NULL;
 
-  lstrcpy(file1, File1);
-  lstrcat(file1, L"\\*");
-  h = FindFirstFile(file1, &wfd);
+// --journal=<file>
 
-  if (h != INVALID_HANDLE_VALUE)
-  { do
-    {
+  if (IsLongOption(Option, namelen, L"journal"))
+  { if (!value || lstrlen(value) == 0 || lstrlen(value) > MAX_FILENAMELEN)
+    { RhsIO.printf(L"reconcile: --journal must be followed by a file name e.g. --journal=reconcile.jnl.\r\n");
+      return FALSE;
+    }
+    lstrcpy(RInfo->JournalFile, value);
+  }
 
-// Check for an abort signal
+// --resume
 
-      if (RhsIO.GetAbort())
-        break;
+  else if (IsLongOption(Option, namelen, L"resume") && !value)
+  { RInfo->Resume = TRUE;
+  }
 
-// Check file is one we want
+// --bwlimit=<profiles>
 
-      if (lstrcmp(wfd.cFileName, L".") == 0 || lstrcmp(wfd.cFileName, L"..") == 0)
-        continue;
+  else if (IsLongOption(Option, namelen, L"bwlimit"))
+  { if (!value || !RInfo->Throttle->SetProfiles(value))
+    { RhsIO.printf(L"reconcile: %s.\r\nThe profiles are [hh:mm-hh:mm@]<bytes/sec>[K|M|G][,<files/sec>] separated by ; e.g. --bwlimit=08:00-18:00@10M,50;0\r\n",
+                   value ? RInfo->Throttle->LastError() : L"--bwlimit must be followed by a list of profiles");
+      return FALSE;
+    }
+  }
 
-// Build source and destination name
+// --dedup=<store>
 
-      lstrcpy(file1, File1);
-      lstrcat(file1, L"\\");
-      lstrcat(file1, wfd.cFileName);
+  else if (IsLongOption(Option, namelen, L"dedup"))
+  { if (!value || lstrlen(value) == 0 || lstrlen(value) > MAX_FILENAMELEN)
+    { RhsIO.printf(L"reconcile: --dedup must be followed by a directory for the archive store e.g. --dedup=d:\\chunks.\r\n");
+      return FALSE;
+    }
+    lstrcpy(RInfo->StorePath, value);
+    RemoveTrailingSlash(RInfo->StorePath);
+    AddCurrentPath(RInfo->StorePath);
+  }
 
-      lstrcpy(file2, File2);
-      lstrcat(file2, L"\\");
-      lstrcat(file2, wfd.cFileName);
+// --restore
 
-      lstrcpy(file3, File3);
-      lstrcat(file3, L"\\");
-      lstrcat(file3, wfd.cFileName);
+  else if (IsLongOption(Option, namelen, L"restore") && !value)
+  { RInfo->Restore = TRUE;
+  }
 
-// ---------------------------------------------------------------------
-// This section deals with directories
+// --stats=<file>
 
-      if (IsDirectory(wfd.dwFileAttributes))
-      { d = FileExists(file2);
+  else if (IsLongOption(Option, namelen, L"stats"))
+  { if (!value || lstrlen(value) == 0 || lstrlen(value) > MAX_FILENAMELEN)
+    { RhsIO.printf(L"reconcile: --stats must be followed by a file name e.g. --stats=reconcile.json.\r\n");
+      return FALSE;
+    }
+    lstrcpy(RInfo->StatsFile, value);
+  }
 
-// If we are updating or creating and the target directory exists, recurse into it
+// --latency=<ms>
 
-        if ((RInfo->Update || RInfo->Create) && d)
-        { if (!ReconcileUpdateFiles(file1, file2, file3, RInfo))
-          { FindClose(h);
-            return(FALSE);
-          }
-        }
+  else if (IsLongOption(Option, namelen, L"latency"))
+  { if (!value || _wtoi(value) < 1)
+    { RhsIO.printf(L"reconcile: --latency must be followed by a time in milliseconds e.g. --latency=50.\r\n");
+      return FALSE;
+    }
+    RInfo->Throttle->SetLatency((DWORD) _wtoi(value));
+  }
 
-// If we are creating and the target directory does not exist, create it
+// --buffer=<size>[K|M]
 
-        if (RInfo->Create && !d)
-        { if (!RInfo->Quiet)
-            RhsIO.printf(L"X Creating destination directory %s\r\n", file2);
-
-          if (!RInfo->Report)
-          { if (!CreateDirectory(file2, NULL))
-            { if (!RInfo->Quiet)
-                RhsIO.errprintf(L"E Cannot create destination directory %s: %s\r\n", file2, GetLastErrorMessage());
-
-              if (RInfo->FailOnError)
-              { FindClose(h);
-                return(FALSE);
-              }
-              else
-              { continue;
-              }
-            }
-            // If we created the directory set its timestamp now
-            else
-            { GetFileTimeByName(file1, &fcreatedate1, NULL, &fmoddate1);
-              SetFileTimeByName(file2, &fcreatedate1, NULL, &fmoddate1);
-            }
-          }
-
-          // And recurse to copy the directory contents
-          if (!ReconcileUpdateFiles(file1, file2, file3, RInfo))
-          { FindClose(h);
-            return(FALSE);
-          }
-        }
-      }
+  else if (IsLongOption(Option, namelen, L"buffer"))
+  { size = value ? (DWORD) _wtoi(value) : 0;
 
-// ---------------------------------------------------------------------
-// This section deals with files
+    for (p = value; p && *p >= '0' && *p <= '9'; p++);
 
-      else
-      { d = FileExists(file2);
-
-// If we are updating check the file timestamps
-
-        if (RInfo->Update && d)
-        { GetFileTimeByName(file1, NULL, NULL, &fmoddate1);
-          GetFileTimeByName(file2, NULL, NULL, &fmoddate2);
-
-          if (ReconcileCompareTime(&fmoddate1, &fmoddate2, RInfo->UseFATTimeStamp) <= 0)
-            continue;
-
-          if (!RInfo->Quiet)
-            RhsIO.printf(L"U %s %s\r\n", file1, file2);
-
-          if (!RInfo->Report)
-          {
-
-// If required archive the old file
-
-            if (RInfo->Archive)
-            { if (!RInfo->Quiet)
-                RhsIO.printf(L"A %s %s\r\n", file2, file3);
-
-              if (!ReconcileArchiveFile(file2, file3))
-              { if (!RInfo->Quiet)
-                  RhsIO.errprintf(L"E Cannot archive %s to %s: %s\r\n", file1, file3, GetLastErrorMessage());
-
-                if (RInfo->FailOnError)
-                { FindClose(h);
-                  return(FALSE);
-                }
-                else
-                { continue;
-                }
-              }
-            }
-
-// Copy the new file
-
-            SetFileAttributes(file2, 0);
-            if (!CopyFile(file1, file2, FALSE))
-            { if (!RInfo->Quiet)
-                RhsIO.errprintf(L"E Cannot copy %s to %s: %s\r\n", file1, file2, GetLastErrorMessage());
-
-              if (RInfo->FailOnError)
-              { FindClose(h);
-                return(FALSE);
-              }
-              else
-              { continue;
-              }
-            }
-          }
-          RInfo->Updated++;
-        }
+// Check the size before applying the suffix so it can't overflow
 
-// If we are creating copy the file
+    if (p && (*p == 'K' || *p == 'k'))
+      size = size > MAX_BUFFERSIZE/0x400 ? MAX_BUFFERSIZE + 1 : size*0x400;
+    else if (p && (*p == 'M' || *p == 'm'))
+      size = size > MAX_BUFFERSIZE/0x100000 ? MAX_BUFFERSIZE + 1 : size*0x100000;
 
-        if (RInfo->Create && !d)
-        { if (!RInfo->Quiet)
-            RhsIO.printf(L"X %s %s\r\n", file1, file2);
-
-          if (!RInfo->Report)
-          { if (!CopyFile(file1, file2, FALSE))
-            { if (!RInfo->Quiet)
-                RhsIO.errprintf(L"E Cannot copy %s to %s: %s\r\n", file1, file2, GetLastErrorMessage());
-
-              if (RInfo->FailOnError)
-              { FindClose(h);
-                return(FALSE);
-              }
-              else
-              { continue;
-              }
-            }
-          }
+    if (size < 0x10000 || size > MAX_BUFFERSIZE || size % 0x10000 != 0)
+    { RhsIO.printf(L"reconcile: --buffer must be followed by a multiple of 64K up to 64M e.g. --buffer=4M.\r\n");
+      return FALSE;
+    }
+    RInfo->BufferSize = size;
+  }
 
-          RInfo->Created++;
-        }
-      }
+// --buffered
 
-// Get next file
+  else if (IsLongOption(Option, namelen, L"buffered") && !value)
+  { RInfo->CopyOptions &= ~COPYOPT_UNBUFFERED;
+  }
 
-    } while (FindNextFile(h, &wfd));
+// --streams
 
-    FindClose(h);
+  else if (IsLongOption(Option, namelen, L"streams") && !value)
+  { RInfo->CopyOptions |= COPYOPT_STREAMS;
   }
 
-// All done so return
+// --acls
 
-  return(TRUE);
+  else if (IsLongOption(Option, namelen, L"acls") && !value)
+  { RInfo->CopyOptions |= COPYOPT_SECURITY;
+  }
+
+// --progress
+
+  else if (IsLongOption(Option, namelen, L"progress") && !value)
+  { RInfo->Progress = TRUE;
+  }
+
+  else
+  { RhsIO.printf(L"reconcile: Unknown option \"--%s\".\r\n%s", Option, SYNTAX);
+    return FALSE;
+  }
+
+  return TRUE;
 }
 
 
 //**********************************************************************
-// ReconcileDeleteFiles
-// --------------------
-// Routine to delete all files in a source directory which are not in
-// a destination directory.
+// ReconcilePhase
+// --------------
+// The plan is run in phases. The copies and moves are done first, then
+// the deletes, and the timestamps last so nothing changes the times
+// after they have been set. Directories are removed after the files in
+// them, once the jobs for the files have finished. Setting the times of
+// a file doesn't change the times of its directory, so directories can
+// be timestamped at the same time as files.
 //**********************************************************************
 
-BOOL ReconcileDeleteFiles(WCHAR* File1, WCHAR* File2, WCHAR* File3, RECONCILEINFO* RInfo)
-{ DWORD d;
-  WCHAR file1[MAX_FILENAMELEN+1], file2[MAX_FILENAMELEN+1], file3[MAX_FILENAMELEN+1];
-  HANDLE h;
-  WIN32_FIND_DATA wfd;
+#define RECONCILE_PHASES    4
+#define RECONCILE_TIMEPHASE 3
+
+int ReconcilePhase(const PLANACTION* Action)
+{
+  switch (Action->Type)
+  { case PLAN_MKDIR:
+    case PLAN_CREATE:
+    case PLAN_UPDATE:
+    case PLAN_MOVE:
+      return 0;
+
+    case PLAN_DELETE:
+      return 1;
+
+    case PLAN_RMDIR:
+      return 2;
 
-// Start the search
+    case PLAN_TIMESTAMP:
+      return RECONCILE_TIMEPHASE;
+  }
 
-  lstrcpy(file2, File2);
-  lstrcat(file2, L"\\*");
-  h = FindFirstFile(file2, &wfd);
+  return -1;
+}
 
-  if (h != INVALID_HANDLE_VALUE)
-  { do
-    {
+
+//**********************************************************************
+// ReconcileRunPlan
+// ----------------
+// Do the actions in the plan. Most actions run on the copy engine.
+// Creating and removing directories is done here because it has to
+// wait for the actions before it, but the messages go through the
+// engine so the output stays in order.
+//
+// With a journal, actions it says are done are skipped and the journal
+// is checkpointed at the end of each phase.
+//**********************************************************************
+
+BOOL ReconcileRunPlan(CReconcilePlan* Plan, RECONCILEINFO* RInfo)
+{ int i, phase, skiplen;
+  BOOL success;
+  UINT64 started;
+  WCHAR skipdir[MAX_FILENAMELEN+1];
+  WCHAR file1[MAX_FILENAMELEN*2+1], file2[MAX_FILENAMELEN*2+1], file3[MAX_FILENAMELEN*2+1];
+  const PLANACTION* a;
+  CCopyEngine* engine;
+
+  engine = RInfo->Engine;
+  engine->SetDeltaMode(RInfo->DeltaMode);
+  engine->SetJournal(RInfo->Journal);
+  engine->SetThrottle(RInfo->Throttle->Enabled() ? RInfo->Throttle : NULL);
+  engine->SetCopyOptions(RInfo->CopyOptions, RInfo->BufferSize);
+  engine->SetProgress(RInfo->Progress && !RInfo->Quiet ? ReconcileProgress : NULL, RInfo);
+  engine->SetStats(RInfo->Stats);
+
+  if (!engine->Start(RInfo->Threads, RInfo->VolumeDepth, RInfo->Quiet, RInfo->FailOnError))
+  { RhsIO.errprintf(L"reconcile: Cannot start the copy threads: %s\r\n", engine->LastError());
+    return FALSE;
+  }
+
+// Make the archive directories before the copy threads need them
+
+  if (RInfo->Archive)
+  { started = RInfo->Stats->Now();
+    ReconcileArchiveDirs(Plan, RInfo);
+    RInfo->Stats->Archived(started, 0);
+  }
+
+  success = TRUE;
+
+  for (phase = 0; phase < RECONCILE_PHASES && success; phase++)
+  { lstrcpy(skipdir, L"");
+    skiplen = 0;
+
+// The statistics have a phase for each of ours, after the planning
+
+    RInfo->Stats->StartPhase(STATS_COPY + phase);
+
+    for (i = 0; i < Plan->NumActions() && success; i++)
+    { a = Plan->Action(i);
 
 // Check for an abort signal
 
       if (RhsIO.GetAbort())
         break;
 
-// Check file is one we want
+// Directories we created get their times once everything has been
+// copied into them. This saves opening them twice.
 
-      if (lstrcmp(wfd.cFileName, L".") == 0 || lstrcmp(wfd.cFileName, L"..") == 0)
+      if (phase == RECONCILE_TIMEPHASE && a->Type == PLAN_MKDIR)
+      { ReconcilePlanPaths(Plan, a, file1, file2, file3);
+        SetFileTimeByName(file2, &a->Created, &a->Modified);
         continue;
+      }
 
-// Build source and destination name
+      if (ReconcilePhase(a) != phase)
+        continue;
 
-      lstrcpy(file1, File1);
-      lstrcat(file1, L"\\");
-      lstrcat(file1, wfd.cFileName);
+      if (RInfo->Journal && RInfo->Journal->IsDone(i))
+        continue;
 
-      lstrcpy(file2, File2);
-      lstrcat(file2, L"\\");
-      lstrcat(file2, wfd.cFileName);
+// If a job has failed stop now
 
-      lstrcpy(file3, File3);
-      lstrcat(file3, L"\\");
-      lstrcat(file3, wfd.cFileName);
+      if (engine->Failed())
+      { success = FALSE;
+        break;
+      }
 
-// If the source file exists and it's not a directory then continue
+// If we couldn't create a directory skip everything in it
 
-      d = FileExists(file1);
-      if (d > 1)
-      { RhsIO.errprintf(L"E Error checking %s: %s\r\n", file1, GetLastErrorMessage());
-        return FALSE;
+      if (skiplen > 0)
+        if (CompareStringOrdinal(a->Path, skiplen, skipdir, skiplen, TRUE) == CSTR_EQUAL && a->Path[skiplen] == '\\')
+          continue;
+
+      if (!ReconcileRunAction(Plan, i, RInfo))
+      { if (RInfo->FailOnError)
+          success = FALSE;
+
+        if (a->Type == PLAN_MKDIR && lstrlen(a->Path) <= MAX_FILENAMELEN)
+        { lstrcpy(skipdir, a->Path);
+          skiplen = lstrlen(skipdir);
+        }
       }
+    }
 
-      if (d == 1)
-        if (!IsDirectory(wfd.dwFileAttributes))
-          continue;
+// Wait for the jobs from this phase before starting the next
 
-// Check if name found is a directory
+    if (!engine->Wait())
+      success = FALSE;
 
-      if (IsDirectory(wfd.dwFileAttributes))
-      { if (!ReconcileDeleteFiles(file1, file2, file3, RInfo))
-          return(FALSE);
+    RInfo->Stats->EndPhase(STATS_COPY + phase);
+
+    if (RInfo->Journal)
+      RInfo->Journal->Checkpoint();
+
+    if (RhsIO.GetAbort())
+      break;
+  }
+
+  engine->Stop();
+
+  RInfo->Updated     += engine->NumUpdated();
+  RInfo->Created     += engine->NumCreated();
+  RInfo->Deleted     += engine->NumDeleted();
+  RInfo->TimeStamped += engine->NumTimeStamped();
+  RInfo->Moved       += engine->NumMoved();
+
+  return success;
+}
+
+
+//**********************************************************************
+// ReconcileRunAction
+// ------------------
+// Do one action or hand it to the copy engine. Returns FALSE if the
+// action failed. Id is the index of the action in the plan.
+//
+// When resuming, a directory that is already there was created by the
+// last run and a directory that has gone was removed by it.
+//**********************************************************************
+
+BOOL ReconcileRunAction(CReconcilePlan* Plan, int Id, RECONCILEINFO* RInfo)
+{ DWORD err;
+  BOOL resuming;
+  WCHAR file1[MAX_FILENAMELEN*2+1], file2[MAX_FILENAMELEN*2+1], file3[MAX_FILENAMELEN*2+1];
+  const PLANACTION* Action;
+  CCopyEngine* engine;
+
+  engine = RInfo->Engine;
+  Action = Plan->Action(Id);
+  ReconcilePlanPaths(Plan, Action, file1, file2, file3);
+
+  resuming = RInfo->Journal && RInfo->Journal->Resuming();
+
+  switch (Action->Type)
+  {
+
+// Create a directory. It's done here so it exists before any copies
+// into it are started.
 
-// If the source dir doesn't exist then remove the destination dir
+    case PLAN_MKDIR:
+      if (!RInfo->Quiet)
+        engine->printf(L"X Creating destination directory %s\r\n", file2);
 
-        d = FileExists(file1);
-        if (d > 1)
-        { RhsIO.errprintf(L"E Error checking %s: %s\r\n", file1, GetLastErrorMessage());
+      if (!CreateDirectory(file2, NULL))
+      { err = GetLastError();
+        if (!resuming || err != ERROR_ALREADY_EXISTS)
+        { if (!RInfo->Quiet)
+            engine->errprintf(L"E Cannot create destination directory %s: %s\r\n", file2, GetLastErrorMessage());
           return FALSE;
         }
+      }
 
-        if (d == 0)
-        { if (!RInfo->Report)
-          { if (!RInfo->Quiet)
-              RhsIO.printf(L"D Deleting directory %s\r\n", file2);
-
-            SetFileAttributes(file2, 0);
-
-            if (!RemoveDirectory(file2))
-            { if (!RInfo->Quiet)
-                RhsIO.errprintf(L"E Cannot remove directory %s: %s\r\n", file2, GetLastErrorMessage());
-
-              if (RInfo->FailOnError)
-              { FindClose(h);
-                return(FALSE);
-              }
-              else
-              { continue;
-              }
-            }
-          }
-        }
+      if (RInfo->Journal)
+        RInfo->Journal->Done(Id);
+      break;
+
+// Copy, update and delete files on the engine
+
+    case PLAN_CREATE:
+      if (!engine->Submit(COPYJOB_CREATE, file1, file2, NULL, Action->Size, Id))
+      { engine->errprintf(L"E Cannot copy %s to %s: %s\r\n", file1, file2, engine->LastError());
+        return FALSE;
       }
+      break;
 
-// Name found is a file
+    case PLAN_UPDATE:
+      if (!engine->Submit(COPYJOB_UPDATE, file1, file2, RInfo->Archive ? file3 : NULL, Action->Size, Id))
+      { engine->errprintf(L"E Cannot copy %s to %s: %s\r\n", file1, file2, engine->LastError());
+        return FALSE;
+      }
+      break;
 
-      else
-      { if (!RInfo->Quiet)
-          RhsIO.printf(L"D %s\r\n", file2);
+// A move is within the destination, so file1 is the old destination
+// file
+
+    case PLAN_MOVE:
+      if (!engine->Submit(COPYJOB_MOVE, file1, file2, RInfo->Archive ? file3 : NULL, Action->Size, Id))
+      { engine->errprintf(L"E Cannot move %s to %s: %s\r\n", file1, file2, engine->LastError());
+        return FALSE;
+      }
+      break;
+
+    case PLAN_DELETE:
+      if (!engine->Submit(COPYJOB_DELETE, L"", file2, RInfo->Archive ? file3 : NULL, 0, Id))
+      { engine->errprintf(L"E Cannot delete file %s: %s\r\n", file2, engine->LastError());
+        return FALSE;
+      }
+      break;
 
-        if (!RInfo->Report)
-        {
-
-// If required archive the old file
-
-          if (RInfo->Archive)
-          { if (!RInfo->Quiet)
-              RhsIO.printf(L"A %s %s\r\n", file2, file3);
-
-            if (!ReconcileArchiveFile(file2, file3))
-            { if (!RInfo->Quiet)
-                RhsIO.errprintf(L"E Cannot archive %s to %s: %s\r\n", file2, file3, GetLastErrorMessage());
-
-              if (RInfo->FailOnError)
-              { FindClose(h);
-                return(FALSE);
-              }
-              else
-              { continue;
-              }
-            }
-          }
-
-// Delete the file
-
-          SetFileAttributes(file2, 0);
-
-          if (!DeleteFile(file2))
-          { if (!RInfo->Quiet)
-              RhsIO.errprintf(L"E Cannot delete file %s: %s\r\n", file2, GetLastErrorMessage());
-
-            if (RInfo->FailOnError)
-            { FindClose(h);
-              return(FALSE);
-            }
-            else
-            { continue;
-            }
-          }
+// Directories are removed once everything in them has been deleted
+
+    case PLAN_RMDIR:
+      if (!RInfo->Quiet)
+        engine->printf(L"D Deleting directory %s\r\n", file2);
+
+      SetFileAttributes(file2, 0);
+
+      if (!RemoveDirectory(file2))
+      { err = GetLastError();
+        if (!resuming || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND))
+        { if (!RInfo->Quiet)
+            engine->errprintf(L"E Cannot remove directory %s: %s\r\n", file2, GetLastErrorMessage());
+          return FALSE;
         }
+      }
 
-        RInfo->Deleted++;
+      if (RInfo->Journal)
+        RInfo->Journal->Done(Id);
+      break;
+
+// Set the times
+
+    case PLAN_TIMESTAMP:
+      if (!engine->SubmitTimeStamp(file1, file2, (Action->Flags & PLANFLAG_CREATED) ? &Action->Created : NULL, &Action->Modified, Id))
+      { engine->errprintf(L"E Cannot timestamp %s to match %s: %s\r\n", file2, file1, engine->LastError());
+        return FALSE;
       }
+      break;
+  }
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// ReconcilePrintPlan
+// ------------------
+// List the actions in the plan, in the order they would be done, and
+// count them as if they had been done.
+//**********************************************************************
+
+void ReconcilePrintPlan(CReconcilePlan* Plan, RECONCILEINFO* RInfo)
+{ int i, phase;
+  WCHAR file1[MAX_FILENAMELEN*2+1], file2[MAX_FILENAMELEN*2+1], file3[MAX_FILENAMELEN*2+1];
+  SYSTEMTIME modified;
+  const PLANACTION* a;
+
+  for (phase = 0; phase < RECONCILE_PHASES; phase++)
+  { for (i = 0; i < Plan->NumActions(); i++)
+    { a = Plan->Action(i);
+      if (ReconcilePhase(a) != phase)
+        continue;
+
+      if (RhsIO.GetAbort())
+        return;
+
+      ReconcilePlanPaths(Plan, a, file1, file2, file3);
 
-// Get next file
+      switch (a->Type)
+      { case PLAN_MKDIR:
+          RhsIO.printf(L"X Creating destination directory %s\r\n", file2);
+          break;
 
-    } while (FindNextFile(h, &wfd));
+        case PLAN_CREATE:
+          RhsIO.printf(L"X %s %s\r\n", file1, file2);
+          RInfo->Created++;
+          break;
+
+        case PLAN_UPDATE:
+          RhsIO.printf(L"U %s %s\r\n", file1, file2);
+          RInfo->Updated++;
+          break;
 
-    FindClose(h);
+        case PLAN_DELETE:
+          RhsIO.printf(L"D %s\r\n", file2);
+          RInfo->Deleted++;
+          break;
+
+        case PLAN_MOVE:
+          RhsIO.printf(L"V %s %s\r\n", file1, file2);
+          RInfo->Moved++;
+          break;
+
+        case PLAN_RMDIR:
+          RhsIO.printf(L"D Deleting directory %s\r\n", file2);
+          break;
+
+        case PLAN_TIMESTAMP:
+          FileTimeToSystemTime(&a->Modified, &modified);
+          RhsIO.printf(L"T %s %s %i/%i/%i %02i:%02i:%02i\r\n", file1, file2, modified.wDay, modified.wMonth, modified.wYear%100, modified.wHour, modified.wMinute, modified.wSecond);
+          RInfo->TimeStamped++;
+          break;
+      }
+    }
   }
+}
 
-// All done so return
 
-  return(TRUE);
+//**********************************************************************
+// ReconcilePlanPaths
+// ------------------
+// Build the source, destination and archive names for an action. For a
+// move the source is the old destination file, and it's archived under
+// its old name.
+//**********************************************************************
+
+void ReconcilePlanPaths(CReconcilePlan* Plan, const PLANACTION* Action, WCHAR* File1, WCHAR* File2, WCHAR* File3)
+{
+  if (Action->Type == PLAN_MOVE)
+  { lstrcpy(File1, Plan->Dest());
+    lstrcat(File1, Action->From);
+
+    lstrcpy(File3, Plan->Archive());
+    lstrcat(File3, Action->From);
+  }
+  else
+  { lstrcpy(File1, Plan->Source());
+    lstrcat(File1, Action->Path);
+
+    lstrcpy(File3, Plan->Archive());
+    lstrcat(File3, Action->Path);
+  }
+
+  lstrcpy(File2, Plan->Dest());
+  lstrcat(File2, Action->Path);
 }
 
 
 //**********************************************************************
-// ReconcileTimeStampFiles
-// -----------------------
-// Update the timestamps of files in the destination to match the
-// source.
-// If RInfo->TimeStampAll is set this will update all three times. If it
-// is not set only the modified time will be set.
+// ReconcileArchiveDirs
+// --------------------
+// Create the archive directories for every action that archives a
+// file, in one pass before the plan is run. The plan is in tree order so
+// the actions for a directory come together, and the cache means each
+// directory is only created once. Errors are ignored here and reported
+// when the file is archived.
 //**********************************************************************
 
-BOOL ReconcileTimeStampFiles(WCHAR* File1, WCHAR* File2, RECONCILEINFO* RInfo)
-{ DWORD d;
-  WCHAR file1[MAX_FILENAMELEN+1], file2[MAX_FILENAMELEN+1];
-  SYSTEMTIME fcreatedate1, fmoddate1, fcreatedate2, fmoddate2;
-  HANDLE h;
-  WIN32_FIND_DATA wfd;
+void ReconcileArchiveDirs(CReconcilePlan* Plan, RECONCILEINFO* RInfo)
+{ int i, j;
+  WCHAR file1[MAX_FILENAMELEN*2+1], file2[MAX_FILENAMELEN*2+1], file3[MAX_FILENAMELEN*2+1];
+  const PLANACTION* a;
 
-// Start the search
+  for (i = 0; i < Plan->NumActions() && !RhsIO.GetAbort(); i++)
+  { a = Plan->Action(i);
 
-  lstrcpy(file1, File1);
-  lstrcat(file1, L"\\*");
-  h = FindFirstFile(file1, &wfd);
+    if (a->Type != PLAN_UPDATE && a->Type != PLAN_DELETE && a->Type != PLAN_MOVE)
+      continue;
 
-  if (h != INVALID_HANDLE_VALUE)
-  { do
-    {
+    if (RInfo->Journal && (RInfo->Journal->IsDone(i) || RInfo->Journal->IsArchived(i)))
+      continue;
 
-// Check for an abort signal
+    ReconcilePlanPaths(Plan, a, file1, file2, file3);
 
-      if (RhsIO.GetAbort())
-        break;
+    for (j = lstrlen(file3); j > 0 && file3[j-1] != '\\'; j--);
 
-// Check file is one we want
+    if (j > 1)
+      ArchiveDirs.Ensure(file3, j - 1);
+  }
+}
 
-      if (lstrcmp(wfd.cFileName, L".") == 0 || lstrcmp(wfd.cFileName, L"..") == 0)
-        continue;
 
-// Build source and destination name
+//**********************************************************************
+// ReconcileProgress
+// -----------------
+// Called by the copy threads while large files are copied. The lines
+// are printed straight away rather than in order with the rest of the
+// output, and start with P so they are easy to filter out.
+//**********************************************************************
+
+void ReconcileProgress(void* Context, const WCHAR* Dest, UINT64 Done, UINT64 Total)
+{
+  RhsIO.printf(L"P %s %i%% of %.1fMB\r\n", Dest, Total > 0 ? (int) (Done*100/Total) : 100, (double) Total/0x100000);
+}
+
+//**********************************************************************
+// ReconcileRestore
+// ----------------
+// Rebuild the files in an archive made with --dedup. The archive can be
+// a whole archive directory or a single manifest. Files in the archive
+// that aren't manifests, e.g. from runs without --dedup, are copied.
+// Existing files are never overwritten.
+//**********************************************************************
+
+BOOL ReconcileRestore(const WCHAR* Archive, const WCHAR* Dest, RECONCILEINFO* RInfo)
+{ int len, extlen;
+  BOOL success;
+  DWORD attrib;
+  const WCHAR* name;
+  WCHAR from[MAX_FILENAMELEN+1], to[MAX_FILENAMELEN+1];
 
-      lstrcpy(file1, File1);
-      lstrcat(file1, L"\\");
-      lstrcat(file1, wfd.cFileName);
+  if (lstrlen(Archive) > MAX_FILENAMELEN/2 || lstrlen(Dest) > MAX_FILENAMELEN/2)
+  { RhsIO.printf(L"reconcile: The archive or destination name is too long.\r\n");
+    return FALSE;
+  }
 
-      lstrcpy(file2, File2);
-      lstrcat(file2, L"\\");
-      lstrcat(file2, wfd.cFileName);
+  lstrcpy(from, Archive);
+  RemoveTrailingSlash(from);
+  AddCurrentPath(from);
 
-// If destination file doesn't exist then continue
+  lstrcpy(to, Dest);
+  RemoveTrailingSlash(to);
+  AddCurrentPath(to);
 
-      d = FileExists(file2);
+  attrib = GetFileAttributes(from);
+  if (attrib == INVALID_FILE_ATTRIBUTES)
+  { RhsIO.printf(L"reconcile: Cannot find the archive \"%s\".\r\n", from);
+    return FALSE;
+  }
 
-      if (d != 1)
-        continue;
+  RInfo->Created = 0;
 
-// Check if name found is a directory
+// Restore a directory tree into the destination directory
 
-      if (IsDirectory(wfd.dwFileAttributes))
-      { if (!ReconcileTimeStampFiles(file1, file2, RInfo))
-        { FindClose(h);
-          return(FALSE);
-        }
-      }
+  if (IsDirectory(attrib))
+  { if (!CreateDirectory(to, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    { RhsIO.printf(L"reconcile: Cannot create the destination directory \"%s\": %s\r\n", to, GetLastErrorMessage());
+      return FALSE;
+    }
 
-// Name found is a file
+    success = ReconcileRestoreDir(from, to, RInfo);
+  }
 
-      else
-      { GetFileTimeByName(file1, &fcreatedate1, NULL, &fmoddate1);
-        GetFileTimeByName(file2, &fcreatedate2, NULL, &fmoddate2);
+// Restore one file. If the destination is a directory the file goes
+// into it with the name it was archived under.
 
-        // Check the timestamps
-        BOOL timediff = FALSE;
-        if (ReconcileCompareTime(&fmoddate1, &fmoddate2, RInfo->UseFATTimeStamp) != 0)
-        { timediff = TRUE;
-        }
-        else if (RInfo->TimeStampAll)
-        { if (ReconcileCompareTime(&fcreatedate1, &fcreatedate2, RInfo->UseFATTimeStamp) != 0)
-            timediff = TRUE;
-        }
-        if (!timediff)
-          continue;
+  else
+  { attrib = GetFileAttributes(to);
 
-        // If we reached here the timestamps differ
-        if (!RInfo->Quiet)
-          RhsIO.printf(L"T %s %s %i/%i/%i %02i:%02i:%02i\r\n", file1, file2, fmoddate1.wDay, fmoddate1.wMonth, fmoddate1.wYear%100, fmoddate1.wHour, fmoddate1.wMinute, fmoddate1.wSecond);
-
-        if (!RInfo->Report)
-        { // If the destination is read-only we need to make it writeable
-          DWORD file2attr = GetFileAttributes(file2);
-          if (file2attr & FILE_ATTRIBUTE_READONLY)
-             SetFileAttributes(file2, 0);
-
-          // Change the timestamp
-          BOOL b;
-          if (RInfo->TimeStampAll)
-            b = SetFileTimeByName(file2, &fcreatedate1, NULL, &fmoddate1);
-          else
-            b = SetFileTimeByName(file2, NULL, NULL, &fmoddate1);
-
-          // If the file was read-only change the attributes back
-          if (file2attr & FILE_ATTRIBUTE_READONLY)
-            SetFileAttributes(file2, file2attr);
-
-          // If the timestamp change failed report the error
-          if (!b)
-          { if (!RInfo->Quiet)
-              RhsIO.errprintf(L"E Cannot timestamp %s to match %s: %s\r\n", file2, file1, GetLastErrorMessage());
-
-            if (RInfo->FailOnError)
-            { FindClose(h);
-              return(FALSE);
-            }
-            else
-            { continue;
-            }
-          }
-        }
+    if (attrib != INVALID_FILE_ATTRIBUTES && IsDirectory(attrib))
+    { for (name = from + lstrlen(from); name > from && *(name-1) != '\\'; name--);
+      lstrcat(to, L"\\");
+      lstrcat(to, name);
 
-        RInfo->TimeStamped++;
-      }
+      len = lstrlen(to);
+      extlen = lstrlen(ARCHIVE_MANIFEXT);
+      if (len > extlen && lstrcmpi(to + len - extlen, ARCHIVE_MANIFEXT) == 0)
+        to[len - extlen] = '\0';
+    }
+
+    success = ReconcileRestoreFile(from, to, RInfo);
+  }
+
+  RhsIO.printf(L"\r\n%i files restored\r\n", RInfo->Created);
+
+  return success;
+}
+
+
+//**********************************************************************
+// ReconcileRestoreDir
+// -------------------
+// Restore everything in an archive directory. From and To are buffers
+// of MAX_FILENAMELEN+1 characters that are used to build the names of
+// the files below them.
+//**********************************************************************
+
+BOOL ReconcileRestoreDir(WCHAR* From, WCHAR* To, RECONCILEINFO* RInfo)
+{ int fromlen, tolen, namelen, extlen;
+  BOOL ok, success;
+  HANDLE h;
+  WIN32_FIND_DATA wfd;
 
-// Get next file
+  fromlen = lstrlen(From);
+  tolen = lstrlen(To);
+  extlen = lstrlen(ARCHIVE_MANIFEXT);
 
-    } while (FindNextFile(h, &wfd));
+  lstrcat(From, L"\\*");
+  h = FindFirstFile(From, &wfd);
+  From[fromlen] = '\0';
 
-    FindClose(h);
+  if (h == INVALID_HANDLE_VALUE)
+  { if (GetLastError() == ERROR_FILE_NOT_FOUND)
+      return TRUE;
+    RhsIO.errprintf(L"E Cannot list directory %s: %s\r\n", From, GetLastErrorMessage());
+    return !RInfo->FailOnError;
   }
 
-// And the last step is to check the timestamps for this directory
+  success = TRUE;
 
-  GetFileTimeByName(File1, &fcreatedate1, NULL, &fmoddate1);
-  GetFileTimeByName(File2, &fcreatedate2, NULL, &fmoddate2);
-  if (ReconcileCompareTime(&fcreatedate1, &fcreatedate2, RInfo->UseFATTimeStamp) != 0
-   || ReconcileCompareTime(&fmoddate1,    &fmoddate2,    RInfo->UseFATTimeStamp) != 0)
-  {
-    if (!RInfo->Report)
-    { RhsIO.printf(L"T %s %s %i/%i/%i %02i:%02i:%02i\r\n", File1, File2, fmoddate1.wDay, fmoddate1.wMonth, fmoddate1.wYear%100, fmoddate1.wHour, fmoddate1.wMinute, fmoddate1.wSecond);
-      BOOL b = SetFileTimeByName(File2, &fcreatedate1, NULL, &fmoddate1);
-      // If the timestamp change failed report the error
-      if (b)
-      { RInfo->TimeStamped++;
+  do
+  { if (RhsIO.GetAbort())
+    { success = FALSE;
+      break;
+    }
+
+    if (lstrcmp(wfd.cFileName, L".") == 0 || lstrcmp(wfd.cFileName, L"..") == 0)
+      continue;
+
+    namelen = lstrlen(wfd.cFileName);
+
+    if (fromlen + 1 + namelen > MAX_FILENAMELEN || tolen + 1 + namelen > MAX_FILENAMELEN)
+    { RhsIO.errprintf(L"E The name %s\\%s is too long\r\n", From, wfd.cFileName);
+      ok = FALSE;
+    }
+    else
+    { From[fromlen] = '\\';
+      lstrcpy(From + fromlen + 1, wfd.cFileName);
+      To[tolen] = '\\';
+      lstrcpy(To + tolen + 1, wfd.cFileName);
+
+      if (IsDirectory(wfd.dwFileAttributes))
+      { ok = CreateDirectory(To, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+        if (!ok)
+          RhsIO.errprintf(L"E Cannot create directory %s: %s\r\n", To, GetLastErrorMessage());
+        else
+          ok = ReconcileRestoreDir(From, To, RInfo);
       }
       else
-      { if (!RInfo->Quiet)
-          RhsIO.errprintf(L"E Cannot timestamp %s to match %s: %s\r\n", File2, File1, GetLastErrorMessage());
-        if (RInfo->FailOnError)
-          return(FALSE);
+      { if (namelen > extlen && lstrcmpi(wfd.cFileName + namelen - extlen, ARCHIVE_MANIFEXT) == 0)
+          To[tolen + 1 + namelen - extlen] = '\0';
+        ok = ReconcileRestoreFile(From, To, RInfo);
       }
+
+      From[fromlen] = '\0';
+      To[tolen] = '\0';
     }
-  }
 
-// All done so return
+    if (!ok && RInfo->FailOnError)
+    { success = FALSE;
+      break;
+    }
+  } while (FindNextFile(h, &wfd));
 
-  return(TRUE);
+  FindClose(h);
+
+  return success;
 }
 
 
 //**********************************************************************
-// ReconcileArchiveFile
+// ReconcileRestoreFile
 // --------------------
-// Copy from File1 to File2.
-// The destination path may not exist and may need to be created.
-// We do this by stepping through the destination file name a directory
-// at a time, and creating that directory if it doesn't already exist.
+// Restore one file from its manifest, or copy it if it isn't one
 //**********************************************************************
 
-BOOL ReconcileArchiveFile(WCHAR* File1, WCHAR* File2)
-{ int i, j;
-  WCHAR newdir[MAX_FILENAMELEN+1];
+BOOL ReconcileRestoreFile(const WCHAR* From, const WCHAR* To, RECONCILEINFO* RInfo)
+{ int len, extlen;
+  BOOL b;
 
-  i = 0;
+  if (!RInfo->Quiet)
+    RhsIO.printf(L"R %s %s\r\n", From, To);
 
-// If this is a UNC name step past the server\share
+  len = lstrlen(From);
+  extlen = lstrlen(ARCHIVE_MANIFEXT);
 
-  if (File2[0] == '\\' && File2[1] == '\\')
-  { for (i = 2; File2[i] != '\\' && File2[i] != '\0'; i++);
-
-    if (File2[i] != '\0')
-      for (i++; File2[i] != '\\' && File2[i] != '\0'; i++);
+  if (len > extlen && lstrcmpi(From + len - extlen, ARCHIVE_MANIFEXT) == 0)
+    b = ArchiveStore.Restore(From, To);
+  else
+    b = CopyFile(From, To, TRUE);
 
-    if (File2[i] != '\0')
-      i++;
+  if (!b)
+  { RhsIO.errprintf(L"E Cannot restore %s to %s: %s\r\n", From, To, GetLastErrorMessage());
+    return FALSE;
   }
 
-// Else if it's a drive letter step past the drive letter
+  RInfo->Created++;
 
-  else if (File2[1] == ':')
-  { i = 2;
-    if (File2[i] == '\\')
-      i++;
-  }
-
-// Else if we start with '\' step past the '\'
+  return TRUE;
+}
 
-  else if (File2[0] == '\\')
-  { i = 1;
-  }
 
-// Copy the bit we've skipped past into our directory buffer
+//**********************************************************************
+// ReconcileArchiveFile
+// --------------------
+// Copy from File1 to File2.
+// The destination path may not exist and may need to be created. The
+// directories that have been created or found already are remembered
+// so each one is only checked once in a run.
+//**********************************************************************
 
-  for (j = 0; j < i; j++)
-    newdir[j] = File2[j];
+BOOL ReconcileArchiveFile(WCHAR* File1, WCHAR* File2)
+{ int i;
+  WCHAR newdir[MAX_FILENAMELEN+1];
 
-// Now go through the path
+// Make sure the directory exists. This runs on the copy threads so
+// another thread may create the directory first. Any real failure
+// shows up when we copy the file.
 
-  while (File2[i] != '\0')
-  { while (File2[i] != '\\' && File2[i] != '\0')
-    { newdir[i] = File2[i];
-      i++;
-    }
+  for (i = lstrlen(File2); i > 0 && File2[i-1] != '\\'; i--);
 
-    if (File2[i] == '\\')
-    { newdir[i] = '\0';
+  if (i > 1)
+    ArchiveDirs.Ensure(File2, i - 1);
 
-      if (!FileExists(newdir))
-        if (!CreateDirectory(newdir, NULL))
-          RhsIO.printf(L"ReconcileArchiveFile error creating \"%s\": %s\r\n", newdir, GetLastErrorMessage());
+// With an archive store the file is chunked and a manifest written
 
-      newdir[i++] = '\\';
+  if (ArchiveStore.Enabled())
+  { if (lstrlen(File2) + lstrlen(ARCHIVE_MANIFEXT) > MAX_FILENAMELEN)
+    { SetLastError(ERROR_FILENAME_EXCED_RANGE);
+      return FALSE;
     }
+
+    lstrcpy(newdir, File2);
+    lstrcat(newdir, ARCHIVE_MANIFEXT);
+
+    return ArchiveStore.Archive(File1, newdir);
   }
 
 // Copy the file
@@ -971,50 +1576,30 @@ BOOL ReconcileArchiveFile(WCHAR* File1, WCHAR* File2)
 //**********************************************************************
 // ReconcileCompareTime
 // --------------------
+// Compare two FILETIMEs to the nearest second, or to within 2 seconds
+// if using FAT times.
 //**********************************************************************
 
-int ReconcileCompareTime(SYSTEMTIME* One, SYSTEMTIME* Two, BOOL DosTime)
-{
-
-// Compare fields in SYSTEMTIME
-
-  if (One->wYear > Two->wYear)
-    return 1;
-  else if (One->wYear < Two->wYear)
-    return(-1);
-
-  if (One->wMonth > Two->wMonth)
-    return 1;
-  else if (One->wMonth < Two->wMonth)
-    return(-1);
-
-  if (One->wDay > Two->wDay)
-    return 1;
-  else if (One->wDay < Two->wDay)
-    return(-1);
+#define FILETIME_SECOND 10000000
 
-  if (One->wHour > Two->wHour)
-    return 1;
-  else if (One->wHour < Two->wHour)
-    return(-1);
+int ReconcileCompareTime(const FILETIME* One, const FILETIME* Two, BOOL DosTime)
+{ UINT64 one, two;
 
-  if (One->wMinute > Two->wMinute)
-    return 1;
-  else if (One->wMinute < Two->wMinute)
-    return(-1);
+  one = (((UINT64) One->dwHighDateTime << 32) | One->dwLowDateTime) / FILETIME_SECOND;
+  two = (((UINT64) Two->dwHighDateTime << 32) | Two->dwLowDateTime) / FILETIME_SECOND;
 
-// If using FAT times round seconds down
+// FAT times have a 2 second resolution
 
   if (DosTime)
-  { if (One->wSecond - Two->wSecond > 2)
+  { if (one > two + 2)
       return 1;
-    else if (One->wSecond - Two->wSecond < -2)
+    else if (two > one + 2)
       return(-1);
   }
   else
-  { if (One->wSecond > Two->wSecond)
+  { if (one > two)
       return 1;
-    else if (One->wSecond < Two->wSecond)
+    else if (one < two)
       return(-1);
   }
 
@@ -1056,80 +1641,29 @@ DWORD FileExists(const WCHAR* FileName)
 }
 
 
-//**********************************************************************
-// GetFileTimeByName
-// -----------------
-// Get the file time.
-// The file has to be opened to get the time.
-//**********************************************************************
-
-BOOL GetFileTimeByName(const WCHAR* FileName, SYSTEMTIME* Created, SYSTEMTIME* Accessed, SYSTEMTIME* Written)
-{ BOOL success;
-  HANDLE h;
-  FILETIME created, accessed, written;
-
-  h = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
-
-  if (!h)
-    return(FALSE);
-
-  success = GetFileTime(h, &created, &accessed, &written);
-
-  if (success)
-  { if (Created)
-      FileTimeToSystemTime(&created, Created);
-
-    if (Accessed)
-      FileTimeToSystemTime(&accessed, Accessed);
-
-    if (Written)
-      FileTimeToSystemTime(&written, Written);
-  }
-
-  CloseHandle(h);
-
-// Return error code
-
-  return(success);
-}
-
-
 //**********************************************************************
 // SetFileTimeByName
 // -----------------
-// Set the file time.
-// The file has to be opened to set the time.
+// Set the file time. Created may be NULL.
+// FILE_WRITE_ATTRIBUTES is all that's needed to set the time, and it
+// works even if the file is read-only.
 //**********************************************************************
 
-BOOL SetFileTimeByName(const WCHAR* FileName, SYSTEMTIME* Created, SYSTEMTIME* Accessed, SYSTEMTIME* Written)
+BOOL SetFileTimeByName(const WCHAR* FileName, const FILETIME* Created, const FILETIME* Written)
 { BOOL success;
+  DWORD d;
   HANDLE h;
-  FILETIME created, accessed, written;
-  LPFILETIME lpcreated = NULL, lpaccessed = NULL, lpwritten = NULL;
 
-  h = CreateFile(FileName, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  h = CreateFile(FileName, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
 
-  if (!h)
+  if (h == INVALID_HANDLE_VALUE)
     return(FALSE);
 
-  if (Created)
-  { SystemTimeToFileTime(Created, &created);
-    lpcreated = &created;
-  }
-
-  if (Accessed)
-  { SystemTimeToFileTime(Accessed, &accessed);
-    lpaccessed = &accessed;
-  }
-
-  if (Written)
-  { SystemTimeToFileTime(Written, &written);
-    lpwritten = &written;
-  }
-
-  success = SetFileTime(h, lpcreated, lpaccessed, lpwritten);
+  success = SetFileTime(h, Created, NULL, Written);
 
+  d = GetLastError();
   CloseHandle(h);
+  SetLastError(d);
 
 // Return error code
 
@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include <CRhsIO/CRhsIO.h>
 #include <CSecurableObject/CRegSecObject.h>
+#include <CSecurableObject/CSecDescCache.h>
+#include <CSecurableObject/CAceSet.h>
+#include <Misc/CRhsTextBuf.h>
 
 
 //**********************************************************************
@@ -21,6 +24,9 @@
 DWORD WINAPI rhsmain(LPVOID unused);
 
 BOOL regshowacl(const WCHAR* RegKey);
+BOOL FormatACL(CRegSecObject& Sec, CAceSet& Aces, CRhsTextBuf& Text);
+void PrintText(const WCHAR* Text);
+void PrintGroups(void);
 HKEY OpenKey(const WCHAR* RegKey);
 BOOL GetSubKey(HKEY hKey, int KeyNum, const WCHAR* ParentName, WCHAR* SubKeyName);
 
@@ -29,29 +35,11 @@ const WCHAR* GetLastErrorMessage(DWORD d);
 
 
 //**********************************************************************
-// Structure to help with handling ACEs
-// ------------------------------------
+// The longest username that can be excluded
 //**********************************************************************
 
 #define MAX_USERNAME 64
 
-#define RHSACE_NCINHERIT      0x01 // Child objects that are not containers inherit permissions
-#define RHSACE_INHERIT_PASS   0x02 // Child objects inherit and pass on permissions
-#define RHSACE_INHERIT_NOPASS 0x04 // Child objects inherit but do not pass on permissions
-#define RHSACE_NOINHERIT_PASS 0x08 // Object is not affected by but passes on permissions
-#define RHSACE_INHERITED      0x10 // Permissions have been inherited
-
-typedef struct _RhsACE
-{
-  WCHAR  domain[MAX_USERNAME+1],   // This identifies the user
-         username[MAX_USERNAME+1];
-
-  DWORD mask, // access mask
-        type, // 0 = access allowed, 1 = access denied
-        flags;
-
-} RhsACE;
-
 
 //**********************************************************************
 // Global variables
@@ -60,17 +48,24 @@ typedef struct _RhsACE
 
 CRhsIO RhsIO;
 
-#define SYNTAX L"regshowacl [-i -x<username>] <keyname>\r\n" \
+#define SYNTAX L"regshowacl [-g -i -x<username>] <keyname>\r\n" \
                L"NB the key must start with HKEY_LOCAL_MACHINE etc\r\n" \
                L"e.g. HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\r\n" \
                L"(the case of the key name doesn't matter)\r\n"
 
-BOOL IncludeInherited;
+BOOL IncludeInherited, GroupByACL;
 
 #define MAX_EXCLUDE 16
 WCHAR Exclude[MAX_EXCLUDE][MAX_USERNAME+1];
 int  NumExclude;
 
+// Each distinct security descriptor is only formatted once
+
+CSecDescCache SDCache;
+
+CAceSet AceSet;
+CRhsTextBuf ACLText;
+
 
 //**********************************************************************
 // WinMain
@@ -101,7 +96,7 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
 // Process command line flags
 
-  IncludeInherited = FALSE;
+  IncludeInherited = GroupByACL = FALSE;
   NumExclude = 0;
   argnum = 1;
 
@@ -116,13 +111,17 @@ DWORD WINAPI rhsmain(LPVOID unused)
         RhsIO.printf(SYNTAX);
         return 0;
 
+      case 'g': // Group the keys by their ACL
+        GroupByACL = TRUE;
+        break;
+
       case 'i': // Include inherited permissions
         IncludeInherited = TRUE;
         break;
 
       case 'x': // Exclude a username
-        if (NumExclude <= MAX_EXCLUDE)
-        { lstrcpy(Exclude[NumExclude], RhsIO.m_argv[argnum]+2);
+        if (NumExclude < MAX_EXCLUDE)
+        { lstrcpyn(Exclude[NumExclude], RhsIO.m_argv[argnum]+2, MAX_USERNAME+1);
           NumExclude++;
         }
         break;
@@ -188,6 +187,9 @@ DWORD WINAPI rhsmain(LPVOID unused)
 
   regshowacl(keyname);
 
+  if (GroupByACL)
+    PrintGroups();
+
 // All done
 
   return 0;
@@ -200,76 +202,143 @@ DWORD WINAPI rhsmain(LPVOID unused)
 //**********************************************************************
 
 BOOL regshowacl(const WCHAR* RegKey)
-{ int num_entries, num_aces, i, j;
-  BOOL found_ace;
-  DWORD mask, type, flags;
+{ int i;
+  DWORD len;
+  UINT hash;
   HKEY hkey;
+  const BYTE* sd;
+  SECDESCENTRY* entry;
   CRegSecObject sec;
-  RhsACE ace[32];
-  WCHAR username[256], domain[256], rights[16];
   WCHAR subkey[1024];
-  WCHAR outstr[0x1000];
-
-  swprintf(outstr, 0x1000, L"%s\r\n", RegKey);
-  found_ace = FALSE;
 
 // Attach the CSecurableObject to this directory
 
   sec.SetKeyName((WCHAR*) RegKey);
+
+// Unless we want the inherited permissions most keys have nothing to
+// show, so don't decode their ACL at all
+
+  sec.SetSkipInherited(!IncludeInherited);
+
   if (!sec.GetObjectSecurity())
   { RhsIO.errprintf(L"Cannot open the key %s: %s\r\n", RegKey, GetLastErrorMessage(sec.m_iSecErrorCode));
     return FALSE;
   }
 
-// Loop over all ACEs in the list
+// The ACL is only formatted the first time we see its security
+// descriptor
 
-  num_entries = sec.GetNumEntries();
-  num_aces = 0;
+  entry = NULL;
 
-  for (i = 0; i < num_entries; i++)
-  { sec.GetRightsFromACE(username, domain, &mask, &type, &flags, i);
+  if (!sec.WasSkipped())
+  { sd = sec.GetRawSD(&len, &hash);
+
+    entry = SDCache.Find(sd, len, hash);
+    if (!entry)
+    { entry = NULL;
+      if (FormatACL(sec, AceSet, ACLText))
+        entry = SDCache.Add(sd, len, hash, ACLText.Text());
+      if (!entry)
+      { RhsIO.errprintf(L"Out of memory\r\n");
+        return FALSE;
+      }
+    }
+  }
 
-// Look to see if this is a new user
+// Only print the output if we found a non-inherited ACL
 
-    for (j = 0; j < num_aces; j++)
-      if (lstrcmp(username, ace[j].username) == 0 && type == ace[j].type)
-        break;
+  if (entry && entry->Text[0] != '\0')
+  { if (GroupByACL)
+    { if (!SDCache.AddObject(entry, RegKey))
+      { RhsIO.errprintf(L"Out of memory\r\n");
+        return FALSE;
+      }
+    }
+    else
+    { RhsIO.printf(L"%s\r\n", RegKey);
+      PrintText(entry->Text);
+    }
+  }
+
+// Now work through subdirectories
+
+  hkey = OpenKey(RegKey);
+
+  if (hkey == INVALID_HANDLE_VALUE)
+  { RhsIO.errprintf(L"Cannot open subkeys of %s\r\n", RegKey, GetLastErrorMessage());
+    return 2;
+  }
+
+  i = 0;
+
+  while (GetSubKey(hkey, i, RegKey, subkey))
+  { i++;
+
+    regshowacl(subkey);
+  }
+
+  CloseHandle(hkey);
+
+// All done
+
+  return TRUE;
+}
+
+
+//**********************************************************************
+// FormatACL
+// ---------
+// Format the ACEs to show. OutStr is set to an empty string if there
+// are none.
+//**********************************************************************
+
+BOOL FormatACL(CRegSecObject& Sec, CAceSet& Aces, CRhsTextBuf& Text)
+{ int num_entries, i, j;
+  DWORD mask, type, flags;
+  RHSACE* ace;
+  WCHAR username[256], domain[256], rights[16];
+
+  Aces.Reset();
+  Text.Reset();
+
+// Loop over all ACEs in the list
+
+  num_entries = Sec.GetNumEntries();
+
+  for (i = 0; i < num_entries; i++)
+  { Sec.GetRightsFromACE(username, domain, &mask, &type, &flags, i);
 
 // If this is a new user get all their entries
 
-    if (j >= num_aces)
-    { lstrcpyn(ace[num_aces].domain, domain, MAX_USERNAME);
-      lstrcpyn(ace[num_aces].username, username, MAX_USERNAME);
-      ace[num_aces].type = type;
-      ace[num_aces].flags = flags;
+    if (!Aces.Find(username, type))
+    { ace = Aces.Add(domain, username, type, flags);
+      if (!ace)
+        return FALSE;
 
 // This gets all entries in the ACL matchine the current SID and type
-      sec.GetAllRightsFor(&(ace[num_aces].mask), i);
-
-      num_aces++;
+      Sec.GetAllRightsFor(&(ace->Mask), i);
     }
   }
 
 // Got all the entries so print them
 
-  for (i = 0; i < num_aces; i++)
-  {
+  for (i = 0; i < Aces.NumAces(); i++)
+  { ace = Aces.Ace(i);
 
 // We only want non-inherited permissions unless we've specifically
 // asked for them.
 
-    if (ace[i].flags & RHSACE_INHERITED)
+    if (ace->Flags & RHSACE_INHERITED)
       if (!IncludeInherited)
         continue;
 
 // For tidiness omit the standard "domains" BUILTIN and NT AUTHORITY
 
-    if (lstrlen(ace[i].domain) == 0 || lstrcmp(ace[i].domain, L"BUILTIN") == 0 || lstrcmp(ace[i].domain, L"NT AUTHORITY") == 0)
-      lstrcpy(username, ace[i].username);
+    if (lstrlen(ace->Domain) == 0 || lstrcmp(ace->Domain, L"BUILTIN") == 0 || lstrcmp(ace->Domain, L"NT AUTHORITY") == 0)
+      lstrcpyn(username, ace->Username, 256);
     else
-      swprintf(username, 256, L"%s\\%s", ace[i].domain, ace[i].username);
+      swprintf(username, 256, L"%s\\%s", ace->Domain, ace->Username);
     CharLower(username);
-RhsIO.printf(L"DEBUG: %s\r\n", ace[i].username);
 
 // Check if we're excluding this username
 
@@ -281,47 +350,56 @@ RhsIO.printf(L"DEBUG: %s\r\n", ace[i].username);
     if (j < NumExclude)
       continue;
 
-// Print the access including whether it's an allowed or denied ACE
-
-    found_ace = TRUE;
+// Add the access including whether it's an allowed or denied ACE
 
-    sec.RightsToText(ace[i].mask, rights);
-    if (ace[i].flags & RHSACE_INHERITED)
+    Sec.RightsToText(ace->Mask, rights);
+    if (ace->Flags & RHSACE_INHERITED)
       lstrcat(rights, L"(I)");
 
-    if (ace[i].type == 0)
-      swprintf(outstr + lstrlen(outstr), 0x1000, L"\t%s\t%s\r\n", username, rights);
-    else
-      swprintf(outstr + lstrlen(outstr), 0x1000, L"\t%s\tDenied: %s\r\n", username, rights);
+    if (!Text.Printf(ace->Type == 0 ? L"\t%s\t%s\r\n" : L"\t%s\tDenied: %s\r\n", username, rights))
+      return FALSE;
   }
 
-// Only print the output if we found a non-inherited ACL
+  return TRUE;
+}
 
-  if (found_ace)
-    RhsIO.printf(outstr);
 
-// Now work through subdirectories
+//**********************************************************************
+// PrintText
+// ---------
+// RhsIO.printf has a limit on the length of its output, and the ACL for
+// an object with lots of users can be longer, so print it in pieces
+//**********************************************************************
 
-  hkey = OpenKey(RegKey);
+void PrintText(const WCHAR* Text)
+{ int len;
 
-  if (hkey == INVALID_HANDLE_VALUE)
-  { RhsIO.errprintf(L"Cannot open subkeys of %s\r\n", RegKey, GetLastErrorMessage());
-    return 2;
-  }
+  for (len = lstrlen(Text); len > 0; len -= 0x1000, Text += 0x1000)
+    RhsIO.printf(L"%.*s", len < 0x1000 ? len : 0x1000, Text);
+}
 
-  i = 0;
 
-  while (GetSubKey(hkey, i, RegKey, subkey))
-  { i++;
+//**********************************************************************
+// PrintGroups
+// -----------
+// Print each distinct ACL once followed by the keys that have it
+//**********************************************************************
 
-    regshowacl(subkey);
-  }
+void PrintGroups(void)
+{ int i, j;
+  SECDESCENTRY* entry;
 
-  CloseHandle(hkey);
+  for (i = 0; i < SDCache.NumGroups(); i++)
+  { entry = SDCache.Group(i);
 
-// All done
+    RhsIO.printf(L"ACL %i: %i keys\r\n", i + 1, entry->NumObjects);
+    PrintText(entry->Text);
+    for (j = 0; j < entry->NumObjects; j++)
+      RhsIO.printf(L"  %s\r\n", entry->Objects[j]);
+    RhsIO.printf(L"\r\n");
+  }
 
-  return TRUE;
+  RhsIO.printf(L"%i distinct ACLs decoded\r\n", SDCache.NumEntries());
 }
 
 